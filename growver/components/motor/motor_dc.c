@@ -9,6 +9,8 @@
 #include "pwm_bdc.h"
 #include "motor_dc.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 #include "driver/timer.h"
 
 
@@ -22,6 +24,13 @@
 static uint16_t mc_speed[MOTORS_IN_SYSTEM];
 static uint16_t mc_direction[MOTORS_IN_SYSTEM];
 
+// Latched fault sources (MOTOR_FAULT_xxx) and time of the first trip
+static volatile uint32_t mc_fault;
+static volatile int64_t mc_fault_time_us;
+
+// Reports the fault sources still active, so a clear can be refused
+static motor_fault_check_t mc_fault_check;
+
 //*****************************************************************************
 // MotorDCInit
 //
@@ -53,6 +62,12 @@ void MotorDCSetSpeed(uint8_t motor, uint16_t speed, uint8_t direction)
 		speed = 100;
 	}
 
+	// No motion while a fault is latched
+	if (mc_fault)
+	{
+		speed = 0;
+	}
+
 	mc_speed[motor] = speed;
 
 	// If speed is zero then hard-stop
@@ -96,4 +111,83 @@ uint16_t MotorDCGetSpeed(uint8_t motor)
 uint8_t MotorDCGetDirection(uint8_t motor)
 {
 	return (mc_direction[motor]);
-}
\ No newline at end of file
+}
+
+//*****************************************************************************
+// MotorDCFaultTrip
+// Emergency stop, safe to call from an ISR. Forces both motors into the stop
+// state and latches the fault bits. MotorDCSetSpeed will only stop the motors
+// until MotorDCFaultClear is called.
+//
+//*****************************************************************************
+void IRAM_ATTR MotorDCFaultTrip(uint32_t fault)
+{
+	for (int motor = 0; motor < MOTORS_IN_SYSTEM; motor++)
+	{
+		brushed_motor_stop_isr(PWM_UNIT, motor_timer_num[motor]);
+		mc_speed[motor] = 0;
+	}
+
+	if (mc_fault == 0)
+	{
+		mc_fault_time_us = esp_timer_get_time();
+	}
+	mc_fault |= fault;
+}
+
+//*****************************************************************************
+// MotorDCFaultCheckSet
+// Sets the function that reports the fault sources still active (e.g. a
+// pressed bumper), checked by MotorDCFaultClear.
+//
+//*****************************************************************************
+void MotorDCFaultCheckSet(motor_fault_check_t check)
+{
+	mc_fault_check = check;
+}
+
+//*****************************************************************************
+// MotorDCFaultClear
+// Clears the latched fault and returns the motors to the normal stop state.
+// Refused with ESP_ERR_INVALID_STATE while a fault source is still active, as
+// no new edge would trip it again. A source that goes active during the clear
+// trips again here, since its own trip may have been undone by the clear.
+//
+//*****************************************************************************
+esp_err_t MotorDCFaultClear(void)
+{
+	uint32_t active;
+
+	if (mc_fault_check && mc_fault_check())
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	mc_fault = 0;
+	for (int motor = 0; motor < MOTORS_IN_SYSTEM; motor++)
+	{
+		brushed_motor_release(PWM_UNIT, motor_timer_num[motor]);
+	}
+
+	active = mc_fault_check ? mc_fault_check() : 0;
+	if (active)
+	{
+		MotorDCFaultTrip(active);
+		return ESP_ERR_INVALID_STATE;
+	}
+	return ESP_OK;
+}
+
+//*****************************************************************************
+// MotorDCFaultGet
+// Returns the latched fault bits, and optionally the time of the trip.
+//
+//*****************************************************************************
+uint32_t MotorDCFaultGet(int64_t *time_us)
+{
+	if (time_us)
+	{
+		*time_us = mc_fault_time_us;
+	}
+	return (mc_fault);
+}
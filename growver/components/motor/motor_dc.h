@@ -10,7 +10,18 @@
 #define MOTOR_FORWARD	0
 #define MOTOR_REVERSE   1
 
+// Fault sources latched by MotorDCFaultTrip
+#define MOTOR_FAULT_AUX(pin)	(1 << (pin))
+#define MOTOR_FAULT_CMD			(1 << 8)
+
+// Returns the fault sources (MOTOR_FAULT_xxx) still active
+typedef uint32_t (*motor_fault_check_t)(void);
+
 int MotorDCInit(void);
 void MotorDCSetSpeed(uint8_t motor, uint16_t speed, uint8_t direction);
 uint16_t MotorDCGetSpeed(uint8_t motor);
 uint8_t MotorDCGetDirection(uint8_t motor);
+void MotorDCFaultTrip(uint32_t fault);
+void MotorDCFaultCheckSet(motor_fault_check_t check);
+esp_err_t MotorDCFaultClear(void);
+uint32_t MotorDCFaultGet(int64_t *time_us);
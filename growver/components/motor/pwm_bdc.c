@@ -22,6 +22,9 @@
 #define GPIO_PWM1A_OUT  19  // Set GPIO 19 as PWM1A for Right Motor
 #define GPIO_PWM1B_OUT  23  // Set GPIO 23 as PWM1B for Right Motor
 
+// Register access for the interrupt safe stop (kept in DRAM for ISR use)
+DRAM_ATTR static mcpwm_dev_t *const mcpwm_dev[MCPWM_UNIT_MAX] = {&MCPWM0, &MCPWM1};
+
 static void mcpwm_example_gpio_initialize()
 {
     // Set PWM pins.
@@ -52,6 +55,28 @@ void brushed_motor_stop(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num)
     mcpwm_set_signal_low(mcpwm_num, timer_num, MCPWM_OPR_B);
 }
 
+// Emergency stop callable from an ISR (IRAM, no driver locks). Applies a
+// continuous software force-low to both outputs of the timer, which is the
+// same output state as brushed_motor_stop, and takes effect immediately
+// rather than at the next PWM period. The force overrides anything the
+// generators do afterwards, so the motor stays stopped until
+// brushed_motor_release.
+void IRAM_ATTR brushed_motor_stop_isr(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num)
+{
+    mcpwm_dev[mcpwm_num]->channel[timer_num].gen_force.cntu_force_upmethod = 0;
+    mcpwm_dev[mcpwm_num]->channel[timer_num].gen_force.a_cntuforce_mode = 1;
+    mcpwm_dev[mcpwm_num]->channel[timer_num].gen_force.b_cntuforce_mode = 1;
+}
+
+// Remove the force applied by brushed_motor_stop_isr, leaving the timer in
+// the normal stopped state.
+void brushed_motor_release(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num)
+{
+    brushed_motor_stop(mcpwm_num, timer_num);
+    mcpwm_dev[mcpwm_num]->channel[timer_num].gen_force.a_cntuforce_mode = 0;
+    mcpwm_dev[mcpwm_num]->channel[timer_num].gen_force.b_cntuforce_mode = 0;
+}
+
 void mcpwm_initialize(void)
 {
     //1. mcpwm gpio initialization
@@ -7,4 +7,6 @@ void mcpwm_example_brushed_motor_control(void *arg);
 void brushed_motor_forward(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num , float duty_cycle);
 void brushed_motor_backward(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num , float duty_cycle);
 void brushed_motor_stop(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num);
+void brushed_motor_stop_isr(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num);
+void brushed_motor_release(mcpwm_unit_t mcpwm_num, mcpwm_timer_t timer_num);
 
@@ -7,17 +7,46 @@
 //
 //*****************************************************************************
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "soc/gpio_struct.h"
+#include "xtensa/core-macros.h"
 #include "peripheral.h"
 #include "driver/adc.h"
 //#include "esp_adc_cal.h"
 
 // Pump control I/O assignments
 #define GPIO_OUTPUT_PUMP   2
-#define GPIO_OUTPUT_PIN_SEL  (1<<GPIO_OUTPUT_PUMP)
+
+// Pump PWM
+#define PUMP_LEDC_MODE        LEDC_HIGH_SPEED_MODE
+#define PUMP_LEDC_TIMER       LEDC_TIMER_0
+#define PUMP_LEDC_CHANNEL     LEDC_CHANNEL_0
+#define PUMP_LEDC_RESOLUTION  LEDC_TIMER_10_BIT
+#define PUMP_DUTY_MAX         ((1 << 10) - 1)
+#define PUMP_PWM_FREQ_HZ      CONFIG_PUMP_PWM_FREQ_HZ
+
+// NVS storage for the pump flow calibration
+#define PUMP_NVS_NAMESPACE    "pump"
+
+static uint8_t pump_speed;
+static uint32_t pump_ms_per_ml = CONFIG_PUMP_MS_PER_ML;
+
+// Dosing state
+static esp_timer_handle_t dose_timer;
+static volatile bool dose_active;
+static float dose_ml;
+static int64_t dose_start_us;
+static pump_dose_t dose_status;
+static pump_dose_cb_t dose_callback;
 
 // Aux I/O Assignments
-gpio_num_t aux_io_pin[] = {0, 32};
+gpio_num_t aux_io_pin[AUX_IO_PINS] = {0, 32};
 #if 0
 #define GPIO_AUX0          0
 #define GPIO_AUX0_PIN_SEL  (1<<GPIO_AUX0)
@@ -26,6 +55,32 @@ gpio_num_t aux_io_pin[] = {0, 32};
 #define GPIO_AUX1_PIN_SEL  (1<<GPIO_AUX1)
 #endif
 
+// Aux pin direction as last configured. Lets set/get skip gpio_config()
+// unless the direction actually changes.
+typedef enum
+{
+    AUX_DIR_NONE = 0,
+    AUX_DIR_INPUT,
+    AUX_DIR_OUTPUT
+} aux_dir_t;
+
+static aux_dir_t aux_dir[AUX_IO_PINS];
+static bool aux_out_level[AUX_IO_PINS];
+
+// Interrupt input state
+#define AUX_EVENT_QUEUE_LEN  16
+static QueueHandle_t aux_event_queue;
+static bool aux_isr_service_installed;
+static bool aux_irq_enabled[AUX_IO_PINS];
+static uint32_t aux_debounce_us[AUX_IO_PINS];
+static int64_t aux_last_edge_us[AUX_IO_PINS];
+static volatile uint32_t aux_events_dropped;
+
+// Safety inputs call the handler straight from the ISR when they go active
+static aux_safety_handler_t aux_safety_handler;
+static bool aux_safety[AUX_IO_PINS];
+static uint8_t aux_safety_level[AUX_IO_PINS];
+
 // ADC Parameters
 #define V_REF   1185
 #define ADC_VBUS_CHANNEL (ADC1_CHANNEL_6)      // GPIO 34
@@ -33,6 +88,69 @@ gpio_num_t aux_io_pin[] = {0, 32};
 // Init ADC and Characteristics
 //esp_adc_cal_characteristics_t characteristics;
 
+//*****************************************************************************
+// AuxPinWrite / AuxPinRead
+// Direct register access to the GPIO output and input registers. Only valid
+// once the pin direction has been configured.
+//
+//*****************************************************************************
+static inline void IRAM_ATTR AuxPinWrite(gpio_num_t gpio, bool level)
+{
+    if (gpio < 32)
+    {
+        if (level)
+            GPIO.out_w1ts = (1UL << gpio);
+        else
+            GPIO.out_w1tc = (1UL << gpio);
+    }
+    else
+    {
+        if (level)
+            GPIO.out1_w1ts.val = (1UL << (gpio - 32));
+        else
+            GPIO.out1_w1tc.val = (1UL << (gpio - 32));
+    }
+}
+
+static inline bool IRAM_ATTR AuxPinRead(gpio_num_t gpio)
+{
+    if (gpio < 32)
+        return (GPIO.in >> gpio) & 0x1;
+    return (GPIO.in1.data >> (gpio - 32)) & 0x1;
+}
+
+//*****************************************************************************
+// AuxPinDirection
+// Slow path. Only called when the cached direction differs from the one
+// requested.
+//
+//*****************************************************************************
+static void AuxPinDirection(uint8_t pin, aux_dir_t dir)
+{
+    gpio_num_t gpio = aux_io_pin[pin];
+
+    if (dir == AUX_DIR_OUTPUT)
+    {
+        // Edge interrupts make no sense on an output
+        if (aux_irq_enabled[pin])
+        {
+            gpio_intr_disable(gpio);
+        }
+        gpio_set_pull_mode(gpio, GPIO_FLOATING);
+        gpio_set_direction(gpio, GPIO_MODE_OUTPUT);
+    }
+    else
+    {
+        gpio_set_direction(gpio, GPIO_MODE_INPUT);
+        gpio_set_pull_mode(gpio, GPIO_PULLUP_ONLY);
+        if (aux_irq_enabled[pin])
+        {
+            gpio_intr_enable(gpio);
+        }
+    }
+    aux_dir[pin] = dir;
+}
+
 //*****************************************************************************
 // GpioInit
 //
@@ -44,10 +162,15 @@ void GpioInit(void)
     // Pins default to input with internal pull-up enabled.
     io_conf.intr_type = GPIO_PIN_INTR_DISABLE;
     io_conf.mode = GPIO_MODE_INPUT;
-    io_conf.pin_bit_mask = (1 << aux_io_pin[0]) | (1 << aux_io_pin[1]);
+    io_conf.pin_bit_mask = (1ULL << aux_io_pin[0]) | (1ULL << aux_io_pin[1]);
     io_conf.pull_down_en = 0;
     io_conf.pull_up_en = 1;
     gpio_config(&io_conf);
+
+    aux_dir[0] = AUX_DIR_INPUT;
+    aux_dir[1] = AUX_DIR_INPUT;
+
+    aux_event_queue = xQueueCreate(AUX_EVENT_QUEUE_LEN, sizeof(aux_event_t));
 }
 
 //*****************************************************************************
@@ -57,71 +180,576 @@ void GpioInit(void)
 //*****************************************************************************
 void GpioLevelSet(uint8_t pin, bool level)
 {
-    gpio_config_t io_conf;
+    // Safety inputs must stay inputs
+    if (pin >= AUX_IO_PINS || aux_safety[pin])
+        return;
 
-    // Change pin to output
-    io_conf.intr_type = GPIO_PIN_INTR_DISABLE;
-    io_conf.mode = GPIO_MODE_OUTPUT;
-    io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 0;
-    io_conf.pin_bit_mask = 1 << aux_io_pin[pin];
-    gpio_config(&io_conf);
+    // Set level before switching direction so the pin does not glitch
+    AuxPinWrite(aux_io_pin[pin], level);
+    aux_out_level[pin] = level;
 
-    // Set level
-    gpio_set_level(aux_io_pin[pin], level);
+    // Change pin to output
+    if (aux_dir[pin] != AUX_DIR_OUTPUT)
+    {
+        AuxPinDirection(pin, AUX_DIR_OUTPUT);
+    }
 }
 
 //*****************************************************************************
 // GpioLevelGet
-//
+// Reads a GPIO pin. Automatically changes pin to input with pull-up.
 //
 //*****************************************************************************
 bool GpioLevelGet(uint8_t pin)
 {
-    gpio_config_t io_conf;
+    if (pin >= AUX_IO_PINS)
+        return false;
 
     // Change pin to input
+    if (aux_dir[pin] != AUX_DIR_INPUT)
+    {
+        AuxPinDirection(pin, AUX_DIR_INPUT);
+    }
+
+    // Read and return the level
+    return AuxPinRead(aux_io_pin[pin]);
+}
+
+//*****************************************************************************
+// GpioLevelPeek
+// Reads an aux pin without changing its direction. Outputs report the level
+// last written.
+//
+//*****************************************************************************
+bool GpioLevelPeek(uint8_t pin)
+{
+    if (pin >= AUX_IO_PINS)
+        return false;
+
+    if (aux_dir[pin] == AUX_DIR_OUTPUT)
+        return aux_out_level[pin];
+    return AuxPinRead(aux_io_pin[pin]);
+}
+
+//*****************************************************************************
+// GpioIsOutput
+//
+//*****************************************************************************
+bool GpioIsOutput(uint8_t pin)
+{
+    return (pin < AUX_IO_PINS) && (aux_dir[pin] == AUX_DIR_OUTPUT);
+}
+
+//*****************************************************************************
+// GpioEdgeIsr
+// Timestamps the edge, applies the debounce window and queues the event.
+//
+//*****************************************************************************
+static void IRAM_ATTR GpioEdgeIsr(void *arg)
+{
+    uint8_t pin = (uint32_t)arg;
+    BaseType_t woken = pdFALSE;
+    aux_event_t event;
+
+    // Safety inputs act first and are not debounced; the first active edge
+    // trips
+    event.level = AuxPinRead(aux_io_pin[pin]);
+    if (aux_safety[pin] && (event.level == aux_safety_level[pin]) && aux_safety_handler)
+    {
+        aux_safety_handler(pin);
+    }
+
+    event.time_us = esp_timer_get_time();
+
+    // Ignore bounces inside the window following an accepted edge
+    if ((event.time_us - aux_last_edge_us[pin]) < aux_debounce_us[pin])
+        return;
+    aux_last_edge_us[pin] = event.time_us;
+
+    event.pin = pin;
+    if (xQueueSendFromISR(aux_event_queue, &event, &woken) != pdTRUE)
+    {
+        aux_events_dropped++;
+    }
+
+    if (woken)
+    {
+        portYIELD_FROM_ISR();
+    }
+}
+
+//*****************************************************************************
+// GpioInputEnable
+// Makes an aux pin an interrupt driven input. Both edges are reported through
+// GpioEventGet, with edges closer than debounce_us to the last accepted edge
+// discarded.
+//
+//*****************************************************************************
+esp_err_t GpioInputEnable(uint8_t pin, uint32_t debounce_us)
+{
+    esp_err_t err;
+
+    if (pin >= AUX_IO_PINS || aux_event_queue == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    if (!aux_isr_service_installed)
+    {
+        err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+        if (err != ESP_OK)
+            return err;
+        aux_isr_service_installed = true;
+    }
+
+    if (aux_irq_enabled[pin])
+    {
+        gpio_isr_handler_remove(aux_io_pin[pin]);
+    }
+    aux_debounce_us[pin] = debounce_us;
+    aux_last_edge_us[pin] = 0;
+    AuxPinDirection(pin, AUX_DIR_INPUT);
+
+    gpio_set_intr_type(aux_io_pin[pin], GPIO_INTR_ANYEDGE);
+    err = gpio_isr_handler_add(aux_io_pin[pin], GpioEdgeIsr, (void *)(uint32_t)pin);
+    if (err != ESP_OK)
+        return err;
+    aux_irq_enabled[pin] = true;
+    return gpio_intr_enable(aux_io_pin[pin]);
+}
+
+//*****************************************************************************
+// GpioInputDisable
+//
+//*****************************************************************************
+void GpioInputDisable(uint8_t pin)
+{
+    // Safety inputs have to be disarmed first
+    if (pin >= AUX_IO_PINS || !aux_irq_enabled[pin] || aux_safety[pin])
+        return;
+
+    gpio_intr_disable(aux_io_pin[pin]);
+    gpio_set_intr_type(aux_io_pin[pin], GPIO_INTR_DISABLE);
+    gpio_isr_handler_remove(aux_io_pin[pin]);
+    aux_irq_enabled[pin] = false;
+}
+
+//*****************************************************************************
+// GpioSafetyHandlerSet
+// Sets the function called from the GPIO ISR when an armed safety input goes
+// to its active level. It must be in IRAM and safe to call from an ISR.
+//
+//*****************************************************************************
+void GpioSafetyHandlerSet(aux_safety_handler_t handler)
+{
+    aux_safety_handler = handler;
+}
+
+//*****************************************************************************
+// GpioSafetyEnable
+// Arms an aux pin as a safety input (e.g. bumper or limit switch). The pin
+// becomes an edge input; if it is already at the active level the handler is
+// called immediately.
+//
+//*****************************************************************************
+esp_err_t GpioSafetyEnable(uint8_t pin, uint8_t active_level)
+{
+    esp_err_t err;
+
+    if (pin >= AUX_IO_PINS || aux_safety_handler == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    aux_safety_level[pin] = active_level ? 1 : 0;
+    aux_safety[pin] = true;
+
+    err = GpioInputEnable(pin, aux_debounce_us[pin]);
+    if (err != ESP_OK)
+    {
+        aux_safety[pin] = false;
+        return err;
+    }
+
+    if (AuxPinRead(aux_io_pin[pin]) == aux_safety_level[pin])
+    {
+        aux_safety_handler(pin);
+    }
+    return ESP_OK;
+}
+
+//*****************************************************************************
+// GpioSafetyDisable
+// Disarms a safety input. The pin stays an edge input.
+//
+//*****************************************************************************
+void GpioSafetyDisable(uint8_t pin)
+{
+    if (pin < AUX_IO_PINS)
+    {
+        aux_safety[pin] = false;
+    }
+}
+
+//*****************************************************************************
+// GpioSafetyArmed
+// Returns a bit mask of aux pins armed as safety inputs.
+//
+//*****************************************************************************
+uint8_t GpioSafetyArmed(void)
+{
+    uint8_t mask = 0;
+
+    for (uint8_t pin = 0; pin < AUX_IO_PINS; pin++)
+    {
+        if (aux_safety[pin])
+            mask |= (1 << pin);
+    }
+    return mask;
+}
+
+//*****************************************************************************
+// GpioSafetyActive
+// Returns a bit mask of armed safety inputs now at their active level.
+//
+//*****************************************************************************
+uint8_t GpioSafetyActive(void)
+{
+    uint8_t mask = 0;
+
+    for (uint8_t pin = 0; pin < AUX_IO_PINS; pin++)
+    {
+        if (aux_safety[pin] && (AuxPinRead(aux_io_pin[pin]) == aux_safety_level[pin]))
+            mask |= (1 << pin);
+    }
+    return mask;
+}
+
+//*****************************************************************************
+// GpioEventGet
+// Pops the oldest aux input edge. Returns false if none arrived in time.
+//
+//*****************************************************************************
+bool GpioEventGet(aux_event_t *event, uint32_t timeout_ms)
+{
+    if (aux_event_queue == NULL)
+        return false;
+
+    return xQueueReceive(aux_event_queue, event, timeout_ms / portTICK_PERIOD_MS) == pdTRUE;
+}
+
+//*****************************************************************************
+// GpioEventsDropped
+// Number of edges lost because the event queue was full.
+//
+//*****************************************************************************
+uint32_t GpioEventsDropped(void)
+{
+    return aux_events_dropped;
+}
+
+//*****************************************************************************
+// GpioBenchmark
+// Measures average CPU cycles for a set and a get on aux pin, first through
+// gpio_config() on every call (the original implementation) and then through
+// the cached direction fast path. Leaves the pin as an input.
+//
+//*****************************************************************************
+void GpioBenchmark(uint8_t pin, gpio_bench_t *result)
+{
+    gpio_config_t io_conf;
+    uint32_t start, i;
+    volatile bool level;
+
+    // gpio_config() would clear the edge interrupt of an active input
+    if (pin >= AUX_IO_PINS || aux_irq_enabled[pin])
+        return;
+
     io_conf.intr_type = GPIO_PIN_INTR_DISABLE;
-    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pin_bit_mask = 1ULL << aux_io_pin[pin];
     io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 1;
-    io_conf.pin_bit_mask = 1 << aux_io_pin[pin];
-    gpio_config(&io_conf);
 
-    // Read and return the level
-    return ((bool)gpio_get_level(aux_io_pin[pin]));
+    // gpio_config() per call
+    start = XTHAL_GET_CCOUNT();
+    for (i = 0; i < GPIO_BENCH_LOOPS; i++)
+    {
+        io_conf.mode = GPIO_MODE_OUTPUT;
+        io_conf.pull_up_en = 0;
+        gpio_config(&io_conf);
+        gpio_set_level(aux_io_pin[pin], i & 1);
+    }
+    result->set_config_cycles = (XTHAL_GET_CCOUNT() - start) / GPIO_BENCH_LOOPS;
+
+    start = XTHAL_GET_CCOUNT();
+    for (i = 0; i < GPIO_BENCH_LOOPS; i++)
+    {
+        io_conf.mode = GPIO_MODE_INPUT;
+        io_conf.pull_up_en = 1;
+        gpio_config(&io_conf);
+        level = gpio_get_level(aux_io_pin[pin]);
+    }
+    result->get_config_cycles = (XTHAL_GET_CCOUNT() - start) / GPIO_BENCH_LOOPS;
+
+    // Cached direction with register access
+    aux_dir[pin] = AUX_DIR_NONE;
+    GpioLevelSet(pin, 0);
+    start = XTHAL_GET_CCOUNT();
+    for (i = 0; i < GPIO_BENCH_LOOPS; i++)
+    {
+        GpioLevelSet(pin, i & 1);
+    }
+    result->set_fast_cycles = (XTHAL_GET_CCOUNT() - start) / GPIO_BENCH_LOOPS;
+
+    level = GpioLevelGet(pin);
+    start = XTHAL_GET_CCOUNT();
+    for (i = 0; i < GPIO_BENCH_LOOPS; i++)
+    {
+        level = GpioLevelGet(pin);
+    }
+    result->get_fast_cycles = (XTHAL_GET_CCOUNT() - start) / GPIO_BENCH_LOOPS;
+    (void)level;
+}
+
+//*****************************************************************************
+// PumpDutySet
+//
+//*****************************************************************************
+static void PumpDutySet(uint8_t speed)
+{
+    if (speed > 100)
+    {
+        speed = 100;
+    }
+    pump_speed = speed;
+    ledc_set_duty(PUMP_LEDC_MODE, PUMP_LEDC_CHANNEL, (PUMP_DUTY_MAX * speed) / 100);
+    ledc_update_duty(PUMP_LEDC_MODE, PUMP_LEDC_CHANNEL);
+}
+
+//*****************************************************************************
+// PumpSpeedSet
+// Sets pump speed 0..100% as LEDC duty. Cancels a dose in progress.
+//
+//*****************************************************************************
+void PumpSpeedSet(uint8_t speed)
+{
+    if (dose_active)
+    {
+        PumpDoseStop();
+    }
+    PumpDutySet(speed);
+}
+
+//*****************************************************************************
+// PumpSpeedGet
+//
+//*****************************************************************************
+uint8_t PumpSpeedGet(void)
+{
+    return pump_speed;
 }
 
 //*****************************************************************************
 // PumpControlSet
+// On/off control, kept for callers that only switch the pump.
 //
 //*****************************************************************************
 void PumpControlSet(bool on)
 {
-    if (on)
+    PumpSpeedSet(on ? 100 : 0);
+}
+
+//*****************************************************************************
+// PumpDoseTimerCallback
+// Runs from the esp_timer task when the dose time has elapsed.
+//
+//*****************************************************************************
+static void PumpDoseTimerCallback(void *arg)
+{
+    PumpDutySet(0);
+
+    dose_status.done_us = esp_timer_get_time() - dose_start_us;
+    dose_status.ml = dose_ml;
+    dose_status.count++;
+    dose_active = false;
+
+    if (dose_callback)
+    {
+        dose_callback(&dose_status);
+    }
+}
+
+//*****************************************************************************
+// PumpDoseStart
+// Runs the pump at full speed for the calibrated time for the requested volume.
+// The pump is stopped from a one-shot high resolution timer, so delivery does
+// not depend on the latency of whoever requested it.
+//
+//*****************************************************************************
+esp_err_t PumpDoseStart(float ml)
+{
+    uint64_t duration_us;
+    esp_err_t err;
+
+    if (ml <= 0 || dose_timer == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    if (dose_active)
+        return ESP_ERR_INVALID_STATE;
+
+    duration_us = (uint64_t)(ml * pump_ms_per_ml * 1000);
+
+    dose_ml = ml;
+    dose_active = true;
+    dose_start_us = esp_timer_get_time();
+    PumpDutySet(100);
+
+    // Nothing would stop the pump without the timer
+    err = esp_timer_start_once(dose_timer, duration_us);
+    if (err != ESP_OK)
     {
-        gpio_set_level(GPIO_OUTPUT_PUMP, on);
+        PumpDutySet(0);
+        dose_active = false;
     }
-    else
+    return err;
+}
+
+//*****************************************************************************
+// PumpDoseStop
+// Aborts a dose in progress and stops the pump.
+//
+//*****************************************************************************
+void PumpDoseStop(void)
+{
+    esp_timer_stop(dose_timer);
+    PumpDutySet(0);
+    dose_active = false;
+}
+
+//*****************************************************************************
+// PumpDoseActive
+// Returns true while a dose is running, and optionally the time remaining.
+//
+//*****************************************************************************
+bool PumpDoseActive(uint32_t *remaining_ms)
+{
+    int64_t remaining_us = 0;
+
+    if (dose_active)
+    {
+        remaining_us = (int64_t)(dose_ml * pump_ms_per_ml * 1000) - (esp_timer_get_time() - dose_start_us);
+        if (remaining_us < 0)
+            remaining_us = 0;
+    }
+    if (remaining_ms)
     {
-        gpio_set_level(GPIO_OUTPUT_PUMP, on);
+        *remaining_ms = remaining_us / 1000;
     }
+    return dose_active;
+}
+
+//*****************************************************************************
+// PumpDoseLast
+// Returns the result of the last completed dose.
+//
+//*****************************************************************************
+void PumpDoseLast(pump_dose_t *dose)
+{
+    *dose = dose_status;
+}
+
+//*****************************************************************************
+// PumpDoseCallbackSet
+// Sets a function called from the esp_timer task when a dose completes.
+//
+//*****************************************************************************
+void PumpDoseCallbackSet(pump_dose_cb_t callback)
+{
+    dose_callback = callback;
+}
+
+//*****************************************************************************
+// PumpCalibrationSet
+// Sets the flow model (ms of full speed pumping per mL) and saves it to NVS.
+//
+//*****************************************************************************
+esp_err_t PumpCalibrationSet(uint32_t ms_per_ml)
+{
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    if (ms_per_ml == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    pump_ms_per_ml = ms_per_ml;
+
+    err = nvs_open(PUMP_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_set_u32(nvs, "ms_per_ml", ms_per_ml);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+//*****************************************************************************
+// PumpCalibrationGet
+//
+//*****************************************************************************
+uint32_t PumpCalibrationGet(void)
+{
+    return pump_ms_per_ml;
 }
 
 //*****************************************************************************
 // PumpInit
+// Pump is driven as PWM from LEDC. Must be called after nvs_flash_init so the
+// saved calibration can be read.
 //
 //*****************************************************************************
 void PumpInit(void)
 {
-    gpio_config_t io_conf;
+    nvs_handle_t nvs;
+    uint32_t ms_per_ml;
 
-    io_conf.intr_type = GPIO_PIN_INTR_DISABLE;
-    io_conf.mode = GPIO_MODE_OUTPUT;
-    io_conf.pin_bit_mask = GPIO_OUTPUT_PIN_SEL;
-    io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 0;
-    gpio_config(&io_conf);
+    ledc_timer_config_t timer_conf =
+    {
+        .speed_mode = PUMP_LEDC_MODE,
+        .duty_resolution = PUMP_LEDC_RESOLUTION,
+        .timer_num = PUMP_LEDC_TIMER,
+        .freq_hz = PUMP_PWM_FREQ_HZ,
+        .clk_cfg = LEDC_AUTO_CLK
+    };
+    ledc_timer_config(&timer_conf);
+
+    ledc_channel_config_t channel_conf =
+    {
+        .gpio_num = GPIO_OUTPUT_PUMP,
+        .speed_mode = PUMP_LEDC_MODE,
+        .channel = PUMP_LEDC_CHANNEL,
+        .intr_type = LEDC_INTR_DISABLE,
+        .timer_sel = PUMP_LEDC_TIMER,
+        .duty = 0,
+        .hpoint = 0
+    };
+    ledc_channel_config(&channel_conf);
+
+    esp_timer_create_args_t dose_timer_conf =
+    {
+        .callback = PumpDoseTimerCallback,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "pump_dose"
+    };
+    esp_timer_create(&dose_timer_conf, &dose_timer);
+
+    // Saved calibration overrides the default
+    if (nvs_open(PUMP_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+    {
+        if (nvs_get_u32(nvs, "ms_per_ml", &ms_per_ml) == ESP_OK && ms_per_ml)
+        {
+            pump_ms_per_ml = ms_per_ml;
+        }
+        nvs_close(nvs);
+    }
 }
 
 //*****************************************************************************
@@ -1,9 +1,67 @@
 // Header file for peripheral.c
 
+// Number of aux I/O pins on the control module
+#define AUX_IO_PINS         2
+
+// Iterations averaged by GpioBenchmark
+#define GPIO_BENCH_LOOPS    1000
+
+// Aux input edge, timestamped in the GPIO ISR
+typedef struct
+{
+    int64_t time_us;        // esp_timer time of the edge
+    uint8_t pin;            // Aux pin index
+    uint8_t level;          // Pin level after the edge
+} aux_event_t;
+
+// Called from the GPIO ISR when a safety input goes active
+typedef void (*aux_safety_handler_t)(uint8_t pin);
+
+// Result of the last completed pump dose
+typedef struct
+{
+    float ml;               // Volume requested
+    int64_t done_us;        // Measured pump on time
+    uint32_t count;         // Doses completed since boot
+} pump_dose_t;
+
+// Called from the esp_timer task when a dose completes
+typedef void (*pump_dose_cb_t)(const pump_dose_t *dose);
+
+// Average CPU cycles per call, see GpioBenchmark
+typedef struct
+{
+    uint32_t set_config_cycles;
+    uint32_t get_config_cycles;
+    uint32_t set_fast_cycles;
+    uint32_t get_fast_cycles;
+} gpio_bench_t;
+
 void GpioInit(void);
 void GpioLevelSet(uint8_t pin, bool level);
 bool GpioLevelGet(uint8_t pin);
+bool GpioLevelPeek(uint8_t pin);
+bool GpioIsOutput(uint8_t pin);
+esp_err_t GpioInputEnable(uint8_t pin, uint32_t debounce_us);
+void GpioInputDisable(uint8_t pin);
+void GpioSafetyHandlerSet(aux_safety_handler_t handler);
+esp_err_t GpioSafetyEnable(uint8_t pin, uint8_t active_level);
+void GpioSafetyDisable(uint8_t pin);
+uint8_t GpioSafetyArmed(void);
+uint8_t GpioSafetyActive(void);
+bool GpioEventGet(aux_event_t *event, uint32_t timeout_ms);
+uint32_t GpioEventsDropped(void);
+void GpioBenchmark(uint8_t pin, gpio_bench_t *result);
 void PumpControlSet(bool on);
+void PumpSpeedSet(uint8_t speed);
+uint8_t PumpSpeedGet(void);
+esp_err_t PumpDoseStart(float ml);
+void PumpDoseStop(void);
+bool PumpDoseActive(uint32_t *remaining_ms);
+void PumpDoseLast(pump_dose_t *dose);
+void PumpDoseCallbackSet(pump_dose_cb_t callback);
+esp_err_t PumpCalibrationSet(uint32_t ms_per_ml);
+uint32_t PumpCalibrationGet(void);
 void PumpInit(void);
 uint32_t AnalogMotorCurrentRead(uint8_t motor);
 uint32_t AnalogVoltageRead(void);
@@ -0,0 +1,63 @@
+// ui.js - The part of jQuery the Growver pages use, served from the module
+// so they work on networks without internet access.
+//
+// $(selector or element) with on, one, off, css and ready. Handlers get the
+// native event, which is also passed as e.originalEvent like jQuery does.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+
+(function () {
+	function Query(elements) {
+		this.elements = elements;
+	}
+
+	Query.prototype.on = function (events, handler, options) {
+		events.split(' ').forEach((type) => this.elements.forEach((el) => {
+			const listener = (e) => {
+				e.originalEvent = e;
+				return handler.call(el, e);
+			};
+			el._handlers = el._handlers || {};
+			(el._handlers[type] = el._handlers[type] || []).push(listener);
+			// Not passive, handlers call preventDefault on touchmove
+			el.addEventListener(type, listener, Object.assign({ passive: false }, options));
+		}));
+		return this;
+	};
+
+	Query.prototype.one = function (events, handler) {
+		return this.on(events, handler, { once: true });
+	};
+
+	Query.prototype.off = function (events) {
+		events.split(' ').forEach((type) => this.elements.forEach((el) => {
+			((el._handlers && el._handlers[type]) || []).forEach((listener) => el.removeEventListener(type, listener));
+			if (el._handlers) {
+				delete el._handlers[type];
+			}
+		}));
+		return this;
+	};
+
+	// Numbers are pixels, as in jQuery
+	Query.prototype.css = function (props) {
+		this.elements.forEach((el) => Object.keys(props).forEach((name) => {
+			const value = props[name];
+			el.style[name] = (typeof value === 'number') ? value + 'px' : value;
+		}));
+		return this;
+	};
+
+	Query.prototype.ready = function (handler) {
+		if (document.readyState === 'loading') {
+			document.addEventListener('DOMContentLoaded', handler);
+		} else {
+			handler();
+		}
+		return this;
+	};
+
+	window.$ = (selector) => new Query((typeof selector === 'string') ?
+		Array.from(document.querySelectorAll(selector)) : [selector]);
+})();
@@ -1,9 +0,0 @@
-// Header file with web asset references
-
-// Embedded Files. To add or remove make changes is component.mk file as well.
-extern const uint8_t index_html_start[] asm("_binary_index_html_start");
-extern const uint8_t index_html_end[]   asm("_binary_index_html_end");
-extern const uint8_t favicon_ico_start[] asm("_binary_favicon_ico_start");
-extern const uint8_t favicon_ico_end[]   asm("_binary_favicon_ico_end");
-extern const uint8_t ota_page_html_start[] asm("_binary_ota_page_html_start");
-extern const uint8_t ota_page_html_end[]   asm("_binary_ota_page_html_end");
\ No newline at end of file
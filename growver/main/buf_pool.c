@@ -0,0 +1,280 @@
+//*****************************************************************************
+//
+// buf_pool.c - Request buffers for the HTTP handlers.
+//
+// Handlers that need a large buffer take one from the pool of their route
+// class for the length of the request, instead of sharing one buffer per
+// server, so requests can be served in parallel (async handlers, or more
+// than one server task) without overwriting each other's data:
+//
+//   buf = BufPoolAcquire(BUF_POOL_FILE);
+//   if (buf == NULL)
+//   {
+//       return BufPoolRespondBusy(req);    // 503, the client retries
+//   }
+//   ... use up to BufPoolSize(BUF_POOL_FILE) bytes ...
+//   BufPoolRelease(BUF_POOL_FILE, buf);
+//
+// Acquire and release are lock-free: a slot is claimed by clearing its bit
+// in the class's free mask with compare and swap, so they never block the
+// control server behind the transfer server. Buffers are allocated on first
+// use and kept for the next request. A timer frees those that have not been
+// used for BUF_POOL_IDLE_MS, so the RAM is returned while traffic is idle.
+//
+// Each buffer starts with a header holding its slot, so a release goes
+// straight to its slot and never matches a buffer by address: once freed by
+// the timer, an address can come back from malloc for another slot.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vfs.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "file_server.h"
+#include "growver_rest.h"
+#include "buf_pool.h"
+
+#define BUF_POOL_MAX_COUNT      32
+
+// Header before each buffer, holding its slot. 8 bytes keep the buffer
+// aligned as malloc returns it.
+#define BUF_POOL_HDR_SIZE       8
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t count;
+    uint32_t free;              // Bit per slot, set when the slot is free
+    uint32_t allocated;         // Bit per slot, set when buf holds memory
+    uint32_t busy;
+    uint8_t *buf[BUF_POOL_MAX_COUNT];   // Header and buffer, or NULL
+    TickType_t released[BUF_POOL_MAX_COUNT];
+} buf_pool_t;
+
+#define BUF_POOL_ALL(count)     ((uint32_t)((1ULL << (count)) - 1))
+
+// Every slot starts free, so handlers can use the pool before BufPoolInit
+static buf_pool_t buf_pools[BUF_POOL_CLASSES] =
+{
+    [BUF_POOL_REST]  = { .size = REST_SCRATCH_BUFSIZE, .count = BUF_POOL_REST_COUNT,
+                         .free = BUF_POOL_ALL(BUF_POOL_REST_COUNT) },
+    [BUF_POOL_FILE]  = { .size = SCRATCH_BUFSIZE, .count = BUF_POOL_FILE_COUNT,
+                         .free = BUF_POOL_ALL(BUF_POOL_FILE_COUNT) },
+    [BUF_POOL_ASSET] = { .size = BUF_POOL_ASSET_SIZE, .count = BUF_POOL_ASSET_COUNT,
+                         .free = BUF_POOL_ALL(BUF_POOL_ASSET_COUNT) },
+};
+
+static esp_timer_handle_t buf_pool_timer;
+
+static const char *TAG = "bufpool";
+
+//*****************************************************************************
+// BufPoolTimer
+// Frees buffers left idle (esp_timer task).
+//
+//*****************************************************************************
+static void BufPoolTimer(void *arg)
+{
+    uint32_t freed = BufPoolTrim(BUF_POOL_IDLE_MS);
+
+    if (freed)
+    {
+        ESP_LOGI(TAG, "Freed %u bytes of idle buffers", freed);
+    }
+}
+
+//*****************************************************************************
+// BufPoolInit
+// Starts the timer that frees idle buffers. No memory is allocated until a
+// buffer is first acquired.
+//
+//*****************************************************************************
+esp_err_t BufPoolInit(void)
+{
+    const esp_timer_create_args_t timer_args =
+    {
+        .callback = BufPoolTimer,
+        .name = "bufpool"
+    };
+    esp_err_t err;
+
+    err = esp_timer_create(&timer_args, &buf_pool_timer);
+    if (err == ESP_OK)
+    {
+        err = esp_timer_start_periodic(buf_pool_timer, BUF_POOL_IDLE_MS * 1000ULL / 2);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Idle timer failed (%s), buffers are kept", esp_err_to_name(err));
+    }
+    return err;
+}
+
+//*****************************************************************************
+// BufPoolAcquire / BufPoolRelease
+// Lock-free allocation from the pool of a route class. A slot that still
+// holds its buffer is preferred, so the pool allocates only as many buffers
+// as requests overlap. Returns NULL if every buffer of the class is in use,
+// or memory is short.
+//
+//*****************************************************************************
+void *BufPoolAcquire(buf_pool_class_t cls)
+{
+    buf_pool_t *pool = &buf_pools[cls];
+    uint32_t free = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+    uint32_t held;
+    int idx = -1;
+
+    while (free)
+    {
+        held = free & __atomic_load_n(&pool->allocated, __ATOMIC_RELAXED);
+        idx = __builtin_ctz(held ? held : free);
+        if (__atomic_compare_exchange_n(&pool->free, &free, free & ~(1UL << idx),
+                                        true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        idx = -1;
+    }
+    if (idx < 0)
+    {
+        __atomic_fetch_add(&pool->busy, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    // The slot is ours, so its buffer can be set without a lock
+    if (pool->buf[idx] == NULL)
+    {
+        pool->buf[idx] = malloc(BUF_POOL_HDR_SIZE + pool->size);
+        if (pool->buf[idx] == NULL)
+        {
+            ESP_LOGW(TAG, "No memory for a %u byte buffer", pool->size);
+            __atomic_fetch_add(&pool->busy, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_or(&pool->free, 1UL << idx, __ATOMIC_RELEASE);
+            return NULL;
+        }
+        *(uint32_t *)pool->buf[idx] = idx;
+        __atomic_fetch_or(&pool->allocated, 1UL << idx, __ATOMIC_RELAXED);
+    }
+    return pool->buf[idx] + BUF_POOL_HDR_SIZE;
+}
+
+void BufPoolRelease(buf_pool_class_t cls, void *buf)
+{
+    buf_pool_t *pool = &buf_pools[cls];
+    uint8_t *block = (uint8_t *)buf - BUF_POOL_HDR_SIZE;
+    uint32_t idx = *(uint32_t *)block;
+
+    // The slot is still ours, so its buffer cannot have been freed
+    if ((idx >= pool->count) || (pool->buf[idx] != block))
+    {
+        ESP_LOGE(TAG, "Release of a buffer not from pool %d", cls);
+        return;
+    }
+    pool->released[idx] = xTaskGetTickCount();
+    __atomic_fetch_or(&pool->free, 1UL << idx, __ATOMIC_RELEASE);
+}
+
+//*****************************************************************************
+// BufPoolSize
+// Usable size of the buffers of a route class.
+//
+//*****************************************************************************
+size_t BufPoolSize(buf_pool_class_t cls)
+{
+    return buf_pools[cls].size;
+}
+
+//*****************************************************************************
+// BufPoolTrim
+// Frees the buffers of free slots released at least idle_ms ago (0 frees
+// every free buffer). Each slot is claimed while its buffer is freed, so a
+// concurrent acquire takes another slot or allocates afresh. Returns the
+// number of bytes freed.
+//
+//*****************************************************************************
+uint32_t BufPoolTrim(uint32_t idle_ms)
+{
+    uint32_t freed = 0;
+    uint32_t mask;
+    uint32_t bit;
+    uint8_t *block;
+    buf_pool_t *pool;
+
+    for (int cls = 0; cls < BUF_POOL_CLASSES; cls++)
+    {
+        pool = &buf_pools[cls];
+        for (int idx = 0; idx < pool->count; idx++)
+        {
+            bit = 1UL << idx;
+            mask = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+            if (!(mask & bit) || !(__atomic_load_n(&pool->allocated, __ATOMIC_RELAXED) & bit))
+            {
+                continue;
+            }
+            // Lost to an acquire or release of another slot, next round then
+            if (!__atomic_compare_exchange_n(&pool->free, &mask, mask & ~bit,
+                                             false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                continue;
+            }
+            // Release time is only stable once the slot is ours
+            if ((xTaskGetTickCount() - pool->released[idx]) < pdMS_TO_TICKS(idle_ms))
+            {
+                __atomic_fetch_or(&pool->free, bit, __ATOMIC_RELEASE);
+                continue;
+            }
+            // Detached before it is freed, so the slot never names memory
+            // that malloc may hand out again
+            block = pool->buf[idx];
+            __atomic_store_n(&pool->buf[idx], NULL, __ATOMIC_RELEASE);
+            free(block);
+            __atomic_fetch_and(&pool->allocated, ~bit, __ATOMIC_RELAXED);
+            __atomic_fetch_or(&pool->free, bit, __ATOMIC_RELEASE);
+            freed += pool->size;
+        }
+    }
+    return freed;
+}
+
+//*****************************************************************************
+// BufPoolStats
+// Snapshot of a route class's pool, for the "bufpool" command.
+//
+//*****************************************************************************
+void BufPoolStats(buf_pool_class_t cls, buf_pool_stats_t *stats)
+{
+    buf_pool_t *pool = &buf_pools[cls];
+    uint32_t all = BUF_POOL_ALL(pool->count);
+
+    stats->size = pool->size;
+    stats->count = pool->count;
+    stats->allocated = __builtin_popcount(__atomic_load_n(&pool->allocated, __ATOMIC_RELAXED));
+    stats->in_use = __builtin_popcount(~__atomic_load_n(&pool->free, __ATOMIC_RELAXED) & all);
+    stats->busy = __atomic_load_n(&pool->busy, __ATOMIC_RELAXED);
+}
+
+//*****************************************************************************
+// BufPoolRespondBusy
+// Answers a request that found no free buffer with 503, which clients
+// retry after a second.
+//
+//*****************************************************************************
+esp_err_t BufPoolRespondBusy(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    return httpd_resp_sendstr(req, "Server busy");
+}
+
+// end of buf_pool.c
@@ -0,0 +1,44 @@
+//******************************************************************************
+//
+// buf_pool.h
+//
+//******************************************************************************
+
+// Route classes, each with its own pool of request buffers
+typedef enum
+{
+    BUF_POOL_REST,              // REST post bodies
+    BUF_POOL_FILE,              // File downloads
+    BUF_POOL_ASSET,             // UI pages overridden from storage
+    BUF_POOL_CLASSES
+} buf_pool_class_t;
+
+// Buffers per class, at most 32 (free mask bits). A buffer is held for the
+// length of one request, so this is the number of requests of the class
+// that can be served at the same time.
+#define BUF_POOL_REST_COUNT     2
+#define BUF_POOL_FILE_COUNT     2
+#define BUF_POOL_ASSET_COUNT    2
+#define BUF_POOL_ASSET_SIZE     1024
+
+// Buffers are allocated on first use and freed once unused for this long
+#define BUF_POOL_IDLE_MS        30000
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t count;
+    uint32_t allocated;         // Buffers holding memory
+    uint32_t in_use;
+    uint32_t busy;              // Acquires that found no free buffer
+} buf_pool_stats_t;
+
+esp_err_t BufPoolInit(void);
+void *BufPoolAcquire(buf_pool_class_t cls);
+void BufPoolRelease(buf_pool_class_t cls, void *buf);
+size_t BufPoolSize(buf_pool_class_t cls);
+uint32_t BufPoolTrim(uint32_t idle_ms);
+void BufPoolStats(buf_pool_class_t cls, buf_pool_stats_t *stats);
+esp_err_t BufPoolRespondBusy(httpd_req_t *req);
+
+// end of buf_pool.h
@@ -0,0 +1,208 @@
+//*****************************************************************************
+//
+// cmdframe.c - Binary framing for host applications on the command UART.
+//
+// A frame is COBS encoded and terminated by a zero byte, so a receiver can
+// always resynchronise on the next zero. Decoded, a frame is:
+//
+//   seq (1) | type (1) | payload (0..CMDFRAME_MAX_PAYLOAD) | crc (2, LSB first)
+//
+// The CRC is CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) over seq, type
+// and payload. This module has no ESP-IDF dependencies.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "cmdframe.h"
+
+//*****************************************************************************
+// CmdFrameCrc16
+// CRC-16/CCITT-FALSE. Pass CMDFRAME_CRC_INIT as crc to start a new CRC.
+//
+//*****************************************************************************
+uint16_t CmdFrameCrc16(const uint8_t *data, size_t len, uint16_t crc)
+{
+    while (len--)
+    {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+//*****************************************************************************
+// CobsEncode
+// Encodes len bytes from in to out. out must hold CMDFRAME_ENCODED_SIZE(len).
+// Returns the encoded length, not including the zero delimiter.
+//
+//*****************************************************************************
+static size_t CobsEncode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t read = 0, write = 1, code_pos = 0;
+    uint8_t code = 1;
+
+    while (read < len)
+    {
+        if (in[read] == 0)
+        {
+            out[code_pos] = code;
+            code = 1;
+            code_pos = write++;
+        }
+        else
+        {
+            out[write++] = in[read];
+            if (++code == 0xFF)
+            {
+                out[code_pos] = code;
+                code = 1;
+                code_pos = write++;
+            }
+        }
+        read++;
+    }
+    out[code_pos] = code;
+    return write;
+}
+
+//*****************************************************************************
+// CobsDecode
+// Decodes in place. Returns the decoded length, or -1 if the data is not
+// valid COBS.
+//
+//*****************************************************************************
+static int CobsDecode(uint8_t *buf, size_t len)
+{
+    size_t read = 0, write = 0;
+
+    while (read < len)
+    {
+        uint8_t code = buf[read++];
+        if (code == 0 || (read + code - 1) > len)
+        {
+            return -1;
+        }
+        for (uint8_t i = 1; i < code; i++)
+        {
+            buf[write++] = buf[read++];
+        }
+        if (code != 0xFF && read < len)
+        {
+            buf[write++] = 0;
+        }
+    }
+    return write;
+}
+
+//*****************************************************************************
+// CmdFrameEncode
+// Builds a complete frame including the trailing zero delimiter. out must
+// hold CMDFRAME_MAX_ENCODED bytes. Returns the number of bytes to send, or 0
+// if the payload is too long.
+//
+//*****************************************************************************
+size_t CmdFrameEncode(uint8_t seq, uint8_t type, const uint8_t *payload, size_t len, uint8_t *out)
+{
+    uint8_t raw[CMDFRAME_MAX_RAW];
+    uint16_t crc;
+    size_t encoded;
+
+    if (len > CMDFRAME_MAX_PAYLOAD)
+    {
+        return 0;
+    }
+
+    raw[0] = seq;
+    raw[1] = type;
+    memcpy(&raw[2], payload, len);
+    crc = CmdFrameCrc16(raw, len + 2, CMDFRAME_CRC_INIT);
+    raw[len + 2] = crc & 0xFF;
+    raw[len + 3] = crc >> 8;
+
+    encoded = CobsEncode(raw, len + 4, out);
+    out[encoded++] = 0;
+    return encoded;
+}
+
+//*****************************************************************************
+// CmdFrameRxReset
+//
+//*****************************************************************************
+void CmdFrameRxReset(cmdframe_rx_t *rx)
+{
+    rx->len = 0;
+    rx->overflow = false;
+}
+
+//*****************************************************************************
+// CmdFrameRxByte
+// Feeds one received byte into the frame assembler. Returns CMDFRAME_NONE
+// until a delimiter completes a frame, then CMDFRAME_OK with frame filled in,
+// or a negative CMDFRAME_xxx error. frame->len is at most CMDFRAME_MAX_PAYLOAD,
+// and frame->payload points into rx and stays valid until the next byte is fed.
+//
+//*****************************************************************************
+int CmdFrameRxByte(cmdframe_rx_t *rx, uint8_t byte, cmdframe_t *frame)
+{
+    int decoded;
+    uint16_t crc;
+
+    if (byte != 0)
+    {
+        if (rx->len < sizeof(rx->buf))
+        {
+            rx->buf[rx->len++] = byte;
+        }
+        else
+        {
+            rx->overflow = true;
+        }
+        return CMDFRAME_NONE;
+    }
+
+    // Delimiter. Back to back delimiters are idle line, not errors.
+    if (rx->len == 0 && !rx->overflow)
+    {
+        return CMDFRAME_NONE;
+    }
+    if (rx->overflow)
+    {
+        CmdFrameRxReset(rx);
+        return CMDFRAME_TOO_LONG;
+    }
+
+    decoded = CobsDecode(rx->buf, rx->len);
+    rx->len = 0;
+    if (decoded < 4)
+    {
+        return CMDFRAME_BAD;
+    }
+    // The encoded buffer has room for a few bytes more than the largest frame
+    if (decoded - 4 > CMDFRAME_MAX_PAYLOAD)
+    {
+        return CMDFRAME_TOO_LONG;
+    }
+
+    crc = rx->buf[decoded - 2] | (rx->buf[decoded - 1] << 8);
+    if (CmdFrameCrc16(rx->buf, decoded - 2, CMDFRAME_CRC_INIT) != crc)
+    {
+        // Sequence number is still useful to the host for a NAK
+        frame->seq = rx->buf[0];
+        return CMDFRAME_CRC_ERROR;
+    }
+
+    frame->seq = rx->buf[0];
+    frame->type = rx->buf[1];
+    frame->payload = &rx->buf[2];
+    frame->len = decoded - 4;
+    return CMDFRAME_OK;
+}
@@ -0,0 +1,58 @@
+//******************************************************************************
+//
+// cmdframe.h
+//
+//******************************************************************************
+
+// Largest payload carried by one frame
+#define CMDFRAME_MAX_PAYLOAD    240
+
+// seq + type + payload + crc
+#define CMDFRAME_MAX_RAW        (CMDFRAME_MAX_PAYLOAD + 4)
+
+// COBS adds one byte per 254 plus one
+#define CMDFRAME_ENCODED_SIZE(len)  ((len) + ((len) / 254) + 1)
+
+// Largest frame on the wire, with the zero delimiter
+#define CMDFRAME_MAX_ENCODED    (CMDFRAME_ENCODED_SIZE(CMDFRAME_MAX_RAW) + 1)
+
+#define CMDFRAME_CRC_INIT       0xFFFF
+
+// Frame types. Host to device
+#define CMDFRAME_TYPE_CMD       0x01    // Payload is a console command line
+
+// Device to host
+#define CMDFRAME_TYPE_RESP      0x81    // Status (int8) then final command output
+#define CMDFRAME_TYPE_RESP_PART 0x82    // More command output, RESP follows
+#define CMDFRAME_TYPE_EVENT     0x83    // Output not tied to a command (seq 0)
+#define CMDFRAME_TYPE_NAK       0x84    // Status (int8), frame was rejected
+
+// CmdFrameRxByte results
+#define CMDFRAME_NONE           0
+#define CMDFRAME_OK             1
+#define CMDFRAME_CRC_ERROR      -1
+#define CMDFRAME_BAD            -2
+#define CMDFRAME_TOO_LONG       -3
+
+typedef struct
+{
+    uint8_t seq;
+    uint8_t type;
+    const uint8_t *payload;
+    size_t len;
+} cmdframe_t;
+
+// Receive assembler state (encoded bytes up to the delimiter)
+typedef struct
+{
+    uint8_t buf[CMDFRAME_MAX_ENCODED];
+    size_t len;
+    bool overflow;
+} cmdframe_rx_t;
+
+uint16_t CmdFrameCrc16(const uint8_t *data, size_t len, uint16_t crc);
+size_t CmdFrameEncode(uint8_t seq, uint8_t type, const uint8_t *payload, size_t len, uint8_t *out);
+void CmdFrameRxReset(cmdframe_rx_t *rx);
+int CmdFrameRxByte(cmdframe_rx_t *rx, uint8_t byte, cmdframe_t *frame);
+
+// end of cmdframe.h
@@ -16,14 +16,27 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <sys/param.h>
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "commandline.h"
+#include "cmdframe.h"
+#include "script.h"
+#include "storage.h"
+#include "esp_http_server.h"
+#include "ota-http.h"
+#include "buf_pool.h"
+#include "growver_wifi.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "../components/motor/motor_dc.h"
 #include "../components/motor/servo.h"
 #include "../components/other/peripheral.h"
 #include "tcpip_adapter.h"
+#include "esp_event.h"
 
 #include <math.h>
 #include <ctype.h>
@@ -44,7 +57,31 @@ int CmdServoControl(int argc, char *argv[]);
 int CmdSoftReset(int argc, char *argv[]);
 int CmdMotorSpeed(int argc, char *argv[]);
 int CmdIPAddress(int argc, char *argv[]);
+int CmdNetStorm(int argc, char *argv[]);
+int CmdWifi(int argc, char *argv[]);
+int CmdWifiAdd(int argc, char *argv[]);
+int CmdWifiDel(int argc, char *argv[]);
 int CmdBattRead(int argc, char *argv[]);
+int CmdGpio(int argc, char *argv[]);
+int CmdGpioInput(int argc, char *argv[]);
+int CmdGpioEvents(int argc, char *argv[]);
+int CmdGpioBench(int argc, char *argv[]);
+int CmdFsBench(int argc, char *argv[]);
+int CmdBufPool(int argc, char *argv[]);
+int CmdSafety(int argc, char *argv[]);
+int CmdFault(int argc, char *argv[]);
+int CmdEmergencyStop(int argc, char *argv[]);
+int CmdDose(int argc, char *argv[]);
+int CmdPumpCal(int argc, char *argv[]);
+int CmdBinaryMode(int argc, char *argv[]);
+int CmdTextMode(int argc, char *argv[]);
+int CmdUartStats(int argc, char *argv[]);
+int CmdLogMirror(int argc, char *argv[]);
+int CmdScriptRun(int argc, char *argv[]);
+int CmdScriptStop(int argc, char *argv[]);
+int CmdScriptStatus(int argc, char *argv[]);
+int CmdOtaProgress(int argc, char *argv[]);
+int CmdLineProcess(char *pCommand);
 
 // GPIO Pin assignments for Growver 2020 module
 #define CMD_UART_TX_PIN (GPIO_NUM_26)
@@ -53,9 +90,11 @@ int CmdBattRead(int argc, char *argv[]);
 // Set UART to use for serial commands
 #define CMD_UART_NUM UART_NUM_1
 
-// Buffers for incoming and outgoing messages
+// Text console baud rate. Binary mode runs at the rate given to "bin".
+#define CMD_UART_TEXT_BAUD  115200
+
+// Buffer for incoming command lines
 char serial_cmd_buff[100];
-char response_buff[1024];
 
 // Prototype for strtoull
 //unsigned long long int strtoull(const char * restrict nptr,char ** restrict endptr,int base);
@@ -72,8 +111,16 @@ typedef struct
 }
 tCmdLineEntry;
 
-// Buffer sizes to use for TX and RX buffers in the UART driver
-#define BUF_SIZE (256)
+// Buffer sizes to use for TX and RX buffers in the UART driver. RX is sized to
+// absorb a scripted burst of commands while the previous one executes.
+#define BUF_SIZE (1024)
+#define RX_BUF_SIZE (1024)
+
+// Response pool. Each CmdLineRespond call formats into a buffer from the pool
+// and queues it for uart_tx_task, so callers never wait for the UART. The pool
+// size is a power of two and at most 32 (free mask bits).
+#define CMD_TX_POOL_SIZE    16
+#define CMD_TX_BUF_SIZE     256
 static QueueHandle_t uart0_queue;
 
 // This table that holds the command names, a function pointer, and a
@@ -93,6 +140,29 @@ tCmdLineEntry pCommandTable[] =
 	{ "reset", CmdSoftReset,    " : Reset Growver"},
 	{ "ms", CmdMotorSpeed,      "    : Set DC motor speed"},
 	{ "ip", CmdIPAddress,       "    : Get IP address"},
+	{ "netstorm", CmdNetStorm,  ": [B] Simulate reconnects, report heap (netstorm [n])"},
+	{ "wifi", CmdWifi,          "  : Known networks and connection (ssid rssi drops roams)"},
+	{ "wifiadd", CmdWifiAdd,    ": Add or change a network (wifiadd ssid password [priority])"},
+	{ "wifidel", CmdWifiDel,    ": Forget a network (wifidel ssid)"},
+	{ "gpio", CmdGpio,          "  : Aux pin read (gpio n) or set (gpio n 0|1)"},
+	{ "gpioin", CmdGpioInput,   ": Aux pin edge input (gpioin n debounce_us|off)"},
+	{ "gpioev", CmdGpioEvents,  ": List queued aux input edges"},
+	{ "gpiobench", CmdGpioBench, " : Cycles per aux set/get, old vs fast path"},
+	{ "fsbench", CmdFsBench,    ": File open/stat/append/list us (fsbench [files])"},
+	{ "bufpool", CmdBufPool,    ": Web buffers (size count alloc used busy), bufpool free"},
+	{ "safety", CmdSafety,      ": Arm aux pin as stop input (safety n level|off)"},
+	{ "fault", CmdFault,        " : Show latched motor fault (fault clear to reset)"},
+	{ "estop", CmdEmergencyStop, " : Stop motors and latch a fault"},
+	{ "dose", CmdDose,          "  : Pump N mL (dose N) or abort (dose stop)"},
+	{ "pumpcal", CmdPumpCal,    ": Get/set pump flow in ms per mL"},
+	{ "run", CmdScriptRun,      "   : Run a script from SPIFFS (run name)"},
+	{ "stop", CmdScriptStop,    "  : Stop the running script"},
+	{ "script", CmdScriptStatus, ": Script state (running name line error runs)"},
+	{ "bin", CmdBinaryMode,     "   : Switch to framed binary protocol (bin baud)"},
+	{ "text", CmdTextMode,      "  : Return to text console (binary mode only)"},
+	{ "ota", CmdOtaProgress,    "   : Firmware upload progress (size received written KB/s)"},
+	{ "log", CmdLogMirror,      "   : Mirror ESP log output to this port (log 0|1)"},
+	{ "uartstat", CmdUartStats, ": UART counters (bytes lines dropped ovf full crc txdrop)"},
     { 0, 0, 0 }
 };
 
@@ -103,6 +173,65 @@ static char *pArgv[MAX_ARGUMENTS + 1];
 
 bool g_uart_echo;
 
+// Binary protocol state. While the UART task dispatches a command frame,
+// CmdLineRespond output is collected into frame_resp and returned in response
+// frames carrying the command's sequence number.
+static bool cmd_binary_mode;
+static bool cmd_text_pending;
+static TaskHandle_t uart_task_handle;
+static cmdframe_rx_t frame_rx;
+static bool frame_capture;
+static uint8_t frame_seq;
+static uint8_t frame_resp[CMDFRAME_MAX_PAYLOAD];
+static size_t frame_resp_len;
+static uint32_t frame_crc_errors;
+
+// Text line assembler state
+static size_t line_len;
+static bool line_overflow;
+static bool line_last_cr;
+
+// Receive statistics, reported by "uartstat"
+static struct
+{
+    uint32_t bytes;
+    uint32_t lines;
+    uint32_t dropped;
+    uint32_t overflows;
+    uint32_t buffer_full;
+} rx_stats;
+
+// Response pool and the lock-free multi-producer queue that feeds
+// uart_tx_task. The queue has a slot per pool buffer so it can never be full
+// for a producer holding a buffer.
+typedef struct
+{
+    uint16_t len;
+    uint8_t data[CMD_TX_BUF_SIZE];
+} cmd_tx_buf_t;
+
+typedef struct
+{
+    uint32_t seq;
+    uint8_t buf;
+} cmd_tx_slot_t;
+
+static cmd_tx_buf_t cmd_tx_pool[CMD_TX_POOL_SIZE];
+static uint32_t cmd_tx_free = (uint32_t)((1ULL << CMD_TX_POOL_SIZE) - 1);
+static cmd_tx_slot_t cmd_tx_ring[CMD_TX_POOL_SIZE];
+static uint32_t cmd_tx_head;
+static uint32_t cmd_tx_tail;
+static uint32_t cmd_tx_dropped;
+static TaskHandle_t uart_tx_task_handle;
+
+// Console log mirroring
+static vprintf_like_t cmd_log_vprintf;
+
+// Serialises command execution between the UART and the script task
+static SemaphoreHandle_t cmd_mutex;
+
+static void CmdTxFlush(uint32_t timeout_ms);
+
 //*****************************************************************************
 // Cmd_help
 // This function implements the "help" command.  It prints a simple list of the
@@ -112,6 +241,9 @@ bool g_uart_echo;
 int CmdHelp(int argc, char *argv[])
 {
     tCmdLineEntry *pEntry;
+    char text[CMD_TX_BUF_SIZE];
+    size_t used = 0;
+    int len;
 
     // Print some header text.
     CmdLineRespond("\nCOMMAND LIST");
@@ -120,15 +252,24 @@ int CmdHelp(int argc, char *argv[])
     pEntry = &pCommandTable[0];
 
     // Enter a loop to read each entry from the command table.  The end of the
-    // table has been reached when the command name is NULL.
+    // table has been reached when the command name is NULL. Lines are packed
+    // into as few responses as possible.
     while(pEntry->pCmd)
     {
         // Print the command name and the brief description.
-        sprintf(response_buff,"\n%s%s", pEntry->pName, pEntry->pHelp);
-        CmdLineRespond(response_buff);
+        len = snprintf(text + used, sizeof(text) - used, "\n%s%s", pEntry->pName, pEntry->pHelp);
+        if ((used + len) >= sizeof(text))
+        {
+            text[used] = 0;
+            CmdLineRespond(text);
+            used = 0;
+            continue;
+        }
+        used += len;
         pEntry++;
     }
-    CmdLineRespond("\n");
+    strcpy(text + MIN(used, sizeof(text) - 2), "\n");
+    CmdLineRespond(text);
     // Return success.
     return 0;
 }
@@ -153,6 +294,22 @@ int CmdEcho(int argc, char *argv[])
 	return 0;
 }
 
+//*****************************************************************************
+// DriveFaulted
+// Drive commands are refused while a motor fault is latched, as the REST
+// motor action is; clear it with "fault clear" first.
+//
+//*****************************************************************************
+static bool DriveFaulted(void)
+{
+	if (MotorDCFaultGet(NULL))
+	{
+		CmdLineRespondf("fault latched\n");
+		return true;
+	}
+	return false;
+}
+
 //*****************************************************************************
 // CmdDriveForward
 // This function implements the "df" drive command which sets both drive motors
@@ -170,6 +327,11 @@ int CmdDriveForward(int argc, char *argv[])
 		return (CMDLINE_INVALID_ARG);
 	}
 
+	if (DriveFaulted())
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+
 	// Get speed argument
 	speed = strtoul(argv[1], NULL, 10);
 
@@ -199,6 +361,11 @@ int CmdDriveReverse(int argc, char *argv[])
 		return (CMDLINE_INVALID_ARG);
 	}
 
+	if (DriveFaulted())
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+
 	// Get speed argument
 	speed = strtoul(argv[1], NULL, 10);
 
@@ -227,6 +394,11 @@ int CmdSpinLeft(int argc, char *argv[])
 		return (CMDLINE_INVALID_ARG);
 	}
 
+	if (DriveFaulted())
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+
 	// Get speed argument (0..100)
 	speed = strtoul(argv[1], NULL, 10);
 
@@ -258,6 +430,11 @@ int CmdSpinRight(int argc, char *argv[])
 		return (CMDLINE_INVALID_ARG);
 	}
 
+	if (DriveFaulted())
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+
 	// Get speed argument (0..100)
 	speed = strtoul(argv[1], NULL, 10);
 
@@ -275,8 +452,8 @@ int CmdSpinRight(int argc, char *argv[])
 
 //*****************************************************************************
 // CmdPumpControl
-// This function implements the "pump" control command which turns the pump
-// on (>0) or off (=0)
+// This function implements the "pump" control command which sets the pump
+// speed 0..100%
 //
 //*****************************************************************************
 int CmdPumpControl(int argc, char *argv[])
@@ -292,15 +469,13 @@ int CmdPumpControl(int argc, char *argv[])
 	// Get speed argument (0..100)
 	speed = strtoul(argv[1], NULL, 10);
 
-	if (speed)
-	{
-		 PumpControlSet(1);
-	}
-	else
+	if (speed > 100)
 	{
-		PumpControlSet(0);
+		speed = 100;
 	}
 
+	PumpSpeedSet(speed);
+
 	return 0;
 }
 
@@ -358,6 +533,11 @@ int CmdMotorSpeed(int argc, char *argv[])
 		return (CMDLINE_INVALID_ARG);
 	}
 
+	if (DriveFaulted())
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+
 	// Get motor argument
 	motor = strtoul(argv[1], NULL, 10);
 
@@ -389,8 +569,7 @@ int CmdIPAddress(int argc, char *argv[])
 	if (argc == 1)
 	{
         tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ipInfo);
-		sprintf(response_buff,IPSTR "\n", IP2STR(&ipInfo.ip));
-        CmdLineRespond(response_buff);
+		CmdLineRespondf(IPSTR "\n", IP2STR(&ipInfo.ip));
 	}
 	else
 	{
@@ -399,6 +578,142 @@ int CmdIPAddress(int argc, char *argv[])
 	return 0;
 }
 
+//*****************************************************************************
+// CmdNetStorm
+// This function implements the "netstorm" command which posts the given
+// number of got-IP events (default 100), as after a Wi-Fi reconnect, and
+// reports the free heap before and after. Every tenth reconnect comes with
+// another address, so the web servers are restarted, and the one after it
+// returns to the real address. The heap should not change.
+//
+//*****************************************************************************
+int CmdNetStorm(int argc, char *argv[])
+{
+	ip_event_got_ip_t event = { .if_index = TCPIP_ADAPTER_IF_STA };
+	uint32_t count = 100;
+	uint32_t restarts = 0;
+	uint32_t ip;
+	size_t before, heap, min;
+
+	if (argc > 2)
+	{
+		return (CMDLINE_BAD_ARG_COUNT);
+	}
+	if (argc == 2)
+	{
+		count = strtoul(argv[1], NULL, 10);
+	}
+
+	tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &event.ip_info);
+	ip = event.ip_info.ip.addr;
+	if (ip == 0)
+	{
+		CmdLineRespondf("not connected\n");
+		return (CMDLINE_EXEC_ERROR);
+	}
+
+	before = min = esp_get_free_heap_size();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		event.ip_changed = ((i % 10) == 4) || ((i % 10) == 5);
+		event.ip_info.ip.addr = ((i % 10) == 4) ? (ip ^ htonl(1)) : ip;
+		restarts += event.ip_changed;
+		if (esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &event, sizeof(event),
+				pdMS_TO_TICKS(1000)) != ESP_OK)
+		{
+			CmdLineRespondf("post failed after %u\n", i);
+			return (CMDLINE_EXEC_ERROR);
+		}
+		// Let the event loop handle it, restarting the servers takes a few ms
+		vTaskDelay(pdMS_TO_TICKS(event.ip_changed ? 200 : 20));
+		heap = esp_get_free_heap_size();
+		min = MIN(min, heap);
+	}
+	heap = esp_get_free_heap_size();
+
+	CmdLineRespondf("reconnects %u restarts %u heap before %u after %u min %u delta %d\n",
+			count, restarts, before, heap, min, (int)(heap - before));
+	return 0;
+}
+
+//*****************************************************************************
+// CmdWifi
+// This function implements the "wifi" command which lists the known
+// networks with their priority, and the current connection.
+//
+//*****************************************************************************
+int CmdWifi(int argc, char *argv[])
+{
+	char ssid[33];
+	uint8_t priority;
+	wifi_stats_t stats;
+
+	if (argc != 1)
+	{
+		return (CMDLINE_BAD_ARG_COUNT);
+	}
+
+	for (int i = 0; i < WIFI_NETWORKS_MAX; i++)
+	{
+		if (WifiNetworkGet(i, ssid, &priority))
+		{
+			CmdLineRespondf("%s %u\n", ssid, priority);
+		}
+	}
+	WifiStats(&stats);
+	CmdLineRespondf("connected %s %d dBm, drops %u roams %u\n", stats.connected ? stats.ssid : "-",
+			stats.rssi, stats.drops, stats.roams);
+	return 0;
+}
+
+//*****************************************************************************
+// CmdWifiAdd
+// This function implements the "wifiadd" command which stores a network,
+// or changes the password and priority of a known one. Networks of higher
+// priority are preferred over a stronger signal by 10 dB per level.
+//
+//*****************************************************************************
+int CmdWifiAdd(int argc, char *argv[])
+{
+	esp_err_t err;
+
+	if ((argc < 3) || (argc > 4))
+	{
+		return (CMDLINE_BAD_ARG_COUNT);
+	}
+
+	err = WifiNetworkAdd(argv[1], argv[2], (argc == 4) ? strtoul(argv[3], NULL, 10) : 0);
+	if (err == ESP_ERR_INVALID_ARG)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+	if (err != ESP_OK)
+	{
+		CmdLineRespondf("not stored (%s)\n", esp_err_to_name(err));
+		return (CMDLINE_EXEC_ERROR);
+	}
+	return 0;
+}
+
+//*****************************************************************************
+// CmdWifiDel
+// This function implements the "wifidel" command which forgets a network.
+//
+//*****************************************************************************
+int CmdWifiDel(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		return (CMDLINE_BAD_ARG_COUNT);
+	}
+
+	if (WifiNetworkRemove(argv[1]) != ESP_OK)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+	return 0;
+}
+
 //*****************************************************************************
 // CmdBattRead
 // This function implements the "batt" command which reads the battery voltage,
@@ -414,173 +729,1112 @@ int CmdBattRead(int argc, char *argv[])
 	}
 
 	// Read and print voltage in millivolts.
-    sprintf(response_buff,"%u\n",AnalogVoltageRead());
-    CmdLineRespond(response_buff);
+    CmdLineRespondf("%u\n",AnalogVoltageRead());
 	return 0;
 }
 
 //*****************************************************************************
-// CmdLineProcess
-//
-// Accepts a command line, determines the action and arguments and executes
-// them.
+// CmdGpio
+// This function implements the "gpio" command. With one argument it reads the
+// aux pin (making it an input), with two it drives the pin to the given level.
 //
 //*****************************************************************************
-int CmdLineProcess(char *pCommand)
+int CmdGpio(int argc, char *argv[])
 {
-    char *pcChar;
-    uint8_t argc;
-    uint8_t lookForArg = 1;
-    tCmdLineEntry *psCmdEntry;
+	uint8_t pin;
 
-    // Start at the beginning of command line table.
-    argc = 0;
-    pcChar = pCommand;
+	if ((argc != 2) && (argc != 3))
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
 
-    // Until NULL
-    while(*pcChar)
-    {
-        // Look for space to delimit arguments
-        if(*pcChar == ' ')
-        {
-            *pcChar = 0;
-            lookForArg = 1;
-        }
-        else
-        {
-            // Look for start of next arg?
-            if(lookForArg)
-            {
-                // Save this argument in array and keep looking - unless max arguments.
-                if(argc < MAX_ARGUMENTS)
-                {
-                    pArgv[argc] = pcChar;
-                    argc++;
-                    lookForArg = 0;
-                }
+	pin = strtoul(argv[1], NULL, 10);
+	if (pin >= AUX_IO_PINS)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
 
-                // Issue with argument count.
-                else
-                {
-                    return(CMDLINE_BAD_ARG_COUNT);
-                }
-            }
-        }
+	if (argc == 3)
+	{
+		GpioLevelSet(pin, strtoul(argv[2], NULL, 10) != 0);
+	}
+	else
+	{
+		CmdLineRespondf("%u\n", GpioLevelGet(pin));
+	}
+	return 0;
+}
 
-        pcChar++;
-    }
+//*****************************************************************************
+// CmdGpioInput
+// This function implements the "gpioin" command which makes an aux pin an
+// interrupt driven input with the given debounce time, or turns that off.
+//
+//*****************************************************************************
+int CmdGpioInput(int argc, char *argv[])
+{
+	uint8_t pin;
 
-    // If one or more arguments was found, then process the command.
-    if(argc)
-    {
-        //
-        // Start at the beginning of the command table, to look for a matching
-        // command.
-        //
-        psCmdEntry = &pCommandTable[0];
+	// Must be 2 arguments in addition to the command.
+	if (argc != 3)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
 
-        //
-        // Search through the command table until a null command string is
-        // found, which marks the end of the table.
-        //
-        while(psCmdEntry->pCmd)
-        {
-            // Is there a match? If so then call the corresponding function.
-            if(!strcmp(pArgv[0], psCmdEntry->pName))
-            {
-				//ESP_LOGI(TAG, "Cmd:%s Args:%u\n", pArgv[0], argc - 1);
-                return(psCmdEntry->pCmd(argc, pArgv));
-            }
+	pin = strtoul(argv[1], NULL, 10);
+	if (pin >= AUX_IO_PINS)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
 
-            psCmdEntry++;
-        }
-    }
+	if (!strcmp(argv[2], "off"))
+	{
+		GpioInputDisable(pin);
+		return 0;
+	}
 
-    // No matches
-    return CMDLINE_BAD_CMD;
+	if (GpioInputEnable(pin, strtoul(argv[2], NULL, 10)) != ESP_OK)
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+	return 0;
 }
 
 //*****************************************************************************
-// CmdLineRespond
+// CmdGpioEvents
+// This function implements the "gpioev" command which prints and removes all
+// queued aux input edges as "pin level time_us".
 //
 //*****************************************************************************
-void CmdLineRespond(char *response)
+int CmdGpioEvents(int argc, char *argv[])
 {
-    uart_write_bytes(CMD_UART_NUM, (const char *) response, strlen(response));
+	aux_event_t event;
+
+	while (GpioEventGet(&event, 0))
+	{
+		CmdLineRespondf("%u %u %lld\n", event.pin, event.level, event.time_us);
+	}
+	CmdLineRespondf("dropped %u\n", GpioEventsDropped());
+	return 0;
 }
 
 //*****************************************************************************
-// HandleUartCommand
+// CmdGpioBench
+// This function implements the "gpiobench" command which reports the average
+// cycles for an aux pin set and get through gpio_config() (as originally
+// implemented) and through the cached direction fast path.
 //
 //*****************************************************************************
-void HandleUartCommand(void)
+int CmdGpioBench(int argc, char *argv[])
 {
-    int32_t len;
+	gpio_bench_t bench = {0};
+	uint8_t pin;
 
-    // Read the buffer
-    len = uart_read_bytes(CMD_UART_NUM, (uint8_t*)serial_cmd_buff, sizeof(serial_cmd_buff), 100 / portTICK_RATE_MS);
+	if (argc != 2)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
 
-    // Change terminator to a null.
-    if (len)
-    {
-        serial_cmd_buff[len - 1] = 0;
-        //ESP_LOGI(TAG, "Got string [%s]", serial_cmd_buff);
-        CmdLineProcess(serial_cmd_buff);
-    }
-    return;
+	pin = strtoul(argv[1], NULL, 10);
+	if (pin >= AUX_IO_PINS)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	GpioBenchmark(pin, &bench);
+	CmdLineRespondf("set: %u -> %u cycles\nget: %u -> %u cycles\n",
+			bench.set_config_cycles, bench.set_fast_cycles,
+			bench.get_config_cycles, bench.get_fast_cycles);
+	return 0;
 }
 
 //*****************************************************************************
-// uart_event_task
+// CmdFsBench
+// This function implements the "fsbench" command which reports the average
+// open, stat and append time per file and the time to list the directory
+// with the given number of files, or with 10, 100 and 500 files.
 //
 //*****************************************************************************
-static void uart_event_task(void *pvParameters)
+int CmdFsBench(int argc, char *argv[])
 {
-    uart_event_t event;
+	static const uint32_t counts[] = { 10, 100, 500 };
+	storage_bench_t bench;
+	uint32_t files;
+	esp_err_t err;
 
-    // Wait for Uart events. Process them as they come
-    while (1)
-    {
-        if (xQueueReceive(uart0_queue, (void * )&event, (portTickType)portMAX_DELAY))
-        {
-            switch (event.type)
-            {
-                case UART_DATA:
-                    // UART Rx event. Do nothing as Rx is handled when <CR> is detected as a pattern.
-                    break;
-                case UART_FIFO_OVF:
-                    // HW FIFO Overflow - flush the buffer.
-                    ESP_LOGE(TAG, " HW fifo overflow");
-                    uart_flush(CMD_UART_NUM);
-                    break;
-                case UART_BUFFER_FULL:
-                    // Buffer full - flush
-                    ESP_LOGE(TAG, "ring buffer full");
-                    uart_flush(CMD_UART_NUM);
-                    break;
-                case UART_BREAK:
-                    // Unused
-                    break;
-                case UART_PARITY_ERR:
-                    // Unused - parity is disabled
-                    ESP_LOGE(TAG, "parity error");
-                    break;
-                case UART_FRAME_ERR:
-                    ESP_LOGE(TAG, "frame error");
-                    break;
-                case UART_PATTERN_DET:
-                    HandleUartCommand();
-                    break;
-                default:
-                    ESP_LOGE(TAG, "no service for this event\n");
-                    break;
-            }
-        }
-    }
-}
+	if (argc > 2)
+	{
+		return (CMDLINE_BAD_ARG_COUNT);
+	}
 
-//*****************************************************************************
-// UART Initialize
+	CmdLineRespondf("files open_us stat_us append_us list_us\n");
+	for (int i = 0; i < ((argc == 2) ? 1 : sizeof(counts) / sizeof(counts[0])); i++)
+	{
+		files = (argc == 2) ? strtoul(argv[1], NULL, 10) : counts[i];
+		err = StorageBench(files, &bench);
+		if (err != ESP_OK)
+		{
+			CmdLineRespondf("%u files failed (%s)\n", files, esp_err_to_name(err));
+			return (CMDLINE_EXEC_ERROR);
+		}
+		CmdLineRespondf("%u %u %u %u %u\n", bench.files, bench.open_us, bench.stat_us,
+				bench.append_us, bench.list_us);
+	}
+	return 0;
+}
+
+//*****************************************************************************
+// CmdBufPool
+// This function implements the "bufpool" command which lists the web server
+// request buffers of each route class, or frees the unused ones.
+//
+//*****************************************************************************
+int CmdBufPool(int argc, char *argv[])
+{
+	static const char *names[BUF_POOL_CLASSES] = { "rest", "file", "asset" };
+	buf_pool_stats_t stats;
+
+	if (argc > 2)
+	{
+		return (CMDLINE_BAD_ARG_COUNT);
+	}
+	if (argc == 2)
+	{
+		if (strcmp(argv[1], "free"))
+		{
+			return (CMDLINE_INVALID_ARG);
+		}
+		CmdLineRespondf("freed %u bytes\n", BufPoolTrim(0));
+		return 0;
+	}
+
+	CmdLineRespondf("class size count alloc used busy\n");
+	for (int cls = 0; cls < BUF_POOL_CLASSES; cls++)
+	{
+		BufPoolStats(cls, &stats);
+		CmdLineRespondf("%s %u %u %u %u %u\n", names[cls], stats.size, stats.count,
+				stats.allocated, stats.in_use, stats.busy);
+	}
+	return 0;
+}
+
+//*****************************************************************************
+// CmdSafety
+// This function implements the "safety" command which arms an aux pin as a
+// bumper/limit input that stops both motors from its ISR when it reaches the
+// given level, or disarms it.
+//
+//*****************************************************************************
+int CmdSafety(int argc, char *argv[])
+{
+	uint8_t pin;
+
+	// Must be 2 arguments in addition to the command.
+	if (argc != 3)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	pin = strtoul(argv[1], NULL, 10);
+	if (pin >= AUX_IO_PINS)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	if (!strcmp(argv[2], "off"))
+	{
+		GpioSafetyDisable(pin);
+		return 0;
+	}
+
+	if (GpioSafetyEnable(pin, strtoul(argv[2], NULL, 10)) != ESP_OK)
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+	return 0;
+}
+
+//*****************************************************************************
+// CmdFault
+// This function implements the "fault" command. Prints the latched fault bits
+// and trip time, or clears the fault with "fault clear", which is refused
+// while a safety input is still active.
+//
+//*****************************************************************************
+int CmdFault(int argc, char *argv[])
+{
+	int64_t time_us;
+	uint32_t fault;
+
+	if (argc == 2)
+	{
+		if (strcmp(argv[1], "clear"))
+		{
+			return (CMDLINE_INVALID_ARG);
+		}
+		if (MotorDCFaultClear() != ESP_OK)
+		{
+			CmdLineRespondf("safety input active\n");
+			return (CMDLINE_EXEC_ERROR);
+		}
+		return 0;
+	}
+	else if (argc != 1)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	fault = MotorDCFaultGet(&time_us);
+	CmdLineRespondf("%u %lld\n", fault, fault ? time_us : 0);
+	return 0;
+}
+
+//*****************************************************************************
+// CmdEmergencyStop
+// This function implements the "estop" command which stops both motors and
+// latches a fault exactly like a safety input does.
+//
+//*****************************************************************************
+int CmdEmergencyStop(int argc, char *argv[])
+{
+	MotorDCFaultTrip(MOTOR_FAULT_CMD);
+	return 0;
+}
+
+//*****************************************************************************
+// CmdDose
+// This function implements the "dose" command which pumps the given volume in
+// mL, timed on the device. Completion is reported asynchronously as
+// "dose done <mL> <ms>".
+//
+//*****************************************************************************
+int CmdDose(int argc, char *argv[])
+{
+	// Must be 1 argument in addition to the command.
+	if (argc != 2)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	if (!strcmp(argv[1], "stop"))
+	{
+		PumpDoseStop();
+		return 0;
+	}
+
+	if (PumpDoseStart(strtof(argv[1], NULL)) != ESP_OK)
+	{
+		return (CMDLINE_EXEC_ERROR);
+	}
+	return 0;
+}
+
+//*****************************************************************************
+// CmdPumpCal
+// This function implements the "pumpcal" command which reads or sets (and
+// saves) the pump flow calibration in ms per mL at full speed.
+//
+//*****************************************************************************
+int CmdPumpCal(int argc, char *argv[])
+{
+	if (argc == 2)
+	{
+		if (PumpCalibrationSet(strtoul(argv[1], NULL, 10)) != ESP_OK)
+		{
+			return (CMDLINE_EXEC_ERROR);
+		}
+		return 0;
+	}
+	else if (argc != 1)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	CmdLineRespondf("%u\n", PumpCalibrationGet());
+	return 0;
+}
+
+//*****************************************************************************
+// CmdScriptRun
+// This function implements the "run" command which starts a script from
+// SCRIPT_DIR. A syntax error is reported with its line before anything runs.
+//
+//*****************************************************************************
+int CmdScriptRun(int argc, char *argv[])
+{
+	uint16_t line = 0;
+	esp_err_t err;
+
+	if (argc != 2)
+	{
+		return (CMDLINE_BAD_ARG_COUNT);
+	}
+
+	err = ScriptStart(argv[1], &line);
+	if (err == ESP_FAIL)
+	{
+		CmdLineRespondf("syntax error line %u\n", line);
+		return (CMDLINE_EXEC_ERROR);
+	}
+	if (err != ESP_OK)
+	{
+		CmdLineRespondf("%s\n", esp_err_to_name(err));
+		return (CMDLINE_EXEC_ERROR);
+	}
+	return 0;
+}
+
+//*****************************************************************************
+// CmdScriptStop
+// This function implements the "stop" command which stops the running
+// script, along with the motors and pump.
+//
+//*****************************************************************************
+int CmdScriptStop(int argc, char *argv[])
+{
+	ScriptStop();
+	return 0;
+}
+
+//*****************************************************************************
+// CmdScriptStatus
+// This function implements the "script" command which reports whether a
+// script is running, its name, the line being executed, the result of the
+// last run and the number of runs since boot.
+//
+//*****************************************************************************
+int CmdScriptStatus(int argc, char *argv[])
+{
+	script_status_t status;
+
+	ScriptStatus(&status);
+	CmdLineRespondf("%u %s %u %d %u\n", status.running, status.name[0] ? status.name : "-",
+			status.line, status.error, status.runs);
+	return 0;
+}
+
+//*****************************************************************************
+// CmdBinaryMode
+// This function implements the "bin" command which switches the console to
+// the framed binary protocol (see cmdframe.c) at the given baud rate. "OK" is
+// sent at the old rate before switching. A break condition on the line, or
+// the "text" command sent in a frame, returns to the text console.
+//
+//*****************************************************************************
+int CmdBinaryMode(int argc, char *argv[])
+{
+	uint32_t baud;
+
+	// Must be 1 argument in addition to the command.
+	if ((argc != 2) || cmd_binary_mode)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	baud = strtoul(argv[1], NULL, 10);
+	if ((baud < 9600) || (baud > 5000000))
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+
+	CmdLineRespond("OK\n");
+	CmdTxFlush(100);
+
+	uart_set_baudrate(CMD_UART_NUM, baud);
+	uart_flush_input(CMD_UART_NUM);
+	CmdFrameRxReset(&frame_rx);
+	cmd_binary_mode = true;
+	return 0;
+}
+
+//*****************************************************************************
+// CmdTextMode
+// This function implements the "text" command which leaves binary mode once
+// the response frame has been sent.
+//
+//*****************************************************************************
+int CmdTextMode(int argc, char *argv[])
+{
+	if (!cmd_binary_mode)
+	{
+		return (CMDLINE_INVALID_ARG);
+	}
+	cmd_text_pending = true;
+	return 0;
+}
+
+//*****************************************************************************
+// CmdUartStats
+// This function implements the "uartstat" command which reports receive
+// counters: bytes, lines, dropped bytes, FIFO overflows, ring buffer full
+// events and frame CRC errors, followed by responses dropped because the
+// response pool was exhausted.
+//
+//*****************************************************************************
+int CmdUartStats(int argc, char *argv[])
+{
+	CmdLineRespondf("%u %u %u %u %u %u %u\n", rx_stats.bytes, rx_stats.lines,
+			rx_stats.dropped, rx_stats.overflows, rx_stats.buffer_full, frame_crc_errors,
+			cmd_tx_dropped);
+	return 0;
+}
+
+//*****************************************************************************
+// CmdOtaProgress
+// This function implements the "ota" command which reports the progress of
+// the current or last firmware upload: image size, bytes received, bytes
+// written to flash and KB/s.
+//
+//*****************************************************************************
+int CmdOtaProgress(int argc, char *argv[])
+{
+	ota_progress_t progress;
+
+	OtaProgressGet(&progress);
+	CmdLineRespondf("%u %u %u %u\n", progress.size, progress.received,
+			progress.written, progress.kbps);
+	return 0;
+}
+
+//*****************************************************************************
+// CmdDoseComplete
+// Pump dose completion callback (esp_timer task).
+//
+//*****************************************************************************
+static void CmdDoseComplete(const pump_dose_t *dose)
+{
+	CmdLineRespondf("dose done %.1f %lld\n", dose->ml, dose->done_us / 1000);
+}
+
+//*****************************************************************************
+// CmdLineExecute
+// Runs one command line. Safe to call from any task; commands run one at a
+// time.
+//
+//*****************************************************************************
+int CmdLineExecute(char *pCommand)
+{
+    int result;
+
+    xSemaphoreTake(cmd_mutex, portMAX_DELAY);
+    result = CmdLineProcess(pCommand);
+    xSemaphoreGive(cmd_mutex);
+    return result;
+}
+
+//*****************************************************************************
+// CmdLineProcess
+//
+// Accepts a command line, determines the action and arguments and executes
+// them.
+//
+//*****************************************************************************
+int CmdLineProcess(char *pCommand)
+{
+    char *pcChar;
+    uint8_t argc;
+    uint8_t lookForArg = 1;
+    tCmdLineEntry *psCmdEntry;
+
+    // Start at the beginning of command line table.
+    argc = 0;
+    pcChar = pCommand;
+
+    // Until NULL
+    while(*pcChar)
+    {
+        // Look for space to delimit arguments
+        if(*pcChar == ' ')
+        {
+            *pcChar = 0;
+            lookForArg = 1;
+        }
+        else
+        {
+            // Look for start of next arg?
+            if(lookForArg)
+            {
+                // Save this argument in array and keep looking - unless max arguments.
+                if(argc < MAX_ARGUMENTS)
+                {
+                    pArgv[argc] = pcChar;
+                    argc++;
+                    lookForArg = 0;
+                }
+
+                // Issue with argument count.
+                else
+                {
+                    return(CMDLINE_BAD_ARG_COUNT);
+                }
+            }
+        }
+
+        pcChar++;
+    }
+
+    // If one or more arguments was found, then process the command.
+    if(argc)
+    {
+        //
+        // Start at the beginning of the command table, to look for a matching
+        // command.
+        //
+        psCmdEntry = &pCommandTable[0];
+
+        //
+        // Search through the command table until a null command string is
+        // found, which marks the end of the table.
+        //
+        while(psCmdEntry->pCmd)
+        {
+            // Is there a match? If so then call the corresponding function.
+            if(!strcmp(pArgv[0], psCmdEntry->pName))
+            {
+				//ESP_LOGI(TAG, "Cmd:%s Args:%u\n", pArgv[0], argc - 1);
+                return(psCmdEntry->pCmd(argc, pArgv));
+            }
+
+            psCmdEntry++;
+        }
+    }
+
+    // No matches
+    return CMDLINE_BAD_CMD;
+}
+
+//*****************************************************************************
+// CmdTxAcquire / CmdTxRelease
+// Lock-free allocation from the response pool. Returns -1 if the pool is
+// exhausted, or if uart_init has not run yet.
+//
+//*****************************************************************************
+static int CmdTxAcquire(void)
+{
+    uint32_t free = __atomic_load_n(&cmd_tx_free, __ATOMIC_RELAXED);
+    int idx;
+
+    if (uart_tx_task_handle == NULL)
+    {
+        return -1;
+    }
+
+    while (free)
+    {
+        idx = __builtin_ctz(free);
+        if (__atomic_compare_exchange_n(&cmd_tx_free, &free, free & ~(1UL << idx),
+                                        true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return idx;
+        }
+    }
+    __atomic_fetch_add(&cmd_tx_dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+static void CmdTxRelease(int idx)
+{
+    __atomic_fetch_or(&cmd_tx_free, 1UL << idx, __ATOMIC_RELEASE);
+}
+
+//*****************************************************************************
+// CmdTxEnqueue
+// Multi-producer enqueue (bounded queue with per-slot sequence numbers) and
+// wake of uart_tx_task.
+//
+//*****************************************************************************
+static void CmdTxEnqueue(int idx)
+{
+    uint32_t pos = __atomic_load_n(&cmd_tx_head, __ATOMIC_RELAXED);
+    cmd_tx_slot_t *slot;
+    int32_t diff;
+
+    while (1)
+    {
+        slot = &cmd_tx_ring[pos & (CMD_TX_POOL_SIZE - 1)];
+        diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&cmd_tx_head, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else
+        {
+            // Another producer claimed this slot first
+            pos = __atomic_load_n(&cmd_tx_head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->buf = idx;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (uart_tx_task_handle)
+    {
+        xTaskNotifyGive(uart_tx_task_handle);
+    }
+}
+
+//*****************************************************************************
+// CmdTxDequeue
+// Single consumer (uart_tx_task). Returns -1 when the queue is empty.
+//
+//*****************************************************************************
+static int CmdTxDequeue(void)
+{
+    cmd_tx_slot_t *slot = &cmd_tx_ring[cmd_tx_tail & (CMD_TX_POOL_SIZE - 1)];
+    int idx;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != (cmd_tx_tail + 1))
+    {
+        return -1;
+    }
+    idx = slot->buf;
+    __atomic_store_n(&slot->seq, cmd_tx_tail + CMD_TX_POOL_SIZE, __ATOMIC_RELEASE);
+    cmd_tx_tail++;
+    return idx;
+}
+
+//*****************************************************************************
+// CmdTxWrite
+// Queues raw bytes for transmission, split across pool buffers.
+//
+//*****************************************************************************
+static void CmdTxWrite(const uint8_t *data, size_t len)
+{
+    size_t copy;
+    int idx;
+
+    while (len)
+    {
+        idx = CmdTxAcquire();
+        if (idx < 0)
+        {
+            return;
+        }
+        copy = MIN(len, CMD_TX_BUF_SIZE);
+        memcpy(cmd_tx_pool[idx].data, data, copy);
+        cmd_tx_pool[idx].len = copy;
+        CmdTxEnqueue(idx);
+        data += copy;
+        len -= copy;
+    }
+}
+
+//*****************************************************************************
+// CmdTxFlush
+// Waits (up to timeout_ms) until everything queued has been transmitted. Only
+// used around baud rate changes.
+//
+//*****************************************************************************
+static void CmdTxFlush(uint32_t timeout_ms)
+{
+    const uint32_t all_free = (uint32_t)((1ULL << CMD_TX_POOL_SIZE) - 1);
+
+    while ((__atomic_load_n(&cmd_tx_free, __ATOMIC_ACQUIRE) != all_free) && timeout_ms)
+    {
+        vTaskDelay(1);
+        timeout_ms -= MIN(timeout_ms, portTICK_PERIOD_MS);
+    }
+    uart_wait_tx_done(CMD_UART_NUM, 100 / portTICK_RATE_MS);
+}
+
+//*****************************************************************************
+// uart_tx_task
+// Drains the response queue into the UART driver.
+//
+//*****************************************************************************
+static void uart_tx_task(void *pvParameters)
+{
+    int idx;
+
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while ((idx = CmdTxDequeue()) >= 0)
+        {
+            uart_write_bytes(CMD_UART_NUM, (const char *)cmd_tx_pool[idx].data, cmd_tx_pool[idx].len);
+            CmdTxRelease(idx);
+        }
+    }
+}
+
+//*****************************************************************************
+// CmdFrameSend
+// Encodes one binary frame straight into a pool buffer and queues it.
+//
+//*****************************************************************************
+static void CmdFrameSend(uint8_t seq, uint8_t type, const uint8_t *payload, size_t len)
+{
+    int idx = CmdTxAcquire();
+
+    if (idx < 0)
+    {
+        return;
+    }
+    cmd_tx_pool[idx].len = CmdFrameEncode(seq, type, payload, len, cmd_tx_pool[idx].data);
+    CmdTxEnqueue(idx);
+}
+
+//*****************************************************************************
+// CmdLineRespond
+// Queues output for the console without waiting for the UART; safe to call
+// from any task. If the response pool is exhausted the output is dropped and
+// counted. In binary mode output from the command being dispatched is
+// collected for its response frame (flushing partial frames when full), and
+// output from other tasks is sent as event frames.
+//
+//*****************************************************************************
+void CmdLineRespond(char *response)
+{
+    size_t len = strlen(response);
+    size_t copy;
+
+    if (!cmd_binary_mode)
+    {
+        CmdTxWrite((const uint8_t *)response, len);
+        return;
+    }
+
+    if (!frame_capture || (xTaskGetCurrentTaskHandle() != uart_task_handle))
+    {
+        while (len)
+        {
+            copy = MIN(len, CMDFRAME_MAX_PAYLOAD);
+            CmdFrameSend(0, CMDFRAME_TYPE_EVENT, (const uint8_t *)response, copy);
+            response += copy;
+            len -= copy;
+        }
+        return;
+    }
+
+    while (len)
+    {
+        // First byte of the payload is reserved for the status in the final frame
+        if (frame_resp_len == sizeof(frame_resp))
+        {
+            CmdFrameSend(frame_seq, CMDFRAME_TYPE_RESP_PART, &frame_resp[1], frame_resp_len - 1);
+            frame_resp_len = 1;
+        }
+        copy = MIN(len, sizeof(frame_resp) - frame_resp_len);
+        memcpy(&frame_resp[frame_resp_len], response, copy);
+        frame_resp_len += copy;
+        response += copy;
+        len -= copy;
+    }
+}
+
+//*****************************************************************************
+// CmdLineRespondf
+// printf style CmdLineRespond. In text mode the output is formatted directly
+// into a pool buffer. Output is truncated to CMD_TX_BUF_SIZE - 1 characters.
+//
+//*****************************************************************************
+void CmdLineRespondf(const char *format, ...)
+{
+    char text[CMD_TX_BUF_SIZE];
+    va_list args;
+    int idx, len;
+
+    va_start(args, format);
+    if (!cmd_binary_mode)
+    {
+        idx = CmdTxAcquire();
+        if (idx >= 0)
+        {
+            len = vsnprintf((char *)cmd_tx_pool[idx].data, CMD_TX_BUF_SIZE, format, args);
+            cmd_tx_pool[idx].len = MIN(MAX(len, 0), CMD_TX_BUF_SIZE - 1);
+            CmdTxEnqueue(idx);
+        }
+    }
+    else
+    {
+        vsnprintf(text, sizeof(text), format, args);
+        CmdLineRespond(text);
+    }
+    va_end(args);
+}
+
+//*****************************************************************************
+// CmdLogVprintf
+// esp_log output hook. Logs still go to the default console and are also
+// queued for the command UART. Never waits for the command UART.
+//
+//*****************************************************************************
+static int CmdLogVprintf(const char *format, va_list args)
+{
+    char text[CMD_TX_BUF_SIZE];
+    va_list copy;
+
+    va_copy(copy, args);
+    vsnprintf(text, sizeof(text), format, copy);
+    va_end(copy);
+    CmdLineRespond(text);
+
+    return cmd_log_vprintf(format, args);
+}
+
+//*****************************************************************************
+// CmdLogMirror
+// This function implements the "log" command which turns mirroring of
+// ESP_LOG output to the command UART on (1) or off (0).
+//
+//*****************************************************************************
+int CmdLogMirror(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        return (CMDLINE_INVALID_ARG);
+    }
+
+    if (strtoul(argv[1], NULL, 10))
+    {
+        if (cmd_log_vprintf == NULL)
+        {
+            cmd_log_vprintf = esp_log_set_vprintf(CmdLogVprintf);
+        }
+    }
+    else if (cmd_log_vprintf)
+    {
+        esp_log_set_vprintf(cmd_log_vprintf);
+        cmd_log_vprintf = NULL;
+    }
+    return 0;
+}
+
+//*****************************************************************************
+// CmdTextModeRestore
+// Returns the console to text mode at the default baud rate.
+//
+//*****************************************************************************
+static void CmdTextModeRestore(void)
+{
+    cmd_binary_mode = false;
+    cmd_text_pending = false;
+    uart_set_baudrate(CMD_UART_NUM, CMD_UART_TEXT_BAUD);
+    uart_flush_input(CMD_UART_NUM);
+    line_len = 0;
+    line_overflow = false;
+}
+
+//*****************************************************************************
+// HandleCommandFrame
+// Dispatches a command frame through the same command table as the text
+// console and sends the response frame.
+//
+//*****************************************************************************
+static void HandleCommandFrame(const cmdframe_t *frame)
+{
+    char cmd[CMDFRAME_MAX_PAYLOAD + 1];
+    int8_t status;
+
+    if (frame->type != CMDFRAME_TYPE_CMD)
+    {
+        status = CMDLINE_BAD_CMD;
+        CmdFrameSend(frame->seq, CMDFRAME_TYPE_NAK, (const uint8_t *)&status, 1);
+        return;
+    }
+
+    memcpy(cmd, frame->payload, frame->len);
+    cmd[frame->len] = 0;
+
+    frame_seq = frame->seq;
+    frame_resp_len = 1;
+    frame_capture = true;
+    frame_resp[0] = (uint8_t)CmdLineExecute(cmd);
+    frame_capture = false;
+
+    CmdFrameSend(frame_seq, CMDFRAME_TYPE_RESP, frame_resp, frame_resp_len);
+
+    // Leave binary mode only after the host has its response
+    if (cmd_text_pending)
+    {
+        CmdTxFlush(100);
+        CmdTextModeRestore();
+    }
+}
+
+//*****************************************************************************
+// CmdFrameFeed
+// Binary mode receive. Feeds received bytes into the frame assembler and
+// handles each complete frame. Stops early if a frame leaves binary mode.
+//
+//*****************************************************************************
+static void CmdFrameFeed(const uint8_t *data, int len)
+{
+    int result;
+    cmdframe_t frame;
+    int8_t status;
+
+    for (int i = 0; (i < len) && cmd_binary_mode; i++)
+    {
+        result = CmdFrameRxByte(&frame_rx, data[i], &frame);
+        if (result == CMDFRAME_OK)
+        {
+            HandleCommandFrame(&frame);
+        }
+        else if (result == CMDFRAME_CRC_ERROR)
+        {
+            frame_crc_errors++;
+            status = CMDLINE_FW_CRC_ERROR;
+            CmdFrameSend(frame.seq, CMDFRAME_TYPE_NAK, (const uint8_t *)&status, 1);
+        }
+        else if (result < 0)
+        {
+            status = CMDLINE_INVALID_ARG;
+            CmdFrameSend(0, CMDFRAME_TYPE_NAK, (const uint8_t *)&status, 1);
+        }
+    }
+}
+
+//*****************************************************************************
+// CmdLineFeed
+// Text mode line assembler. Every complete line in the data is processed.
+// CR, LF and CRLF all end a line (CRLF counts once) and empty lines are
+// ignored. A line longer than serial_cmd_buff is discarded up to its
+// terminator and its bytes are counted as dropped. Stops early if a command
+// switches to binary mode.
+//
+//*****************************************************************************
+static void CmdLineFeed(const uint8_t *data, int len)
+{
+    char c;
+
+    for (int i = 0; (i < len) && !cmd_binary_mode; i++)
+    {
+        c = data[i];
+        if ((c == ASCII_CR) || (c == ASCII_LF))
+        {
+            // Second half of CRLF
+            if ((c == ASCII_LF) && line_last_cr)
+            {
+                line_last_cr = false;
+                continue;
+            }
+            line_last_cr = (c == ASCII_CR);
+
+            if (line_overflow)
+            {
+                line_overflow = false;
+            }
+            else if (line_len)
+            {
+                serial_cmd_buff[line_len] = 0;
+                rx_stats.lines++;
+                CmdLineExecute(serial_cmd_buff);
+            }
+            line_len = 0;
+            continue;
+        }
+        line_last_cr = false;
+
+        if (line_overflow)
+        {
+            rx_stats.dropped++;
+        }
+        else if (line_len < (sizeof(serial_cmd_buff) - 1))
+        {
+            serial_cmd_buff[line_len++] = c;
+        }
+        else
+        {
+            // Too long to be a command, drop the whole line
+            rx_stats.dropped += line_len + 1;
+            line_overflow = true;
+        }
+    }
+}
+
+//*****************************************************************************
+// HandleUartRx
+// Drains everything the driver has buffered into the line or frame assembler.
+// Reading promptly is the backpressure: while the driver ring buffer is full
+// it leaves bytes in the hardware FIFO instead of discarding them.
+//
+//*****************************************************************************
+static void HandleUartRx(void)
+{
+    uint8_t buff[64];
+    size_t buffered;
+    int len;
+
+    while ((uart_get_buffered_data_len(CMD_UART_NUM, &buffered) == ESP_OK) && buffered)
+    {
+        len = uart_read_bytes(CMD_UART_NUM, buff, MIN(buffered, sizeof(buff)), 0);
+        if (len <= 0)
+        {
+            break;
+        }
+        rx_stats.bytes += len;
+
+        if (cmd_binary_mode)
+        {
+            CmdFrameFeed(buff, len);
+        }
+        else
+        {
+            CmdLineFeed(buff, len);
+        }
+    }
+}
+
+//*****************************************************************************
+// uart_event_task
+//
+//*****************************************************************************
+static void uart_event_task(void *pvParameters)
+{
+    uart_event_t event;
+
+    // Wait for Uart events. Process them as they come
+    while (1)
+    {
+        if (xQueueReceive(uart0_queue, (void * )&event, (portTickType)portMAX_DELAY))
+        {
+            switch (event.type)
+            {
+                case UART_DATA:
+                    // UART Rx event. Process all complete lines or frames.
+                    HandleUartRx();
+                    break;
+                case UART_FIFO_OVF:
+                    // HW FIFO overflow. The driver has already discarded the
+                    // FIFO contents; keep what is in the ring buffer.
+                    rx_stats.overflows++;
+                    HandleUartRx();
+                    break;
+                case UART_BUFFER_FULL:
+                    // Ring buffer full. Drain it; the driver holds further
+                    // bytes in the FIFO until there is room.
+                    rx_stats.buffer_full++;
+                    HandleUartRx();
+                    break;
+                case UART_BREAK:
+                    // Host sends a break to get back to the text console
+                    if (cmd_binary_mode)
+                    {
+                        ESP_LOGI(TAG, "break, text mode");
+                        CmdTextModeRestore();
+                    }
+                    break;
+                case UART_PARITY_ERR:
+                    // Unused - parity is disabled
+                    ESP_LOGE(TAG, "parity error");
+                    break;
+                case UART_FRAME_ERR:
+                    ESP_LOGE(TAG, "frame error");
+                    break;
+                default:
+                    ESP_LOGE(TAG, "no service for this event\n");
+                    break;
+            }
+        }
+    }
+}
+
+//*****************************************************************************
+// UART Initialize
 //
 //*****************************************************************************
 void uart_init()
@@ -589,7 +1843,7 @@ void uart_init()
     // communication pins and install the driver
     uart_config_t uart_config =
     {
-        .baud_rate = 115200,
+        .baud_rate = CMD_UART_TEXT_BAUD,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
@@ -598,13 +1852,22 @@ void uart_init()
     uart_param_config(CMD_UART_NUM, &uart_config);
     // Set UART pins using UART0 default pins i.e. no changes
     uart_set_pin(CMD_UART_NUM, CMD_UART_TX_PIN, CMD_UART_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    uart_driver_install(CMD_UART_NUM, BUF_SIZE, BUF_SIZE, 10, &uart0_queue, 0);
+    uart_driver_install(CMD_UART_NUM, RX_BUF_SIZE, BUF_SIZE, 20, &uart0_queue, 0);
+
+    cmd_mutex = xSemaphoreCreateMutex();
+
+    // Response queue starts empty: slot n expects producer position n
+    for (int i = 0; i < CMD_TX_POOL_SIZE; i++)
+    {
+        cmd_tx_ring[i].seq = i;
+    }
 
-    // Set uart pattern detection function (13 = CR)
-    uart_enable_pattern_det_intr(CMD_UART_NUM, ASCII_CR, 1, 10000, 10, 10);
+    // Create a task to handle uart event from ISR, and one to transmit responses
+    xTaskCreate(uart_event_task, "uart_event_task", 3072, NULL, 12, &uart_task_handle);
+    xTaskCreate(uart_tx_task, "uart_tx_task", 2048, NULL, 11, &uart_tx_task_handle);
 
-    // Create a task to handle uart event from ISR
-    xTaskCreate(uart_event_task, "uart_event_task", 2048, NULL, 12, NULL);
+    // Report pump doses on the console when they finish
+    PumpDoseCallbackSet(CmdDoseComplete);
 
     // Welcome message
     CmdLineRespond("\r\nGrowver Start-up\n");
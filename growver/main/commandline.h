@@ -34,13 +34,14 @@ typedef int (*pCmdLine)(int argc, char *argv[]);
 
 // Prototypes
 void CmdLineRespond(char *response);
+void CmdLineRespondf(const char *format, ...) __attribute__((format(printf, 1, 2)));
 //bool CmdLineBinaryPacket(void);
 //uint16_t CmdRxCRCGet(void);
 //int CmdLineProcess(char *pCommand);
+int CmdLineExecute(char *pCommand);
 //unsigned char VerboseIsOn(void);
 
 void uart_init();
-//void HandleUartCommand(void);
 
 // end of commandline.h
 
@@ -0,0 +1,469 @@
+//*****************************************************************************
+//
+// file_index.c - In-RAM index of the files in storage.
+//
+// The index is built once at boot from the directory and afterwards kept
+// current by the file server's upload and delete handlers, which are the
+// only writers of the store. Listings are served from it without touching
+// the flash. Entries are kept sorted by name so pages of a listing are
+// stable.
+//
+// The SHA-256 of an uploaded file is computed while it is received. Files
+// found at boot are hashed the first time a listing includes them, and the
+// result is kept. Hashing reads the whole file, so it is done on a copy of
+// the entry without the lock, and uploads and deletes are not held up.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_vfs.h"
+#include "mbedtls/sha256.h"
+#include "cJSON.h"
+#include "storage.h"
+#include "file_index.h"
+
+static const char *TAG = "file_index";
+
+static char index_base[ESP_VFS_PATH_MAX + 1];
+static file_index_entry_t *index_files;
+static size_t index_count;
+static size_t index_capacity;
+static size_t index_total;
+static size_t index_used;
+static SemaphoreHandle_t index_lock;
+static bool index_scanning;     // Storage use is read once after the scan
+
+//*****************************************************************************
+// FileIndexFind
+// Binary search by name. Returns true if found, with its position in pos,
+// else false with the position it would be inserted at.
+//
+//*****************************************************************************
+static bool FileIndexFind(const char *name, size_t *pos)
+{
+    size_t low = 0;
+    size_t high = index_count;
+    size_t mid;
+    int cmp;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        cmp = strcmp(index_files[mid].name, name);
+        if (cmp == 0)
+        {
+            *pos = mid;
+            return true;
+        }
+        if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    *pos = low;
+    return false;
+}
+
+//*****************************************************************************
+// FileIndexPath
+// Full path of a file in the store.
+//
+//*****************************************************************************
+static void FileIndexPath(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, "%s/%s", index_base, name);
+}
+
+//*****************************************************************************
+// FileIndexRefreshStorage
+// Caches the partition size and use. SPIFFS keeps these counts in RAM;
+// LittleFS walks its block allocator, so listings do not ask for them.
+//
+//*****************************************************************************
+static void FileIndexRefreshStorage(void)
+{
+    if (StorageInfo(&index_total, &index_used) != ESP_OK)
+    {
+        index_total = 0;
+        index_used = 0;
+    }
+}
+
+//*****************************************************************************
+// FileIndexHash
+// Computes the SHA-256 of a file not yet hashed.
+//
+//*****************************************************************************
+static esp_err_t FileIndexHash(file_index_entry_t *entry)
+{
+    char path[ESP_VFS_PATH_MAX + STORAGE_NAME_MAX + 1];
+    mbedtls_sha256_context sha;
+    uint8_t *buf;
+    size_t len;
+    FILE *fd;
+
+    FileIndexPath(path, sizeof(path), entry->name);
+    fd = fopen(path, "r");
+    if (fd == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    buf = malloc(FILE_INDEX_BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        fclose(fd);
+        return ESP_ERR_NO_MEM;
+    }
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    while ((len = fread(buf, 1, FILE_INDEX_BLOCK_SIZE, fd)) > 0)
+    {
+        mbedtls_sha256_update_ret(&sha, buf, len);
+    }
+    mbedtls_sha256_finish_ret(&sha, entry->sha256);
+    mbedtls_sha256_free(&sha);
+    entry->hashed = !ferror(fd);
+
+    free(buf);
+    fclose(fd);
+    return entry->hashed ? ESP_OK : ESP_FAIL;
+}
+
+//*****************************************************************************
+// FileIndexScan
+// Indexes the files in directory dir below the base path ("" for the base
+// path itself) and in its subdirectories. SPIFFS has no directories and
+// lists every file here with any '/' in its name.
+//
+//*****************************************************************************
+static void FileIndexScan(const char *dir_name)
+{
+    char path[ESP_VFS_PATH_MAX + STORAGE_NAME_MAX + 1];
+    char name[STORAGE_NAME_MAX];
+    struct dirent *entry;
+    DIR *dir;
+
+    if (dir_name[0])
+    {
+        FileIndexPath(path, sizeof(path), dir_name);
+    }
+    else
+    {
+        strlcpy(path, index_base, sizeof(path));
+    }
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == 0 || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (snprintf(name, sizeof(name), "%s%s%s", dir_name, dir_name[0] ? "/" : "", entry->d_name) >= sizeof(name))
+        {
+            ESP_LOGW(TAG, "Name too long in %s", path);
+            continue;
+        }
+        if (entry->d_type == DT_DIR)
+        {
+            FileIndexScan(name);
+        }
+        else
+        {
+            FileIndexUpdate(name, NULL);
+        }
+    }
+    closedir(dir);
+}
+
+//*****************************************************************************
+// FileIndexInit
+// Builds the index from the files under base_path, once storage is mounted.
+//
+//*****************************************************************************
+esp_err_t FileIndexInit(const char *base_path)
+{
+    if (index_lock == NULL)
+    {
+        index_lock = xSemaphoreCreateMutex();
+        if (index_lock == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    strlcpy(index_base, base_path, sizeof(index_base));
+
+    index_scanning = true;
+    FileIndexScan("");
+    index_scanning = false;
+    FileIndexRefreshStorage();
+
+    ESP_LOGI(TAG, "%u files, %u of %u bytes used", index_count, index_used, index_total);
+    return ESP_OK;
+}
+
+//*****************************************************************************
+// FileIndexUpdate
+// Adds or refreshes a file after it was written, taking its size and time
+// from the file system. sha256 is the content hash if the writer computed
+// it, else NULL to hash it when listed.
+//
+//*****************************************************************************
+esp_err_t FileIndexUpdate(const char *name, const uint8_t *sha256)
+{
+    char path[ESP_VFS_PATH_MAX + STORAGE_NAME_MAX + 1];
+    file_index_entry_t *grown;
+    file_index_entry_t *entry;
+    struct stat file_stat;
+    size_t pos;
+
+    if (index_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    FileIndexPath(path, sizeof(path), name);
+    if (stat(path, &file_stat) == -1)
+    {
+        FileIndexRemove(name);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(index_lock, portMAX_DELAY);
+    if (!FileIndexFind(name, &pos))
+    {
+        if (index_count == index_capacity)
+        {
+            grown = realloc(index_files, (index_capacity ? index_capacity * 2 : 16) * sizeof(*index_files));
+            if (grown == NULL)
+            {
+                xSemaphoreGive(index_lock);
+                ESP_LOGE(TAG, "No memory to index %s", name);
+                return ESP_ERR_NO_MEM;
+            }
+            index_files = grown;
+            index_capacity = index_capacity ? index_capacity * 2 : 16;
+        }
+        memmove(&index_files[pos + 1], &index_files[pos], (index_count - pos) * sizeof(*index_files));
+        index_count++;
+        strlcpy(index_files[pos].name, name, sizeof(index_files[pos].name));
+    }
+
+    entry = &index_files[pos];
+    entry->size = file_stat.st_size;
+    entry->mtime = file_stat.st_mtime;
+    entry->hashed = (sha256 != NULL);
+    if (sha256)
+    {
+        memcpy(entry->sha256, sha256, sizeof(entry->sha256));
+    }
+    if (!index_scanning)
+    {
+        FileIndexRefreshStorage();
+    }
+    xSemaphoreGive(index_lock);
+    return ESP_OK;
+}
+
+//*****************************************************************************
+// FileIndexRemove
+// Drops a deleted file. Unknown names are ignored.
+//
+//*****************************************************************************
+void FileIndexRemove(const char *name)
+{
+    size_t pos;
+
+    if (index_lock == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(index_lock, portMAX_DELAY);
+    if (FileIndexFind(name, &pos))
+    {
+        index_count--;
+        memmove(&index_files[pos], &index_files[pos + 1], (index_count - pos) * sizeof(*index_files));
+    }
+    FileIndexRefreshStorage();
+    xSemaphoreGive(index_lock);
+}
+
+//*****************************************************************************
+// FileIndexCount
+//
+//*****************************************************************************
+size_t FileIndexCount(void)
+{
+    return index_count;
+}
+
+//*****************************************************************************
+// FileIndexGet
+// Copies entry i, in name order. False past the end.
+//
+//*****************************************************************************
+bool FileIndexGet(size_t i, file_index_entry_t *entry)
+{
+    bool found = false;
+
+    if (index_lock == NULL)
+    {
+        return false;
+    }
+
+    xSemaphoreTake(index_lock, portMAX_DELAY);
+    if (i < index_count)
+    {
+        *entry = index_files[i];
+        found = true;
+    }
+    xSemaphoreGive(index_lock);
+    return found;
+}
+
+//*****************************************************************************
+// FileIndexStorage
+// Partition size and bytes used, as of the last change.
+//
+//*****************************************************************************
+void FileIndexStorage(size_t *total, size_t *used)
+{
+    *total = index_total;
+    *used = index_used;
+}
+
+//*****************************************************************************
+// FileIndexHashPage
+// Hashes the files of a listing page not hashed yet. Each entry is copied
+// and hashed without the lock. The result is stored only if the file was not
+// replaced meanwhile; a new upload brings its own hash.
+//
+//*****************************************************************************
+static void FileIndexHashPage(size_t offset, size_t limit)
+{
+    file_index_entry_t entry;
+    file_index_entry_t *stored;
+    size_t pos;
+
+    for (size_t i = offset; (i < offset + limit) && FileIndexGet(i, &entry); i++)
+    {
+        if (entry.hashed || (FileIndexHash(&entry) != ESP_OK))
+        {
+            continue;
+        }
+
+        xSemaphoreTake(index_lock, portMAX_DELAY);
+        if (FileIndexFind(entry.name, &pos))
+        {
+            stored = &index_files[pos];
+            if (!stored->hashed && (stored->size == entry.size) && (stored->mtime == entry.mtime))
+            {
+                memcpy(stored->sha256, entry.sha256, sizeof(stored->sha256));
+                stored->hashed = true;
+            }
+        }
+        xSemaphoreGive(index_lock);
+    }
+}
+
+//*****************************************************************************
+// FileIndexJson
+// Adds one page of the listing to json:
+//   {"total":n,"offset":n,"storage_total":n,"storage_used":n,
+//    "files":[{"name","size","mtime","sha256"}],"next":n}
+// next is the offset of the following page, left out on the last one. A
+// limit of 0 gives the default page size. sha256 is null for a file that
+// could not be hashed. Returns the files listed.
+//
+//*****************************************************************************
+int FileIndexJson(cJSON *json, size_t offset, size_t limit)
+{
+    char hex[sizeof(((file_index_entry_t *)0)->sha256) * 2 + 1];
+    file_index_entry_t *entry;
+    cJSON *files;
+    cJSON *file;
+    size_t end;
+    size_t i;
+
+    if (limit == 0)
+    {
+        limit = FILE_INDEX_PAGE_DEFAULT;
+    }
+    if (limit > FILE_INDEX_PAGE_MAX)
+    {
+        limit = FILE_INDEX_PAGE_MAX;
+    }
+
+    if (index_lock == NULL)
+    {
+        return 0;
+    }
+    FileIndexHashPage(offset, limit);
+    xSemaphoreTake(index_lock, portMAX_DELAY);
+
+    offset = (offset < index_count) ? offset : index_count;
+    end = (index_count - offset > limit) ? offset + limit : index_count;
+    cJSON_AddNumberToObject(json, "total", index_count);
+    cJSON_AddNumberToObject(json, "offset", offset);
+    cJSON_AddNumberToObject(json, "storage_total", index_total);
+    cJSON_AddNumberToObject(json, "storage_used", index_used);
+    files = cJSON_AddArrayToObject(json, "files");
+
+    for (i = offset; files && i < end; i++)
+    {
+        entry = &index_files[i];
+        file = cJSON_CreateObject();
+        if (file == NULL)
+        {
+            break;
+        }
+        cJSON_AddItemToArray(files, file);
+        cJSON_AddStringToObject(file, "name", entry->name);
+        cJSON_AddNumberToObject(file, "size", entry->size);
+        cJSON_AddNumberToObject(file, "mtime", entry->mtime);
+        if (entry->hashed)
+        {
+            for (int b = 0; b < sizeof(entry->sha256); b++)
+            {
+                sprintf(&hex[b * 2], "%02x", entry->sha256[b]);
+            }
+            cJSON_AddStringToObject(file, "sha256", hex);
+        }
+        else
+        {
+            cJSON_AddNullToObject(file, "sha256");
+        }
+    }
+    if (end < index_count)
+    {
+        cJSON_AddNumberToObject(json, "next", end);
+    }
+
+    xSemaphoreGive(index_lock);
+    return end - offset;
+}
+
+// end of file_index.c
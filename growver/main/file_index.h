@@ -0,0 +1,33 @@
+//******************************************************************************
+//
+// file_index.h
+//
+//******************************************************************************
+
+// Longest page of GET /api/v1/files, and the page size when none is given
+#define FILE_INDEX_PAGE_MAX     50
+#define FILE_INDEX_PAGE_DEFAULT 20
+
+// File read size when hashing
+#define FILE_INDEX_BLOCK_SIZE   1024
+
+// One file in the store. Names are relative to the base path, without a
+// leading '/', and include any directories. Needs storage.h.
+typedef struct
+{
+    char name[STORAGE_NAME_MAX];
+    uint32_t size;
+    time_t mtime;
+    uint8_t sha256[32];
+    bool hashed;                // sha256 is known, else computed when listed
+} file_index_entry_t;
+
+esp_err_t FileIndexInit(const char *base_path);
+esp_err_t FileIndexUpdate(const char *name, const uint8_t *sha256);
+void FileIndexRemove(const char *name);
+size_t FileIndexCount(void);
+bool FileIndexGet(size_t i, file_index_entry_t *entry);
+void FileIndexStorage(size_t *total, size_t *used);
+int FileIndexJson(cJSON *json, size_t offset, size_t limit);
+
+// end of file_index.h
@@ -7,27 +7,39 @@
 //*****************************************************************************
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <dirent.h>
 
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "esp_vfs.h"
 #include "esp_spiffs.h"
 #include "esp_http_server.h"
+#include "mbedtls/sha256.h"
+#include "cJSON.h"
 #include "file_server.h"
+#include "storage.h"
+#include "file_index.h"
+#include "resp_writer.h"
+#include "write_pipe.h"
+#include "static_assets.h"
+#include "buf_pool.h"
 
 /* Max length a file path can have on storage */
-#define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
+#define FILE_PATH_MAX (ESP_VFS_PATH_MAX + STORAGE_NAME_MAX)
 
-/* Max size of an individual file. Make sure this
- * value is same as that set in upload_script.html */
-#define MAX_FILE_SIZE   (200*1024) // 200 KB
-#define MAX_FILE_SIZE_STR "200KB"
+/* Upload buffer size. Uploads are received into one buffer while the
+ * previous one is written on the other core, and a multiple of the
+ * 4 KB flash sector keeps the writes of full buffers aligned */
+#define UPLOAD_BUF_SIZE (8*1024)
 
 /* Scratch buffer size */
 //#define SCRATCH_BUFSIZE  8192
@@ -45,135 +57,190 @@ esp_err_t index_html_get_handler(httpd_req_t *req)
 }
 
 /* Send HTTP response with a run-time generated html consisting of
- * a list of all files and folders under the requested path.
- * In case of SPIFFS this returns empty list when path is any
- * string other than '/', since SPIFFS doesn't support directories */
+ * a list of all files under the requested path, taken from the
+ * file index so the flash is not scanned. A path other than '/'
+ * lists the files whose names start with it, and names with a
+ * further '/' are shown once as a subdirectory. This is the same
+ * whether the '/' is a LittleFS directory or part of a SPIFFS name */
 static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
 {
-    char entrypath[FILE_PATH_MAX];
-    char entrysize[16];
-    const char *entrytype;
+    file_index_entry_t entry;
+    const char *base_path = ((struct file_server_data *)req->user_ctx)->base_path;
+    const size_t base_len = strlen(base_path);
 
-    struct dirent *entry;
-    struct stat entry_stat;
-
-    DIR *dir = opendir(dirpath);
-
-    const size_t dirpath_len = strlen(dirpath);
+    /* Names in the index are relative to the base path */
+    const char *prefix = (strlen(dirpath) > base_len) ? dirpath + base_len + 1 : "";
+    const size_t prefix_len = strlen(prefix);
 
     //ESP_LOGI(TAG, "Directory request2 [%s]", dirpath);
 
-    /* Retrieve the base path of file storage to construct the full path */
-    strlcpy(entrypath, dirpath, sizeof(entrypath));
-
-    if (!dir)
-    {
-        ESP_LOGE(TAG, "Failed to stat dir : %s", dirpath);
-        /* Respond with 404 Not Found */
-        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
-        return ESP_FAIL;
-    }
+    /* Output is collected and sent in segment-sized chunks */
+    resp_writer_t w;
+    RespWriterInit(&w, req);
 
     /* Send HTML file header */
-    httpd_resp_sendstr_chunk(req, "<!DOCTYPE html><html><body>");
+    RespWriterStr(&w, "<!DOCTYPE html><html><body>");
 
-    /* Get handle to embedded file upload script */
-    extern const unsigned char upload_script_start[] asm("_binary_upload_script_html_start");
-    extern const unsigned char upload_script_end[]   asm("_binary_upload_script_html_end");
-    const size_t upload_script_size = (upload_script_end - upload_script_start);
-
-    /* Add file upload form and script which on execution sends a POST request to /upload */
-    httpd_resp_send_chunk(req, (const char *)upload_script_start, upload_script_size);
+    /* Add file upload form and script which on execution sends a POST request
+     * to /upload, from the asset pack in flash */
+    static_asset_t upload_script;
+    if (StaticAssetFind("/upload_script.html", &upload_script)) {
+        RespWriterWrite(&w, upload_script.data, upload_script.data_len);
+    }
 
     /* Send file-list table definition and column labels */
-    httpd_resp_sendstr_chunk(req,
+    RespWriterStr(&w,
         "<table class=\"fixed\" border=\"1\">"
         "<col width=\"800px\" /><col width=\"300px\" /><col width=\"300px\" /><col width=\"100px\" />"
         "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Delete</th></tr></thead>"
         "<tbody>");
 
-    /* Iterate over all files / folders and fetch their names and sizes */
-    while ((entry = readdir(dir)) != NULL)
+    /* Iterate over the indexed files under the path. Names are
+     * sorted, so the files of a subdirectory are consecutive */
+    char subdir[STORAGE_NAME_MAX] = "";
+    size_t subdir_len = 0;
+    for (size_t i = 0; FileIndexGet(i, &entry); i++)
     {
-        // JAG: For some reason (due to /fs likely) directories aren't handled. They can't exist in SPIFFS anyway
-        // so no loss in skipping them.
-        if (entry->d_name[0] == 0)
+        if (strncmp(entry.name, prefix, prefix_len) != 0) {
             continue;
-        entrytype = (entry->d_type == DT_DIR ? "directory" : "file");
+        }
+        const char *name = entry.name + prefix_len;
+        //ESP_LOGI(TAG, "Found file : %s (%u bytes)", name, entry.size);
 
-        strlcpy(entrypath + dirpath_len, entry->d_name, sizeof(entrypath) - dirpath_len);
-        if (stat(entrypath, &entry_stat) == -1) {
-            ESP_LOGE(TAG, "Failed to stat %s : %s", entrytype, entry->d_name);
+        /* Table row with a link to the subdirectory listing */
+        const char *slash = strchr(name, '/');
+        if (slash) {
+            if (subdir_len == slash - name + 1 && strncmp(subdir, name, subdir_len) == 0) {
+                continue;
+            }
+            subdir_len = slash - name + 1;
+            strlcpy(subdir, name, subdir_len + 1);
+            RespWriterPrintf(&w,
+                "<tr><td><a href=\"%s%s\">%s</a></td><td>directory</td><td></td><td></td></tr>\n",
+                req->uri, subdir, subdir);
+            if (w.err != ESP_OK) {
+                break;
+            }
             continue;
         }
-        sprintf(entrysize, "%ld", entry_stat.st_size);
-        //ESP_LOGI(TAG, "Found %s : %s (%s bytes)", entrytype, entry->d_name, entrysize);
-        //ESP_LOGI(TAG, "DEBUG [%s] [%s] [%s]", req->uri, entry->d_name, entrytype);
-
-        /* Send chunk of HTML file containing table entries with file name and size */
-        httpd_resp_sendstr_chunk(req, "<tr><td><a href=\"");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        if (entry->d_type == DT_DIR) {
-            httpd_resp_sendstr_chunk(req, "/");
+
+        /* Table row with file name, type, size and delete button */
+        RespWriterPrintf(&w,
+            "<tr><td><a href=\"%s%s\">%s</a></td><td>file</td><td>%u</td><td>"
+            "<form method=\"post\" action=\"/delete%s%s\"><button type=\"submit\">Delete</button></form>"
+            "</td></tr>\n",
+            req->uri, name, name, entry.size, req->uri, name);
+        if (w.err != ESP_OK) {
+            break;
         }
-        httpd_resp_sendstr_chunk(req, "\">");
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "</a></td><td>");
-        httpd_resp_sendstr_chunk(req, entrytype);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, entrysize);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/delete");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Delete</button></form>");
-        httpd_resp_sendstr_chunk(req, "</td></tr>\n");
-    }
-
-    closedir(dir);
+    }
 
     /* Finish the file list table */
-    httpd_resp_sendstr_chunk(req, "</tbody></table>");
+    RespWriterStr(&w, "</tbody></table>");
 
     // Display SPIFFS info (size and used space)
     size_t total_size, used_size;
-    ESP_ERROR_CHECK(esp_spiffs_info(0, &total_size, &used_size));
-    httpd_resp_sendstr_chunk(req, "<br>Storage Size (kB): ");
-    sprintf(entrypath, "%d", (unsigned int)total_size/1024);
-    httpd_resp_sendstr_chunk(req, entrypath);
-
-    httpd_resp_sendstr_chunk(req, " Available (kB): ");
-    sprintf(entrypath, "%d", (unsigned int)(total_size - used_size)/1024);
-    httpd_resp_sendstr_chunk(req, entrypath);
+    FileIndexStorage(&total_size, &used_size);
+    RespWriterPrintf(&w, "<br>Storage Size (kB): %d Available (kB): %d",
+                     (unsigned int)total_size/1024, (unsigned int)(total_size - used_size)/1024);
 
     /* Send remaining chunk of HTML file to complete it */
-    httpd_resp_sendstr_chunk(req, "</body></html>");
-
-    /* Send empty chunk to signal HTTP response completion */
-    httpd_resp_sendstr_chunk(req, NULL);
+    RespWriterStr(&w, "</body></html>");
 
-    return ESP_OK;
+    /* Send the last chunk and the empty chunk signalling completion */
+    return RespWriterFinish(&w);
 }
 
 #define IS_FILE_EXT(filename, ext) \
     (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 
-/* Set HTTP response content type according to file extension */
-static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename)
+/* HTTP content type according to file extension */
+static const char *content_type_from_file(const char *filename)
 {
     if (IS_FILE_EXT(filename, ".pdf")) {
-        return httpd_resp_set_type(req, "application/pdf");
+        return "application/pdf";
     } else if (IS_FILE_EXT(filename, ".html")) {
-        return httpd_resp_set_type(req, "text/html");
+        return "text/html";
     } else if (IS_FILE_EXT(filename, ".jpeg")) {
-        return httpd_resp_set_type(req, "image/jpeg");
+        return "image/jpeg";
     } else if (IS_FILE_EXT(filename, ".ico")) {
-        return httpd_resp_set_type(req, "image/x-icon");
+        return "image/x-icon";
+    } else if (IS_FILE_EXT(filename, ".css")) {
+        return "text/css";
+    } else if (IS_FILE_EXT(filename, ".js")) {
+        return "application/javascript";
+    } else if (IS_FILE_EXT(filename, ".json")) {
+        return "application/json";
+    } else if (IS_FILE_EXT(filename, ".svg")) {
+        return "image/svg+xml";
+    } else if (IS_FILE_EXT(filename, ".png")) {
+        return "image/png";
     }
     /* This is a limited set only */
     /* For any other type always set as plain text */
-    return httpd_resp_set_type(req, "text/plain");
+    return "text/plain";
+}
+
+/* Parses a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+ * range against a file of size bytes. Returns 1 for a satisfiable range,
+ * 0 if there is none or it is not understood (send the whole file) and -1
+ * if it lies outside the file (416). */
+static int parse_range(const char *range, size_t size, size_t *first, size_t *last)
+{
+    char *end;
+    unsigned long a, b;
+
+    if (strncmp(range, "bytes=", 6) || strchr(range, ',')) {
+        return 0;
+    }
+    range += 6;
+    if (*range == '-') {
+        /* Suffix: the last b bytes */
+        b = strtoul(range + 1, &end, 10);
+        if (end == range + 1 || *end) {
+            return 0;
+        }
+        if (b == 0 || size == 0) {
+            return -1;
+        }
+        *first = (b < size) ? size - b : 0;
+        *last = size - 1;
+        return 1;
+    }
+    a = strtoul(range, &end, 10);
+    if (end == range || *end != '-') {
+        return 0;
+    }
+    range = end + 1;
+    b = *range ? strtoul(range, &end, 10) : size - 1;
+    if (*range && (end == range || *end)) {
+        return 0;
+    }
+    if (*range && (b < a)) {
+        return 0;
+    }
+    if (a >= size) {
+        return -1;
+    }
+    *first = a;
+    *last = (b < size) ? b : size - 1;
+    return 1;
+}
+
+/* httpd_send until all of buf is out */
+static esp_err_t send_all(httpd_req_t *req, const char *buf, size_t len)
+{
+    int sent;
+
+    while (len > 0) {
+        sent = httpd_send(req, buf, len);
+        if (sent <= 0) {
+            return ESP_FAIL;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return ESP_OK;
 }
 
 /* Copies the full path into destination buffer and returns
@@ -246,53 +313,139 @@ esp_err_t download_get_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
+    const char *type = content_type_from_file(filename);
+    bool gzip = false;
+
+    /* Send the precompressed variant made by tools/web_assets.py, if any,
+     * to clients that accept gzip */
+    size_t pathlen = strlen(filepath);
+    bool vary = StaticAssetAcceptsGzip(req);
+    if (vary && (pathlen + sizeof(".gz") <= sizeof(filepath))) {
+        strcpy(filepath + pathlen, ".gz");
+        gzip = (stat(filepath, &file_stat) == 0);
+        if (!gzip) {
+            filepath[pathlen] = '\0';
+            stat(filepath, &file_stat);
+        }
+    }
+
+    /* Strong validator from size and modification time. The gzip variant
+     * is a different file, so it gets its own. */
+    char etag[40];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx%s\"", (unsigned long)file_stat.st_mtime,
+             (unsigned long)file_stat.st_size, gzip ? "-gz" : "");
+    if (StaticAssetNotModified(req, etag)) {
+        return ESP_OK;
+    }
+
+    /* Range, unless If-Range names another version of the file */
+    size_t size = file_stat.st_size;
+    size_t first = 0, last = size ? size - 1 : 0;
+    int ranged = 0;
+    char value[64];
+    if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) == ESP_OK) {
+        ranged = parse_range(value, size, &first, &last);
+        if ((httpd_req_get_hdr_value_str(req, "If-Range", value, sizeof(value)) == ESP_OK) &&
+            strcmp(value, etag)) {
+            ranged = 0;
+            first = 0;
+            last = size ? size - 1 : 0;
+        }
+    }
+
+    /* Take a buffer for the response from the pool, so that downloads
+     * served in parallel do not share one */
+    char *chunk = BufPoolAcquire(BUF_POOL_FILE);
+    if (!chunk) {
+        return BufPoolRespondBusy(req);
+    }
+
+    if (ranged < 0) {
+        snprintf(chunk, SCRATCH_BUFSIZE,
+                 "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                 "Content-Range: bytes */%u\r\n"
+                 "Content-Length: 0\r\n\r\n", size);
+        esp_err_t err = send_all(req, chunk, strlen(chunk));
+        BufPoolRelease(BUF_POOL_FILE, chunk);
+        return err;
+    }
+
     fd = fopen(filepath, "r");
-    if (!fd) {
+    if (!fd || (ranged && fseek(fd, first, SEEK_SET))) {
+        if (fd) {
+            fclose(fd);
+        }
+        BufPoolRelease(BUF_POOL_FILE, chunk);
         ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filename, file_stat.st_size);
-    set_content_type_from_file(req, filename);
+    size_t remaining = size ? last - first + 1 : 0;
+    ESP_LOGI(TAG, "Sending file : %s (%u of %u bytes from %u)...", filename, remaining, size, first);
+
+    /* The response header is written directly, so that it carries a
+     * Content-Length instead of using chunked encoding */
+    int len = snprintf(chunk, SCRATCH_BUFSIZE,
+                       "HTTP/1.1 %s\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %u\r\n"
+                       "Accept-Ranges: bytes\r\n"
+                       "ETag: %s\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "%s%s",
+                       ranged ? "206 Partial Content" : "200 OK", type, remaining, etag,
+                       gzip ? "Content-Encoding: gzip\r\n" : "",
+                       vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (ranged) {
+        len += snprintf(chunk + len, SCRATCH_BUFSIZE - len, "Content-Range: bytes %u-%u/%u\r\n", first, last, size);
+    }
+    len += snprintf(chunk + len, SCRATCH_BUFSIZE - len, "\r\n");
+    esp_err_t err = send_all(req, chunk, len);
 
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *chunk = ((struct file_server_data *)req->user_ctx)->scratch;
     size_t chunksize;
-    do {
-        /* Read file in chunks into the scratch buffer */
-        chunksize = fread(chunk, 1, SCRATCH_BUFSIZE, fd);
-
-        /* Send the buffer contents as HTTP response chunk */
-        if (httpd_resp_send_chunk(req, chunk, chunksize) != ESP_OK) {
-            fclose(fd);
-            ESP_LOGE(TAG, "File sending failed!");
-            /* Abort sending file */
-            httpd_resp_sendstr_chunk(req, NULL);
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
-            return ESP_FAIL;
+    while ((err == ESP_OK) && (remaining > 0)) {
+        /* Read file in chunks into the buffer */
+        chunksize = fread(chunk, 1, MIN(remaining, SCRATCH_BUFSIZE), fd);
+        if (chunksize == 0) {
+            err = ESP_FAIL;
+            break;
         }
-
-        /* Keep looping till the whole file is sent */
-    } while (chunksize != 0);
+        err = send_all(req, chunk, chunksize);
+        remaining -= chunksize;
+    }
 
     /* Close file after sending complete */
     fclose(fd);
+    BufPoolRelease(BUF_POOL_FILE, chunk);
+    if (err != ESP_OK) {
+        /* The header is out, so all that can be done is drop the connection */
+        ESP_LOGE(TAG, "File sending failed!");
+        return ESP_FAIL;
+    }
     ESP_LOGI(TAG, "File sending complete");
-
-    /* Respond with an empty chunk to signal HTTP response completion */
-    httpd_resp_send_chunk(req, NULL, 0);
     return ESP_OK;
 }
 
-/* Handler to upload a file onto the server */
+/* Commits a received buffer to the upload temp file, from the
+ * write pipe's task */
+static esp_err_t upload_write(void *ctx, const void *data, size_t len)
+{
+    int fd = *(int *)ctx;
+    return (write(fd, data, len) == len) ? ESP_OK : ESP_FAIL;
+}
+
+/* Handler to upload a file onto the server. The file is received into
+ * a temp file and renamed over the target once complete, so a failed
+ * upload leaves the previous version in place. LittleFS replaces it
+ * atomically; SPIFFS can't rename over a file, so there the old one is
+ * removed just before the rename. A gzip variant of the old version is
+ * removed after it */
 esp_err_t upload_post_handler(httpd_req_t *req)
 {
     char filepath[FILE_PATH_MAX];
-    FILE *fd = NULL;
-    struct stat file_stat;
+    size_t total, used;
 
     /* Skip leading "/upload" from URI to get filename */
     /* Note sizeof() counts NULL termination hence the -1 */
@@ -311,85 +464,131 @@ esp_err_t upload_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    if (stat(filepath, &file_stat) == 0) {
-        ESP_LOGE(TAG, "File already exists : %s", filepath);
-        /* Respond with 400 Bad Request */
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File already exists");
-        return ESP_FAIL;
-    }
-
-    /* File cannot be larger than a limit */
-    if (req->content_len > MAX_FILE_SIZE) {
+    /* File cannot be larger than the free space. The temp file is
+     * written before the old version is freed, so that counts too */
+    if (StorageInfo(&total, &used) != ESP_OK || req->content_len > total - used) {
         ESP_LOGE(TAG, "File too large : %d bytes", req->content_len);
         /* Respond with 400 Bad Request */
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
-                            "File size must be less than "
-                            MAX_FILE_SIZE_STR "!");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File larger than the free space");
         /* Return failure to close underlying connection else the
          * incoming file content will keep the socket busy */
         return ESP_FAIL;
     }
 
-    fd = fopen(filepath, "w");
-    if (!fd) {
-        ESP_LOGE(TAG, "Failed to create file : %s", filepath);
+    /* Create any directories in the name (LittleFS) */
+    StorageMakeParents(filepath);
+
+    int fd = open(STORAGE_UPLOAD_TEMP, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to create file : %s", STORAGE_UPLOAD_TEMP);
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file");
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "Receiving file : %s...", filename);
+    write_pipe_t *pipe = WritePipeCreate(UPLOAD_BUF_SIZE, upload_write, &fd, true);
+    if (!pipe) {
+        close(fd);
+        unlink(STORAGE_UPLOAD_TEMP);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
 
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
-    int received;
+    ESP_LOGI(TAG, "Receiving file : %s (%d bytes)...", filename, req->content_len);
+    int64_t start_us = esp_timer_get_time();
 
     /* Content length of the request gives
      * the size of the file being uploaded */
     int remaining = req->content_len;
-
-    while (remaining > 0) {
-
-        ESP_LOGI(TAG, "Remaining size : %d", remaining);
-        /* Receive the file part by part into a buffer */
-        if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0) {
+    int received;
+    esp_err_t err = ESP_OK;
+
+    /* Hash the content on the way through for the file index, while
+     * the writer task commits the previous buffer */
+    mbedtls_sha256_context sha;
+    uint8_t sha256[32];
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+
+    while (err == ESP_OK && remaining > 0) {
+        char *buf = WritePipeBuffer(pipe);
+        size_t fill = 0;
+
+        /* Fill the buffer, so only the last write is partial */
+        while (fill < UPLOAD_BUF_SIZE && remaining > 0) {
+            received = httpd_req_recv(req, buf + fill, MIN(remaining, UPLOAD_BUF_SIZE - fill));
             if (received == HTTPD_SOCK_ERR_TIMEOUT) {
                 /* Retry if timeout occurred */
                 continue;
             }
-
-            /* In case of unrecoverable error,
-             * close and delete the unfinished file*/
-            fclose(fd);
-            unlink(filepath);
-
-            ESP_LOGE(TAG, "File reception failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file");
-            return ESP_FAIL;
+            if (received <= 0) {
+                ESP_LOGE(TAG, "File reception failed!");
+                /* Respond with 500 Internal Server Error */
+                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file");
+                err = ESP_FAIL;
+                break;
+            }
+            mbedtls_sha256_update_ret(&sha, (const uint8_t *)buf + fill, received);
+            fill += received;
+            remaining -= received;
         }
 
-        /* Write buffer content to file on storage */
-        if (received && (received != fwrite(buf, 1, received, fd))) {
+        if (WritePipeSubmit(pipe, (err == ESP_OK) ? fill : 0) != ESP_OK && err == ESP_OK) {
             /* Couldn't write everything to file!
              * Storage may be full? */
-            fclose(fd);
-            unlink(filepath);
-
             ESP_LOGE(TAG, "File write failed!");
             /* Respond with 500 Internal Server Error */
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
-            return ESP_FAIL;
+            err = ESP_FAIL;
         }
+    }
 
-        /* Keep track of remaining size of
-         * the file left to be uploaded */
-        remaining -= received;
+    if (WritePipeFinish(pipe) != ESP_OK && err == ESP_OK) {
+        ESP_LOGE(TAG, "File write failed!");
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
+        err = ESP_FAIL;
+    }
+    WritePipeDelete(pipe);
+    mbedtls_sha256_finish_ret(&sha, sha256);
+    mbedtls_sha256_free(&sha);
+    if (close(fd) != 0 && err == ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
+        err = ESP_FAIL;
     }
 
-    /* Close file upon upload completion */
-    fclose(fd);
-    ESP_LOGI(TAG, "File reception complete");
+    /* Replace the target with the complete file */
+    if (err == ESP_OK && rename(STORAGE_UPLOAD_TEMP, filepath) != 0) {
+        unlink(filepath);
+        if (rename(STORAGE_UPLOAD_TEMP, filepath) != 0) {
+            ESP_LOGE(TAG, "Failed to rename to %s", filepath);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
+            err = ESP_FAIL;
+        }
+    }
+    if (err != ESP_OK) {
+        /* Delete the unfinished file */
+        unlink(STORAGE_UPLOAD_TEMP);
+        return ESP_FAIL;
+    }
+
+    FileIndexUpdate(filename + 1, sha256);
+
+    /* A gzip variant holds the old content and is preferred by
+     * download_get_handler, so it goes with the old version */
+    size_t pathlen = strlen(filepath);
+    if (pathlen + sizeof(".gz") <= sizeof(filepath)) {
+        strcpy(filepath + pathlen, ".gz");
+        /* filename points into filepath, so it now names the .gz */
+        if (unlink(filepath) == 0) {
+            ESP_LOGI(TAG, "Removed stale %s", filename);
+            FileIndexRemove(filename + 1);
+        }
+        filepath[pathlen] = 0;
+    }
+
+    int64_t elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+    ESP_LOGI(TAG, "File reception complete : %d bytes in %lld ms, %u KB/s", req->content_len, elapsed_ms,
+             elapsed_ms ? (unsigned int)((uint64_t)req->content_len * 1000 / 1024 / elapsed_ms) : 0);
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_set_status(req, "303 See Other");
@@ -431,6 +630,17 @@ esp_err_t delete_post_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "Deleting file : %s", filename);
     /* Delete file */
     unlink(filepath);
+    FileIndexRemove(filename + 1);
+
+    /* and its gzip variant, which would otherwise still be served */
+    size_t pathlen = strlen(filepath);
+    if (pathlen + sizeof(".gz") <= sizeof(filepath)) {
+        strcpy(filepath + pathlen, ".gz");
+        /* filename points into filepath, so it now names the .gz */
+        if (unlink(filepath) == 0) {
+            FileIndexRemove(filename + 1);
+        }
+    }
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_set_status(req, "303 See Other");
@@ -1,12 +1,10 @@
 // File server header file
+/* Size of the download buffers, taken from the pool in buf_pool.c */
 #define SCRATCH_BUFSIZE  8192
 
 struct file_server_data {
     /* Base path of file storage */
     char base_path[ESP_VFS_PATH_MAX + 1];
-
-    /* Scratch buffer for temporary storage during file transfer */
-    char scratch[SCRATCH_BUFSIZE];
 };
 
 /* Declare the function which starts the file server.
@@ -7,6 +7,8 @@
 //
 //
 //*****************************************************************************
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include "esp_http_server.h"
@@ -15,6 +17,12 @@
 #include "esp_vfs.h"
 #include "cJSON.h"
 #include "growver_rest.h"
+#include "storage.h"
+#include "file_index.h"
+#include "resp_writer.h"
+#include "script.h"
+#include "buf_pool.h"
+#include "growver_wifi.h"
 #include "../components/motor/motor_dc.h"
 #include "../components/motor/servo.h"
 #include "../components/other/peripheral.h"
@@ -27,11 +35,17 @@ const char *URI_REST_API = "/api/v1/*";
 int ActionMotorSpeedPost(char *buf);
 int ActionPumpControlPost(char *buf);
 int ActionServoControlPost(char *buf);
-int ActionStatusGet(cJSON *json_response);
+int ActionGpioPost(char *buf);
+int ActionFaultPost(char *buf);
+int ActionDosePost(char *buf);
+int ActionScriptPost(char *buf);
+int ActionStatusGet(cJSON *json_response, const char *query);
+int ActionGpioGet(cJSON *json_response, const char *query);
+int ActionFilesGet(cJSON *json_response, const char *query);
 
 // Typedef for Post and Get functions
 typedef int (*pPostCmd)(char *buf);
-typedef int (*pGetCmd)(cJSON *json_response);
+typedef int (*pGetCmd)(cJSON *json_response, const char *query);
 
 // Define a structure for the POST command table
 typedef struct
@@ -59,6 +73,10 @@ tPostCmdEntry PostCmdTable[] =
 	{ "motor", ActionMotorSpeedPost},
     { "pump", ActionPumpControlPost},
     { "servo", ActionServoControlPost},
+    { "gpio", ActionGpioPost},
+    { "fault", ActionFaultPost},
+    { "dose", ActionDosePost},
+    { "script", ActionScriptPost},
     { 0, 0}
 };
 
@@ -66,6 +84,8 @@ tPostCmdEntry PostCmdTable[] =
 tGetCmdEntry GetCmdTable[] =
 {
 	{ "status", ActionStatusGet},
+    { "gpio", ActionGpioGet},
+    { "files", ActionFilesGet},
     { 0, 0}
 };
 
@@ -88,10 +108,16 @@ bool JsonGetIntItem(cJSON *object, const char *item, int32_t *var)
 
 //*****************************************************************************
 // ActionMotorSpeedPost
+// Refused with ESP_ERR_INVALID_STATE while a motor fault is latched.
 //
 //*****************************************************************************
 int ActionMotorSpeedPost(char *buf)
 {
+    if (MotorDCFaultGet(NULL))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
     // Get current speed and direction
     int32_t ls = MotorDCGetSpeed(MOTOR_L);
     int32_t rs = MotorDCGetSpeed(MOTOR_R);
@@ -134,11 +160,86 @@ int ActionPumpControlPost(char *buf)
 
 	ESP_LOGI(REST_TAG, "Pump %u\n", speed);
 
-	(speed) ? (PumpControlSet(1)) : (PumpControlSet(0));
+	PumpSpeedSet(speed);
 
 	return 0;
 }
 
+//*****************************************************************************
+// ActionDosePost
+// {"ml":n} pumps n mL timed on the device, {"stop":1} aborts the dose and
+// {"ms_per_ml":n} sets the flow calibration.
+//
+//*****************************************************************************
+int ActionDosePost(char *buf)
+{
+    int32_t stop = 0, ms_per_ml = 0;
+    double ml = 0;
+    esp_err_t err = ESP_OK;
+
+    cJSON *root = cJSON_Parse(buf);
+    if (root == NULL)
+    {
+        return ESP_FAIL;
+    }
+    if (cJSON_GetObjectItem(root, "ml"))
+    {
+        ml = cJSON_GetObjectItem(root, "ml")->valuedouble;
+    }
+    JsonGetIntItem(root, "stop", &stop);
+    JsonGetIntItem(root, "ms_per_ml", &ms_per_ml);
+    cJSON_Delete(root);
+
+    if (ms_per_ml > 0)
+    {
+        err = PumpCalibrationSet(ms_per_ml);
+    }
+    if (stop)
+    {
+        PumpDoseStop();
+    }
+    else if (ml > 0)
+    {
+        ESP_LOGI(REST_TAG, "Dose %.1f mL\n", ml);
+        err = PumpDoseStart(ml);
+    }
+    return err;
+}
+
+//*****************************************************************************
+// ActionScriptPost
+// {"run":"name"} starts a script stored on SPIFFS, {"stop":1} stops it.
+// Syntax errors and the result of the run are reported in the status.
+//
+//*****************************************************************************
+int ActionScriptPost(char *buf)
+{
+    int32_t stop = 0;
+    uint16_t line = 0;
+    esp_err_t err = ESP_OK;
+
+    cJSON *root = cJSON_Parse(buf);
+    if (root == NULL)
+    {
+        return ESP_FAIL;
+    }
+    JsonGetIntItem(root, "stop", &stop);
+    if (stop)
+    {
+        ScriptStop();
+    }
+    else if (cJSON_IsString(cJSON_GetObjectItem(root, "run")))
+    {
+        err = ScriptStart(cJSON_GetObjectItem(root, "run")->valuestring, &line);
+        if (err != ESP_OK)
+        {
+            ESP_LOGW(REST_TAG, "Script start failed (%s) line %u", esp_err_to_name(err), line);
+        }
+    }
+    cJSON_Delete(root);
+    return err;
+}
+
 //*****************************************************************************
 // ActionServoControlPost
 //
@@ -159,13 +260,195 @@ int ActionServoControlPost(char *buf)
 	return 0;
 }
 
+//*****************************************************************************
+// ActionGpioPost
+// {"pin":n, "level":0|1} drives an aux pin. {"pin":n, "input":1,
+// "debounce_us":t} makes it an edge interrupt input, "input":0 turns that off.
+// {"pin":n, "safety":1, "active":0|1} arms it as a motor stop input,
+// "safety":0 disarms it.
+//
+//*****************************************************************************
+int ActionGpioPost(char *buf)
+{
+    int32_t pin = -1, level = -1, input = -1, debounce_us = 0;
+    int32_t safety = -1, active = 0;
+    esp_err_t err = ESP_OK;
+
+    cJSON *root = cJSON_Parse(buf);
+    if (root == NULL)
+    {
+        return ESP_FAIL;
+    }
+    JsonGetIntItem(root, "pin", &pin);
+    JsonGetIntItem(root, "level", &level);
+    JsonGetIntItem(root, "input", &input);
+    JsonGetIntItem(root, "debounce_us", &debounce_us);
+    JsonGetIntItem(root, "safety", &safety);
+    JsonGetIntItem(root, "active", &active);
+    cJSON_Delete(root);
+
+    if (pin < 0 || pin >= AUX_IO_PINS)
+    {
+        return ESP_FAIL;
+    }
+
+    if (safety == 0)
+    {
+        GpioSafetyDisable(pin);
+    }
+    else if (safety > 0)
+    {
+        err = GpioSafetyEnable(pin, active);
+    }
+    else if (input == 0)
+    {
+        GpioInputDisable(pin);
+    }
+    else if (input > 0)
+    {
+        err = GpioInputEnable(pin, debounce_us);
+    }
+    else if (level >= 0)
+    {
+        GpioLevelSet(pin, level);
+    }
+    return err;
+}
+
+//*****************************************************************************
+// ActionFaultPost
+// {"clear":1} clears a latched motor fault, {"trip":1} stops the motors and
+// latches one.
+//
+//*****************************************************************************
+int ActionFaultPost(char *buf)
+{
+    int32_t clear = 0, trip = 0;
+    esp_err_t err = ESP_OK;
+
+    cJSON *root = cJSON_Parse(buf);
+    if (root == NULL)
+    {
+        return ESP_FAIL;
+    }
+    JsonGetIntItem(root, "clear", &clear);
+    JsonGetIntItem(root, "trip", &trip);
+    cJSON_Delete(root);
+
+    if (trip)
+    {
+        MotorDCFaultTrip(MOTOR_FAULT_CMD);
+    }
+    else if (clear)
+    {
+        // Refused while a safety input is still active
+        err = MotorDCFaultClear();
+        if (err == ESP_OK)
+        {
+            ESP_LOGI(REST_TAG, "Fault cleared\n");
+        }
+    }
+    return err;
+}
+
+//*****************************************************************************
+// ActionGpioGet
+// Reports aux pin levels and drains the queue of timestamped input edges.
+//
+//*****************************************************************************
+int ActionGpioGet(cJSON *json_response, const char *query)
+{
+    aux_event_t event;
+    char name[8];
+
+    for (uint8_t pin = 0; pin < AUX_IO_PINS; pin++)
+    {
+        sprintf(name, "aux%u", pin);
+        cJSON_AddNumberToObject(json_response, name, GpioLevelPeek(pin));
+    }
+
+    cJSON *events = cJSON_AddArrayToObject(json_response, "events");
+    while (GpioEventGet(&event, 0))
+    {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "pin", event.pin);
+        cJSON_AddNumberToObject(item, "level", event.level);
+        cJSON_AddNumberToObject(item, "time_us", (double)event.time_us);
+        cJSON_AddItemToArray(events, item);
+    }
+    cJSON_AddNumberToObject(json_response, "dropped", GpioEventsDropped());
+    cJSON_AddNumberToObject(json_response, "safety", GpioSafetyArmed());
+    return 0;
+}
+
 //*****************************************************************************
 // GetStatus
 //
 //*****************************************************************************
-int ActionStatusGet(cJSON *json_response)
+int ActionStatusGet(cJSON *json_response, const char *query)
 {
+    int64_t fault_time_us;
+    uint32_t fault = MotorDCFaultGet(&fault_time_us);
+
     cJSON_AddNumberToObject(json_response, "battery_v", (double)AnalogVoltageRead() / 1000);
+    cJSON_AddNumberToObject(json_response, "fault", fault);
+    if (fault)
+    {
+        cJSON_AddNumberToObject(json_response, "fault_time_us", (double)fault_time_us);
+    }
+
+    uint32_t dose_remaining_ms;
+    pump_dose_t dose;
+    PumpDoseLast(&dose);
+    cJSON_AddNumberToObject(json_response, "pump_speed", PumpSpeedGet());
+    cJSON_AddNumberToObject(json_response, "dose_active", PumpDoseActive(&dose_remaining_ms));
+    cJSON_AddNumberToObject(json_response, "dose_remaining_ms", dose_remaining_ms);
+    cJSON_AddNumberToObject(json_response, "dose_count", dose.count);
+    cJSON_AddNumberToObject(json_response, "dose_last_ml", dose.ml);
+    cJSON_AddNumberToObject(json_response, "dose_last_ms", (double)(dose.done_us / 1000));
+
+    script_status_t script;
+    ScriptStatus(&script);
+    cJSON_AddNumberToObject(json_response, "script_running", script.running);
+    cJSON_AddStringToObject(json_response, "script_name", script.name);
+    cJSON_AddNumberToObject(json_response, "script_line", script.line);
+    cJSON_AddNumberToObject(json_response, "script_error", script.error);
+    cJSON_AddNumberToObject(json_response, "script_runs", script.runs);
+
+    wifi_stats_t wifi;
+    WifiStats(&wifi);
+    cJSON_AddNumberToObject(json_response, "wifi_boot_ms", wifi.boot_ms);
+    cJSON_AddNumberToObject(json_response, "wifi_drop_ms", wifi.drop_ms);
+    cJSON_AddNumberToObject(json_response, "wifi_drops", wifi.drops);
+    cJSON_AddNumberToObject(json_response, "wifi_attempts", wifi.attempts);
+    cJSON_AddNumberToObject(json_response, "wifi_fast", wifi.fast);
+    cJSON_AddStringToObject(json_response, "wifi_ssid", wifi.ssid);
+    cJSON_AddNumberToObject(json_response, "wifi_rssi", wifi.rssi);
+    cJSON_AddNumberToObject(json_response, "wifi_roams", wifi.roams);
+    return 0;
+}
+
+//*****************************************************************************
+// ActionFilesGet
+// Lists the files in storage from the file index, a page at a time:
+// files?offset=n&limit=n
+//
+//*****************************************************************************
+int ActionFilesGet(cJSON *json_response, const char *query)
+{
+    char value[12];
+    size_t offset = 0;
+    size_t limit = 0;
+
+    if (httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK)
+    {
+        offset = strtoul(value, NULL, 10);
+    }
+    if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK)
+    {
+        limit = strtoul(value, NULL, 10);
+    }
+    FileIndexJson(json_response, offset, limit);
     return 0;
 }
 
@@ -214,6 +497,10 @@ int ProcessGet(char *uri, cJSON *json_response)
 {
     tGetCmdEntry *psCmdEntry;
 
+    // Commands are matched without the query string, which is passed on
+    size_t len = strcspn(uri, "?");
+    const char *query = (uri[len] == '?') ? &uri[len + 1] : "";
+
     //
     // Start at the beginning of the command table, to look for a matching
     // command.
@@ -227,10 +514,10 @@ int ProcessGet(char *uri, cJSON *json_response)
     while(psCmdEntry->pCmd)
     {
         // Is there a match? If so then call the corresponding function.
-        if(!strcmp(uri, psCmdEntry->pName))
+        if((strlen(psCmdEntry->pName) == len) && !strncmp(uri, psCmdEntry->pName, len))
         {
 	    	//ESP_LOGI(REST_TAG, "Cmd:%s\n", uri);
-            return(psCmdEntry->pCmd(json_response));
+            return(psCmdEntry->pCmd(json_response, query));
         }
 
         psCmdEntry++;
@@ -248,18 +535,26 @@ esp_err_t rest_post_handler(httpd_req_t *req)
 {
     int total_len = req->content_len;
     int cur_len = 0;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
+    char *buf;
     int received = 0;
     char *api;
+    esp_err_t err;
 
     if (total_len >= REST_SCRATCH_BUFSIZE) {
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "content too long");
         return ESP_FAIL;
     }
+
+    // Each post has its own buffer, so posts can be handled in parallel
+    buf = BufPoolAcquire(BUF_POOL_REST);
+    if (buf == NULL) {
+        return BufPoolRespondBusy(req);
+    }
     while (cur_len < total_len) {
-        received = httpd_req_recv(req, buf + cur_len, total_len);
+        received = httpd_req_recv(req, buf + cur_len, total_len - cur_len);
         if (received <= 0) {
+            BufPoolRelease(BUF_POOL_REST, buf);
             /* Respond with 500 Internal Server Error */
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to post control value");
             return ESP_FAIL;
@@ -273,8 +568,15 @@ esp_err_t rest_post_handler(httpd_req_t *req)
     //ESP_LOGI(REST_TAG, "URI [%s]Post to [%s] with [%s]\n", req->uri, api , buf);
 
     // Process the Post
-    ProcessPost(api, buf);
+    err = ProcessPost(api, buf);
+    BufPoolRelease(BUF_POOL_REST, buf);
 
+    // A refused action (e.g. a fault clear with a safety input active) is a conflict
+    if (err != ESP_OK)
+    {
+        httpd_resp_set_status(req, (err == ESP_ERR_INVALID_STATE) ? "409 Conflict" : HTTPD_400);
+        return httpd_resp_sendstr(req, esp_err_to_name(err));
+    }
     httpd_resp_sendstr(req, "Post control value successfully");
     return ESP_OK;
 }
@@ -315,9 +617,9 @@ esp_err_t rest_get_handler(httpd_req_t *req)
     ProcessGet(api, root);
 
     //cJSON_AddNumberToObject(root, "raw", esp_random() % 20);
-    const char *sys_info = cJSON_Print(root);
-    httpd_resp_sendstr(req, sys_info);
-    free((void *)sys_info);
+    resp_writer_t w;
+    RespWriterInit(&w, req);
+    RespWriterJson(&w, root);
     cJSON_Delete(root);
-    return ESP_OK;
+    return RespWriterFinish(&w);
 }
@@ -1,5 +1,6 @@
 // Growver REST Module header file
 
+// Size of the REST post buffers, taken from the pool in buf_pool.c
 #define REST_SCRATCH_BUFSIZE (10240)
 
 extern const char *URI_REST_API;
@@ -7,7 +8,6 @@ extern const char *URI_REST_API;
 typedef struct rest_server_context
 {
     char base_path[ESP_VFS_PATH_MAX + 1];
-    char scratch[REST_SCRATCH_BUFSIZE];
 } rest_server_context_t;
 
 esp_err_t rest_post_handler(httpd_req_t *req);
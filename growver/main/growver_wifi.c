@@ -0,0 +1,786 @@
+//*****************************************************************************
+//
+// growver_wifi.c - Wi-Fi station connection, reconnect and roaming.
+//
+// Several networks can be stored, each with a priority (WifiNetworkAdd).
+// The provisioned network is the first, and a network set by provisioning
+// later is added. To connect, one scan of all channels is made, and the AP
+// of a known network with the best RSSI, raised by WIFI_PRIORITY_DB per
+// priority level, is joined. So a robot moving between a greenhouse AP and
+// a house AP joins whichever it can reach.
+//
+// The AP of the last connection (BSSID and channel) is kept in NVS. The
+// first connect attempt after boot or after an AP drop goes straight to it
+// on its channel, without the scan. With CONFIG_WIFI_CACHE_LEASE it also
+// reuses the cached DHCP lease.
+//
+// Attempts after the first are spaced by an exponential backoff with
+// jitter, so a robot out of range does not keep the radio busy and robots
+// that lost the same AP do not retry in step. Authentication failures are
+// counted per network. A network that failed more than
+// CONFIG_EXAMPLE_AP_RECONN_ATTEMPTS times is passed over by the scans until
+// the next connection, so another known network in range is joined instead.
+// Only when every known network found has failed does the module fall back
+// to provisioning.
+//
+// While connected the RSSI is checked periodically. When it stays below
+// CONFIG_WIFI_ROAM_RSSI a scan is made without leaving the AP, and if a
+// known AP is clearly stronger the module moves to it while the link still
+// works, instead of after losing it.
+//
+// The connection state is only touched by the default event loop task.
+// The timers post events to it rather than act themselves.
+//
+// The time from boot to the first IP and from the last drop or roam to IP
+// is reported in the status (WifiStats).
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "tcpip_adapter.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "growver_wifi.h"
+
+// Events posted by the timers
+ESP_EVENT_DEFINE_BASE(GROWVER_WIFI_EVENT);
+enum
+{
+    WIFI_APP_RETRY,
+    WIFI_APP_ROAM_CHECK
+};
+
+static wifi_cache_t wifi_cache;
+static bool wifi_cache_valid;
+
+// Known networks, an empty SSID marks a free entry. Locked as the console
+// edits them from its own task.
+static wifi_network_t wifi_networks[WIFI_NETWORKS_MAX];
+static SemaphoreHandle_t wifi_networks_lock;
+
+// Authentication failures of each known network in this outage, also under
+// wifi_networks_lock. Cleared on getting an IP.
+static uint8_t wifi_auth_fails[WIFI_NETWORKS_MAX];
+#define WIFI_NETWORK_FAILED(i)  (wifi_auth_fails[i] > CONFIG_EXAMPLE_AP_RECONN_ATTEMPTS)
+
+// Network of the current connect attempt
+static char wifi_join_ssid[sizeof(wifi_networks[0].ssid)];
+
+// AP of the current connection, from the connected event
+static wifi_event_sta_connected_t wifi_ap;
+
+static esp_timer_handle_t wifi_retry_timer;
+static esp_timer_handle_t wifi_roam_timer;
+static void (*wifi_auth_failed)(void);
+static bool wifi_provisioning;
+static bool wifi_scanning;
+
+// Current outage: start, attempts and whether the last attempt went to the
+// cached AP
+static int64_t wifi_outage_us;
+static uint32_t wifi_attempts;
+static bool wifi_fast;
+
+// Roaming: checks in a row with a low RSSI, and the AP being moved to
+static uint32_t wifi_low_checks;
+static bool wifi_roaming;
+static wifi_network_t wifi_roam_network;
+static uint8_t wifi_roam_bssid[6];
+static uint8_t wifi_roam_channel;
+
+static wifi_stats_t wifi_stats;
+
+static const char *TAG = "wifi";
+
+static void WifiRetry(void);
+
+//*****************************************************************************
+// WifiCacheLoad / WifiCacheSave
+// The AP of the last connection in NVS. Saved on connecting, only when it
+// has changed.
+//
+//*****************************************************************************
+static void WifiCacheLoad(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(wifi_cache);
+
+    if (nvs_open(WIFI_CACHE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return;
+    }
+    wifi_cache_valid = (nvs_get_blob(nvs, "ap", &wifi_cache, &len) == ESP_OK) &&
+                       (len == sizeof(wifi_cache));
+    nvs_close(nvs);
+}
+
+static void WifiCacheSave(const tcpip_adapter_ip_info_t *ip_info)
+{
+    wifi_cache_t cache = { 0 };
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    memcpy(cache.ssid, wifi_ap.ssid, MIN(wifi_ap.ssid_len, sizeof(cache.ssid)));
+    memcpy(cache.bssid, wifi_ap.bssid, sizeof(cache.bssid));
+    cache.channel = wifi_ap.channel;
+    cache.ip = ip_info->ip.addr;
+    cache.netmask = ip_info->netmask.addr;
+    cache.gw = ip_info->gw.addr;
+    if (wifi_cache_valid && !memcmp(&cache, &wifi_cache, sizeof(cache)))
+    {
+        return;
+    }
+
+    err = nvs_open(WIFI_CACHE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nvs, "ap", &cache, sizeof(cache));
+        err = (err == ESP_OK) ? nvs_commit(nvs) : err;
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "AP cache not saved (%s)", esp_err_to_name(err));
+        return;
+    }
+    wifi_cache = cache;
+    wifi_cache_valid = true;
+}
+
+//*****************************************************************************
+// WifiNetworksLoad / WifiNetworksSave
+// The known networks in NVS. Load returns false if none were ever saved.
+// Save is called with wifi_networks_lock held.
+//
+//*****************************************************************************
+static bool WifiNetworksLoad(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(wifi_networks);
+    bool loaded;
+
+    if (nvs_open(WIFI_NETWORKS_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return false;
+    }
+    loaded = (nvs_get_blob(nvs, "nets", wifi_networks, &len) == ESP_OK) && (len == sizeof(wifi_networks));
+    if (!loaded)
+    {
+        memset(wifi_networks, 0, sizeof(wifi_networks));
+    }
+    nvs_close(nvs);
+    return loaded;
+}
+
+static esp_err_t WifiNetworksSave(void)
+{
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    err = nvs_open(WIFI_NETWORKS_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_blob(nvs, "nets", wifi_networks, sizeof(wifi_networks));
+    err = (err == ESP_OK) ? nvs_commit(nvs) : err;
+    nvs_close(nvs);
+    return err;
+}
+
+//*****************************************************************************
+// WifiNetworkFind
+// Index of a known network by SSID (at most max bytes, as in scan records
+// and configs it need not be terminated), or -1. Called with wifi_networks_lock
+// held.
+//
+//*****************************************************************************
+static int WifiNetworkFind(const uint8_t *ssid, size_t max)
+{
+    size_t len = strnlen((const char *)ssid, max);
+
+    for (int i = 0; i < WIFI_NETWORKS_MAX; i++)
+    {
+        if (wifi_networks[i].ssid[0] && (strlen(wifi_networks[i].ssid) == len) &&
+            !memcmp(wifi_networks[i].ssid, ssid, len))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//*****************************************************************************
+// WifiNetworkAdd / WifiNetworkRemove / WifiNetworkGet
+// Adds a network, or changes the password and priority of a known one.
+// Changes take effect from the next connect or roam.
+//
+//*****************************************************************************
+esp_err_t WifiNetworkAdd(const char *ssid, const char *password, uint8_t priority)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+    int index;
+
+    if (!ssid[0] || (strlen(ssid) >= sizeof(wifi_networks[0].ssid)) ||
+        (strlen(password) >= sizeof(wifi_networks[0].password)))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+    index = WifiNetworkFind((const uint8_t *)ssid, sizeof(wifi_networks[0].ssid));
+    for (int i = 0; (index < 0) && (i < WIFI_NETWORKS_MAX); i++)
+    {
+        index = wifi_networks[i].ssid[0] ? -1 : i;
+    }
+    if (index >= 0)
+    {
+        strcpy(wifi_networks[index].ssid, ssid);
+        strcpy(wifi_networks[index].password, password);
+        wifi_networks[index].priority = priority;
+        wifi_auth_fails[index] = 0;
+        err = WifiNetworksSave();
+    }
+    xSemaphoreGive(wifi_networks_lock);
+    return err;
+}
+
+esp_err_t WifiNetworkRemove(const char *ssid)
+{
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    int index;
+
+    xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+    index = WifiNetworkFind((const uint8_t *)ssid, sizeof(wifi_networks[0].ssid));
+    if (index >= 0)
+    {
+        memset(&wifi_networks[index], 0, sizeof(wifi_networks[index]));
+        wifi_auth_fails[index] = 0;
+        err = WifiNetworksSave();
+    }
+    xSemaphoreGive(wifi_networks_lock);
+    return err;
+}
+
+bool WifiNetworkGet(int index, char *ssid, uint8_t *priority)
+{
+    bool found;
+
+    xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+    found = (index >= 0) && (index < WIFI_NETWORKS_MAX) && wifi_networks[index].ssid[0];
+    if (found)
+    {
+        strcpy(ssid, wifi_networks[index].ssid);
+        *priority = wifi_networks[index].priority;
+    }
+    xSemaphoreGive(wifi_networks_lock);
+    return found;
+}
+
+//*****************************************************************************
+// WifiNetworkKeep
+// Adds the network of the station config, as set by provisioning. A known
+// network keeps its priority and takes the new password, as provisioning
+// again is how a changed AP password reaches the module.
+//
+//*****************************************************************************
+static void WifiNetworkKeep(void)
+{
+    wifi_config_t config;
+    char ssid[sizeof(config.sta.ssid) + 1] = { 0 };
+    char password[sizeof(config.sta.password) + 1] = { 0 };
+    uint8_t priority = 0;
+    bool changed = true;
+    int index;
+
+    if (esp_wifi_get_config(ESP_IF_WIFI_STA, &config) != ESP_OK)
+    {
+        return;
+    }
+    memcpy(ssid, config.sta.ssid, sizeof(config.sta.ssid));
+    memcpy(password, config.sta.password, sizeof(config.sta.password));
+
+    xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+    index = WifiNetworkFind(config.sta.ssid, sizeof(config.sta.ssid));
+    if (index >= 0)
+    {
+        priority = wifi_networks[index].priority;
+        changed = strcmp(wifi_networks[index].password, password) != 0;
+    }
+    xSemaphoreGive(wifi_networks_lock);
+    if (ssid[0] && changed)
+    {
+        ESP_LOGI(TAG, "%s provisioned network %s", (index < 0) ? "Adding" : "Updating", ssid);
+        WifiNetworkAdd(ssid, password, priority);
+    }
+}
+
+//*****************************************************************************
+// WifiJoin
+// Connects to an AP of a known network.
+//
+//*****************************************************************************
+static void WifiJoin(const wifi_network_t *network, const uint8_t *bssid, uint8_t channel)
+{
+    wifi_config_t config = { 0 };
+
+    strcpy(wifi_join_ssid, network->ssid);
+    memcpy(config.sta.ssid, network->ssid, strlen(network->ssid));
+    memcpy(config.sta.password, network->password, strlen(network->password));
+    memcpy(config.sta.bssid, bssid, sizeof(config.sta.bssid));
+    config.sta.bssid_set = true;
+    config.sta.channel = channel;
+    config.sta.scan_method = WIFI_FAST_SCAN;
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &config);
+
+#if CONFIG_WIFI_CACHE_LEASE
+    if (wifi_fast && wifi_cache.ip)
+    {
+        tcpip_adapter_ip_info_t ip_info =
+        {
+            .ip.addr = wifi_cache.ip,
+            .netmask.addr = wifi_cache.netmask,
+            .gw.addr = wifi_cache.gw
+        };
+        tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+        tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &ip_info);
+    }
+    else
+    {
+        tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+    }
+#endif
+
+    ESP_LOGI(TAG, "Joining %s " MACSTR " channel %u%s", network->ssid, MAC2STR(bssid), channel,
+             wifi_fast ? " (cached AP)" : "");
+    esp_wifi_connect();
+}
+
+//*****************************************************************************
+// WifiScan
+// Scans all channels, the result is picked up on WIFI_EVENT_SCAN_DONE.
+// While connected the scan dwells less on each channel, so the traffic
+// with the AP is held up less.
+//
+//*****************************************************************************
+static void WifiScan(void)
+{
+    wifi_scan_config_t config = { .show_hidden = false };
+
+    if (wifi_stats.connected)
+    {
+        config.scan_time.active.min = WIFI_ROAM_SCAN_MS;
+        config.scan_time.active.max = WIFI_ROAM_SCAN_MS;
+    }
+    wifi_scanning = (esp_wifi_scan_start(&config, false) == ESP_OK);
+    if (!wifi_scanning)
+    {
+        ESP_LOGW(TAG, "Scan failed to start");
+    }
+}
+
+//*****************************************************************************
+// WifiConnect
+// Starts a connect attempt: to the cached AP on the first attempt of an
+// outage, through a scan for the best known AP after that.
+//
+//*****************************************************************************
+static void WifiConnect(void)
+{
+    wifi_network_t network = { 0 };
+    int index;
+
+    xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+    index = WifiNetworkFind(wifi_cache.ssid, sizeof(wifi_cache.ssid));
+    if ((index >= 0) && !WIFI_NETWORK_FAILED(index))
+    {
+        network = wifi_networks[index];
+    }
+    else
+    {
+        index = -1;
+    }
+    xSemaphoreGive(wifi_networks_lock);
+
+    wifi_fast = wifi_cache_valid && (wifi_attempts == 0) && (index >= 0);
+    wifi_attempts++;
+    ESP_LOGI(TAG, "Connect attempt %u", wifi_attempts);
+    if (wifi_fast)
+    {
+        WifiJoin(&network, wifi_cache.bssid, wifi_cache.channel);
+        return;
+    }
+    WifiScan();
+    if (!wifi_scanning)
+    {
+        WifiRetry();
+    }
+}
+
+//*****************************************************************************
+// WifiRetry
+// Schedules the next connect attempt. The first of an outage is immediate,
+// then the delay doubles from WIFI_BACKOFF_MIN_MS up to WIFI_BACKOFF_MAX_MS,
+// less a random part of up to half.
+//
+//*****************************************************************************
+static void WifiRetry(void)
+{
+    uint32_t delay_ms;
+
+    if (wifi_attempts == 0)
+    {
+        WifiConnect();
+        return;
+    }
+    delay_ms = MIN(WIFI_BACKOFF_MIN_MS << MIN(wifi_attempts - 1, 16), WIFI_BACKOFF_MAX_MS);
+    delay_ms -= esp_random() % (delay_ms / 2 + 1);
+
+    ESP_LOGI(TAG, "Retry in %u ms", delay_ms);
+    esp_timer_stop(wifi_retry_timer);
+    esp_timer_start_once(wifi_retry_timer, delay_ms * 1000ULL);
+}
+
+//*****************************************************************************
+// WifiProvision
+// Hands over to provisioning, which stores the new credentials and takes
+// over the connection.
+//
+//*****************************************************************************
+static void WifiProvision(void)
+{
+    ESP_LOGW(TAG, "Every known network in range rejected the credentials");
+    wifi_provisioning = true;
+    esp_timer_stop(wifi_retry_timer);
+    esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+    wifi_auth_failed();
+}
+
+//*****************************************************************************
+// WifiScanDone
+// Picks the known AP with the best score from the scan, passing over
+// networks that failed authentication. Joins it when not connected, or
+// falls back to provisioning if every known network found has failed. When
+// connected, moves to it if it is another AP and its RSSI beats the current
+// one by WIFI_ROAM_HYSTERESIS_DB.
+//
+//*****************************************************************************
+static void WifiScanDone(void)
+{
+    wifi_ap_record_t *records = NULL;
+    wifi_ap_record_t *best = NULL;
+    wifi_network_t network = { 0 };
+    uint16_t count = 0;
+    uint16_t failed = 0;
+    int best_score = INT32_MIN;
+    int score;
+    int index;
+
+    wifi_scanning = false;
+    esp_wifi_scan_get_ap_num(&count);
+    if (count)
+    {
+        records = malloc(count * sizeof(*records));
+    }
+    if (records == NULL)
+    {
+        count = 0;
+    }
+    // Also frees the scan result held by the driver
+    esp_wifi_scan_get_ap_records(&count, records);
+
+    xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+    for (int i = 0; i < count; i++)
+    {
+        index = WifiNetworkFind(records[i].ssid, sizeof(records[i].ssid));
+        if (index < 0)
+        {
+            continue;
+        }
+        if (WIFI_NETWORK_FAILED(index))
+        {
+            failed++;
+            continue;
+        }
+        score = records[i].rssi + wifi_networks[index].priority * WIFI_PRIORITY_DB;
+        if (score > best_score)
+        {
+            best_score = score;
+            best = &records[i];
+            network = wifi_networks[index];
+        }
+    }
+    xSemaphoreGive(wifi_networks_lock);
+
+    if (!wifi_stats.connected)
+    {
+        if (best)
+        {
+            WifiJoin(&network, best->bssid, best->primary);
+        }
+        else if (failed && wifi_auth_failed)
+        {
+            WifiProvision();
+        }
+        else
+        {
+            ESP_LOGW(TAG, "No known network among %u APs", count);
+            WifiRetry();
+        }
+    }
+    else if (best && memcmp(best->bssid, wifi_ap.bssid, sizeof(wifi_ap.bssid)) &&
+             (best->rssi >= wifi_stats.rssi + WIFI_ROAM_HYSTERESIS_DB))
+    {
+        // The disconnected event joins the new AP
+        ESP_LOGI(TAG, "Roaming to %s " MACSTR " (%d dBm, now %d dBm)", network.ssid,
+                 MAC2STR(best->bssid), best->rssi, wifi_stats.rssi);
+        wifi_roaming = true;
+        wifi_roam_network = network;
+        memcpy(wifi_roam_bssid, best->bssid, sizeof(wifi_roam_bssid));
+        wifi_roam_channel = best->primary;
+        esp_wifi_disconnect();
+    }
+    free(records);
+}
+
+//*****************************************************************************
+// WifiRoamCheck
+// Reads the RSSI of the current AP, and scans for a stronger one after
+// WIFI_ROAM_LOW_CHECKS low readings in a row.
+//
+//*****************************************************************************
+static void WifiRoamCheck(void)
+{
+    wifi_ap_record_t ap;
+
+    if (!wifi_stats.connected || wifi_roaming || (esp_wifi_sta_get_ap_info(&ap) != ESP_OK))
+    {
+        return;
+    }
+    wifi_stats.rssi = ap.rssi;
+    wifi_low_checks = (ap.rssi < CONFIG_WIFI_ROAM_RSSI) ? wifi_low_checks + 1 : 0;
+    if ((wifi_low_checks >= WIFI_ROAM_LOW_CHECKS) && !wifi_scanning)
+    {
+        ESP_LOGI(TAG, "RSSI %d dBm, looking for a stronger AP", ap.rssi);
+        wifi_low_checks = 0;
+        WifiScan();
+    }
+}
+
+static void WifiTimer(void *arg)
+{
+    esp_event_post(GROWVER_WIFI_EVENT, (int32_t)(intptr_t)arg, NULL, 0, 0);
+}
+
+//*****************************************************************************
+// WifiEventHandler
+//
+//*****************************************************************************
+static void WifiEventHandler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if (event_base == GROWVER_WIFI_EVENT)
+    {
+        if (wifi_provisioning)
+        {
+            return;
+        }
+        if (event_id == WIFI_APP_RETRY)
+        {
+            WifiConnect();
+        }
+        else
+        {
+            WifiRoamCheck();
+        }
+    }
+    else if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_START))
+    {
+        wifi_outage_us = esp_timer_get_time();
+        WifiConnect();
+    }
+    else if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_SCAN_DONE))
+    {
+        if (!wifi_provisioning)
+        {
+            WifiScanDone();
+        }
+    }
+    else if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_CONNECTED))
+    {
+        wifi_ap = *(wifi_event_sta_connected_t *)event_data;
+    }
+    else if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_DISCONNECTED))
+    {
+        wifi_event_sta_disconnected_t *disconnected = (wifi_event_sta_disconnected_t *)event_data;
+        int index;
+
+        if (wifi_stats.connected)
+        {
+            // AP dropped or left for a stronger one, a new outage
+            wifi_stats.connected = false;
+            wifi_outage_us = esp_timer_get_time();
+            wifi_attempts = 0;
+            wifi_low_checks = 0;
+            if (wifi_roaming)
+            {
+                wifi_stats.roams++;
+            }
+            else
+            {
+                wifi_stats.drops++;
+            }
+        }
+        if (wifi_provisioning)
+        {
+            return;
+        }
+        if (wifi_roaming)
+        {
+            wifi_roaming = false;
+            wifi_fast = false;
+            wifi_attempts++;
+            WifiJoin(&wifi_roam_network, wifi_roam_bssid, wifi_roam_channel);
+            return;
+        }
+
+        switch (disconnected->reason)
+        {
+        case WIFI_REASON_AUTH_EXPIRE:
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_BEACON_TIMEOUT:
+        case WIFI_REASON_AUTH_FAIL:
+        case WIFI_REASON_ASSOC_FAIL:
+        case WIFI_REASON_HANDSHAKE_TIMEOUT:
+            ESP_LOGW(TAG, "Connect to %s failed: auth error (%d)", wifi_join_ssid, disconnected->reason);
+            // The scan of the next attempt passes over the network once it failed too often
+            xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+            index = WifiNetworkFind((const uint8_t *)wifi_join_ssid, sizeof(wifi_join_ssid));
+            if ((index >= 0) && (wifi_auth_fails[index] < UINT8_MAX))
+            {
+                wifi_auth_fails[index]++;
+            }
+            xSemaphoreGive(wifi_networks_lock);
+            break;
+        case WIFI_REASON_NO_AP_FOUND:
+            ESP_LOGW(TAG, "Connect failed: AP not found");
+            break;
+        default:
+            ESP_LOGW(TAG, "Disconnected (%d)", disconnected->reason);
+            break;
+        }
+        WifiRetry();
+    }
+    else if ((event_base == IP_EVENT) && (event_id == IP_EVENT_STA_GOT_IP))
+    {
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+        int64_t now = esp_timer_get_time();
+
+        // A new lease on the same connection is not a reconnect
+        if (!wifi_stats.connected)
+        {
+            if (wifi_stats.boot_ms == 0)
+            {
+                wifi_stats.boot_ms = now / 1000;
+            }
+            else
+            {
+                wifi_stats.drop_ms = (now - wifi_outage_us) / 1000;
+            }
+            wifi_stats.attempts = wifi_attempts;
+            wifi_stats.fast = wifi_fast;
+            wifi_stats.connected = true;
+            memcpy(wifi_stats.ssid, wifi_ap.ssid, MIN(wifi_ap.ssid_len, sizeof(wifi_stats.ssid) - 1));
+            wifi_stats.ssid[MIN(wifi_ap.ssid_len, sizeof(wifi_stats.ssid) - 1)] = 0;
+            ESP_LOGI(TAG, "IP %u ms after %s, %u attempts%s", (uint32_t)((now - wifi_outage_us) / 1000),
+                     (wifi_stats.drops + wifi_stats.roams) ? "the drop" : "Wi-Fi start", wifi_attempts,
+                     wifi_fast ? ", cached AP" : "");
+            WifiCacheSave(&event->ip_info);
+            WifiRoamCheck();
+        }
+
+        // Keep a network set by provisioning, and take the connection back
+        if (wifi_provisioning)
+        {
+            WifiNetworkKeep();
+            esp_wifi_set_storage(WIFI_STORAGE_RAM);
+            wifi_provisioning = false;
+        }
+        wifi_attempts = 0;
+        xSemaphoreTake(wifi_networks_lock, portMAX_DELAY);
+        memset(wifi_auth_fails, 0, sizeof(wifi_auth_fails));
+        xSemaphoreGive(wifi_networks_lock);
+        esp_timer_stop(wifi_retry_timer);
+    }
+}
+
+//*****************************************************************************
+// WifiStart
+// Starts the station and keeps it connected to the best known network.
+// auth_failed
+// is called instead of retrying when the APs keep rejecting the
+// credentials.
+//
+//*****************************************************************************
+esp_err_t WifiStart(void (*auth_failed)(void))
+{
+    const esp_timer_create_args_t retry_args =
+    {
+        .callback = WifiTimer,
+        .arg = (void *)WIFI_APP_RETRY,
+        .name = "wifi_retry"
+    };
+    const esp_timer_create_args_t roam_args =
+    {
+        .callback = WifiTimer,
+        .arg = (void *)WIFI_APP_ROAM_CHECK,
+        .name = "wifi_roam"
+    };
+    esp_err_t err;
+
+    wifi_auth_failed = auth_failed;
+    wifi_networks_lock = xSemaphoreCreateMutex();
+    WifiCacheLoad();
+
+    // On the first start the provisioned network becomes the first known one
+    if (!WifiNetworksLoad())
+    {
+        WifiNetworkKeep();
+    }
+
+    err = esp_timer_create(&retry_args, &wifi_retry_timer);
+    err = (err == ESP_OK) ? esp_timer_create(&roam_args, &wifi_roam_timer) : err;
+    err = (err == ESP_OK) ? esp_event_handler_register(GROWVER_WIFI_EVENT, ESP_EVENT_ANY_ID, WifiEventHandler, NULL) : err;
+    err = (err == ESP_OK) ? esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, WifiEventHandler, NULL) : err;
+    err = (err == ESP_OK) ? esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, WifiEventHandler, NULL) : err;
+
+    // The AP set for each attempt is not written to flash
+    err = (err == ESP_OK) ? esp_wifi_set_storage(WIFI_STORAGE_RAM) : err;
+    err = (err == ESP_OK) ? esp_wifi_set_mode(WIFI_MODE_STA) : err;
+    err = (err == ESP_OK) ? esp_wifi_start() : err;
+    err = (err == ESP_OK) ? esp_timer_start_periodic(wifi_roam_timer, WIFI_ROAM_CHECK_MS * 1000ULL) : err;
+    return err;
+}
+
+//*****************************************************************************
+// WifiStats
+//
+//*****************************************************************************
+void WifiStats(wifi_stats_t *stats)
+{
+    *stats = wifi_stats;
+}
+
+// end of growver_wifi.c
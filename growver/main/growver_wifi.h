@@ -0,0 +1,68 @@
+//******************************************************************************
+//
+// growver_wifi.h
+//
+//******************************************************************************
+
+// The AP of the last connection, for the fast reconnect
+#define WIFI_CACHE_NVS_NAMESPACE    "wifi_cache"
+
+// Known networks. A network found in a scan scores its RSSI plus
+// WIFI_PRIORITY_DB per priority level, and the highest score is joined.
+#define WIFI_NETWORKS_NVS_NAMESPACE "wifi_nets"
+#define WIFI_NETWORKS_MAX           8
+#define WIFI_PRIORITY_DB            10
+
+// While connected the RSSI is checked every WIFI_ROAM_CHECK_MS. After
+// WIFI_ROAM_LOW_CHECKS checks below CONFIG_WIFI_ROAM_RSSI a scan looks for
+// an AP at least WIFI_ROAM_HYSTERESIS_DB stronger, and the module moves to
+// it. A scan while connected dwells WIFI_ROAM_SCAN_MS per channel.
+#define WIFI_ROAM_CHECK_MS          5000
+#define WIFI_ROAM_LOW_CHECKS        2
+#define WIFI_ROAM_HYSTERESIS_DB     8
+#define WIFI_ROAM_SCAN_MS           40
+
+// Delay before the second connect attempt of an outage, doubled on each
+// further attempt up to the maximum. The first attempt is immediate.
+#define WIFI_BACKOFF_MIN_MS         250
+#define WIFI_BACKOFF_MAX_MS         30000
+
+typedef struct
+{
+    char ssid[33];
+    char password[65];
+    uint8_t priority;
+} wifi_network_t;
+
+typedef struct
+{
+    uint8_t ssid[32];
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t reserved;
+    uint32_t ip;                // DHCP lease, network byte order
+    uint32_t netmask;
+    uint32_t gw;
+} wifi_cache_t;
+
+// Connection and time to IP, for the status
+typedef struct
+{
+    bool connected;
+    uint32_t boot_ms;           // Boot to the first IP
+    uint32_t drop_ms;           // Last AP drop or roam to IP
+    uint32_t drops;             // Drops since boot
+    uint32_t roams;             // Moves to a stronger AP since boot
+    uint32_t attempts;          // Connect attempts for the last IP
+    bool fast;                  // Last IP came through the cached AP
+    int8_t rssi;                // Of the current AP, at the last check
+    char ssid[33];              // Current network
+} wifi_stats_t;
+
+esp_err_t WifiStart(void (*auth_failed)(void));
+void WifiStats(wifi_stats_t *stats);
+esp_err_t WifiNetworkAdd(const char *ssid, const char *password, uint8_t priority);
+esp_err_t WifiNetworkRemove(const char *ssid);
+bool WifiNetworkGet(int index, char *ssid, uint8_t *priority);
+
+// end of growver_wifi.h
@@ -31,15 +31,22 @@
 #include "esp_vfs.h"
 #include <esp_http_server.h>
 #include "ota-http.h"
-#include "WebFiles/webpageassets.h"
 #include "../components/prov/app_prov.h"
 #include "file_server.h"
+#include "cJSON.h"
+#include "storage.h"
+#include "file_index.h"
 #include "growver_rest.h"
+#include "script.h"
+#include "esp_partition.h"
+#include "storage_ota.h"
+#include "static_assets.h"
+#include "buf_pool.h"
+#include "growver_wifi.h"
 
 
 #define EXAMPLE_WIFI_SSID CONFIG_WIFI_SSID
 #define EXAMPLE_WIFI_PASS CONFIG_WIFI_PASSWORD
-#define EXAMPLE_AP_RECONN_ATTEMPTS  CONFIG_EXAMPLE_AP_RECONN_ATTEMPTS
 
 #define CONFIG_EXAMPLE_POP "abcd1234"
 
@@ -60,22 +67,15 @@ static const char *TAG="APP";
 // Delay macro
 #define delay_ms(ms) vTaskDelay((ms) / portTICK_RATE_MS)
 
+// Web servers, started once the first IP is obtained and kept across reconnects
+static httpd_handle_t server = NULL;
+static httpd_handle_t bulk_server = NULL;
+static uint32_t server_ip;
+
 // Metadata on when this code module was built
 const char *main_time = __TIME__;
 const char *main_date = __DATE__;
 
-//************************************************************************************************
-// Serve root web page handler
-//
-//************************************************************************************************
-esp_err_t root_get_handler(httpd_req_t *req)
-{
-    //ESP_LOGI(TAG, "Root URI");
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, (const char *)index_html_start, index_html_end - index_html_start);
-    return ESP_OK;
-}
-
 //************************************************************************************************
 // Serve ota page
 //
@@ -86,58 +86,114 @@ esp_err_t OTA_index_html_handler(httpd_req_t *req)
 	flash_status = 0;
 
     // Response with ota page
-	httpd_resp_set_type(req, "text/html");
-	httpd_resp_send(req, (const char *)ota_page_html_start, ota_page_html_end - ota_page_html_start);
-	return ESP_OK;
+	return StaticAssetSend(req, "/ota-page.html");
 }
 
 //************************************************************************************************
-// Serve Favicon
+// Redirect a transfer URI from the control server to the transfer server
 //
 //************************************************************************************************
-esp_err_t OTA_favicon_ico_handler(httpd_req_t *req)
+static esp_err_t bulk_redirect_handler(httpd_req_t *req)
 {
-	ESP_LOGI("OTA", "favicon_ico Requested");
-	httpd_resp_set_type(req, "image/x-icon");
-    httpd_resp_send(req, (const char *)favicon_ico_start, favicon_ico_end - favicon_ico_start);
-	return ESP_OK;
+    char host[64];
+    char *location;
+    char *port;
+
+    // Same host as the request, on the transfer port
+    if (httpd_req_get_hdr_value_str(req, "Host", host, sizeof(host)) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing Host header");
+        return ESP_FAIL;
+    }
+    port = strchr(host, ':');
+    if (port)
+    {
+        *port = 0;
+    }
+    location = malloc(strlen(host) + strlen(req->uri) + sizeof("http://:65535"));
+    if (location == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    sprintf(location, "http://%s:%d%s", host, CONFIG_HTTP_BULK_PORT, req->uri);
+
+    httpd_resp_set_status(req, "307 Temporary Redirect");
+    httpd_resp_set_hdr(req, "Location", location);
+    httpd_resp_send(req, NULL, 0);
+    free(location);
+
+    // Close instead of draining an upload body on the control task
+    return (req->content_len > 0) ? ESP_FAIL : ESP_OK;
 }
 
 //************************************************************************************************
 // Start Web server
+// Control requests (REST, pages, OTA status) and transfers (files, firmware and storage images)
+// are served by two httpd instances, each with its own task. The control task has the higher
+// priority and keeps answering motor commands while the transfer task is busy.
+// Does nothing if the servers are running. The contexts and the reboot task are created on the
+// first call and kept, so stopping and starting again does not allocate more.
 //
 //************************************************************************************************
 static httpd_handle_t start_webserver(const char *base_path)
 {
-    httpd_handle_t server = NULL;
-    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-
-    // Increase URI handlers from default
-    config.max_uri_handlers = 10;
-
     static struct file_server_data *server_data = NULL;
+    static rest_server_context_t *rest_context = NULL;
+    static TaskHandle_t reboot_task = NULL;
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    httpd_config_t bulk_config = HTTPD_DEFAULT_CONFIG();
+
+    // Control server, above the transfer task and the flash writer
+    config.max_uri_handlers = 11;
+    config.task_priority = tskIDLE_PRIORITY + 7;
+    config.max_open_sockets = 6;
+    config.lru_purge_enable = true;
+
+    // Transfer server, below the flash writer so a received buffer is committed promptly
+    bulk_config.server_port = CONFIG_HTTP_BULK_PORT;
+    bulk_config.ctrl_port = config.ctrl_port + 1;
+    bulk_config.max_uri_handlers = 9;
+    bulk_config.task_priority = tskIDLE_PRIORITY + 4;
+    bulk_config.max_open_sockets = 4;
+    bulk_config.lru_purge_enable = true;
+
+    if ((server != NULL) && (bulk_server != NULL))
+    {
+        return server;
+    }
 
     // Task for rebooting after firmware update
-	xTaskCreate(&systemRebootTask, "rebootTask", 2048, NULL, 5, NULL);
-
-    // Allocate memory for server data
-    server_data = calloc(1, sizeof(struct file_server_data));
-    if (!server_data)
+    if (reboot_task == NULL)
     {
-        ESP_LOGE(TAG, "Failed to allocate memory for server data");
-        return NULL;
+        xTaskCreate(&systemRebootTask, "rebootTask", 2048, NULL, 5, &reboot_task);
     }
-    strlcpy(server_data->base_path, base_path,
-            sizeof(server_data->base_path));
 
-    // Allocate memory for REST context
-    rest_server_context_t *rest_context = calloc(1, sizeof(rest_server_context_t));
+    // Allocate memory for server data and the REST context
+    if (server_data == NULL)
+    {
+        server_data = calloc(1, sizeof(struct file_server_data));
+        rest_context = calloc(1, sizeof(rest_server_context_t));
+        if (!server_data || !rest_context)
+        {
+            ESP_LOGE(TAG, "Failed to allocate memory for server data");
+            free(server_data);
+            free(rest_context);
+            server_data = NULL;
+            rest_context = NULL;
+            return NULL;
+        }
+        strlcpy(server_data->base_path, base_path,
+                sizeof(server_data->base_path));
+    }
 
-    static const httpd_uri_t root =
+    // Pages, scripts and styles from the asset pack, see static_assets.c.
+    // Registered last so every other GET handler matches first.
+    static const httpd_uri_t assets =
     {
-        .uri = "/",
+        .uri = "/*",
         .method = HTTP_GET,
-        .handler = root_get_handler,
+        .handler = StaticAssetGetHandler,
         .user_ctx = NULL
     };
 
@@ -159,14 +215,6 @@ static httpd_handle_t start_webserver(const char *base_path)
         .user_ctx = rest_context
     };
 
-    static const httpd_uri_t OTA_favicon_ico =
-    {
-        .uri = "/favicon.ico",
-        .method = HTTP_GET,
-        .handler = OTA_favicon_ico_handler,
-        .user_ctx = NULL
-    };
-
     static const httpd_uri_t OTA_index =
     {
         .uri = "/ota-page*",
@@ -191,6 +239,23 @@ static httpd_handle_t start_webserver(const char *base_path)
         .user_ctx = NULL
     };
 
+    // Resumable OTA session API
+    static const httpd_uri_t OTA_session_post =
+    {
+        .uri = "/ota/*",
+        .method = HTTP_POST,
+        .handler = OTA_session_post_handler,
+        .user_ctx = NULL
+    };
+
+    static const httpd_uri_t OTA_session_get =
+    {
+        .uri = "/ota/session",
+        .method = HTTP_GET,
+        .handler = OTA_session_get_handler,
+        .user_ctx = NULL
+    };
+
     // URI handler for getting uploaded files
     // Match all URIs of type /path/to/file (was "/*")
     httpd_uri_t file_download =
@@ -221,30 +286,102 @@ static httpd_handle_t start_webserver(const char *base_path)
         .user_ctx  = server_data
     };
 
+    // Transfer URIs on the control server, redirected to the transfer server
+    static const httpd_uri_t redirect_fs =
+    {
+        .uri = "/fs/*",
+        .method = HTTP_GET,
+        .handler = bulk_redirect_handler,
+        .user_ctx = NULL
+    };
+
+    static const httpd_uri_t redirect_ota_page =
+    {
+        .uri = "/ota-page*",
+        .method = HTTP_GET,
+        .handler = bulk_redirect_handler,
+        .user_ctx = NULL
+    };
+
+    static const httpd_uri_t redirect_update =
+    {
+        .uri = "/update",
+        .method = HTTP_POST,
+        .handler = bulk_redirect_handler,
+        .user_ctx = NULL
+    };
+
+    static const httpd_uri_t redirect_ota =
+    {
+        .uri = "/ota/*",
+        .method = HTTP_POST,
+        .handler = bulk_redirect_handler,
+        .user_ctx = NULL
+    };
+
+    static const httpd_uri_t redirect_upload =
+    {
+        .uri = "/upload/*",
+        .method = HTTP_POST,
+        .handler = bulk_redirect_handler,
+        .user_ctx = NULL
+    };
+
+    static const httpd_uri_t redirect_delete =
+    {
+        .uri = "/delete/*",
+        .method = HTTP_POST,
+        .handler = bulk_redirect_handler,
+        .user_ctx = NULL
+    };
+
     // Enable wildcard URIs
     config.uri_match_fn = httpd_uri_match_wildcard;
+    bulk_config.uri_match_fn = httpd_uri_match_wildcard;
+
+    // Start the transfer server first, so the control server only redirects to a running one
+    ESP_LOGI(TAG, "Starting transfer server on port: '%d'", bulk_config.server_port);
+    if ((bulk_server == NULL) && (httpd_start(&bulk_server, &bulk_config) == ESP_OK))
+    {
+        httpd_register_uri_handler(bulk_server, &OTA_index);
+        httpd_register_uri_handler(bulk_server, &OTA_update);
+        httpd_register_uri_handler(bulk_server, &OTA_status);
+        httpd_register_uri_handler(bulk_server, &OTA_session_post);
+        httpd_register_uri_handler(bulk_server, &OTA_session_get);
+        httpd_register_uri_handler(bulk_server, &file_download);
+        httpd_register_uri_handler(bulk_server, &file_upload);
+        httpd_register_uri_handler(bulk_server, &file_delete);
+        httpd_register_uri_handler(bulk_server, &assets);
+    }
+    else if (bulk_server == NULL)
+    {
+        ESP_LOGE(TAG, "Error starting transfer server!");
+    }
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
-    if (httpd_start(&server, &config) == ESP_OK)
+    if ((server == NULL) && (httpd_start(&server, &config) == ESP_OK))
     {
         // Set URI handlers
         ESP_LOGI(TAG, "Registering URI handlers");
-        httpd_register_uri_handler(server, &root);
         httpd_register_uri_handler(server, &rest_get_uri);
         httpd_register_uri_handler(server, &rest_post_uri);
-        httpd_register_uri_handler(server, &OTA_index);
-        httpd_register_uri_handler(server, &OTA_update);
 		httpd_register_uri_handler(server, &OTA_status);
-        httpd_register_uri_handler(server, &OTA_favicon_ico);
-        httpd_register_uri_handler(server, &file_download);
-        httpd_register_uri_handler(server, &file_upload);
-        httpd_register_uri_handler(server, &file_delete);
-        return server;
+        httpd_register_uri_handler(server, &OTA_session_get);
+        httpd_register_uri_handler(server, &redirect_fs);
+        httpd_register_uri_handler(server, &redirect_ota_page);
+        httpd_register_uri_handler(server, &redirect_update);
+        httpd_register_uri_handler(server, &redirect_ota);
+        httpd_register_uri_handler(server, &redirect_upload);
+        httpd_register_uri_handler(server, &redirect_delete);
+        httpd_register_uri_handler(server, &assets);
     }
-
-    ESP_LOGI(TAG, "Error starting server!");
-    return NULL;
+    else if (server == NULL)
+    {
+        ESP_LOGE(TAG, "Error starting server!");
+    }
+    ESP_LOGI(TAG, "Free heap after server start: %u", esp_get_free_heap_size());
+    return server;
 }
 
 //************************************************************************************************
@@ -276,12 +413,23 @@ static void StartBLEProvisioning()
 
 //************************************************************************************************
 // Stop Webserver
+// Stops both servers, closing their sockets and client connections. The contexts are kept for
+// the next start_webserver.
 //
 //************************************************************************************************
-void stop_webserver(httpd_handle_t server)
+static void stop_webserver(void)
 {
-    // Stop the httpd server
-    httpd_stop(server);
+    // Stop the httpd servers
+    if (server != NULL)
+    {
+        httpd_stop(server);
+        server = NULL;
+    }
+    if (bulk_server != NULL)
+    {
+        httpd_stop(bulk_server);
+        bulk_server = NULL;
+    }
 }
 
 //************************************************************************************************
@@ -292,125 +440,65 @@ void stop_webserver(httpd_handle_t server)
 static void event_handler(void* arg, esp_event_base_t event_base,
                           int event_id, void* event_data)
 {
-    httpd_handle_t server = NULL;
-    static int s_retry_num_ap_not_found = 0;
-    static int s_retry_num_ap_auth_fail = 0;
-
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
-    {
-        esp_wifi_connect();
-    }
-    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
-    {
-        wifi_event_sta_disconnected_t* disconnected = (wifi_event_sta_disconnected_t*) event_data;
-        switch (disconnected->reason) {
-        case WIFI_REASON_AUTH_EXPIRE:
-        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
-        case WIFI_REASON_BEACON_TIMEOUT:
-        case WIFI_REASON_AUTH_FAIL:
-        case WIFI_REASON_ASSOC_FAIL:
-        case WIFI_REASON_HANDSHAKE_TIMEOUT:
-            ESP_LOGW(TAG, "connect to the AP fail : auth Error");
-            if (s_retry_num_ap_auth_fail < EXAMPLE_AP_RECONN_ATTEMPTS)
-            {
-                s_retry_num_ap_auth_fail++;
-                esp_wifi_connect();
-                ESP_LOGI(TAG, "retry connecting to the AP...");
-            } else
-            {
-                // Restart provisioning if authentication fails
-                StartBLEProvisioning();
-            }
-            break;
-        case WIFI_REASON_NO_AP_FOUND:
-            ESP_LOGW(TAG, "connect to the AP fail : not found");
-            if (s_retry_num_ap_not_found < EXAMPLE_AP_RECONN_ATTEMPTS)
-            {
-                s_retry_num_ap_not_found++;
-                esp_wifi_connect();
-                ESP_LOGI(TAG, "retry to connecting to the AP...");
-            }
-            break;
-        default:
-            // None of the expected reasons
-            esp_wifi_connect();
-            break;
-        }
-    }
-    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    // Connecting and reconnecting is done by growver_wifi.c
+    if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:%s",
                  ip4addr_ntoa(&event->ip_info.ip));
-        s_retry_num_ap_not_found = 0;
-        s_retry_num_ap_auth_fail = 0;
-        // Start Webserver
-        if (server == NULL)
+
+        // The servers keep listening across reconnects. On a new address they are restarted,
+        // which drops the connections made to the old one instead of leaving them to time out.
+        if (((server != NULL) || (bulk_server != NULL)) && (event->ip_info.ip.addr != server_ip))
         {
-            // TODO: Is this base path correct?
-            server = start_webserver("/spiffs");
+            ESP_LOGI(TAG, "IP changed, restarting web servers");
+            stop_webserver();
         }
+        server_ip = event->ip_info.ip.addr;
+        start_webserver(STORAGE_BASE_PATH);
     }
 }
 
 //************************************************************************************************
-// Initialise SPIFFS
+// Initialise Wifi
 //
 //************************************************************************************************
-static esp_err_t init_spiffs(void)
+static void wifi_init_sta()
 {
-    // .max_files sets the maximum number of files that can be created on the storage
-    esp_vfs_spiffs_conf_t conf =
-    {
-      .base_path = "/spiffs",
-      .partition_label = NULL,
-      .max_files = 5,
-      .format_if_mount_failed = true
-    };
-
-    esp_err_t ret = esp_vfs_spiffs_register(&conf);
-    if (ret != ESP_OK)
-    {
-        if (ret == ESP_FAIL)
-        {
-            ESP_LOGE(TAG, "Failed to mount or format filesystem");
-        }
-        else if (ret == ESP_ERR_NOT_FOUND)
-        {
-            ESP_LOGE(TAG, "Failed to find SPIFFS partition");
-        }
-        else
-        {
-            ESP_LOGE(TAG, "Failed to initialize SPIFFS (%s)", esp_err_to_name(ret));
-        }
-        return ESP_FAIL;
-    }
+    // Set network event handling
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, event_handler, NULL));
 
-    size_t total = 0, used = 0;
-    ret = esp_spiffs_info(NULL, &total, &used);
-    if (ret != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
-        return ESP_FAIL;
-    }
+    // Start Wi-Fi in station mode with credentials set during provisioning, back to
+    // provisioning if they are rejected
+    ESP_ERROR_CHECK(WifiStart(StartBLEProvisioning));
+}
 
-    ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
-    return ESP_OK;
+//************************************************************************************************
+// Safety input trip. Called from the GPIO ISR.
+//
+//************************************************************************************************
+static void IRAM_ATTR SafetyInputTrip(uint8_t pin)
+{
+    MotorDCFaultTrip(MOTOR_FAULT_AUX(pin));
 }
 
 //************************************************************************************************
-// Initialise Wifi
+// Safety inputs still at their active level, which keep the motor fault from being cleared.
 //
 //************************************************************************************************
-static void wifi_init_sta()
+static uint32_t SafetyInputsActive(void)
 {
-    // Set network event handling
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, event_handler, NULL));
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, event_handler, NULL));
+    uint8_t active = GpioSafetyActive();
+    uint32_t fault = 0;
 
-    // Start Wi-Fi in station mode with credentials set during provisioning
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    for (uint8_t pin = 0; pin < AUX_IO_PINS; pin++)
+    {
+        if (active & (1 << pin))
+        {
+            fault |= MOTOR_FAULT_AUX(pin);
+        }
+    }
+    return fault;
 }
 
 //************************************************************************************************
@@ -427,6 +515,9 @@ void app_main()
     // Motors ready and stopped
     MotorDCInit();
 
+    // Free idle web server buffers
+    BufPoolInit();
+
     // Initialise NVS flash storage for Wifi credentials etc.
     ESP_ERROR_CHECK(nvs_flash_init());
 
@@ -461,13 +552,26 @@ void app_main()
         wifi_init_sta(NULL);
     }
 
-    // Initialize file storage
-    ESP_ERROR_CHECK(init_spiffs());
+    // Initialize file storage, after applying a storage image update if one is pending
+    StorageOtaApply();
+    ESP_ERROR_CHECK(StorageInit());
+    FileIndexInit(STORAGE_BASE_PATH);
 
     // Initialize other controller functions
     ServoInit();
+    GpioInit();
+    GpioSafetyHandlerSet(SafetyInputTrip);
+    MotorDCFaultCheckSet(SafetyInputsActive);
+    for (uint8_t pin = 0; pin < AUX_IO_PINS; pin++)
+    {
+        if (CONFIG_SAFETY_AUX_MASK & (1 << pin))
+        {
+            GpioSafetyEnable(pin, CONFIG_SAFETY_ACTIVE_LEVEL);
+        }
+    }
     AnalogMeasInit();
     PumpInit();
+    ScriptInit();
     ws2812_init(WS2812_PIN);
 
     // Main periodic loop
@@ -475,8 +579,13 @@ void app_main()
     int blink_timer = 0;
     while(1)
     {
+        // Solid RED while a motor fault is latched
+        if (MotorDCFaultGet(NULL))
+        {
+            ws2812_setColors(1, (rgbVal*)&ws2812_RED);
+        }
         // Change LED color to BLUE if either motor is running
-        if (MotorDCGetSpeed(0) || MotorDCGetSpeed(1))
+        else if (MotorDCGetSpeed(0) || MotorDCGetSpeed(1))
         {
             if (!led_on)
                 ws2812_setColors(1, (rgbVal*)&ws2812_GRN);
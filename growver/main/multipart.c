@@ -0,0 +1,290 @@
+//*****************************************************************************
+//
+// multipart.c - Incremental multipart/form-data parser.
+//
+// Body data is fed in pieces of any size as it arrives from the socket and
+// each part's content is passed to on_data, with the part headers and the
+// boundary lines removed. A delimiter split across two pieces is held back
+// until it either completes or turns out to be content.
+//
+// The delimiter is CRLF "--" boundary. Its only CR is the first byte, so on
+// a mismatch no suffix of the bytes matched so far can start a new match:
+// they are content, and matching restarts at the current byte.
+//
+// This module has no ESP-IDF dependencies.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include "multipart.h"
+
+// Parser states
+#define MP_PREAMBLE     0       // Before the first boundary, discarded
+#define MP_BODY         1       // Part content
+#define MP_AFTER_DELIM  2       // "--" (last) or CRLF, after optional padding
+#define MP_DASH         3       // Second '-' of the close delimiter
+#define MP_LF           4       // LF ending the boundary line
+#define MP_HEADERS      5
+#define MP_EPILOGUE     6       // After the close delimiter, discarded
+#define MP_ERROR        7
+
+//*****************************************************************************
+// MultipartInit
+// Takes the boundary from the request Content-Type. Returns MULTIPART_OK or
+// MULTIPART_BAD_BOUNDARY.
+//
+//*****************************************************************************
+int MultipartInit(multipart_t *mp, const char *content_type, const multipart_callbacks_t *cb, void *ctx)
+{
+    const char *boundary;
+    size_t len;
+
+    memset(mp, 0, sizeof(*mp));
+    mp->cb = cb;
+    mp->ctx = ctx;
+    mp->state = MP_ERROR;
+
+    boundary = content_type ? strstr(content_type, "boundary=") : NULL;
+    if (boundary == NULL)
+    {
+        return MULTIPART_BAD_BOUNDARY;
+    }
+    boundary += strlen("boundary=");
+    if (*boundary == '"')
+    {
+        boundary++;
+        len = strcspn(boundary, "\"");
+    }
+    else
+    {
+        len = strcspn(boundary, "; \t");
+    }
+    if (len == 0 || len > MULTIPART_BOUNDARY_MAX)
+    {
+        return MULTIPART_BAD_BOUNDARY;
+    }
+
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(&mp->delim[4], boundary, len);
+    mp->delim_len = len + 4;
+
+    // The first boundary need not follow a CRLF
+    mp->state = MP_PREAMBLE;
+    mp->match = 2;
+    return MULTIPART_OK;
+}
+
+//*****************************************************************************
+// MultipartQuoted
+// Copies the value of key="value" from a header line, truncated to the
+// size of out.
+//
+//*****************************************************************************
+static void MultipartQuoted(const char *line, const char *key, char *out, size_t size)
+{
+    const char *p = line;
+    size_t key_len = strlen(key);
+    size_t len;
+
+    // Match key only at the start of a parameter (filename= contains name=)
+    while ((p = strstr(p, key)) != NULL)
+    {
+        if ((p == line || p[-1] == ' ' || p[-1] == ';' || p[-1] == '\t') && p[key_len] == '"')
+        {
+            p += key_len + 1;
+            len = strcspn(p, "\"");
+            len = (len < size - 1) ? len : size - 1;
+            memcpy(out, p, len);
+            out[len] = 0;
+            return;
+        }
+        p += key_len;
+    }
+}
+
+//*****************************************************************************
+// MultipartHeaderLine
+// Handles one complete part header line. An empty line ends the headers.
+//
+//*****************************************************************************
+static int MultipartHeaderLine(multipart_t *mp)
+{
+    mp->line[mp->line_len] = 0;
+
+    if (mp->line_len == 0)
+    {
+        mp->state = MP_BODY;
+        mp->in_part = true;
+        return (mp->cb && mp->cb->on_part) ? mp->cb->on_part(mp->ctx, &mp->part) : MULTIPART_OK;
+    }
+    if (!strncasecmp(mp->line, "Content-Disposition:", 20))
+    {
+        MultipartQuoted(mp->line, "name=", mp->part.name, sizeof(mp->part.name));
+        MultipartQuoted(mp->line, "filename=", mp->part.filename, sizeof(mp->part.filename));
+    }
+    mp->line_len = 0;
+    return MULTIPART_OK;
+}
+
+//*****************************************************************************
+// MultipartContent
+// Passes content to on_data, or drops it outside a part.
+//
+//*****************************************************************************
+static int MultipartContent(multipart_t *mp, const uint8_t *data, size_t len)
+{
+    if (len && mp->state == MP_BODY && mp->cb && mp->cb->on_data)
+    {
+        return mp->cb->on_data(mp->ctx, data, len);
+    }
+    return MULTIPART_OK;
+}
+
+//*****************************************************************************
+// MultipartFeed
+// Feeds the next len bytes of the request body. Returns MULTIPART_OK, a
+// MULTIPART_xxx error or the first callback error. After an error all
+// further input is rejected.
+//
+//*****************************************************************************
+int MultipartFeed(multipart_t *mp, const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + len;
+    const uint8_t *cr;
+    int result = MULTIPART_OK;
+    uint8_t c;
+
+    while (data < end && result == MULTIPART_OK)
+    {
+        switch (mp->state)
+        {
+        case MP_PREAMBLE:
+        case MP_BODY:
+            if (mp->match == 0)
+            {
+                // Fast path: everything up to the next CR is content
+                cr = memchr(data, '\r', end - data);
+                result = MultipartContent(mp, data, (cr ? cr : end) - data);
+                if (cr == NULL)
+                {
+                    data = end;
+                    break;
+                }
+                data = cr + 1;
+                mp->match = 1;
+                break;
+            }
+
+            if (*data == (uint8_t)mp->delim[mp->match])
+            {
+                data++;
+                if (++mp->match == mp->delim_len)
+                {
+                    mp->match = 0;
+                    if (mp->in_part)
+                    {
+                        mp->in_part = false;
+                        if (mp->cb && mp->cb->on_part_end)
+                        {
+                            result = mp->cb->on_part_end(mp->ctx);
+                        }
+                    }
+                    mp->state = MP_AFTER_DELIM;
+                }
+                break;
+            }
+
+            // Not a delimiter after all. The held bytes were content; the
+            // current byte is looked at again with no match.
+            result = MultipartContent(mp, (const uint8_t *)mp->delim, mp->match);
+            mp->match = 0;
+            break;
+
+        case MP_AFTER_DELIM:
+            c = *data++;
+            if (c == '-')
+            {
+                mp->state = MP_DASH;
+            }
+            else if (c == '\r')
+            {
+                mp->state = MP_LF;
+            }
+            else if (c != ' ' && c != '\t')
+            {
+                result = MULTIPART_BAD_FORMAT;
+            }
+            break;
+
+        case MP_DASH:
+            mp->state = (*data++ == '-') ? MP_EPILOGUE : MP_ERROR;
+            result = (mp->state == MP_ERROR) ? MULTIPART_BAD_FORMAT : MULTIPART_OK;
+            break;
+
+        case MP_LF:
+            if (*data++ != '\n')
+            {
+                result = MULTIPART_BAD_FORMAT;
+                break;
+            }
+            memset(&mp->part, 0, sizeof(mp->part));
+            mp->line_len = 0;
+            mp->header_bytes = 0;
+            mp->state = MP_HEADERS;
+            break;
+
+        case MP_HEADERS:
+            c = *data++;
+            if (++mp->header_bytes > MULTIPART_HEADERS_MAX)
+            {
+                result = MULTIPART_HEADERS_LONG;
+            }
+            else if (c == '\n')
+            {
+                // Lines end in CRLF; tolerate a bare LF
+                if (mp->line_len && mp->line[mp->line_len - 1] == '\r')
+                {
+                    mp->line_len--;
+                }
+                result = MultipartHeaderLine(mp);
+            }
+            else if (mp->line_len < MULTIPART_LINE_MAX)
+            {
+                mp->line[mp->line_len++] = c;
+            }
+            break;
+
+        case MP_EPILOGUE:
+            data = end;
+            break;
+
+        default:
+            return MULTIPART_BAD_FORMAT;
+        }
+    }
+
+    if (result != MULTIPART_OK)
+    {
+        mp->state = MP_ERROR;
+    }
+    return result;
+}
+
+//*****************************************************************************
+// MultipartDone
+// True once the close delimiter has been seen.
+//
+//*****************************************************************************
+bool MultipartDone(const multipart_t *mp)
+{
+    return mp->state == MP_EPILOGUE;
+}
+
+// end of multipart.c
@@ -0,0 +1,58 @@
+//******************************************************************************
+//
+// multipart.h
+//
+//******************************************************************************
+
+// RFC 2046 limits the boundary to 70 characters
+#define MULTIPART_BOUNDARY_MAX  70
+
+// Longest part header line kept for parsing; longer lines are skipped
+#define MULTIPART_LINE_MAX      200
+
+// Longest name and filename reported to on_part
+#define MULTIPART_NAME_MAX      64
+
+// Most part header bytes accepted before the body
+#define MULTIPART_HEADERS_MAX   2048
+
+// MultipartFeed results. Callback errors are passed through unchanged.
+#define MULTIPART_OK            0
+#define MULTIPART_BAD_BOUNDARY  -1      // No usable boundary in Content-Type
+#define MULTIPART_BAD_FORMAT    -2      // Unexpected bytes after a boundary
+#define MULTIPART_HEADERS_LONG  -3
+
+typedef struct
+{
+    char name[MULTIPART_NAME_MAX + 1];
+    char filename[MULTIPART_NAME_MAX + 1];
+} multipart_part_t;
+
+// Callbacks return 0, or an error that stops parsing. Any may be NULL.
+typedef struct
+{
+    int (*on_part)(void *ctx, const multipart_part_t *part);
+    int (*on_data)(void *ctx, const uint8_t *data, size_t len);
+    int (*on_part_end)(void *ctx);
+} multipart_callbacks_t;
+
+typedef struct
+{
+    char delim[MULTIPART_BOUNDARY_MAX + 5];    // CRLF "--" boundary
+    size_t delim_len;
+    size_t match;
+    uint8_t state;
+    bool in_part;
+    char line[MULTIPART_LINE_MAX + 1];
+    size_t line_len;
+    size_t header_bytes;
+    multipart_part_t part;
+    const multipart_callbacks_t *cb;
+    void *ctx;
+} multipart_t;
+
+int MultipartInit(multipart_t *mp, const char *content_type, const multipart_callbacks_t *cb, void *ctx);
+int MultipartFeed(multipart_t *mp, const uint8_t *data, size_t len);
+bool MultipartDone(const multipart_t *mp);
+
+// end of multipart.h
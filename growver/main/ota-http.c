@@ -6,12 +6,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
 #include <esp_log.h>
 #include <sys/param.h>
 #include "esp_ota_ops.h"
 #include "esp_http_server.h"
+#include "esp_image_format.h"
 #include "freertos/event_groups.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
+#include "cJSON.h"
+#include "esp_timer.h"
+#include "esp32/rom/miniz.h"
+#include "write_pipe.h"
+#include "ota_delta.h"
+#include "multipart.h"
+#include "storage_ota.h"
+#include "resp_writer.h"
+#include "ota-http.h"
 
 int8_t flash_status = 0;
 
@@ -20,6 +34,29 @@ const int REBOOT_BIT = BIT0;
 
 extern const char *main_time, *main_date;
 
+// Resumable OTA session. offset is the committed length: every byte below it
+// has been written and verified by its chunk hash, and sha covers exactly
+// those bytes.
+typedef struct
+{
+	bool active;
+	const esp_partition_t *partition;
+	uint32_t size;
+	uint32_t offset;
+	uint8_t sha256[32];
+	mbedtls_sha256_context sha;
+} ota_session_t;
+
+static ota_session_t ota_session;
+
+// Where OtaPartitionWrite writes next
+typedef struct
+{
+	const esp_partition_t *partition;
+	uint32_t offset;
+} ota_partition_target_t;
+static char ota_chunk_buff[OTA_RECV_BUF_SIZE];
+
 
 /*****************************************************
 
@@ -55,17 +92,21 @@ void systemRebootTask(void * parameter)
 	}
 }
 
+/* Progress of the last upload, see OtaProgressGet */
+static ota_progress_t ota_progress;
+
 /* Status */
 esp_err_t OTA_update_status_handler(httpd_req_t *req)
 {
-	char ledJSON[100];
+	resp_writer_t w;
 
 	ESP_LOGI("OTA", "Status Requested");
 
-	sprintf(ledJSON, "{\"status\":%d,\"compile_time\":\"%s\",\"compile_date\":\"%s\"}", flash_status, main_time, main_date);
-
 	httpd_resp_set_type(req, "application/json");
-	httpd_resp_send(req, ledJSON, strlen(ledJSON));
+	RespWriterInit(&w, req);
+	RespWriterPrintf(&w, "{\"status\":%d,\"compile_time\":\"%s\",\"compile_date\":\"%s\",\"received\":%u,\"written\":%u,\"kbps\":%u}",
+			flash_status, main_time, main_date, ota_progress.received, ota_progress.written, ota_progress.kbps);
+	RespWriterFinish(&w);
 
 	if (flash_status == 1)
 	{
@@ -76,25 +117,226 @@ esp_err_t OTA_update_status_handler(httpd_req_t *req)
 
 	return ESP_OK;
 }
-/* Receive .Bin file */
-esp_err_t OTA_update_post_handler(httpd_req_t *req)
+/* write_pipe_fn_t for the /update handler */
+static esp_err_t OtaPipeWrite(void *ctx, const void *data, size_t len)
+{
+	esp_err_t err = esp_ota_write(*(esp_ota_handle_t *)ctx, data, len);
+
+	ota_progress.written += (err == ESP_OK) ? len : 0;
+	return err;
+}
+
+/* write_pipe_fn_t for session chunks. Buffers start on a sector boundary. */
+static esp_err_t OtaPartitionWrite(void *ctx, const void *data, size_t len)
+{
+	ota_partition_target_t *target = ctx;
+	esp_err_t err;
+
+	err = esp_partition_erase_range(target->partition, target->offset,
+			(len + OTA_SECTOR_SIZE - 1) & ~(OTA_SECTOR_SIZE - 1));
+	if (err == ESP_OK)
+	{
+		err = esp_partition_write(target->partition, target->offset, data, len);
+	}
+	target->offset += len;
+	ota_progress.written += (err == ESP_OK) ? len : 0;
+	return err;
+}
+
+/* Copy of the upload progress counters, for any task */
+void OtaProgressGet(ota_progress_t *progress)
+{
+	*progress = ota_progress;
+}
+
+/* True unless the request has ?pipe=0, which writes inline for comparison */
+static bool OtaPipelined(httpd_req_t *req)
+{
+	char query[64], value[4];
+
+	if ((httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) &&
+		(httpd_query_key_value(query, "pipe", value, sizeof(value)) == ESP_OK))
+	{
+		return atoi(value) != 0;
+	}
+	return true;
+}
+
+/* Logs and records throughput at the end of an upload */
+static void OtaThroughput(uint32_t bytes, int64_t start_us, bool pipelined)
+{
+	int64_t elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+
+	ota_progress.kbps = elapsed_ms ? (uint32_t)((uint64_t)bytes * 1000 / 1024 / elapsed_ms) : 0;
+	ESP_LOGI("OTA", "%u bytes in %lld ms, %u KB/s (%s)", bytes, elapsed_ms, ota_progress.kbps,
+			 pipelined ? "pipelined" : "inline");
+}
+
+/* Image part of an /update request, fed by the multipart parser or raw */
+typedef struct
+{
+	write_pipe_t *pipe;
+	uint8_t *buf;
+	size_t fill;
+	esp_ota_handle_t handle;
+	const esp_partition_t *partition;
+	bool started;
+	bool in_image;
+	int64_t parse_us;
+} ota_update_t;
+
+static esp_err_t OtaUpdateBegin(ota_update_t *update)
 {
-	esp_ota_handle_t ota_handle;
+	if (esp_ota_begin(update->partition, OTA_SIZE_UNKNOWN, &update->handle) != ESP_OK)
+	{
+		ESP_LOGI("OTA", "Error With OTA Begin, Cancelling OTA");
+		return ESP_FAIL;
+	}
+	update->started = true;
+	ESP_LOGI("OTA", "Writing to partition subtype %d at offset 0x%x", update->partition->subtype, update->partition->address);
+	return ESP_OK;
+}
 
-	char ota_buff[1024];
+/* Hands the partly filled pipe buffer to the writer */
+static esp_err_t OtaUpdateSubmit(ota_update_t *update)
+{
+	esp_err_t err = ESP_OK;
+
+	if (update->buf != NULL)
+	{
+		err = WritePipeSubmit(update->pipe, update->fill);
+		update->buf = NULL;
+		update->fill = 0;
+	}
+	return err;
+}
+
+/* multipart on_part: the first part with a filename is the image */
+static int OtaUpdatePart(void *ctx, const multipart_part_t *part)
+{
+	ota_update_t *update = ctx;
+
+	update->in_image = !update->started && (part->filename[0] != 0);
+	return (update->in_image && (OtaUpdateBegin(update) != ESP_OK)) ? -1 : 0;
+}
+
+/* multipart on_data: copies image bytes into pipe buffers */
+static int OtaUpdateData(void *ctx, const uint8_t *data, size_t len)
+{
+	ota_update_t *update = ctx;
+	size_t n;
+
+	while (update->in_image && (len > 0))
+	{
+		if (update->buf == NULL)
+		{
+			update->buf = WritePipeBuffer(update->pipe);
+		}
+		n = MIN(len, OTA_PIPE_BUF_SIZE - update->fill);
+		memcpy(update->buf + update->fill, data, n);
+		update->fill += n;
+		data += n;
+		len -= n;
+		if ((update->fill == OTA_PIPE_BUF_SIZE) && (OtaUpdateSubmit(update) != ESP_OK))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* multipart on_part_end */
+static int OtaUpdatePartEnd(void *ctx)
+{
+	((ota_update_t *)ctx)->in_image = false;
+	return 0;
+}
+
+/* Receive .Bin file
+
+	Content-Type multipart/form-data is what the OTA page sends; the first
+	file part is the image. application/octet-stream is the bare image,
+	received straight into the pipe buffers without parsing, for scripts:
+
+	curl --data-binary @growver.bin -H "Content-Type: application/octet-stream" http://growver.local/update
+*/
+esp_err_t OTA_update_post_handler(httpd_req_t *req)
+{
+	static const multipart_callbacks_t callbacks = { OtaUpdatePart, OtaUpdateData, OtaUpdatePartEnd };
+	ota_update_t update = { 0 };
+	multipart_t *mp = NULL;
+	char content_type[128];
+	char *dest;
+	size_t space;
 	int content_length = req->content_len;
 	int content_received = 0;
-	int recv_len;
-	bool is_req_body_started = false;
-	const esp_partition_t *update_partition = esp_ota_get_next_update_partition(NULL);
+	int recv_len = 0;
+	int mp_err;
+	bool raw;
+	bool pipelined = OtaPipelined(req);
+	int64_t start_us = esp_timer_get_time();
+	int64_t parse_start_us;
+	esp_err_t err = ESP_OK;
 
 	// Unsucessful Flashing
 	flash_status = -1;
 
-	do
+	if (httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type)) != ESP_OK)
+	{
+		content_type[0] = 0;
+	}
+	raw = !strncasecmp(content_type, "application/octet-stream", strlen("application/octet-stream"));
+	if (!raw)
+	{
+		mp = malloc(sizeof(multipart_t));
+		if ((mp == NULL) || (MultipartInit(mp, content_type, &callbacks, &update) != MULTIPART_OK))
+		{
+			ESP_LOGI("OTA", "Not multipart/form-data or application/octet-stream, Cancelling OTA");
+			free(mp);
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected multipart/form-data or application/octet-stream");
+			return ESP_FAIL;
+		}
+	}
+
+	update.partition = esp_ota_get_next_update_partition(NULL);
+	update.pipe = WritePipeCreate(OTA_PIPE_BUF_SIZE, OtaPipeWrite, &update.handle, pipelined);
+	if (update.pipe == NULL)
 	{
+		free(mp);
+		return ESP_FAIL;
+	}
+	ota_progress.size = content_length;
+	ota_progress.received = 0;
+	ota_progress.written = 0;
+	ESP_LOGI("OTA", "OTA File Size: %d (%s)", content_length, raw ? "raw" : "multipart");
+
+	if (raw)
+	{
+		err = OtaUpdateBegin(&update);
+		update.in_image = true;
+	}
+
+	while ((err == ESP_OK) && (content_received < content_length))
+	{
+		// Raw bodies go straight into the pipe buffer, multipart bodies
+		// through the parser
+		if (raw)
+		{
+			if (update.buf == NULL)
+			{
+				update.buf = WritePipeBuffer(update.pipe);
+			}
+			dest = (char *)update.buf + update.fill;
+			space = OTA_PIPE_BUF_SIZE - update.fill;
+		}
+		else
+		{
+			dest = ota_chunk_buff;
+			space = sizeof(ota_chunk_buff);
+		}
+
 		/* Read the data for the request */
-		if ((recv_len = httpd_req_recv(req, ota_buff, MIN(content_length, sizeof(ota_buff)))) < 0)
+		if ((recv_len = httpd_req_recv(req, dest, MIN(content_length - content_received, space))) < 0)
 		{
 			if (recv_len == HTTPD_SOCK_ERR_TIMEOUT)
 			{
@@ -103,53 +345,75 @@ esp_err_t OTA_update_post_handler(httpd_req_t *req)
 				continue;
 			}
 			ESP_LOGI("OTA", "OTA Other Error %d", recv_len);
-			return ESP_FAIL;
+			err = ESP_FAIL;
+			break;
 		}
-
-		printf("OTA RX: %d of %d\r", content_received, content_length);
-
-	    // Is this the first data we are receiving
-		// If so, it will have the information in the header we need.
-		if (!is_req_body_started)
+		if (recv_len == 0)
 		{
-			is_req_body_started = true;
-
-			// Lets find out where the actual data staers after the header info
-			char *body_start_p = strstr(ota_buff, "\r\n\r\n") + 4;
-			int body_part_len = recv_len - (body_start_p - ota_buff);
-
-			//int body_part_sta = recv_len - body_part_len;
-			//printf("OTA File Size: %d : Start Location:%d - End Location:%d\r\n", content_length, body_part_sta, body_part_len);
-			printf("OTA File Size: %d\r\n", content_length);
+			ESP_LOGI("OTA", "Connection closed after %d of %d bytes", content_received, content_length);
+			err = ESP_FAIL;
+			break;
+		}
+		content_received += recv_len;
+		ota_progress.received = content_received;
 
-			esp_err_t err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &ota_handle);
-			if (err != ESP_OK)
-			{
-				printf("Error With OTA Begin, Cancelling OTA\r\n");
-				return ESP_FAIL;
-			}
-			else
+		if (raw)
+		{
+			update.fill += recv_len;
+			if (update.fill == OTA_PIPE_BUF_SIZE)
 			{
-				printf("Writing to partition subtype %d at offset 0x%x\r\n", update_partition->subtype, update_partition->address);
+				err = OtaUpdateSubmit(&update);
 			}
-
-			// Lets write this first part of data out
-			esp_ota_write(ota_handle, body_start_p, body_part_len);
+			continue;
 		}
-		else
-		{
-			// Write OTA data
-			esp_ota_write(ota_handle, ota_buff, recv_len);
 
-			content_received += recv_len;
+		parse_start_us = esp_timer_get_time();
+		mp_err = MultipartFeed(mp, (const uint8_t *)dest, recv_len);
+		update.parse_us += esp_timer_get_time() - parse_start_us;
+		if (mp_err != MULTIPART_OK)
+		{
+			ESP_LOGI("OTA", "Multipart error %d, Cancelling OTA", mp_err);
+			err = ESP_FAIL;
 		}
+	}
 
-	} while (recv_len > 0 && content_received < content_length);
+	if (err == ESP_OK)
+	{
+		err = OtaUpdateSubmit(&update);
+	}
+	if ((err == ESP_OK) && (mp != NULL) && !(update.started && MultipartDone(mp)))
+	{
+		ESP_LOGI("OTA", "%s, Cancelling OTA", update.started ? "No closing boundary" : "No file part");
+		err = ESP_FAIL;
+	}
+	free(mp);
+
+	if (WritePipeFinish(update.pipe) != ESP_OK)
+	{
+		ESP_LOGI("OTA", "\r\n\r\n !!! OTA Write Error !!!");
+		err = ESP_FAIL;
+	}
+	OtaThroughput(WritePipeWritten(update.pipe), start_us, pipelined);
+	if (!raw)
+	{
+		ESP_LOGI("OTA", "Multipart parsing %lld us", update.parse_us);
+	}
+	WritePipeDelete(update.pipe);
 
-	if (esp_ota_end(ota_handle) == ESP_OK)
+	if (!update.started)
+	{
+		return ESP_FAIL;
+	}
+	if (err != ESP_OK)
+	{
+		esp_ota_end(update.handle);
+		return ESP_FAIL;
+	}
+
+	if (esp_ota_end(update.handle) == ESP_OK)
 	{
 		// Lets update the partition
-		if(esp_ota_set_boot_partition(update_partition) == ESP_OK)
+		if(esp_ota_set_boot_partition(update.partition) == ESP_OK)
 		{
 			const esp_partition_t *boot_partition = esp_ota_get_boot_partition();
 
@@ -174,3 +438,917 @@ esp_err_t OTA_update_post_handler(httpd_req_t *req)
 	return ESP_OK;
 
 }
+
+/*****************************************************
+
+	Resumable OTA session API
+
+	POST /ota/begin   {"size":n,"sha256":"hex"} starts a session, or
+	                  resumes one for the same image. Returns the
+	                  committed offset to continue from.
+	POST /ota/chunk?offset=n&sha256=hex
+	                  Raw image bytes for [offset, offset + len). offset
+	                  must equal the committed offset (409 otherwise) and
+	                  len must be a multiple of OTA_SECTOR_SIZE except for
+	                  the last chunk, so a failed chunk can be erased and
+	                  sent again without touching committed data.
+	POST /ota/finish  Checks the whole image SHA-256, validates the image
+	                  and selects it for boot. ?reboot=1 restarts.
+	POST /ota/abort   Drops the session.
+	POST /ota/storage?sha256=hex&reboot=1
+	                  SPIFFS image for the storage partition, see
+	                  OtaStorageUpload.
+	GET  /ota/session {"active","size","offset"}
+
+	The committed offset is kept in NVS, so a session survives a reboot.
+	The image hash up to the offset is then rebuilt from flash.
+
+ *****************************************************/
+
+/* Hex string to bytes, false if malformed */
+static bool OtaHexDecode(const char *hex, uint8_t *out, size_t len)
+{
+	unsigned int byte;
+
+	if (strlen(hex) != len * 2)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < len; i++)
+	{
+		if (sscanf(&hex[i * 2], "%2x", &byte) != 1)
+		{
+			return false;
+		}
+		out[i] = byte;
+	}
+	return true;
+}
+
+/* Sends a small JSON reply with an optional HTTP status */
+static esp_err_t OtaReply(httpd_req_t *req, const char *status, const char *json)
+{
+	if (status)
+	{
+		httpd_resp_set_status(req, status);
+	}
+	httpd_resp_set_type(req, "application/json");
+	return httpd_resp_sendstr(req, json);
+}
+
+/* Saves (or with size 0, clears) the session in NVS */
+static void OtaSessionSave(void)
+{
+	nvs_handle_t nvs;
+
+	if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+	{
+		return;
+	}
+	if (ota_session.active)
+	{
+		nvs_set_u32(nvs, "addr", ota_session.partition->address);
+		nvs_set_u32(nvs, "size", ota_session.size);
+		nvs_set_u32(nvs, "offset", ota_session.offset);
+		nvs_set_blob(nvs, "sha256", ota_session.sha256, sizeof(ota_session.sha256));
+	}
+	else
+	{
+		nvs_erase_all(nvs);
+	}
+	nvs_commit(nvs);
+	nvs_close(nvs);
+}
+
+/* Committed offset of a saved session for this image, or 0 */
+static uint32_t OtaSessionSaved(const esp_partition_t *partition, uint32_t size, const uint8_t *sha256)
+{
+	nvs_handle_t nvs;
+	uint32_t addr = 0, saved_size = 0, offset = 0;
+	uint8_t saved_sha[32];
+	size_t len = sizeof(saved_sha);
+
+	if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+	{
+		return 0;
+	}
+	if ((nvs_get_u32(nvs, "addr", &addr) != ESP_OK) ||
+		(nvs_get_u32(nvs, "size", &saved_size) != ESP_OK) ||
+		(nvs_get_u32(nvs, "offset", &offset) != ESP_OK) ||
+		(nvs_get_blob(nvs, "sha256", saved_sha, &len) != ESP_OK) ||
+		(addr != partition->address) || (saved_size != size) ||
+		memcmp(saved_sha, sha256, sizeof(saved_sha)) || (offset > size))
+	{
+		offset = 0;
+	}
+	nvs_close(nvs);
+	return offset;
+}
+
+/* Drops the session, here and in NVS */
+static void OtaSessionEnd(void)
+{
+	ota_session.active = false;
+	mbedtls_sha256_free(&ota_session.sha);
+	mbedtls_sha256_init(&ota_session.sha);
+	OtaSessionSave();
+}
+
+/* Start or resume a session */
+static esp_err_t OtaSessionBegin(httpd_req_t *req)
+{
+	char body[128], reply[64];
+	uint8_t sha256[32];
+	uint32_t size, offset;
+	int len;
+	const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+
+	len = httpd_req_recv(req, body, MIN(req->content_len, sizeof(body) - 1));
+	if (len <= 0)
+	{
+		return ESP_FAIL;
+	}
+	body[len] = 0;
+
+	cJSON *root = cJSON_Parse(body);
+	cJSON *size_item = cJSON_GetObjectItem(root, "size");
+	cJSON *sha_item = cJSON_GetObjectItem(root, "sha256");
+	bool valid = cJSON_IsNumber(size_item) && cJSON_IsString(sha_item) &&
+				 OtaHexDecode(sha_item->valuestring, sha256, sizeof(sha256));
+	size = valid ? size_item->valuedouble : 0;
+	cJSON_Delete(root);
+
+	if (!valid || (size == 0) || (partition == NULL) || (size > partition->size))
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad size or sha256");
+	}
+
+	if (!ota_session.active || (ota_session.partition != partition) ||
+		(ota_session.size != size) || memcmp(ota_session.sha256, sha256, sizeof(sha256)))
+	{
+		// New image, or the session was lost with a reboot
+		offset = OtaSessionSaved(partition, size, sha256);
+		ota_session.active = true;
+		ota_session.partition = partition;
+		ota_session.size = size;
+		ota_session.offset = 0;
+		memcpy(ota_session.sha256, sha256, sizeof(sha256));
+		mbedtls_sha256_free(&ota_session.sha);
+		mbedtls_sha256_init(&ota_session.sha);
+		mbedtls_sha256_starts_ret(&ota_session.sha, 0);
+
+		// Rebuild the image hash over what is already committed in flash
+		while (ota_session.offset < offset)
+		{
+			len = MIN(offset - ota_session.offset, sizeof(ota_chunk_buff));
+			if (esp_partition_read(partition, ota_session.offset, ota_chunk_buff, len) != ESP_OK)
+			{
+				break;
+			}
+			mbedtls_sha256_update_ret(&ota_session.sha, (uint8_t *)ota_chunk_buff, len);
+			ota_session.offset += len;
+		}
+		OtaSessionSave();
+		ESP_LOGI("OTA", "Session %u bytes to 0x%x, resume at %u", size, partition->address, ota_session.offset);
+	}
+
+	flash_status = -1;
+	sprintf(reply, "{\"offset\":%u,\"chunk_max\":%u}", ota_session.offset, OTA_CHUNK_MAX);
+	return OtaReply(req, NULL, reply);
+}
+
+/* Receive, write and verify one chunk */
+static esp_err_t OtaSessionChunk(httpd_req_t *req)
+{
+	char query[128], value[72], reply[48];
+	uint8_t chunk_sha[32], sha[32];
+	uint32_t offset, len, received = 0;
+	int recv_len, timeouts = 0;
+	size_t fill;
+	char *buff;
+	mbedtls_sha256_context chunk_ctx, image_ctx;
+	ota_partition_target_t target;
+	write_pipe_t *pipe = NULL;
+	bool pipelined = OtaPipelined(req);
+	int64_t start_us = esp_timer_get_time();
+	esp_err_t err = ESP_OK;
+
+	if (!ota_session.active)
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "No OTA session");
+	}
+	if ((httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) ||
+		(httpd_query_key_value(query, "offset", value, sizeof(value)) != ESP_OK))
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing offset");
+	}
+	offset = strtoul(value, NULL, 10);
+	if ((httpd_query_key_value(query, "sha256", value, sizeof(value)) != ESP_OK) ||
+		!OtaHexDecode(value, chunk_sha, sizeof(chunk_sha)))
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing sha256");
+	}
+
+	if (offset != ota_session.offset)
+	{
+		sprintf(reply, "{\"offset\":%u}", ota_session.offset);
+		return OtaReply(req, "409 Conflict", reply);
+	}
+
+	ota_progress.size = ota_session.size;
+	ota_progress.received = 0;
+	ota_progress.written = offset;
+
+	len = req->content_len;
+	if ((len == 0) || (len > OTA_CHUNK_MAX) || (offset + len > ota_session.size) ||
+		((len % OTA_SECTOR_SIZE) && (offset + len != ota_session.size)))
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad chunk length");
+	}
+
+	mbedtls_sha256_init(&chunk_ctx);
+	mbedtls_sha256_init(&image_ctx);
+	mbedtls_sha256_starts_ret(&chunk_ctx, 0);
+	mbedtls_sha256_clone(&image_ctx, &ota_session.sha);
+
+	target.partition = ota_session.partition;
+	target.offset = offset;
+	pipe = WritePipeCreate(OTA_PIPE_BUF_SIZE, OtaPartitionWrite, &target, pipelined);
+	if (pipe == NULL)
+	{
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+		err = ESP_FAIL;
+	}
+
+	while ((err == ESP_OK) && (received < len))
+	{
+		buff = WritePipeBuffer(pipe);
+		fill = 0;
+		while ((fill < OTA_PIPE_BUF_SIZE) && (received < len))
+		{
+			recv_len = httpd_req_recv(req, buff + fill, MIN(len - received, OTA_PIPE_BUF_SIZE - fill));
+			if (recv_len == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < OTA_RECV_RETRIES)
+			{
+				continue;
+			}
+			if (recv_len <= 0)
+			{
+				// Connection lost. The session stays at the committed offset.
+				ESP_LOGW("OTA", "Chunk at %u lost after %u bytes (%d)", offset, received, recv_len);
+				err = ESP_FAIL;
+				break;
+			}
+			if ((offset == 0) && (received == 0) && ((uint8_t)buff[0] != ESP_IMAGE_HEADER_MAGIC))
+			{
+				httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not an app image");
+				err = ESP_FAIL;
+				break;
+			}
+			// Hash here while the writer task commits the previous buffer
+			mbedtls_sha256_update_ret(&chunk_ctx, (uint8_t *)buff + fill, recv_len);
+			mbedtls_sha256_update_ret(&image_ctx, (uint8_t *)buff + fill, recv_len);
+			fill += recv_len;
+			received += recv_len;
+			ota_progress.received = offset + received;
+		}
+		if ((WritePipeSubmit(pipe, (err == ESP_OK) ? fill : 0) != ESP_OK) && (err == ESP_OK))
+		{
+			err = ESP_FAIL;
+			httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write failed");
+		}
+	}
+
+	if (pipe)
+	{
+		if ((WritePipeFinish(pipe) != ESP_OK) && (err == ESP_OK))
+		{
+			err = ESP_FAIL;
+			httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write failed");
+		}
+		OtaThroughput(received, start_us, pipelined);
+		WritePipeDelete(pipe);
+	}
+
+	if (err == ESP_OK)
+	{
+		mbedtls_sha256_finish_ret(&chunk_ctx, sha);
+		if (memcmp(sha, chunk_sha, sizeof(sha)))
+		{
+			ESP_LOGW("OTA", "Chunk at %u hash mismatch", offset);
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Chunk sha256 mismatch");
+		}
+		else
+		{
+			// Commit. Free first, the old context may hold the SHA engine.
+			mbedtls_sha256_free(&ota_session.sha);
+			mbedtls_sha256_init(&ota_session.sha);
+			mbedtls_sha256_clone(&ota_session.sha, &image_ctx);
+			ota_session.offset += len;
+			OtaSessionSave();
+
+			sprintf(reply, "{\"offset\":%u}", ota_session.offset);
+			OtaReply(req, NULL, reply);
+		}
+	}
+
+	mbedtls_sha256_free(&chunk_ctx);
+	mbedtls_sha256_free(&image_ctx);
+	return err;
+}
+
+/* Verify the whole image and select it for boot */
+static esp_err_t OtaSessionFinish(httpd_req_t *req)
+{
+	char query[32], value[8], reply[48];
+	uint8_t sha[32];
+	mbedtls_sha256_context image_ctx;
+
+	if (!ota_session.active)
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "No OTA session");
+	}
+	if (ota_session.offset != ota_session.size)
+	{
+		sprintf(reply, "{\"offset\":%u}", ota_session.offset);
+		return OtaReply(req, "409 Conflict", reply);
+	}
+
+	mbedtls_sha256_init(&image_ctx);
+	mbedtls_sha256_clone(&image_ctx, &ota_session.sha);
+	mbedtls_sha256_finish_ret(&image_ctx, sha);
+	mbedtls_sha256_free(&image_ctx);
+
+	if (memcmp(sha, ota_session.sha256, sizeof(sha)))
+	{
+		// Every chunk matched but the image does not: start again
+		ESP_LOGI("OTA", "\r\n\r\n !!! Image SHA-256 Mismatch !!!");
+		OtaSessionEnd();
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Image sha256 mismatch");
+	}
+
+	// Validates the image before selecting it
+	if (esp_ota_set_boot_partition(ota_session.partition) != ESP_OK)
+	{
+		ESP_LOGI("OTA", "\r\n\r\n !!! Flashed Error !!!");
+		OtaSessionEnd();
+		return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Image not valid");
+	}
+
+	ESP_LOGI("OTA", "Next boot partition subtype %d at offset 0x%x", ota_session.partition->subtype, ota_session.partition->address);
+	OtaSessionEnd();
+	flash_status = 1;
+
+	OtaReply(req, NULL, "{\"status\":1}");
+	if ((httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) &&
+		(httpd_query_key_value(query, "reboot", value, sizeof(value)) == ESP_OK) && atoi(value))
+	{
+		xEventGroupSetBits(reboot_event_group, REBOOT_BIT);
+	}
+	return ESP_OK;
+}
+
+/*****************************************************
+
+	Encoded image upload
+
+	POST /ota/stream?encoding=raw|zlib|delta&sha256=hex
+	                  Body is the image, a zlib stream of it, or a zlib
+	                  compressed delta against the running firmware (see
+	                  ota_delta.c and tools/ota_pack.py). It is decoded as
+	                  it arrives and written to the update partition.
+	                  sha256 is of the decoded image, and is checked
+	                  before the image is selected for boot. ?reboot=1
+	                  restarts. Not resumable: decoder state is lost with
+	                  the connection.
+
+ *****************************************************/
+
+#define OTA_ENCODING_RAW    0
+#define OTA_ENCODING_ZLIB   1
+#define OTA_ENCODING_DELTA  2
+
+typedef struct
+{
+	uint8_t encoding;
+	write_pipe_t *pipe;
+	uint8_t *buf;					// Pipe buffer being filled
+	size_t fill;
+	uint32_t out;					// Decoded bytes so far
+	uint32_t limit;					// Update partition size
+	esp_err_t pipe_err;				// First failed pipe submit
+	const esp_partition_t *base;	// Running partition, for delta copies
+	mbedtls_sha256_context sha;
+	ota_delta_t delta;
+	tinfl_decompressor inflator;
+	size_t dict_ofs;
+	uint8_t dict[TINFL_LZ_DICT_SIZE];
+} ota_stream_t;
+
+/* Space in the current pipe buffer, submitting it when full */
+static uint8_t *OtaStreamSpace(ota_stream_t *stream, size_t *space)
+{
+	if (stream->buf && stream->fill == OTA_PIPE_BUF_SIZE)
+	{
+		esp_err_t err = WritePipeSubmit(stream->pipe, stream->fill);
+		if (stream->pipe_err == ESP_OK)
+		{
+			stream->pipe_err = err;
+		}
+		stream->buf = NULL;
+	}
+	if (stream->buf == NULL)
+	{
+		stream->buf = WritePipeBuffer(stream->pipe);
+		stream->fill = 0;
+	}
+	*space = OTA_PIPE_BUF_SIZE - stream->fill;
+	return stream->buf + stream->fill;
+}
+
+/* Accounts for len decoded bytes placed by OtaStreamSpace. Also reports a
+   failed flash write, so the receive loop stops. */
+static int OtaStreamCommit(ota_stream_t *stream, size_t len)
+{
+	mbedtls_sha256_update_ret(&stream->sha, stream->buf + stream->fill, len);
+	stream->fill += len;
+	stream->out += len;
+	ota_progress.received = stream->out;
+	if (stream->pipe_err != ESP_OK)
+	{
+		return stream->pipe_err;
+	}
+	return (stream->out > stream->limit) ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+/* Decoded image bytes (ota_delta_emit_fn_t) */
+static int OtaStreamEmit(void *ctx, const uint8_t *data, size_t len)
+{
+	ota_stream_t *stream = ctx;
+	uint8_t *dest;
+	size_t space, n;
+	int err = ESP_OK;
+
+	while (len && err == ESP_OK)
+	{
+		dest = OtaStreamSpace(stream, &space);
+		n = MIN(len, space);
+		memcpy(dest, data, n);
+		err = OtaStreamCommit(stream, n);
+		data += n;
+		len -= n;
+	}
+	return err;
+}
+
+/* Delta COPY from the running firmware (ota_delta_copy_fn_t) */
+static int OtaStreamCopy(void *ctx, uint32_t offset, uint32_t len)
+{
+	ota_stream_t *stream = ctx;
+	uint8_t *dest;
+	size_t space, n;
+	int err = ESP_OK;
+
+	while (len && err == ESP_OK)
+	{
+		dest = OtaStreamSpace(stream, &space);
+		n = MIN(len, space);
+		err = esp_partition_read(stream->base, offset, dest, n);
+		if (err == ESP_OK)
+		{
+			err = OtaStreamCommit(stream, n);
+		}
+		offset += n;
+		len -= n;
+	}
+	return err;
+}
+
+/* Delta header: the patch must be against the firmware that is running */
+static int OtaStreamDeltaHeader(void *ctx, const ota_delta_header_t *header)
+{
+	ota_stream_t *stream = ctx;
+	mbedtls_sha256_context sha;
+	uint8_t digest[32];
+	uint8_t *buf;
+	uint32_t offset = 0;
+	size_t n;
+	int err = ESP_OK;
+
+	if ((header->base_size > stream->base->size) || (header->target_size > stream->limit))
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	// ota_chunk_buff still holds undecoded input, so read into a buffer of our own
+	buf = malloc(OTA_SECTOR_SIZE);
+	if (buf == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+	mbedtls_sha256_init(&sha);
+	mbedtls_sha256_starts_ret(&sha, 0);
+	while ((offset < header->base_size) && (err == ESP_OK))
+	{
+		n = MIN(header->base_size - offset, OTA_SECTOR_SIZE);
+		err = esp_partition_read(stream->base, offset, buf, n);
+		mbedtls_sha256_update_ret(&sha, buf, n);
+		offset += n;
+	}
+	mbedtls_sha256_finish_ret(&sha, digest);
+	mbedtls_sha256_free(&sha);
+	free(buf);
+
+	if ((err == ESP_OK) && memcmp(digest, header->base_sha256, sizeof(digest)))
+	{
+		ESP_LOGW("OTA", "Delta is not for the running firmware");
+		err = ESP_ERR_INVALID_VERSION;
+	}
+	return err;
+}
+
+/* Runs received bytes through the decoder for the stream's encoding */
+static int OtaStreamDecode(ota_stream_t *stream, const uint8_t *data, size_t len, bool *done)
+{
+	size_t in_bytes, out_bytes;
+	tinfl_status status;
+	int err = ESP_OK;
+
+	if (stream->encoding == OTA_ENCODING_RAW)
+	{
+		return OtaStreamEmit(stream, data, len);
+	}
+
+	do
+	{
+		in_bytes = len;
+		out_bytes = TINFL_LZ_DICT_SIZE - stream->dict_ofs;
+		status = tinfl_decompress(&stream->inflator, data, &in_bytes, stream->dict,
+								  stream->dict + stream->dict_ofs, &out_bytes,
+								  TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+		data += in_bytes;
+		len -= in_bytes;
+
+		if (out_bytes)
+		{
+			if (stream->encoding == OTA_ENCODING_DELTA)
+			{
+				err = OtaDeltaFeed(&stream->delta, stream->dict + stream->dict_ofs, out_bytes);
+				if (err < 0)
+				{
+					// Patch format errors; callback errors are already esp_err_t
+					ESP_LOGW("OTA", "Delta error %d", err);
+					err = (err == OTA_DELTA_RANGE || err == OTA_DELTA_TRAILING) ?
+						  ESP_ERR_INVALID_SIZE : ESP_ERR_INVALID_RESPONSE;
+				}
+			}
+			else
+			{
+				err = OtaStreamEmit(stream, stream->dict + stream->dict_ofs, out_bytes);
+			}
+		}
+		stream->dict_ofs = (stream->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+	} while ((err == ESP_OK) && (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && len)));
+
+	if ((err == ESP_OK) && (status < TINFL_STATUS_DONE))
+	{
+		ESP_LOGW("OTA", "Inflate error %d", status);
+		err = ESP_ERR_INVALID_RESPONSE;
+	}
+	*done = (status == TINFL_STATUS_DONE);
+	if ((err == ESP_OK) && *done && len)
+	{
+		// Bytes after the end of the compressed stream
+		err = ESP_ERR_INVALID_SIZE;
+	}
+	return err;
+}
+
+/* POST /ota/stream */
+static esp_err_t OtaStreamUpload(httpd_req_t *req)
+{
+	char query[128], value[72];
+	uint8_t sha256[32], digest[32];
+	esp_ota_handle_t ota_handle = 0;
+	const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+	ota_stream_t *stream;
+	uint32_t received = 0;
+	int recv_len = 1, timeouts = 0;
+	bool pipelined = OtaPipelined(req);
+	bool done = false;
+	int64_t start_us = esp_timer_get_time();
+	esp_err_t err;
+
+	if ((httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) ||
+		(httpd_query_key_value(query, "sha256", value, sizeof(value)) != ESP_OK) ||
+		!OtaHexDecode(value, sha256, sizeof(sha256)))
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing sha256");
+	}
+	if (httpd_query_key_value(query, "encoding", value, sizeof(value)) != ESP_OK)
+	{
+		strcpy(value, "raw");
+	}
+
+	// Only encoded streams need the decoder state, keep raw uploads small
+	stream = calloc(1, strcmp(value, "raw") ? sizeof(ota_stream_t) : offsetof(ota_stream_t, delta));
+	if (stream == NULL)
+	{
+		return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+	}
+	if (!strcmp(value, "zlib"))
+	{
+		stream->encoding = OTA_ENCODING_ZLIB;
+	}
+	else if (!strcmp(value, "delta"))
+	{
+		stream->encoding = OTA_ENCODING_DELTA;
+		OtaDeltaInit(&stream->delta, OtaStreamDeltaHeader, OtaStreamEmit, OtaStreamCopy, stream);
+	}
+	else if (strcmp(value, "raw"))
+	{
+		free(stream);
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown encoding");
+	}
+	if (stream->encoding != OTA_ENCODING_RAW)
+	{
+		tinfl_init(&stream->inflator);
+	}
+	stream->limit = partition->size;
+	stream->base = esp_ota_get_running_partition();
+	mbedtls_sha256_init(&stream->sha);
+	mbedtls_sha256_starts_ret(&stream->sha, 0);
+
+	flash_status = -1;
+	ota_progress.size = req->content_len;
+	ota_progress.received = 0;
+	ota_progress.written = 0;
+
+	err = esp_ota_begin(partition, OTA_SIZE_UNKNOWN, &ota_handle);
+	if (err == ESP_OK)
+	{
+		stream->pipe = WritePipeCreate(OTA_PIPE_BUF_SIZE, OtaPipeWrite, &ota_handle, pipelined);
+		err = stream->pipe ? ESP_OK : ESP_ERR_NO_MEM;
+	}
+
+	while ((err == ESP_OK) && (received < req->content_len))
+	{
+		recv_len = httpd_req_recv(req, ota_chunk_buff, MIN(req->content_len - received, sizeof(ota_chunk_buff)));
+		if (recv_len == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < OTA_RECV_RETRIES)
+		{
+			continue;
+		}
+		if (recv_len <= 0)
+		{
+			ESP_LOGW("OTA", "Stream lost after %u bytes (%d)", received, recv_len);
+			err = ESP_FAIL;
+			break;
+		}
+		received += recv_len;
+		if (done)
+		{
+			// Bytes after the end of the compressed stream
+			err = ESP_ERR_INVALID_SIZE;
+			break;
+		}
+		err = OtaStreamDecode(stream, (uint8_t *)ota_chunk_buff, recv_len, &done);
+	}
+
+	// Flush the last buffer and wait for the writer
+	if (stream->pipe)
+	{
+		if (stream->buf)
+		{
+			WritePipeSubmit(stream->pipe, stream->fill);
+		}
+		if ((WritePipeFinish(stream->pipe) != ESP_OK) && (err == ESP_OK))
+		{
+			err = ESP_FAIL;
+		}
+		WritePipeDelete(stream->pipe);
+	}
+	OtaThroughput(received, start_us, pipelined);
+	ESP_LOGI("OTA", "Received %u bytes, image %u bytes", received, stream->out);
+
+	if ((err == ESP_OK) && (stream->encoding != OTA_ENCODING_RAW) && !done)
+	{
+		err = ESP_ERR_INVALID_SIZE;
+	}
+	if ((err == ESP_OK) && (stream->encoding == OTA_ENCODING_DELTA) && !OtaDeltaDone(&stream->delta))
+	{
+		err = ESP_ERR_INVALID_SIZE;
+	}
+	mbedtls_sha256_finish_ret(&stream->sha, digest);
+	mbedtls_sha256_free(&stream->sha);
+	if ((err == ESP_OK) && memcmp(digest, sha256, sizeof(digest)))
+	{
+		ESP_LOGI("OTA", "\r\n\r\n !!! Image SHA-256 Mismatch !!!");
+		err = ESP_ERR_INVALID_CRC;
+	}
+	free(stream);
+
+	if (ota_handle)
+	{
+		if (esp_ota_end(ota_handle) != ESP_OK && err == ESP_OK)
+		{
+			err = ESP_ERR_OTA_VALIDATE_FAILED;
+		}
+	}
+	if (err == ESP_OK)
+	{
+		err = esp_ota_set_boot_partition(partition);
+	}
+	if (err != ESP_OK)
+	{
+		ESP_LOGI("OTA", "\r\n\r\n !!! Stream Update Error (%s) !!!", esp_err_to_name(err));
+		if (recv_len > 0)
+		{
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, esp_err_to_name(err));
+		}
+		return (recv_len > 0) ? ESP_OK : ESP_FAIL;
+	}
+
+	ESP_LOGI("OTA", "Next boot partition subtype %d at offset 0x%x", partition->subtype, partition->address);
+	flash_status = 1;
+	OtaReply(req, NULL, "{\"status\":1}");
+	if ((httpd_query_key_value(query, "reboot", value, sizeof(value)) == ESP_OK) && atoi(value))
+	{
+		xEventGroupSetBits(reboot_event_group, REBOOT_BIT);
+	}
+	return ESP_OK;
+}
+
+/* POST /ota/storage?sha256=hex&reboot=1
+
+	A SPIFFS image for the storage partition (build/storage.bin), staged in
+	the idle app partition and applied on the next boot, see storage_ota.c.
+*/
+static esp_err_t OtaStorageUpload(httpd_req_t *req)
+{
+	char query[128], hex[65], value[4], reply[64];
+	uint8_t sha256[32], digest[32];
+	ota_partition_target_t target;
+	mbedtls_sha256_context sha;
+	write_pipe_t *pipe;
+	uint8_t *buf;
+	size_t fill;
+	uint32_t received = 0;
+	int recv_len = 1;
+	int timeouts = 0;
+	bool pipelined = OtaPipelined(req);
+	int64_t start_us = esp_timer_get_time();
+	const esp_partition_t *storage;
+	esp_err_t err = ESP_OK;
+
+	if ((httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) ||
+		(httpd_query_key_value(query, "sha256", hex, sizeof(hex)) != ESP_OK) ||
+		!OtaHexDecode(hex, sha256, sizeof(sha256)))
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Need sha256");
+	}
+	target.partition = StorageOtaStaging();
+	target.offset = 0;
+	if ((target.partition == NULL) || ota_session.active)
+	{
+		return OtaReply(req, "409 Conflict", "{\"error\":\"firmware update in progress\"}");
+	}
+	storage = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, STORAGE_OTA_LABEL);
+	if ((storage == NULL) || (req->content_len == 0) ||
+		(req->content_len > storage->size) || (req->content_len > target.partition->size))
+	{
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad image size");
+	}
+
+	pipe = WritePipeCreate(OTA_PIPE_BUF_SIZE, OtaPartitionWrite, &target, pipelined);
+	if (pipe == NULL)
+	{
+		return ESP_FAIL;
+	}
+
+	// A saved firmware session in this partition can not be resumed any more
+	OtaSessionEnd();
+	ota_progress.size = req->content_len;
+	ota_progress.received = 0;
+	ota_progress.written = 0;
+	mbedtls_sha256_init(&sha);
+	mbedtls_sha256_starts_ret(&sha, 0);
+	ESP_LOGI("OTA", "Storage image %u bytes to 0x%x", req->content_len, target.partition->address);
+
+	while ((err == ESP_OK) && (received < req->content_len))
+	{
+		// Fill a whole buffer, so every write but the last is sector aligned
+		buf = WritePipeBuffer(pipe);
+		fill = 0;
+		while ((fill < OTA_PIPE_BUF_SIZE) && (received < req->content_len))
+		{
+			recv_len = httpd_req_recv(req, (char *)buf + fill, MIN(req->content_len - received, OTA_PIPE_BUF_SIZE - fill));
+			if (recv_len == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < OTA_RECV_RETRIES)
+			{
+				continue;
+			}
+			if (recv_len <= 0)
+			{
+				ESP_LOGW("OTA", "Storage image lost after %u bytes (%d)", received, recv_len);
+				err = ESP_FAIL;
+				break;
+			}
+			fill += recv_len;
+			received += recv_len;
+			ota_progress.received = received;
+		}
+		mbedtls_sha256_update_ret(&sha, buf, fill);
+		if (WritePipeSubmit(pipe, fill) != ESP_OK)
+		{
+			err = ESP_FAIL;
+		}
+	}
+
+	if ((WritePipeFinish(pipe) != ESP_OK) && (err == ESP_OK))
+	{
+		err = ESP_FAIL;
+	}
+	OtaThroughput(WritePipeWritten(pipe), start_us, pipelined);
+	WritePipeDelete(pipe);
+	mbedtls_sha256_finish_ret(&sha, digest);
+	mbedtls_sha256_free(&sha);
+
+	// Check the received hash, then what actually landed in flash
+	if ((err == ESP_OK) && memcmp(digest, sha256, sizeof(digest)))
+	{
+		err = ESP_ERR_INVALID_CRC;
+	}
+	if (err == ESP_OK)
+	{
+		err = StorageOtaHash(target.partition, received, digest);
+	}
+	if ((err == ESP_OK) && memcmp(digest, sha256, sizeof(digest)))
+	{
+		err = ESP_ERR_INVALID_CRC;
+	}
+	if (err == ESP_OK)
+	{
+		err = StorageOtaSetPending(target.partition, received, sha256);
+	}
+	if (err != ESP_OK)
+	{
+		ESP_LOGI("OTA", "\r\n\r\n !!! Storage Update Error (%s) !!!", esp_err_to_name(err));
+		if (recv_len > 0)
+		{
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, esp_err_to_name(err));
+		}
+		return (recv_len > 0) ? ESP_OK : ESP_FAIL;
+	}
+
+	sprintf(reply, "{\"size\":%u,\"pending\":1}", received);
+	OtaReply(req, NULL, reply);
+	if ((httpd_query_key_value(query, "reboot", value, sizeof(value)) == ESP_OK) && atoi(value))
+	{
+		xEventGroupSetBits(reboot_event_group, REBOOT_BIT);
+	}
+	return ESP_OK;
+}
+
+/* POST /ota/... */
+esp_err_t OTA_session_post_handler(httpd_req_t *req)
+{
+	const char *api = req->uri + strlen("/ota/");
+	size_t len = strcspn(api, "?");
+
+	if (!strncmp(api, "begin", len) && len == 5)
+	{
+		return OtaSessionBegin(req);
+	}
+	else if (!strncmp(api, "chunk", len) && len == 5)
+	{
+		return OtaSessionChunk(req);
+	}
+	else if (!strncmp(api, "finish", len) && len == 6)
+	{
+		return OtaSessionFinish(req);
+	}
+	else if (!strncmp(api, "stream", len) && len == 6)
+	{
+		return OtaStreamUpload(req);
+	}
+	else if (!strncmp(api, "storage", len) && len == 7)
+	{
+		return OtaStorageUpload(req);
+	}
+	else if (!strncmp(api, "abort", len) && len == 5)
+	{
+		OtaSessionEnd();
+		return OtaReply(req, NULL, "{}");
+	}
+	return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown OTA request");
+}
+
+/* GET /ota/session */
+esp_err_t OTA_session_get_handler(httpd_req_t *req)
+{
+	resp_writer_t w;
+
+	httpd_resp_set_type(req, "application/json");
+	RespWriterInit(&w, req);
+	RespWriterPrintf(&w, "{\"active\":%d,\"size\":%u,\"offset\":%u,\"kbps\":%u}",
+			ota_session.active, ota_session.size, ota_session.offset, ota_progress.kbps);
+	return RespWriterFinish(&w);
+}
@@ -4,9 +4,32 @@
 //
 //*****************************************************************************
 
+// Resumable OTA sessions
+#define OTA_NVS_NAMESPACE   "ota"
+#define OTA_SECTOR_SIZE     4096
+#define OTA_CHUNK_MAX       (64 * 1024)
+#define OTA_RECV_BUF_SIZE   4096
+#define OTA_RECV_RETRIES    5
+
+// Upload buffers. One is received into while the other is written to flash.
+#define OTA_PIPE_BUF_SIZE   (8 * 1024)
+
+// Upload progress. The httpd task is busy during an upload, so read it with
+// OtaProgressGet from another task (e.g. the "ota" console command).
+typedef struct
+{
+	uint32_t size;          // Image size (request length for /update)
+	uint32_t received;      // Bytes received from the socket
+	uint32_t written;       // Bytes committed to flash
+	uint32_t kbps;          // Throughput of the last completed upload or chunk
+} ota_progress_t;
+
 void systemRebootTask(void * parameter);
 esp_err_t OTA_update_status_handler(httpd_req_t *req);
 esp_err_t OTA_update_post_handler(httpd_req_t *req);
+esp_err_t OTA_session_post_handler(httpd_req_t *req);
+esp_err_t OTA_session_get_handler(httpd_req_t *req);
+void OtaProgressGet(ota_progress_t *progress);
 void systemRebootTask(void * parameter);
 
-extern int8_t flash_status;
\ No newline at end of file
+extern int8_t flash_status;
@@ -0,0 +1,213 @@
+//*****************************************************************************
+//
+// ota_delta.c - Applies binary firmware patches as they stream in.
+//
+// A patch (built by tools/ota_pack.py) is a header followed by COPY ops,
+// which reuse a range of the base image (the running firmware), and INSERT
+// ops, which carry new bytes:
+//
+//   "GRVD" | version (1) | 3 reserved | target size (4) | base size (4)
+//          | base SHA-256 (32)
+//   0x01 offset (4) length (4)         COPY
+//   0x02 length (4) bytes              INSERT
+//   0x00                               END
+//
+// All fields are little endian. Input may be fed in pieces of any size; the
+// target image is produced through the emit and copy callbacks in order.
+// This module has no ESP-IDF dependencies.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "ota_delta.h"
+
+// Parser states
+#define DELTA_HEADER    0
+#define DELTA_OP        1
+#define DELTA_ARGS      2
+#define DELTA_INSERT    3
+#define DELTA_END       4
+
+static uint32_t DeltaU32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+//*****************************************************************************
+// OtaDeltaInit
+// on_header is called once the header is complete, before any output, so the
+// caller can check the base image. It may be NULL.
+//
+//*****************************************************************************
+void OtaDeltaInit(ota_delta_t *delta, ota_delta_header_fn_t on_header,
+                  ota_delta_emit_fn_t emit, ota_delta_copy_fn_t copy, void *ctx)
+{
+    memset(delta, 0, sizeof(*delta));
+    delta->state = DELTA_HEADER;
+    delta->need = OTA_DELTA_HEADER_SIZE;
+    delta->on_header = on_header;
+    delta->emit = emit;
+    delta->copy = copy;
+    delta->ctx = ctx;
+}
+
+//*****************************************************************************
+// DeltaOutput
+// Checks that len more bytes fit in the target.
+//
+//*****************************************************************************
+static bool DeltaOutput(ota_delta_t *delta, uint32_t len)
+{
+    if (len > delta->header.target_size - delta->out)
+    {
+        return false;
+    }
+    delta->out += len;
+    return true;
+}
+
+//*****************************************************************************
+// DeltaComplete
+// Acts on a complete header or op held in buf.
+//
+//*****************************************************************************
+static int DeltaComplete(ota_delta_t *delta)
+{
+    uint32_t offset, len;
+
+    switch (delta->state)
+    {
+    case DELTA_HEADER:
+        if (memcmp(delta->buf, OTA_DELTA_MAGIC, 4) || (delta->buf[4] != OTA_DELTA_VERSION))
+        {
+            return OTA_DELTA_BAD_HEADER;
+        }
+        delta->header.target_size = DeltaU32(&delta->buf[8]);
+        delta->header.base_size = DeltaU32(&delta->buf[12]);
+        memcpy(delta->header.base_sha256, &delta->buf[16], sizeof(delta->header.base_sha256));
+        delta->state = DELTA_OP;
+        delta->need = 1;
+        return delta->on_header ? delta->on_header(delta->ctx, &delta->header) : OTA_DELTA_OK;
+
+    case DELTA_OP:
+        switch (delta->buf[0])
+        {
+        case OTA_DELTA_OP_END:
+            delta->state = DELTA_END;
+            return (delta->out == delta->header.target_size) ? OTA_DELTA_OK : OTA_DELTA_RANGE;
+        case OTA_DELTA_OP_COPY:
+            delta->need = 8;
+            break;
+        case OTA_DELTA_OP_INSERT:
+            delta->need = 4;
+            break;
+        default:
+            return OTA_DELTA_BAD_OP;
+        }
+        delta->state = DELTA_ARGS;
+        return OTA_DELTA_OK;
+
+    default:
+        // DELTA_ARGS
+        delta->state = DELTA_OP;
+        delta->need = 1;
+        if (delta->buf[0] == OTA_DELTA_OP_INSERT)
+        {
+            delta->insert_left = DeltaU32(&delta->buf[1]);
+            if (!DeltaOutput(delta, delta->insert_left))
+            {
+                return OTA_DELTA_RANGE;
+            }
+            if (delta->insert_left)
+            {
+                delta->state = DELTA_INSERT;
+            }
+            return OTA_DELTA_OK;
+        }
+        offset = DeltaU32(&delta->buf[1]);
+        len = DeltaU32(&delta->buf[5]);
+        if ((offset > delta->header.base_size) || (len > delta->header.base_size - offset) ||
+            !DeltaOutput(delta, len))
+        {
+            return OTA_DELTA_RANGE;
+        }
+        return len ? delta->copy(delta->ctx, offset, len) : OTA_DELTA_OK;
+    }
+}
+
+//*****************************************************************************
+// OtaDeltaFeed
+// Feeds the next len bytes of the patch. Returns OTA_DELTA_OK, an
+// OTA_DELTA_xxx error or the first callback error. After an error the patch
+// must be started again.
+//
+//*****************************************************************************
+int OtaDeltaFeed(ota_delta_t *delta, const uint8_t *data, size_t len)
+{
+    size_t n;
+    int result;
+
+    while (len)
+    {
+        if (delta->state == DELTA_END)
+        {
+            return OTA_DELTA_TRAILING;
+        }
+
+        if (delta->state == DELTA_INSERT)
+        {
+            // Literal bytes go straight through
+            n = (len < delta->insert_left) ? len : delta->insert_left;
+            result = delta->emit(delta->ctx, data, n);
+            if (result)
+            {
+                return result;
+            }
+            delta->insert_left -= n;
+            if (delta->insert_left == 0)
+            {
+                delta->state = DELTA_OP;
+                delta->need = 1;
+            }
+        }
+        else
+        {
+            // Collect a header, opcode or op arguments, which may be split
+            // across calls. Arguments follow the opcode in buf[0].
+            n = delta->need - delta->have;
+            n = (len < n) ? len : n;
+            memcpy(&delta->buf[((delta->state == DELTA_ARGS) ? 1 : 0) + delta->have], data, n);
+            delta->have += n;
+            if (delta->have == delta->need)
+            {
+                delta->have = 0;
+                result = DeltaComplete(delta);
+                if (result)
+                {
+                    return result;
+                }
+            }
+        }
+        data += n;
+        len -= n;
+    }
+    return OTA_DELTA_OK;
+}
+
+//*****************************************************************************
+// OtaDeltaDone
+// True once the END op has been seen and the target is complete.
+//
+//*****************************************************************************
+bool OtaDeltaDone(const ota_delta_t *delta)
+{
+    return delta->state == DELTA_END;
+}
+
+// end of ota_delta.c
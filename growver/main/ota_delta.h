@@ -0,0 +1,59 @@
+//******************************************************************************
+//
+// ota_delta.h
+//
+//******************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OTA_DELTA_MAGIC         "GRVD"
+#define OTA_DELTA_VERSION       1
+#define OTA_DELTA_HEADER_SIZE   48
+
+// Ops
+#define OTA_DELTA_OP_END        0x00
+#define OTA_DELTA_OP_COPY       0x01    // base offset (4), length (4)
+#define OTA_DELTA_OP_INSERT     0x02    // length (4), then the bytes
+
+// OtaDeltaFeed results. Callback errors are passed through unchanged.
+#define OTA_DELTA_OK            0
+#define OTA_DELTA_BAD_HEADER    -1
+#define OTA_DELTA_BAD_OP        -2
+#define OTA_DELTA_RANGE         -3      // Copy outside base or output too long
+#define OTA_DELTA_TRAILING      -4      // Data after the END op
+
+typedef struct
+{
+    uint32_t target_size;
+    uint32_t base_size;
+    uint8_t base_sha256[32];
+} ota_delta_header_t;
+
+// Callbacks return 0, or an error that stops the patch
+typedef int (*ota_delta_header_fn_t)(void *ctx, const ota_delta_header_t *header);
+typedef int (*ota_delta_emit_fn_t)(void *ctx, const uint8_t *data, size_t len);
+typedef int (*ota_delta_copy_fn_t)(void *ctx, uint32_t offset, uint32_t len);
+
+typedef struct
+{
+    uint8_t buf[OTA_DELTA_HEADER_SIZE];
+    size_t have;
+    size_t need;
+    uint8_t state;
+    uint32_t insert_left;
+    uint32_t out;
+    ota_delta_header_t header;
+    ota_delta_header_fn_t on_header;
+    ota_delta_emit_fn_t emit;
+    ota_delta_copy_fn_t copy;
+    void *ctx;
+} ota_delta_t;
+
+void OtaDeltaInit(ota_delta_t *delta, ota_delta_header_fn_t on_header,
+                  ota_delta_emit_fn_t emit, ota_delta_copy_fn_t copy, void *ctx);
+int OtaDeltaFeed(ota_delta_t *delta, const uint8_t *data, size_t len);
+bool OtaDeltaDone(const ota_delta_t *delta);
+
+// end of ota_delta.h
@@ -0,0 +1,248 @@
+//*****************************************************************************
+//
+// resp_writer.c - Buffered writer for generated HTTP responses.
+//
+// Generated pages and JSON are written in many small pieces. Sent one by one
+// with httpd_resp_send_chunk, each piece is its own chunk and its own TCP
+// sends. The writer collects them in a buffer of one TCP segment and sends
+// it as one chunk when it fills. A response that fits in the buffer is sent
+// whole with Content-Length, without chunked encoding.
+//
+// Bytes, write calls, chunks and time of each chunked response are logged,
+// where the write calls are the chunks it took before buffering.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "cJSON.h"
+#include "resp_writer.h"
+
+static const char *TAG = "resp_writer";
+
+//*****************************************************************************
+// RespWriterInit
+// Starts a response. Headers and status are set on req as usual, before
+// the first chunk is sent. Without memory for the buffer every write is
+// sent as its own chunk.
+//
+//*****************************************************************************
+esp_err_t RespWriterInit(resp_writer_t *w, httpd_req_t *req)
+{
+    memset(w, 0, sizeof(*w));
+    w->req = req;
+    w->start_us = esp_timer_get_time();
+    w->buf = malloc(RESP_WRITER_SIZE);
+    if (w->buf == NULL)
+    {
+        ESP_LOGW(TAG, "No memory for response buffer, sending unbuffered");
+        return ESP_ERR_NO_MEM;
+    }
+    w->size = RESP_WRITER_SIZE;
+    return ESP_OK;
+}
+
+//*****************************************************************************
+// RespWriterChunk
+// Sends one chunk. A failed send leaves the connection unusable, so the
+// error sticks and later writes are dropped.
+//
+//*****************************************************************************
+static esp_err_t RespWriterChunk(resp_writer_t *w, const char *data, size_t len)
+{
+    if (w->err == ESP_OK && len)
+    {
+        w->err = httpd_resp_send_chunk(w->req, data, len);
+        w->chunks++;
+    }
+    return w->err;
+}
+
+//*****************************************************************************
+// RespWriterFlush
+// Sends what is buffered as one chunk.
+//
+//*****************************************************************************
+static esp_err_t RespWriterFlush(resp_writer_t *w)
+{
+    RespWriterChunk(w, w->buf, w->len);
+    w->len = 0;
+    return w->err;
+}
+
+//*****************************************************************************
+// RespWriterWrite
+// Appends len bytes to the body.
+//
+//*****************************************************************************
+esp_err_t RespWriterWrite(resp_writer_t *w, const void *data, size_t len)
+{
+    const char *p = data;
+    size_t n;
+
+    w->writes++;
+    w->bytes += len;
+
+    // Fill up the buffer, then send what does not fit in a whole buffer
+    // straight from the caller's memory
+    while (len && w->err == ESP_OK)
+    {
+        if (w->len == 0 && len >= w->size)
+        {
+            return RespWriterChunk(w, p, len);
+        }
+        n = (len < w->size - w->len) ? len : w->size - w->len;
+        memcpy(&w->buf[w->len], p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+        if (w->len == w->size)
+        {
+            RespWriterFlush(w);
+        }
+    }
+    return w->err;
+}
+
+//*****************************************************************************
+// RespWriterStr
+// Appends a string.
+//
+//*****************************************************************************
+esp_err_t RespWriterStr(resp_writer_t *w, const char *s)
+{
+    return RespWriterWrite(w, s, strlen(s));
+}
+
+//*****************************************************************************
+// RespWriterPrintf
+// Appends formatted text, formatting straight into the buffer when it fits.
+//
+//*****************************************************************************
+esp_err_t RespWriterPrintf(resp_writer_t *w, const char *fmt, ...)
+{
+    va_list args;
+    char *text;
+    int len;
+
+    if (w->err != ESP_OK)
+    {
+        return w->err;
+    }
+
+    va_start(args, fmt);
+    len = vsnprintf(&w->buf[w->len], w->size - w->len, fmt, args);
+    va_end(args);
+    if (len < 0)
+    {
+        return w->err;
+    }
+    if ((size_t)len < w->size - w->len)
+    {
+        w->writes++;
+        w->bytes += len;
+        w->len += len;
+        return w->err;
+    }
+
+    // Too long for the space left
+    text = malloc(len + 1);
+    if (text == NULL)
+    {
+        return w->err = ESP_ERR_NO_MEM;
+    }
+    va_start(args, fmt);
+    vsnprintf(text, len + 1, fmt, args);
+    va_end(args);
+    RespWriterWrite(w, text, len);
+    free(text);
+    return w->err;
+}
+
+//*****************************************************************************
+// RespWriterJson
+// Appends item as unformatted JSON, printed straight into the buffer when
+// it fits.
+//
+//*****************************************************************************
+esp_err_t RespWriterJson(resp_writer_t *w, cJSON *item)
+{
+    char *text;
+    size_t len;
+
+    if (w->err != ESP_OK)
+    {
+        return w->err;
+    }
+
+    // cJSON asks for 5 bytes more than it prints
+    if (w->size - w->len > 5 && cJSON_PrintPreallocated(item, &w->buf[w->len], w->size - w->len, false))
+    {
+        len = strlen(&w->buf[w->len]);
+        w->writes++;
+        w->bytes += len;
+        w->len += len;
+        return w->err;
+    }
+
+    text = cJSON_PrintUnformatted(item);
+    if (text == NULL)
+    {
+        return w->err = ESP_ERR_NO_MEM;
+    }
+    RespWriterStr(w, text);
+    free(text);
+    return w->err;
+}
+
+//*****************************************************************************
+// RespWriterFinish
+// Ends the response and frees the buffer. Returns the first error, after
+// which the handler should return it so the connection is closed.
+//
+//*****************************************************************************
+esp_err_t RespWriterFinish(resp_writer_t *w)
+{
+    unsigned elapsed_ms;
+
+    if (w->err == ESP_OK)
+    {
+        if (w->chunks == 0)
+        {
+            // It all fit: one response with Content-Length
+            w->err = httpd_resp_send(w->req, w->buf, w->len);
+            w->chunks = 1;
+        }
+        else if (RespWriterFlush(w) == ESP_OK)
+        {
+            w->err = httpd_resp_send_chunk(w->req, NULL, 0);
+        }
+    }
+
+    // Chunked responses are the large ones, such as directory listings
+    elapsed_ms = (esp_timer_get_time() - w->start_us) / 1000;
+    if (w->chunks > 1)
+    {
+        ESP_LOGI(TAG, "%s: %u bytes, %u writes, %u chunks, %u ms", w->req->uri, w->bytes, w->writes, w->chunks, elapsed_ms);
+    }
+    else
+    {
+        ESP_LOGD(TAG, "%s: %u bytes, %u writes, 1 send, %u ms", w->req->uri, w->bytes, w->writes, elapsed_ms);
+    }
+
+    free(w->buf);
+    w->buf = NULL;
+    w->len = 0;
+    w->size = 0;
+    return w->err;
+}
+
+// end of resp_writer.c
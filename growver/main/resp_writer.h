@@ -0,0 +1,30 @@
+//******************************************************************************
+//
+// resp_writer.h
+//
+//******************************************************************************
+
+// Body bytes per chunk: a full TCP segment less the chunk size line and CRLF
+#define RESP_WRITER_SIZE    (CONFIG_LWIP_TCP_MSS - 8)
+
+typedef struct
+{
+    httpd_req_t *req;
+    char *buf;
+    size_t len;                 // Bytes waiting in buf
+    size_t size;                // 0 if buf could not be allocated
+    size_t bytes;               // Body bytes so far
+    unsigned writes;            // Write calls, the chunks sent unbuffered
+    unsigned chunks;            // Chunks sent
+    int64_t start_us;
+    esp_err_t err;
+} resp_writer_t;
+
+esp_err_t RespWriterInit(resp_writer_t *w, httpd_req_t *req);
+esp_err_t RespWriterWrite(resp_writer_t *w, const void *data, size_t len);
+esp_err_t RespWriterStr(resp_writer_t *w, const char *s);
+esp_err_t RespWriterPrintf(resp_writer_t *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+esp_err_t RespWriterJson(resp_writer_t *w, cJSON *item);
+esp_err_t RespWriterFinish(resp_writer_t *w);
+
+// end of resp_writer.h
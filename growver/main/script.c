@@ -0,0 +1,558 @@
+//*****************************************************************************
+//
+// script.c - Runs sequences of console commands stored on SPIFFS.
+//
+// A script is a text file in SCRIPT_DIR with one console command per line,
+// plus these directives:
+//
+//   wait ms                Pause. Measured from the end of the previous wait
+//                          (or the start of the script), so the time taken by
+//                          commands does not accumulate in loops.
+//   loop n ... end         Repeat n times, or forever if n is 0.
+//   if var op value        Run the block if the condition holds. var is one of
+//     ... [else ...] end   batt (mV), aux0, aux1, fault, pump (0..100) or dose
+//                          (1 while a dose runs). op is < > <= >= == or !=.
+//   # text                 Comment. Blank lines are ignored.
+//
+// The whole script is parsed before it runs, so syntax errors are reported
+// by ScriptStart. A failing command stops the script. Motors and pump are
+// stopped if a script fails or is stopped, but not when it ends normally.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "commandline.h"
+#include "script.h"
+#include "../components/motor/motor_dc.h"
+#include "../components/other/peripheral.h"
+
+static const char *TAG = "script";
+
+// Deepest nesting of loop and if blocks
+#define SCRIPT_MAX_DEPTH    8
+
+// Longest command line passed to the console
+#define SCRIPT_CMD_SIZE     100
+
+// Line types
+#define LINE_CMD            0
+#define LINE_WAIT           1
+#define LINE_LOOP           2
+#define LINE_IF             3
+#define LINE_ELSE           4
+#define LINE_END            5
+
+// Condition variables and operators
+#define VAR_BATT            0
+#define VAR_AUX0            1
+#define VAR_AUX1            2
+#define VAR_FAULT           3
+#define VAR_PUMP            4
+#define VAR_DOSE            5
+
+#define OP_LT               0
+#define OP_GT               1
+#define OP_LE               2
+#define OP_GE               3
+#define OP_EQ               4
+#define OP_NE               5
+
+static const char *script_vars[] = { "batt", "aux0", "aux1", "fault", "pump", "dose", NULL };
+static const char *script_ops[] = { "<", ">", "<=", ">=", "==", "!=", NULL };
+
+// One parsed line. jump is the matching end for loop, the else or end for
+// if, the end for else and the loop for a loop's end.
+typedef struct
+{
+    char *text;                 // Command text (LINE_CMD)
+    uint16_t number;            // Source line number
+    uint16_t jump;
+    uint8_t type;
+    uint8_t var;
+    uint8_t op;
+    bool closes_loop;           // LINE_END of a loop
+    int32_t value;              // Wait ms, loop count or if operand
+    uint32_t remaining;         // Loop iterations left while running
+} script_line_t;
+
+static char script_text[SCRIPT_MAX_SIZE + 1];
+static script_line_t script_lines[SCRIPT_MAX_LINES];
+static uint16_t script_line_count;
+
+static TaskHandle_t script_task_handle;
+static portMUX_TYPE script_mux = portMUX_INITIALIZER_UNLOCKED;
+static script_status_t script_status;
+static volatile bool script_stop;
+static volatile bool script_pending;
+
+//*****************************************************************************
+// ScriptLookup
+// Returns the index of word in table, or -1.
+//
+//*****************************************************************************
+static int ScriptLookup(const char **table, const char *word)
+{
+    for (int i = 0; table[i]; i++)
+    {
+        if (!strcmp(table[i], word))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//*****************************************************************************
+// ScriptParseLine
+// Fills in type and arguments for one trimmed, non-empty line. Returns false
+// on a syntax error.
+//
+//*****************************************************************************
+static bool ScriptParseLine(char *text, script_line_t *line)
+{
+    char word[8], var[8], op[4];
+    int32_t value;
+    int count;
+
+    line->text = text;
+    line->type = LINE_CMD;
+
+    // Directives are recognised by their first word only
+    if (sscanf(text, "%7s", word) != 1)
+    {
+        return false;
+    }
+
+    if (!strcmp(word, "wait"))
+    {
+        line->type = LINE_WAIT;
+        return (sscanf(text, "wait %d%n", &line->value, &count) == 1) && !text[count] && (line->value >= 0);
+    }
+    else if (!strcmp(word, "loop"))
+    {
+        line->type = LINE_LOOP;
+        return (sscanf(text, "loop %d%n", &line->value, &count) == 1) && !text[count] && (line->value >= 0);
+    }
+    else if (!strcmp(word, "if"))
+    {
+        line->type = LINE_IF;
+        if ((sscanf(text, "if %7s %3s %d%n", var, op, &value, &count) != 3) || text[count])
+        {
+            return false;
+        }
+        line->var = ScriptLookup(script_vars, var);
+        line->op = ScriptLookup(script_ops, op);
+        line->value = value;
+        return (line->var != (uint8_t)-1) && (line->op != (uint8_t)-1);
+    }
+    else if (!strcmp(text, "else"))
+    {
+        line->type = LINE_ELSE;
+    }
+    else if (!strcmp(text, "end"))
+    {
+        line->type = LINE_END;
+    }
+    else if (strlen(text) >= SCRIPT_CMD_SIZE)
+    {
+        return false;
+    }
+    return true;
+}
+
+//*****************************************************************************
+// ScriptParse
+// Splits script_text into script_lines and matches loop/if/else/end. On a
+// syntax error returns false with the source line number in error_line.
+//
+//*****************************************************************************
+static bool ScriptParse(uint16_t *error_line)
+{
+    uint16_t stack[SCRIPT_MAX_DEPTH];
+    uint16_t depth = 0, number = 0, index;
+    char *next = script_text;
+    char *text, *end;
+    script_line_t *line, *open;
+
+    script_line_count = 0;
+    while (next)
+    {
+        // Split off the next line and trim it
+        text = next;
+        next = strchr(text, '\n');
+        if (next)
+        {
+            *next++ = 0;
+        }
+        number++;
+        *error_line = number;
+
+        while (*text == ' ' || *text == '\t')
+        {
+            text++;
+        }
+        end = text + strlen(text);
+        while (end > text && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        {
+            *--end = 0;
+        }
+        if (*text == 0 || *text == '#')
+        {
+            continue;
+        }
+
+        if (script_line_count == SCRIPT_MAX_LINES)
+        {
+            return false;
+        }
+        index = script_line_count++;
+        line = &script_lines[index];
+        memset(line, 0, sizeof(*line));
+        line->number = number;
+        if (!ScriptParseLine(text, line))
+        {
+            return false;
+        }
+
+        switch (line->type)
+        {
+        case LINE_LOOP:
+        case LINE_IF:
+            if (depth == SCRIPT_MAX_DEPTH)
+            {
+                return false;
+            }
+            stack[depth++] = index;
+            break;
+
+        case LINE_ELSE:
+            // Must be inside an if without an else yet
+            if (depth == 0)
+            {
+                return false;
+            }
+            open = &script_lines[stack[depth - 1]];
+            if (open->type != LINE_IF)
+            {
+                return false;
+            }
+            open->jump = index;
+            stack[depth - 1] = index;
+            break;
+
+        case LINE_END:
+            if (depth == 0)
+            {
+                return false;
+            }
+            open = &script_lines[stack[--depth]];
+            open->jump = index;
+            if (open->type == LINE_LOOP)
+            {
+                line->closes_loop = true;
+                line->jump = stack[depth];
+            }
+            break;
+        }
+    }
+
+    if (depth)
+    {
+        *error_line = script_lines[stack[depth - 1]].number;
+        return false;
+    }
+    return true;
+}
+
+//*****************************************************************************
+// ScriptCondition
+// Evaluates an if line against current telemetry.
+//
+//*****************************************************************************
+static bool ScriptCondition(const script_line_t *line)
+{
+    int32_t value = 0;
+
+    switch (line->var)
+    {
+    case VAR_BATT:  value = AnalogVoltageRead(); break;
+    case VAR_AUX0:  value = GpioLevelPeek(0); break;
+    case VAR_AUX1:  value = GpioLevelPeek(1); break;
+    case VAR_FAULT: value = MotorDCFaultGet(NULL); break;
+    case VAR_PUMP:  value = PumpSpeedGet(); break;
+    case VAR_DOSE:  value = PumpDoseActive(NULL); break;
+    }
+
+    switch (line->op)
+    {
+    case OP_LT: return value < line->value;
+    case OP_GT: return value > line->value;
+    case OP_LE: return value <= line->value;
+    case OP_GE: return value >= line->value;
+    case OP_EQ: return value == line->value;
+    default:    return value != line->value;
+    }
+}
+
+//*****************************************************************************
+// ScriptWaitUntil
+// Sleeps until the esp_timer time deadline_us. Returns false if the script
+// was stopped while waiting.
+//
+//*****************************************************************************
+static bool ScriptWaitUntil(int64_t deadline_us)
+{
+    int64_t remaining_us;
+
+    while (!script_stop)
+    {
+        remaining_us = deadline_us - esp_timer_get_time();
+        if (remaining_us <= 0)
+        {
+            return true;
+        }
+        // Round up so the deadline is never cut short by a tick
+        ulTaskNotifyTake(pdTRUE, (remaining_us / 1000 + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    }
+    return false;
+}
+
+//*****************************************************************************
+// ScriptRun
+// Executes the parsed script. Returns SCRIPT_OK, a SCRIPT_ERR_xxx code or
+// the CMDLINE_xxx code of a failing command.
+//
+//*****************************************************************************
+static int ScriptRun(void)
+{
+    char cmd[SCRIPT_CMD_SIZE];
+    uint16_t pc = 0;
+    int64_t mark_us = esp_timer_get_time();
+    bool waited = false;
+    script_line_t *line, *loop;
+    int result;
+
+    while (pc < script_line_count)
+    {
+        if (script_stop)
+        {
+            return SCRIPT_ERR_STOPPED;
+        }
+
+        line = &script_lines[pc];
+        script_status.line = line->number;
+
+        switch (line->type)
+        {
+        case LINE_CMD:
+            // CmdLineProcess splits the line in place, so work on a copy
+            strcpy(cmd, line->text);
+            result = CmdLineExecute(cmd);
+            if (result)
+            {
+                ESP_LOGW(TAG, "%s line %u: %s failed (%d)", script_status.name, line->number, line->text, result);
+                return result;
+            }
+            pc++;
+            break;
+
+        case LINE_WAIT:
+            mark_us += (int64_t)line->value * 1000;
+            if (mark_us < esp_timer_get_time())
+            {
+                // Commands overran the wait, resynchronise
+                mark_us = esp_timer_get_time();
+            }
+            if (!ScriptWaitUntil(mark_us))
+            {
+                return SCRIPT_ERR_STOPPED;
+            }
+            waited = true;
+            pc++;
+            break;
+
+        case LINE_LOOP:
+            line->remaining = line->value;
+            pc++;
+            break;
+
+        case LINE_IF:
+            pc = ScriptCondition(line) ? pc + 1 : line->jump + 1;
+            break;
+
+        case LINE_ELSE:
+            pc = line->jump + 1;
+            break;
+
+        case LINE_END:
+            pc++;
+            if (line->closes_loop)
+            {
+                loop = &script_lines[line->jump];
+                if ((loop->value == 0) || (--loop->remaining > 0))
+                {
+                    pc = line->jump + 1;
+
+                    // Let lower priority tasks run if the body never waits
+                    if (!waited)
+                    {
+                        vTaskDelay(1);
+                    }
+                    waited = false;
+                }
+            }
+            break;
+        }
+    }
+    return SCRIPT_OK;
+}
+
+//*****************************************************************************
+// ScriptTask
+// Runs a script each time ScriptStart wakes it.
+//
+//*****************************************************************************
+static void ScriptTask(void *pvParameters)
+{
+    int result;
+
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!script_pending)
+        {
+            // Late stop request, nothing to start
+            continue;
+        }
+        script_pending = false;
+
+        ESP_LOGI(TAG, "Run %s", script_status.name);
+        result = ScriptRun();
+        if (result != SCRIPT_OK)
+        {
+            MotorDCSetSpeed(MOTOR_L, 0, 0);
+            MotorDCSetSpeed(MOTOR_R, 0, 0);
+            PumpSpeedSet(0);
+        }
+        ESP_LOGI(TAG, "%s done (%d)", script_status.name, result);
+
+        portENTER_CRITICAL(&script_mux);
+        script_status.error = result;
+        script_status.running = false;
+        portEXIT_CRITICAL(&script_mux);
+    }
+}
+
+//*****************************************************************************
+// ScriptStart
+// Loads, checks and starts the named script. On a syntax error returns
+// ESP_FAIL with the source line in error_line (if not NULL). Returns
+// ESP_ERR_INVALID_STATE if a script is already running.
+//
+//*****************************************************************************
+esp_err_t ScriptStart(const char *name, uint16_t *error_line)
+{
+    char path[sizeof(SCRIPT_DIR) + SCRIPT_NAME_MAX + 1];
+    uint16_t line = 0;
+    size_t len;
+    FILE *file;
+    bool busy;
+
+    if (!name[0] || strlen(name) > SCRIPT_NAME_MAX || strchr(name, '/'))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Claim the script buffers
+    portENTER_CRITICAL(&script_mux);
+    busy = script_status.running;
+    script_status.running = true;
+    portEXIT_CRITICAL(&script_mux);
+    if (busy)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    sprintf(path, SCRIPT_DIR "/%s", name);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        script_status.running = false;
+        return ESP_ERR_NOT_FOUND;
+    }
+    len = fread(script_text, 1, sizeof(script_text), file);
+    fclose(file);
+    if (len > SCRIPT_MAX_SIZE)
+    {
+        script_status.running = false;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    script_text[len] = 0;
+
+    if (!ScriptParse(&line))
+    {
+        ESP_LOGE(TAG, "%s: syntax error on line %u", name, line);
+        if (error_line)
+        {
+            *error_line = line;
+        }
+        script_status.running = false;
+        return ESP_FAIL;
+    }
+
+    strcpy(script_status.name, name);
+    script_status.line = 0;
+    script_status.error = SCRIPT_OK;
+    script_status.runs++;
+    script_stop = false;
+    script_pending = true;
+    xTaskNotifyGive(script_task_handle);
+    return ESP_OK;
+}
+
+//*****************************************************************************
+// ScriptStop
+// Stops the running script at the next line or during a wait.
+//
+//*****************************************************************************
+void ScriptStop(void)
+{
+    if (script_status.running)
+    {
+        script_stop = true;
+        xTaskNotifyGive(script_task_handle);
+    }
+}
+
+//*****************************************************************************
+// ScriptStatus
+//
+//*****************************************************************************
+void ScriptStatus(script_status_t *status)
+{
+    portENTER_CRITICAL(&script_mux);
+    *status = script_status;
+    portEXIT_CRITICAL(&script_mux);
+}
+
+//*****************************************************************************
+// ScriptInit
+//
+//*****************************************************************************
+void ScriptInit(void)
+{
+    xTaskCreate(ScriptTask, "script_task", 4096, NULL, 5, &script_task_handle);
+}
+
+// end of script.c
@@ -0,0 +1,37 @@
+//******************************************************************************
+//
+// script.h
+//
+//******************************************************************************
+
+// Scripts are read from this directory
+#define SCRIPT_DIR              "/spiffs"
+
+// Largest script file and most lines in one script
+#define SCRIPT_MAX_SIZE         4096
+#define SCRIPT_MAX_LINES        128
+
+// Longest script name (file name without directory)
+#define SCRIPT_NAME_MAX         32
+
+// Script error codes, reported in script_status_t.error. Console command
+// failures are reported as the command's own CMDLINE_xxx code.
+#define SCRIPT_OK               0
+#define SCRIPT_ERR_STOPPED      1       // Stopped by ScriptStop
+#define SCRIPT_ERR_SYNTAX       2       // Bad directive, unmatched loop/if/end
+
+typedef struct
+{
+    bool running;
+    char name[SCRIPT_NAME_MAX + 1];
+    uint16_t line;              // Line being executed (1 based), or failing line
+    int16_t error;              // Result of the last run
+    uint32_t runs;              // Runs started since boot
+} script_status_t;
+
+esp_err_t ScriptStart(const char *name, uint16_t *error_line);
+void ScriptStop(void);
+void ScriptStatus(script_status_t *status);
+void ScriptInit(void);
+
+// end of script.h
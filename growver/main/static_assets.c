@@ -0,0 +1,349 @@
+//*****************************************************************************
+//
+// static_assets.c - Serves the web pages built into the firmware.
+//
+// tools/web_assets.py minifies and gzips the pages, scripts and styles at
+// build time and packs them into one blob, web_assets.bin, embedded in the
+// app image. The pack starts with a hash table of the paths, followed by an
+// entry per asset with its content type, cache control, ETags and the
+// offsets of its data and gzip variant. The app image is mapped into the
+// address space from flash, so responses are sent straight from the pack
+// without copying the data to RAM.
+//
+// StaticAssetGetHandler serves any asset in the pack, so one handler covers
+// them all. The gzip variant is sent to clients that accept it. Every
+// response carries a strong ETag and Cache-Control, and a request whose
+// If-None-Match matches is answered with an empty 304, so reloads cost a
+// header exchange.
+//
+// A storage image update (see storage_ota.c) can replace a page by placing
+// it, and optionally a .gz of it, in STATIC_ASSET_UI_DIR.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_http_server.h"
+#include "static_assets.h"
+#include "buf_pool.h"
+
+extern const uint8_t web_assets_start[] asm("_binary_web_assets_bin_start");
+extern const uint8_t web_assets_end[]   asm("_binary_web_assets_bin_end");
+
+//*****************************************************************************
+// StaticAssetHash
+// FNV-1a, as used by tools/web_assets.py to place the paths.
+//
+//*****************************************************************************
+static uint32_t StaticAssetHash(const char *path)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    while (*path)
+    {
+        hash = (hash ^ (uint8_t)*path++) * 0x01000193;
+    }
+    return hash;
+}
+
+//*****************************************************************************
+// StaticAssetFind
+// Looks up an asset by path ("/index.html"). The pack is read with memcpy
+// as the embedded blob is not necessarily aligned.
+//
+//*****************************************************************************
+bool StaticAssetFind(const char *path, static_asset_t *asset)
+{
+    static_asset_pack_t pack;
+    static_asset_entry_t entry;
+    const uint8_t *buckets;
+    const char *strings;
+    uint32_t hash = StaticAssetHash(path);
+    uint16_t index;
+
+    if (web_assets_end - web_assets_start < sizeof(pack))
+    {
+        return false;
+    }
+    memcpy(&pack, web_assets_start, sizeof(pack));
+    if (memcmp(pack.magic, STATIC_ASSET_PACK_MAGIC, sizeof(pack.magic)) ||
+        (pack.version != STATIC_ASSET_PACK_VERSION) || (pack.buckets == 0))
+    {
+        return false;
+    }
+    buckets = web_assets_start + sizeof(pack);
+    strings = (const char *)web_assets_start + pack.strings;
+
+    // Linear probing from the path's bucket up to an empty one
+    for (uint16_t i = 0; i < pack.buckets; i++)
+    {
+        memcpy(&index, buckets + ((hash + i) & (pack.buckets - 1)) * sizeof(index), sizeof(index));
+        if (index == 0)
+        {
+            break;
+        }
+        memcpy(&entry, buckets + ((pack.buckets * sizeof(index) + 3) & ~3) + (index - 1) * sizeof(entry),
+               sizeof(entry));
+        if ((entry.hash == hash) && !strcmp(strings + entry.path, path))
+        {
+            asset->path = strings + entry.path;
+            asset->type = strings + entry.type;
+            asset->cache_control = strings + entry.cache_control;
+            asset->etag = strings + entry.etag;
+            asset->etag_gz = strings + entry.etag_gz;
+            asset->data = web_assets_start + entry.data;
+            asset->data_len = entry.data_len;
+            asset->gz = web_assets_start + entry.gz;
+            asset->gz_len = entry.gz_len;
+            return true;
+        }
+    }
+    return false;
+}
+
+//*****************************************************************************
+// StaticAssetQZero
+// True if the parameters of an Accept-Encoding coding (from just after its
+// name up to the comma) hold a q-value of zero: "0", "0.", "0.0" to "0.000".
+//
+//*****************************************************************************
+static bool StaticAssetQZero(const char *params, size_t len)
+{
+    const char *end = params + len;
+    const char *q = NULL;
+    const char *p;
+
+    for (p = params; (p < end) && (q == NULL); p++)
+    {
+        if (*p != ';')
+        {
+            continue;
+        }
+        for (q = p + 1; q < end && (*q == ' ' || *q == '\t'); q++)
+        {
+        }
+        if ((end - q < 2) || (q[0] != 'q' && q[0] != 'Q') || q[1] != '=')
+        {
+            q = NULL;
+        }
+    }
+    if (q == NULL)
+    {
+        return false;
+    }
+
+    q += 2;
+    if (q >= end || *q++ != '0')
+    {
+        return false;
+    }
+    if (q < end && *q == '.')
+    {
+        for (q++; q < end && *q == '0'; q++)
+        {
+        }
+    }
+    while (q < end && (*q == ' ' || *q == '\t'))
+    {
+        q++;
+    }
+    return (q == end) || (*q == ';');
+}
+
+//*****************************************************************************
+// StaticAssetAcceptsGzip
+// True if the request's Accept-Encoding lists gzip (or its alias x-gzip) with
+// a q-value other than zero.
+//
+//*****************************************************************************
+bool StaticAssetAcceptsGzip(httpd_req_t *req)
+{
+    char accept[128];
+    const char *coding;
+    size_t len, name_len;
+
+    if (httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept, sizeof(accept)) != ESP_OK)
+    {
+        return false;
+    }
+
+    for (coding = accept; *coding; coding += len + (coding[len] == ','))
+    {
+        coding += strspn(coding, " \t");
+        len = strcspn(coding, ",");
+        name_len = strcspn(coding, ";, \t");
+        if (((name_len == 4) && !strncasecmp(coding, "gzip", 4)) ||
+            ((name_len == 6) && !strncasecmp(coding, "x-gzip", 6)))
+        {
+            return !StaticAssetQZero(coding + name_len, len - name_len);
+        }
+    }
+    return false;
+}
+
+//*****************************************************************************
+// StaticAssetNotModified
+// True if the request's If-None-Match lists etag (or is "*"). Sends the 304
+// response in that case.
+//
+//*****************************************************************************
+bool StaticAssetNotModified(httpd_req_t *req, const char *etag)
+{
+    char match[128];
+
+    if ((httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) != ESP_OK) ||
+        ((strstr(match, etag) == NULL) && strcmp(match, "*")))
+    {
+        return false;
+    }
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_send(req, NULL, 0);
+    return true;
+}
+
+//*****************************************************************************
+// StaticAssetSendOverride
+// Sends STATIC_ASSET_UI_DIR/name (or name.gz) if present. Returns
+// ESP_ERR_NOT_FOUND if there is no override.
+//
+//*****************************************************************************
+static esp_err_t StaticAssetSendOverride(httpd_req_t *req, const char *name, const char *type, bool gzip)
+{
+    char *chunk;
+    char path[48];
+    size_t len;
+    FILE *fd = NULL;
+
+    if (gzip)
+    {
+        snprintf(path, sizeof(path), STATIC_ASSET_UI_DIR "/%s.gz", name);
+        fd = fopen(path, "r");
+    }
+    if (fd == NULL)
+    {
+        gzip = false;
+        snprintf(path, sizeof(path), STATIC_ASSET_UI_DIR "/%s", name);
+        fd = fopen(path, "r");
+    }
+    if (fd == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    chunk = BufPoolAcquire(BUF_POOL_ASSET);
+    if (chunk == NULL)
+    {
+        fclose(fd);
+        return BufPoolRespondBusy(req);
+    }
+
+    httpd_resp_set_type(req, type);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    if (gzip)
+    {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    }
+    do
+    {
+        len = fread(chunk, 1, BUF_POOL_ASSET_SIZE, fd);
+        if ((len > 0) && (httpd_resp_send_chunk(req, chunk, len) != ESP_OK))
+        {
+            break;
+        }
+    } while (len > 0);
+    fclose(fd);
+    BufPoolRelease(BUF_POOL_ASSET, chunk);
+    if (len > 0)
+    {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+//*****************************************************************************
+// StaticAssetSend
+// Responds with the asset at path ("/index.html").
+//
+//*****************************************************************************
+esp_err_t StaticAssetSend(httpd_req_t *req, const char *path)
+{
+    static_asset_t asset;
+    bool gzip = StaticAssetAcceptsGzip(req);
+    esp_err_t err;
+
+    if (!StaticAssetFind(path, &asset))
+    {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such page");
+    }
+
+    err = StaticAssetSendOverride(req, path + 1, asset.type, gzip);
+    if (err != ESP_ERR_NOT_FOUND)
+    {
+        return err;
+    }
+
+    gzip = gzip && asset.gz_len;
+    if (StaticAssetNotModified(req, gzip ? asset.etag_gz : asset.etag))
+    {
+        return ESP_OK;
+    }
+    httpd_resp_set_type(req, asset.type);
+    httpd_resp_set_hdr(req, "ETag", gzip ? asset.etag_gz : asset.etag);
+    httpd_resp_set_hdr(req, "Cache-Control", asset.cache_control);
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    if (gzip)
+    {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        return httpd_resp_send(req, (const char *)asset.gz, asset.gz_len);
+    }
+    return httpd_resp_send(req, (const char *)asset.data, asset.data_len);
+}
+
+//*****************************************************************************
+// StaticAssetGetHandler
+// GET of any asset in the pack. Register it last, as "/*", so other
+// handlers match first. "/" is the control page, "/assets/<name>?v=<hash>"
+// (the versioned URL pages use for scripts and styles) is "/<name>", and
+// ".html" may be left out.
+//
+//*****************************************************************************
+esp_err_t StaticAssetGetHandler(httpd_req_t *req)
+{
+    static_asset_t asset;
+    char path[48];
+    const char *uri = req->uri;
+    size_t len;
+
+    if (!strncmp(uri, "/assets/", strlen("/assets/")))
+    {
+        uri += strlen("/assets");
+    }
+    len = strcspn(uri, "?");
+    if (len + sizeof(".html") > sizeof(path))
+    {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such page");
+    }
+    memcpy(path, uri, len);
+    path[len] = 0;
+
+    if (!strcmp(path, "/"))
+    {
+        strcpy(path, "/index.html");
+    }
+    else if (!StaticAssetFind(path, &asset) && (strchr(path, '.') == NULL))
+    {
+        strcat(path, ".html");
+    }
+    return StaticAssetSend(req, path);
+}
+
+// end of static_assets.c
@@ -0,0 +1,61 @@
+//******************************************************************************
+//
+// static_assets.h
+//
+//******************************************************************************
+
+// Pages in this SPIFFS directory replace the copies built into the firmware
+#define STATIC_ASSET_UI_DIR     "/spiffs/ui"
+
+// Asset pack built by tools/web_assets.py, little endian
+#define STATIC_ASSET_PACK_MAGIC     "GWAP"
+#define STATIC_ASSET_PACK_VERSION   1
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint16_t buckets;           // Power of 2
+    uint16_t reserved;
+    uint32_t strings;           // Offset of the string area
+} static_asset_pack_t;
+
+// String fields are offsets into the string area, data offsets are from
+// the start of the pack. gz_len is 0 when gzip would not be smaller.
+typedef struct
+{
+    uint32_t hash;              // FNV-1a of path
+    uint16_t path;
+    uint16_t type;
+    uint16_t cache_control;
+    uint16_t etag;
+    uint16_t etag_gz;
+    uint16_t reserved;
+    uint32_t data;
+    uint32_t data_len;
+    uint32_t gz;
+    uint32_t gz_len;
+} static_asset_entry_t;
+
+// One asset, pointing into the pack in flash
+typedef struct
+{
+    const char *path;
+    const char *type;
+    const char *cache_control;
+    const char *etag;
+    const char *etag_gz;
+    const uint8_t *data;
+    size_t data_len;
+    const uint8_t *gz;
+    size_t gz_len;
+} static_asset_t;
+
+bool StaticAssetFind(const char *path, static_asset_t *asset);
+esp_err_t StaticAssetSend(httpd_req_t *req, const char *path);
+esp_err_t StaticAssetGetHandler(httpd_req_t *req);
+bool StaticAssetAcceptsGzip(httpd_req_t *req);
+bool StaticAssetNotModified(httpd_req_t *req, const char *etag);
+
+// end of static_assets.h
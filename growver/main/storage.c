@@ -0,0 +1,650 @@
+//*****************************************************************************
+//
+// storage.c - Mounts the storage partition as SPIFFS or LittleFS.
+//
+// The file system is chosen at build time (Storage filesystem in the
+// project configuration). LittleFS has real directories, and its open and
+// stat do not slow down with the number of files as SPIFFS does; it needs
+// the esp_littlefs component in components/littlefs.
+//
+// A LittleFS build that finds SPIFFS in the partition, either from before
+// the switch or from a storage image update (see storage_ota.c), migrates
+// it once: the files are packed into the idle OTA app partition, the
+// partition is formatted as LittleFS and the files are unpacked into it.
+// Names containing '/' become directories. The packed copy is recorded in
+// NVS with its SHA-256 before anything is formatted, so a migration cut
+// short by a reset is redone from the copy on the next boot. As with a
+// storage image update, this overwrites the previous firmware kept in the
+// idle partition.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "esp_spiffs.h"
+#include "nvs.h"
+#if CONFIG_STORAGE_FS_LITTLEFS
+#include "esp_littlefs.h"
+#endif
+#include "storage_ota.h"
+#include "storage.h"
+
+static const char *TAG = "storage";
+
+// True once LittleFS is mounted, false while on SPIFFS
+static bool storage_littlefs;
+
+//*****************************************************************************
+// StorageMountSpiffs
+//
+//*****************************************************************************
+static esp_err_t StorageMountSpiffs(bool format)
+{
+    esp_vfs_spiffs_conf_t conf =
+    {
+        .base_path = STORAGE_BASE_PATH,
+        .partition_label = STORAGE_OTA_LABEL,
+        .max_files = CONFIG_STORAGE_MAX_FILES,
+        .format_if_mount_failed = format
+    };
+
+    storage_littlefs = false;
+    return esp_vfs_spiffs_register(&conf);
+}
+
+//*****************************************************************************
+// StorageReport
+// Logs the outcome of mounting and the partition use, and drops the temp
+// file of an upload cut short by a reset.
+//
+//*****************************************************************************
+static esp_err_t StorageReport(esp_err_t err)
+{
+    size_t total = 0, used = 0;
+
+    if (err == ESP_OK)
+    {
+        err = StorageInfo(&total, &used);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to mount %s (%s)", storage_littlefs ? "LittleFS" : "SPIFFS", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "%s partition size: total: %d, used: %d", storage_littlefs ? "LittleFS" : "SPIFFS", total, used);
+    unlink(STORAGE_UPLOAD_TEMP);
+    return ESP_OK;
+}
+
+#if CONFIG_STORAGE_FS_LITTLEFS
+
+// Packed files in the staging partition: per file a header, the name and
+// the content, each padded to 4 bytes, then a header with no name.
+#define STORAGE_PACK_MAGIC      0x4d534647      // "GFSM"
+#define STORAGE_PACK_ALIGN(n)   (((n) + 3) & ~3)
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t name_len;
+    uint16_t reserved;
+    uint32_t size;
+} storage_pack_hdr_t;
+
+// Sequential writer to a partition in whole blocks
+typedef struct
+{
+    const esp_partition_t *partition;
+    uint32_t offset;            // Partition offset of buf
+    uint8_t *buf;
+    uint32_t len;
+    esp_err_t err;
+} storage_pack_t;
+
+//*****************************************************************************
+// StorageMountLittlefs
+//
+//*****************************************************************************
+static esp_err_t StorageMountLittlefs(bool format)
+{
+    esp_vfs_littlefs_conf_t conf =
+    {
+        .base_path = STORAGE_BASE_PATH,
+        .partition_label = STORAGE_OTA_LABEL,
+        .format_if_mount_failed = format
+    };
+    esp_err_t err = esp_vfs_littlefs_register(&conf);
+
+    storage_littlefs = (err == ESP_OK);
+    return err;
+}
+
+//*****************************************************************************
+// StoragePackWrite
+// Appends len bytes, and zeros up to the next multiple of 4 if pad.
+//
+//*****************************************************************************
+static esp_err_t StoragePackWrite(storage_pack_t *pack, const void *data, uint32_t len, bool pad)
+{
+    static const uint8_t zeros[3];
+    const uint8_t *p = data;
+    uint32_t n;
+
+    while (len && pack->err == ESP_OK)
+    {
+        n = STORAGE_OTA_BLOCK_SIZE - pack->len;
+        n = (len < n) ? len : n;
+        memcpy(&pack->buf[pack->len], p, n);
+        pack->len += n;
+        p += n;
+        len -= n;
+        if (pack->len == STORAGE_OTA_BLOCK_SIZE)
+        {
+            pack->err = esp_partition_write(pack->partition, pack->offset, pack->buf, pack->len);
+            pack->offset += pack->len;
+            pack->len = 0;
+        }
+    }
+    if (pad && (pack->len & 3))
+    {
+        StoragePackWrite(pack, zeros, 4 - (pack->len & 3), false);
+    }
+    return pack->err;
+}
+
+//*****************************************************************************
+// StoragePackFile
+// Appends one file from the mounted SPIFFS.
+//
+//*****************************************************************************
+static esp_err_t StoragePackFile(storage_pack_t *pack, const char *name, uint32_t size, uint8_t *chunk)
+{
+    char path[sizeof(STORAGE_BASE_PATH) + STORAGE_NAME_MAX + 1];
+    storage_pack_hdr_t hdr = { STORAGE_PACK_MAGIC, strlen(name), 0, size };
+    uint32_t remaining = size;
+    size_t len;
+    FILE *fd;
+
+    sprintf(path, STORAGE_BASE_PATH "/%s", name);
+    fd = fopen(path, "r");
+    if (fd == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    StoragePackWrite(pack, &hdr, sizeof(hdr), false);
+    StoragePackWrite(pack, name, hdr.name_len, true);
+    while (remaining && pack->err == ESP_OK)
+    {
+        len = fread(chunk, 1, (remaining < STORAGE_OTA_BLOCK_SIZE) ? remaining : STORAGE_OTA_BLOCK_SIZE, fd);
+        if (len == 0)
+        {
+            pack->err = ESP_FAIL;
+            break;
+        }
+        StoragePackWrite(pack, chunk, len, false);
+        remaining -= len;
+    }
+    fclose(fd);
+    return StoragePackWrite(pack, NULL, 0, true);
+}
+
+//*****************************************************************************
+// StoragePack
+// Packs every file of the mounted SPIFFS into the staging partition.
+// Returns the packed size.
+//
+//*****************************************************************************
+static esp_err_t StoragePack(const esp_partition_t *staging, uint32_t *size)
+{
+    storage_pack_hdr_t end = { STORAGE_PACK_MAGIC, 0, 0, 0 };
+    storage_pack_t pack = { staging, 0, NULL, 0, ESP_OK };
+    struct dirent *entry;
+    struct stat file_stat;
+    char path[sizeof(STORAGE_BASE_PATH) + STORAGE_NAME_MAX + 1];
+    uint32_t total = sizeof(end);
+    uint8_t *chunk;
+    DIR *dir;
+
+    // Size first, to erase only what is needed
+    dir = opendir(STORAGE_BASE_PATH);
+    if (dir == NULL)
+    {
+        return ESP_FAIL;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        sprintf(path, STORAGE_BASE_PATH "/%.*s", STORAGE_NAME_MAX, entry->d_name);
+        if ((stat(path, &file_stat) == 0) && S_ISREG(file_stat.st_mode))
+        {
+            total += sizeof(end) + STORAGE_PACK_ALIGN(strlen(entry->d_name)) + STORAGE_PACK_ALIGN(file_stat.st_size);
+        }
+    }
+    if (total > staging->size)
+    {
+        closedir(dir);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    pack.buf = malloc(STORAGE_OTA_BLOCK_SIZE);
+    chunk = malloc(STORAGE_OTA_BLOCK_SIZE);
+    pack.err = (pack.buf && chunk) ? ESP_OK : ESP_ERR_NO_MEM;
+    if (pack.err == ESP_OK)
+    {
+        pack.err = esp_partition_erase_range(staging, 0,
+                                             (total + STORAGE_OTA_BLOCK_SIZE - 1) & ~(STORAGE_OTA_BLOCK_SIZE - 1));
+    }
+
+    rewinddir(dir);
+    while ((pack.err == ESP_OK) && (entry = readdir(dir)) != NULL)
+    {
+        sprintf(path, STORAGE_BASE_PATH "/%.*s", STORAGE_NAME_MAX, entry->d_name);
+        if ((stat(path, &file_stat) == 0) && S_ISREG(file_stat.st_mode))
+        {
+            StoragePackFile(&pack, entry->d_name, file_stat.st_size, chunk);
+        }
+    }
+    closedir(dir);
+
+    StoragePackWrite(&pack, &end, sizeof(end), false);
+    if ((pack.err == ESP_OK) && pack.len)
+    {
+        pack.err = esp_partition_write(staging, pack.offset, pack.buf, pack.len);
+    }
+    *size = pack.offset + pack.len;
+    free(pack.buf);
+    free(chunk);
+    return pack.err;
+}
+
+//*****************************************************************************
+// StorageUnpack
+// Writes the packed files into the mounted LittleFS.
+//
+//*****************************************************************************
+static esp_err_t StorageUnpack(const esp_partition_t *staging, uint32_t size)
+{
+    char path[sizeof(STORAGE_BASE_PATH) + STORAGE_NAME_MAX + 1];
+    char *name = &path[sizeof(STORAGE_BASE_PATH)];
+    storage_pack_hdr_t hdr;
+    uint32_t offset = 0;
+    uint32_t files = 0;
+    uint32_t len;
+    uint8_t *chunk = malloc(STORAGE_OTA_BLOCK_SIZE);
+    esp_err_t err = chunk ? ESP_OK : ESP_ERR_NO_MEM;
+    FILE *fd;
+
+    strcpy(path, STORAGE_BASE_PATH "/");
+    while (err == ESP_OK)
+    {
+        err = esp_partition_read(staging, offset, &hdr, sizeof(hdr));
+        offset += sizeof(hdr);
+        if ((err != ESP_OK) || (hdr.magic != STORAGE_PACK_MAGIC) || (hdr.name_len > STORAGE_NAME_MAX) ||
+            (offset + STORAGE_PACK_ALIGN(hdr.name_len) + STORAGE_PACK_ALIGN(hdr.size) > size))
+        {
+            err = (err != ESP_OK) ? err : ESP_ERR_INVALID_CRC;
+            break;
+        }
+        if (hdr.name_len == 0)
+        {
+            break;
+        }
+
+        err = esp_partition_read(staging, offset, name, hdr.name_len);
+        name[hdr.name_len] = 0;
+        offset += STORAGE_PACK_ALIGN(hdr.name_len);
+        StorageMakeParents(path);
+        fd = (err == ESP_OK) ? fopen(path, "w") : NULL;
+        if (fd == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to create %s", path);
+            err = (err != ESP_OK) ? err : ESP_FAIL;
+            break;
+        }
+        for (uint32_t done = 0; (done < hdr.size) && (err == ESP_OK); done += len)
+        {
+            len = hdr.size - done;
+            len = (len < STORAGE_OTA_BLOCK_SIZE) ? len : STORAGE_OTA_BLOCK_SIZE;
+            err = esp_partition_read(staging, offset + done, chunk, len);
+            if ((err == ESP_OK) && (fwrite(chunk, 1, len, fd) != len))
+            {
+                err = ESP_FAIL;
+            }
+        }
+        fclose(fd);
+        offset += STORAGE_PACK_ALIGN(hdr.size);
+        files++;
+    }
+
+    free(chunk);
+    ESP_LOGI(TAG, "Unpacked %u files (%s)", files, esp_err_to_name(err));
+    return err;
+}
+
+//*****************************************************************************
+// StorageMigrateRecord
+// Reads (set false) or writes (set true) the NVS record of a packed copy.
+// A size of 0 written clears it.
+//
+//*****************************************************************************
+static esp_err_t StorageMigrateRecord(bool set, uint32_t *addr, uint32_t *size, uint8_t *sha256)
+{
+    nvs_handle_t nvs;
+    size_t len = 32;
+    esp_err_t err;
+
+    err = nvs_open(STORAGE_MIGRATE_NVS_NAMESPACE, set ? NVS_READWRITE : NVS_READONLY, &nvs);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    if (!set)
+    {
+        err = nvs_get_u32(nvs, "addr", addr);
+        err = (err == ESP_OK) ? nvs_get_u32(nvs, "size", size) : err;
+        err = (err == ESP_OK) ? nvs_get_blob(nvs, "sha256", sha256, &len) : err;
+        err = ((err == ESP_OK) && (*size == 0)) ? ESP_ERR_NOT_FOUND : err;
+    }
+    else if (*size == 0)
+    {
+        err = nvs_erase_all(nvs);
+        err = (err == ESP_OK) ? nvs_commit(nvs) : err;
+    }
+    else
+    {
+        err = nvs_set_u32(nvs, "addr", *addr);
+        err = (err == ESP_OK) ? nvs_set_u32(nvs, "size", *size) : err;
+        err = (err == ESP_OK) ? nvs_set_blob(nvs, "sha256", sha256, 32) : err;
+        err = (err == ESP_OK) ? nvs_commit(nvs) : err;
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+//*****************************************************************************
+// StorageMigrateStage
+// Packs the mounted SPIFFS into the idle OTA partition and records it. The
+// caller unmounts SPIFFS afterwards.
+//
+//*****************************************************************************
+static esp_err_t StorageMigrateStage(void)
+{
+    const esp_partition_t *staging = StorageOtaStaging();
+    uint8_t sha256[32];
+    uint32_t addr, size = 0;
+    esp_err_t err;
+
+    if (staging == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    err = StoragePack(staging, &size);
+    if (err == ESP_OK)
+    {
+        err = StorageOtaHash(staging, size, sha256);
+    }
+    if (err == ESP_OK)
+    {
+        addr = staging->address;
+        err = StorageMigrateRecord(true, &addr, &size, sha256);
+    }
+    ESP_LOGI(TAG, "SPIFFS packed into %u bytes at 0x%x (%s)", size, staging->address, esp_err_to_name(err));
+    return err;
+}
+
+//*****************************************************************************
+// StorageMigrateFinish
+// Formats the partition as LittleFS and unpacks the recorded copy into it,
+// then clears the record. A copy that no longer matches its hash is
+// dropped and LittleFS starts empty.
+//
+//*****************************************************************************
+static esp_err_t StorageMigrateFinish(uint32_t addr, uint32_t size, const uint8_t *sha256)
+{
+    const esp_partition_t *staging = StorageOtaPartitionAt(addr);
+    uint8_t digest[32];
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    if (staging && (staging != esp_ota_get_running_partition()) && (size <= staging->size))
+    {
+        err = StorageOtaHash(staging, size, digest);
+        err = ((err == ESP_OK) && memcmp(digest, sha256, sizeof(digest))) ? ESP_ERR_INVALID_CRC : err;
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Packed SPIFFS at 0x%x is gone (%s), starting empty", addr, esp_err_to_name(err));
+        size = 0;
+        StorageMigrateRecord(true, &addr, &size, NULL);
+        return StorageMountLittlefs(true);
+    }
+
+    err = esp_littlefs_format(STORAGE_OTA_LABEL);
+    if (err == ESP_OK)
+    {
+        err = StorageMountLittlefs(false);
+    }
+    if (err == ESP_OK)
+    {
+        err = StorageUnpack(staging, size);
+    }
+
+    // Keep the record after a failure so the migration is redone next boot
+    if (err == ESP_OK)
+    {
+        size = 0;
+        StorageMigrateRecord(true, &addr, &size, NULL);
+        ESP_LOGI(TAG, "Migrated SPIFFS to LittleFS");
+    }
+    return err;
+}
+
+//*****************************************************************************
+// StorageInit
+// Mounts the storage partition at STORAGE_BASE_PATH, migrating SPIFFS to
+// LittleFS first if needed. Call after StorageOtaApply.
+//
+//*****************************************************************************
+esp_err_t StorageInit(void)
+{
+    uint32_t addr = 0, size = 0;
+    uint8_t sha256[32];
+    esp_err_t err;
+
+    if (StorageMigrateRecord(false, &addr, &size, sha256) != ESP_OK)
+    {
+        if (StorageMountLittlefs(false) == ESP_OK)
+        {
+            return StorageReport(ESP_OK);
+        }
+
+        // Not LittleFS. Migrate SPIFFS, or format a blank partition.
+        if (StorageMountSpiffs(false) != ESP_OK)
+        {
+            ESP_LOGW(TAG, "No file system in the storage partition, formatting");
+            return StorageReport(StorageMountLittlefs(true));
+        }
+        err = StorageMigrateStage();
+        esp_vfs_spiffs_unregister(STORAGE_OTA_LABEL);
+        if (err == ESP_OK)
+        {
+            err = StorageMigrateRecord(false, &addr, &size, sha256);
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "SPIFFS could not be migrated (%s), staying on SPIFFS", esp_err_to_name(err));
+            return StorageReport(StorageMountSpiffs(false));
+        }
+    }
+
+    return StorageReport(StorageMigrateFinish(addr, size, sha256));
+}
+
+#else
+
+//*****************************************************************************
+// StorageInit
+// Mounts SPIFFS at STORAGE_BASE_PATH, formatting it if it does not mount.
+// Call after StorageOtaApply.
+//
+//*****************************************************************************
+esp_err_t StorageInit(void)
+{
+    return StorageReport(StorageMountSpiffs(true));
+}
+
+#endif
+
+//*****************************************************************************
+// StorageInfo
+// Size of the partition and bytes in use.
+//
+//*****************************************************************************
+esp_err_t StorageInfo(size_t *total, size_t *used)
+{
+#if CONFIG_STORAGE_FS_LITTLEFS
+    if (storage_littlefs)
+    {
+        return esp_littlefs_info(STORAGE_OTA_LABEL, total, used);
+    }
+#endif
+    return esp_spiffs_info(STORAGE_OTA_LABEL, total, used);
+}
+
+//*****************************************************************************
+// StorageMakeParents
+// Creates the directories leading to a file path. Nothing to do on SPIFFS,
+// where '/' is part of the name.
+//
+//*****************************************************************************
+void StorageMakeParents(const char *path)
+{
+    char dir[sizeof(STORAGE_BASE_PATH) + STORAGE_NAME_MAX + 1];
+    char *slash;
+
+    if (!storage_littlefs || strlen(path) >= sizeof(dir))
+    {
+        return;
+    }
+    strcpy(dir, path);
+    for (slash = strchr(&dir[sizeof(STORAGE_BASE_PATH)], '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = 0;
+        mkdir(dir, 0775);
+        *slash = '/';
+    }
+}
+
+//*****************************************************************************
+// StorageBench
+// Creates files in STORAGE_BENCH_DIR, measures the average latency of an
+// open, a stat and an append on each and the time to list them, then
+// deletes them. Takes seconds to minutes on SPIFFS with hundreds of files.
+//
+//*****************************************************************************
+esp_err_t StorageBench(uint32_t files, storage_bench_t *result)
+{
+    static const char data[STORAGE_BENCH_FILE_SIZE] = "growver storage benchmark data\n";
+    char path[sizeof(STORAGE_BENCH_DIR) + 8];
+    int64_t open_us = 0, stat_us = 0, append_us = 0, start;
+    size_t total, used;
+    struct stat file_stat;
+    struct dirent *entry;
+    esp_err_t err = ESP_OK;
+    uint32_t i, listed = 0;
+    FILE *fd;
+    DIR *dir;
+
+    memset(result, 0, sizeof(*result));
+
+    // Each file takes a couple of pages with its metadata
+    if ((files == 0) || (StorageInfo(&total, &used) != ESP_OK) || (total - used < files * 1024))
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    mkdir(STORAGE_BENCH_DIR, 0775);
+
+    for (i = 0; (i < files) && (err == ESP_OK); i++)
+    {
+        sprintf(path, STORAGE_BENCH_DIR "/f%04u", i);
+        fd = fopen(path, "w");
+        err = (fd && fwrite(data, 1, sizeof(data), fd) == sizeof(data)) ? ESP_OK : ESP_FAIL;
+        if (fd)
+        {
+            fclose(fd);
+        }
+    }
+
+    // Yield between files so the idle tasks are not starved
+    for (i = 0; (i < files) && (err == ESP_OK); i++)
+    {
+        sprintf(path, STORAGE_BENCH_DIR "/f%04u", i);
+        start = esp_timer_get_time();
+        fd = fopen(path, "r");
+        if (fd)
+        {
+            fclose(fd);
+        }
+        open_us += esp_timer_get_time() - start;
+
+        start = esp_timer_get_time();
+        err = (stat(path, &file_stat) == 0) ? err : ESP_FAIL;
+        stat_us += esp_timer_get_time() - start;
+
+        start = esp_timer_get_time();
+        fd = fopen(path, "a");
+        if (fd)
+        {
+            fwrite(data, 1, sizeof(data), fd);
+            fclose(fd);
+        }
+        append_us += esp_timer_get_time() - start;
+        err = fd ? err : ESP_FAIL;
+        vTaskDelay(1);
+    }
+
+    start = esp_timer_get_time();
+    dir = opendir(STORAGE_BENCH_DIR);
+    while (dir && (entry = readdir(dir)) != NULL)
+    {
+        listed += (entry->d_name[0] != '.');
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+    result->list_us = esp_timer_get_time() - start;
+
+    for (i = 0; i < files; i++)
+    {
+        sprintf(path, STORAGE_BENCH_DIR "/f%04u", i);
+        unlink(path);
+    }
+    rmdir(STORAGE_BENCH_DIR);
+
+    result->files = files;
+    result->open_us = open_us / files;
+    result->stat_us = stat_us / files;
+    result->append_us = append_us / files;
+    if ((err == ESP_OK) && (listed != files))
+    {
+        ESP_LOGW(TAG, "Listed %u of %u files", listed, files);
+    }
+    return err;
+}
+
+// end of storage.c
@@ -0,0 +1,44 @@
+//******************************************************************************
+//
+// storage.h
+//
+//******************************************************************************
+
+// Mount point of the storage partition. It keeps its name with LittleFS so
+// scripts, the UI override directory and /fs/ URLs do not change.
+#define STORAGE_BASE_PATH           "/spiffs"
+
+// Longest file name below STORAGE_BASE_PATH, including any directories
+#if CONFIG_STORAGE_FS_LITTLEFS
+#define STORAGE_NAME_MAX            128
+#else
+#define STORAGE_NAME_MAX            CONFIG_SPIFFS_OBJ_NAME_LEN
+#endif
+
+// Uploads are received here and renamed into place when complete. A leftover
+// from an interrupted upload is removed at mount.
+#define STORAGE_UPLOAD_TEMP         STORAGE_BASE_PATH "/.upload"
+
+// Record of a SPIFFS to LittleFS migration in progress
+#define STORAGE_MIGRATE_NVS_NAMESPACE "storage_mig"
+
+// Directory and size of the files made by StorageBench
+#define STORAGE_BENCH_DIR           STORAGE_BASE_PATH "/bench"
+#define STORAGE_BENCH_FILE_SIZE     32
+
+// Average latencies measured by StorageBench
+typedef struct
+{
+    uint32_t files;
+    uint32_t open_us;           // fopen for reading and fclose
+    uint32_t stat_us;
+    uint32_t append_us;         // fopen to append, fwrite, fclose
+    uint32_t list_us;           // opendir, readdir of every file, closedir
+} storage_bench_t;
+
+esp_err_t StorageInit(void);
+esp_err_t StorageInfo(size_t *total, size_t *used);
+void StorageMakeParents(const char *path);
+esp_err_t StorageBench(uint32_t files, storage_bench_t *result);
+
+// end of storage.h
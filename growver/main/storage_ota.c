@@ -0,0 +1,261 @@
+//*****************************************************************************
+//
+// storage_ota.c - Image updates of the SPIFFS storage partition.
+//
+// There is only one storage partition, so a new SPIFFS image can not be
+// written beside the old one. It is instead received into the idle OTA app
+// partition, checked against its SHA-256 and recorded as pending in NVS.
+// On the next boot, before SPIFFS is mounted, StorageOtaApply copies it
+// over the storage partition and clears the record once the copy hashes
+// correctly. A copy cut short by a reset is redone on the following boot,
+// so the mounted filesystem is always either the old or the new image.
+//
+// Staging is refused while a firmware update waits for its reboot, because
+// the idle partition then holds the new firmware. A firmware update after
+// staging overwrites the staged image; the hash check at boot catches that
+// and the pending record is dropped.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
+#include "storage_ota.h"
+
+static const char *TAG = "storage_ota";
+
+//*****************************************************************************
+// StorageOtaStaging
+// The partition a storage image is received into, or NULL while a firmware
+// update is waiting for its reboot.
+//
+//*****************************************************************************
+const esp_partition_t *StorageOtaStaging(void)
+{
+    if (esp_ota_get_boot_partition() != esp_ota_get_running_partition())
+    {
+        return NULL;
+    }
+    return esp_ota_get_next_update_partition(NULL);
+}
+
+//*****************************************************************************
+// StorageOtaPartitionAt
+// The app partition at a flash address recorded in NVS, or NULL.
+//
+//*****************************************************************************
+const esp_partition_t *StorageOtaPartitionAt(uint32_t addr)
+{
+    const esp_partition_t *partition = NULL;
+    esp_partition_iterator_t it;
+
+    it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+    for (; it && (partition == NULL); it = esp_partition_next(it))
+    {
+        if (esp_partition_get(it)->address == addr)
+        {
+            partition = esp_partition_get(it);
+        }
+    }
+    esp_partition_iterator_release(it);
+    return partition;
+}
+
+//*****************************************************************************
+// StorageOtaHash
+// SHA-256 of the first size bytes of a partition.
+//
+//*****************************************************************************
+esp_err_t StorageOtaHash(const esp_partition_t *partition, uint32_t size, uint8_t *sha256)
+{
+    mbedtls_sha256_context sha;
+    uint8_t *buf = malloc(STORAGE_OTA_BLOCK_SIZE);
+    uint32_t len;
+    esp_err_t err = buf ? ESP_OK : ESP_ERR_NO_MEM;
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    for (uint32_t offset = 0; (offset < size) && (err == ESP_OK); offset += len)
+    {
+        len = size - offset;
+        len = (len < STORAGE_OTA_BLOCK_SIZE) ? len : STORAGE_OTA_BLOCK_SIZE;
+        err = esp_partition_read(partition, offset, buf, len);
+        if (err == ESP_OK)
+        {
+            mbedtls_sha256_update_ret(&sha, buf, len);
+        }
+    }
+    mbedtls_sha256_finish_ret(&sha, sha256);
+    mbedtls_sha256_free(&sha);
+    free(buf);
+    return err;
+}
+
+//*****************************************************************************
+// StorageOtaSetPending
+// Records a verified image in the staging partition for the next boot.
+//
+//*****************************************************************************
+esp_err_t StorageOtaSetPending(const esp_partition_t *staging, uint32_t size, const uint8_t *sha256)
+{
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    err = nvs_open(STORAGE_OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_u32(nvs, "addr", staging->address);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u32(nvs, "size", size);
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nvs, "sha256", sha256, 32);
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    ESP_LOGI(TAG, "Image of %u bytes staged at 0x%x, applied on reboot", size, staging->address);
+    return err;
+}
+
+//*****************************************************************************
+// StorageOtaPending
+// True if an image is waiting to be applied on the next boot.
+//
+//*****************************************************************************
+bool StorageOtaPending(void)
+{
+    nvs_handle_t nvs;
+    uint32_t size = 0;
+
+    if (nvs_open(STORAGE_OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return false;
+    }
+    nvs_get_u32(nvs, "size", &size);
+    nvs_close(nvs);
+    return size != 0;
+}
+
+//*****************************************************************************
+// StorageOtaCopy
+// Erases the storage partition and copies size bytes of the staged image.
+//
+//*****************************************************************************
+static esp_err_t StorageOtaCopy(const esp_partition_t *staging, const esp_partition_t *storage, uint32_t size)
+{
+    uint8_t *buf = malloc(STORAGE_OTA_BLOCK_SIZE);
+    uint32_t len;
+    esp_err_t err = buf ? ESP_OK : ESP_ERR_NO_MEM;
+
+    if (err == ESP_OK)
+    {
+        err = esp_partition_erase_range(storage, 0, storage->size);
+    }
+    for (uint32_t offset = 0; (offset < size) && (err == ESP_OK); offset += len)
+    {
+        len = size - offset;
+        len = (len < STORAGE_OTA_BLOCK_SIZE) ? len : STORAGE_OTA_BLOCK_SIZE;
+        err = esp_partition_read(staging, offset, buf, len);
+        if (err == ESP_OK)
+        {
+            err = esp_partition_write(storage, offset, buf, len);
+        }
+    }
+    free(buf);
+    return err;
+}
+
+//*****************************************************************************
+// StorageOtaApply
+// Call at boot after nvs_flash_init and before SPIFFS is mounted. Copies a
+// pending image into the storage partition. Returns ESP_OK if there was
+// nothing to do or the image was applied.
+//
+//*****************************************************************************
+esp_err_t StorageOtaApply(void)
+{
+    nvs_handle_t nvs;
+    uint32_t addr = 0, size = 0;
+    uint8_t sha256[32], digest[32];
+    size_t len = sizeof(sha256);
+    const esp_partition_t *staging, *storage;
+    esp_err_t err;
+
+    if (nvs_open(STORAGE_OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+    {
+        return ESP_OK;
+    }
+    if ((nvs_get_u32(nvs, "addr", &addr) != ESP_OK) ||
+        (nvs_get_u32(nvs, "size", &size) != ESP_OK) ||
+        (nvs_get_blob(nvs, "sha256", sha256, &len) != ESP_OK) || (size == 0))
+    {
+        nvs_close(nvs);
+        return ESP_OK;
+    }
+
+    staging = StorageOtaPartitionAt(addr);
+    storage = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, STORAGE_OTA_LABEL);
+
+    // The staged copy must still be intact, and must not be the running app
+    err = ESP_ERR_NOT_FOUND;
+    if (staging && storage && (staging != esp_ota_get_running_partition()) &&
+        (size <= storage->size) && (size <= staging->size))
+    {
+        err = StorageOtaHash(staging, size, digest);
+        if ((err == ESP_OK) && memcmp(digest, sha256, sizeof(digest)))
+        {
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Staged image at 0x%x is gone (%s), dropped", addr, esp_err_to_name(err));
+        nvs_erase_all(nvs);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Applying %u byte image from 0x%x", size, addr);
+    err = StorageOtaCopy(staging, storage, size);
+    if (err == ESP_OK)
+    {
+        err = StorageOtaHash(storage, size, digest);
+    }
+    if ((err == ESP_OK) && memcmp(digest, sha256, sizeof(digest)))
+    {
+        err = ESP_ERR_INVALID_CRC;
+    }
+
+    // Keep the record after a failure so the copy is tried again next boot
+    if (err == ESP_OK)
+    {
+        nvs_erase_all(nvs);
+        nvs_commit(nvs);
+        ESP_LOGI(TAG, "Storage image applied");
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Storage copy failed (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+// end of storage_ota.c
@@ -0,0 +1,23 @@
+//******************************************************************************
+//
+// storage_ota.h
+//
+//******************************************************************************
+
+// Label of the SPIFFS partition in partitions.csv
+#define STORAGE_OTA_LABEL           "storage"
+
+// Pending update record
+#define STORAGE_OTA_NVS_NAMESPACE   "storage_ota"
+
+// Flash copy and hash block
+#define STORAGE_OTA_BLOCK_SIZE      4096
+
+const esp_partition_t *StorageOtaStaging(void);
+const esp_partition_t *StorageOtaPartitionAt(uint32_t addr);
+esp_err_t StorageOtaHash(const esp_partition_t *partition, uint32_t size, uint8_t *sha256);
+esp_err_t StorageOtaSetPending(const esp_partition_t *staging, uint32_t size, const uint8_t *sha256);
+bool StorageOtaPending(void);
+esp_err_t StorageOtaApply(void);
+
+// end of storage_ota.h
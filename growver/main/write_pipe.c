@@ -0,0 +1,282 @@
+//*****************************************************************************
+//
+// write_pipe.c - Double buffered writer for streaming uploads to flash.
+//
+// The receiving task fills one buffer while a writer task on the other core
+// commits the previous one, so the socket keeps being drained while flash
+// erases and writes. Usage:
+//
+//   pipe = WritePipeCreate(size, write, ctx, true);
+//   while (data)
+//   {
+//       buf = WritePipeBuffer(pipe);       // Waits for a free buffer
+//       ... fill up to size bytes ...
+//       WritePipeSubmit(pipe, len);        // Queues it for the writer
+//   }
+//   err = WritePipeFinish(pipe);           // Waits for the last write
+//   WritePipeDelete(pipe);
+//
+// The first write error stops further writes and is returned by Submit and
+// Finish. With pipelined false there is a single buffer and Submit writes
+// inline, which is the baseline for throughput comparisons.
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "write_pipe.h"
+
+#define WRITE_PIPE_BUFFERS  2
+
+typedef struct
+{
+    uint8_t buf;
+    size_t len;                 // 0 ends the writer task
+} write_pipe_job_t;
+
+struct write_pipe
+{
+    uint8_t *buf[WRITE_PIPE_BUFFERS];
+    size_t buf_size;
+    int8_t filling;             // Buffer handed out by WritePipeBuffer, or -1
+    bool pipelined;
+    write_pipe_fn_t write;
+    void *ctx;
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    SemaphoreHandle_t done;
+    volatile esp_err_t err;
+    volatile uint32_t written;
+};
+
+//*****************************************************************************
+// WritePipeCommit
+// Writes one buffer unless an earlier write failed.
+//
+//*****************************************************************************
+static void WritePipeCommit(write_pipe_t *pipe, const uint8_t *data, size_t len)
+{
+    esp_err_t err;
+
+    if (pipe->err == ESP_OK)
+    {
+        err = pipe->write(pipe->ctx, data, len);
+        if (err == ESP_OK)
+        {
+            pipe->written += len;
+        }
+        else
+        {
+            pipe->err = err;
+        }
+    }
+}
+
+//*****************************************************************************
+// WritePipeTask
+//
+//*****************************************************************************
+static void WritePipeTask(void *pvParameters)
+{
+    write_pipe_t *pipe = pvParameters;
+    write_pipe_job_t job;
+
+    while (xQueueReceive(pipe->full_q, &job, portMAX_DELAY))
+    {
+        if (job.len == 0)
+        {
+            break;
+        }
+        WritePipeCommit(pipe, pipe->buf[job.buf], job.len);
+        xQueueSend(pipe->free_q, &job.buf, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(pipe->done);
+    vTaskDelete(NULL);
+}
+
+//*****************************************************************************
+// WritePipeCreate
+// Allocates the buffers and starts the writer task. Returns NULL if out of
+// memory.
+//
+//*****************************************************************************
+write_pipe_t *WritePipeCreate(size_t buf_size, write_pipe_fn_t write, void *ctx, bool pipelined)
+{
+    write_pipe_t *pipe = calloc(1, sizeof(write_pipe_t));
+    uint8_t buffers = pipelined ? WRITE_PIPE_BUFFERS : 1;
+
+    if (pipe == NULL)
+    {
+        return NULL;
+    }
+    pipe->buf_size = buf_size;
+    pipe->filling = -1;
+    pipe->pipelined = pipelined;
+    pipe->write = write;
+    pipe->ctx = ctx;
+    pipe->free_q = xQueueCreate(WRITE_PIPE_BUFFERS, sizeof(uint8_t));
+    if (pipe->free_q == NULL)
+    {
+        goto fail;
+    }
+    for (uint8_t i = 0; i < buffers; i++)
+    {
+        pipe->buf[i] = malloc(buf_size);
+        if (pipe->buf[i] == NULL)
+        {
+            goto fail;
+        }
+        xQueueSend(pipe->free_q, &i, 0);
+    }
+
+    if (pipelined)
+    {
+        pipe->full_q = xQueueCreate(WRITE_PIPE_BUFFERS + 1, sizeof(write_pipe_job_t));
+        pipe->done = xSemaphoreCreateBinary();
+        if ((pipe->full_q == NULL) || (pipe->done == NULL) ||
+            (xTaskCreatePinnedToCore(WritePipeTask, "write_pipe", WRITE_PIPE_STACK, pipe,
+                                     WRITE_PIPE_PRIORITY, NULL, WRITE_PIPE_CORE) != pdPASS))
+        {
+            goto fail;
+        }
+    }
+    return pipe;
+
+fail:
+    ESP_LOGE("pipe", "Out of memory for %u byte buffers", buf_size);
+    pipe->pipelined = false;
+    WritePipeDelete(pipe);
+    return NULL;
+}
+
+//*****************************************************************************
+// WritePipeBuffer
+// Returns an empty buffer of buf_size bytes to fill, waiting for the writer
+// if both are in use.
+//
+//*****************************************************************************
+void *WritePipeBuffer(write_pipe_t *pipe)
+{
+    uint8_t buf;
+
+    if (pipe->filling < 0)
+    {
+        xQueueReceive(pipe->free_q, &buf, portMAX_DELAY);
+        pipe->filling = buf;
+    }
+    return pipe->buf[pipe->filling];
+}
+
+//*****************************************************************************
+// WritePipeSubmit
+// Hands the buffer from WritePipeBuffer to the writer. Returns the first
+// write error so far, so the caller can stop receiving.
+//
+//*****************************************************************************
+esp_err_t WritePipeSubmit(write_pipe_t *pipe, size_t len)
+{
+    write_pipe_job_t job;
+
+    if (pipe->filling < 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    job.buf = pipe->filling;
+    job.len = len;
+    pipe->filling = -1;
+
+    if (len == 0)
+    {
+        xQueueSend(pipe->free_q, &job.buf, 0);
+    }
+    else if (pipe->pipelined)
+    {
+        xQueueSend(pipe->full_q, &job, portMAX_DELAY);
+    }
+    else
+    {
+        WritePipeCommit(pipe, pipe->buf[job.buf], len);
+        xQueueSend(pipe->free_q, &job.buf, 0);
+    }
+    return pipe->err;
+}
+
+//*****************************************************************************
+// WritePipeFinish
+// Waits until every submitted buffer is written and returns the first write
+// error. The pipe can not be used afterwards except to delete it.
+//
+//*****************************************************************************
+esp_err_t WritePipeFinish(write_pipe_t *pipe)
+{
+    write_pipe_job_t job = { 0, 0 };
+
+    if (pipe->filling >= 0)
+    {
+        WritePipeSubmit(pipe, 0);
+    }
+    if (pipe->pipelined)
+    {
+        xQueueSend(pipe->full_q, &job, portMAX_DELAY);
+        xSemaphoreTake(pipe->done, portMAX_DELAY);
+        pipe->pipelined = false;
+    }
+    return pipe->err;
+}
+
+//*****************************************************************************
+// WritePipeDelete
+// Finishes the pipe if needed and frees it.
+//
+//*****************************************************************************
+void WritePipeDelete(write_pipe_t *pipe)
+{
+    if (pipe == NULL)
+    {
+        return;
+    }
+    if (pipe->pipelined)
+    {
+        WritePipeFinish(pipe);
+    }
+    for (int i = 0; i < WRITE_PIPE_BUFFERS; i++)
+    {
+        free(pipe->buf[i]);
+    }
+    if (pipe->free_q)
+    {
+        vQueueDelete(pipe->free_q);
+    }
+    if (pipe->full_q)
+    {
+        vQueueDelete(pipe->full_q);
+    }
+    if (pipe->done)
+    {
+        vSemaphoreDelete(pipe->done);
+    }
+    free(pipe);
+}
+
+//*****************************************************************************
+// WritePipeWritten
+// Bytes committed so far. May be read from any task for progress reports.
+//
+//*****************************************************************************
+uint32_t WritePipeWritten(write_pipe_t *pipe)
+{
+    return pipe->written;
+}
+
+// end of write_pipe.c
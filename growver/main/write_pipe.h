@@ -0,0 +1,26 @@
+//******************************************************************************
+//
+// write_pipe.h
+//
+//******************************************************************************
+
+// Writer task placement. Receive runs in the httpd task, so commit on the
+// other core.
+#define WRITE_PIPE_CORE         1
+#define WRITE_PIPE_PRIORITY     6
+#define WRITE_PIPE_STACK        3072
+
+// Commits len bytes. Called from the writer task, or from WritePipeSubmit
+// when the pipe is not pipelined.
+typedef esp_err_t (*write_pipe_fn_t)(void *ctx, const void *data, size_t len);
+
+typedef struct write_pipe write_pipe_t;
+
+write_pipe_t *WritePipeCreate(size_t buf_size, write_pipe_fn_t write, void *ctx, bool pipelined);
+void *WritePipeBuffer(write_pipe_t *pipe);
+esp_err_t WritePipeSubmit(write_pipe_t *pipe, size_t len);
+esp_err_t WritePipeFinish(write_pipe_t *pipe);
+void WritePipeDelete(write_pipe_t *pipe);
+uint32_t WritePipeWritten(write_pipe_t *pipe);
+
+// end of write_pipe.h
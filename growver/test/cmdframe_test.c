@@ -0,0 +1,189 @@
+//*****************************************************************************
+//
+// cmdframe_test.c - Host test of the command frame receiver (cmdframe.c).
+//
+// Frames are built here with their own COBS encoder, so payloads longer than
+// CmdFrameEncode allows can be sent. Checks the payload length limit at its
+// boundary, that the receiver resynchronises after a rejected frame, and
+// that payloads with zero bytes round trip.
+//
+//   cc -Wall -I../main -o cmdframe_test cmdframe_test.c ../main/cmdframe.c
+//   ./cmdframe_test
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "cmdframe.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                        \
+    do                                                          \
+    {                                                           \
+        if (!(cond))                                            \
+        {                                                       \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+//*****************************************************************************
+// FrameBuild
+// Encodes seq, type, payload and CRC of any length as COBS plus delimiter.
+// Returns the number of bytes in out.
+//
+//*****************************************************************************
+static size_t FrameBuild(uint8_t seq, uint8_t type, const uint8_t *payload, size_t len, uint8_t *out)
+{
+    uint8_t raw[512];
+    size_t read = 0, write = 1, code_pos = 0;
+    uint8_t code = 1;
+    uint16_t crc;
+
+    raw[0] = seq;
+    raw[1] = type;
+    memcpy(&raw[2], payload, len);
+    crc = CmdFrameCrc16(raw, len + 2, CMDFRAME_CRC_INIT);
+    raw[len + 2] = crc & 0xFF;
+    raw[len + 3] = crc >> 8;
+    len += 4;
+
+    while (read < len)
+    {
+        if (raw[read] == 0)
+        {
+            out[code_pos] = code;
+            code = 1;
+            code_pos = write++;
+        }
+        else
+        {
+            out[write++] = raw[read];
+            if (++code == 0xFF)
+            {
+                out[code_pos] = code;
+                code = 1;
+                code_pos = write++;
+            }
+        }
+        read++;
+    }
+    out[code_pos] = code;
+    out[write++] = 0;
+    return write;
+}
+
+//*****************************************************************************
+// FrameFeed
+// Feeds bytes to the receiver. Returns the result at the delimiter, or
+// CMDFRAME_NONE if no frame completed.
+//
+//*****************************************************************************
+static int FrameFeed(cmdframe_rx_t *rx, const uint8_t *data, size_t len, cmdframe_t *frame)
+{
+    int result = CMDFRAME_NONE;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int r = CmdFrameRxByte(rx, data[i], frame);
+        if (r != CMDFRAME_NONE)
+        {
+            result = r;
+        }
+    }
+    return result;
+}
+
+//*****************************************************************************
+// TestLength
+// Sends a frame with a payload of len bytes and checks the result.
+//
+//*****************************************************************************
+static void TestLength(cmdframe_rx_t *rx, size_t len, int expected)
+{
+    uint8_t payload[300];
+    uint8_t encoded[600];
+    cmdframe_t frame = { 0 };
+    size_t n;
+    int result;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        payload[i] = 'a' + (i % 26);
+    }
+    n = FrameBuild(7, CMDFRAME_TYPE_CMD, payload, len, encoded);
+    result = FrameFeed(rx, encoded, n, &frame);
+    CHECK(result == expected, "payload %zu: result %d, expected %d", len, result, expected);
+    if (result == CMDFRAME_OK)
+    {
+        CHECK(frame.len == len, "payload %zu: len %zu", len, frame.len);
+        CHECK(frame.len <= CMDFRAME_MAX_PAYLOAD, "payload %zu: len %zu over the limit", len, frame.len);
+        CHECK(frame.seq == 7 && frame.type == CMDFRAME_TYPE_CMD, "payload %zu: header", len);
+        CHECK(!memcmp(frame.payload, payload, len), "payload %zu: contents", len);
+    }
+}
+
+int main(void)
+{
+    cmdframe_rx_t rx;
+    cmdframe_t frame = { 0 };
+    uint8_t encoded[600];
+    uint8_t zeros[CMDFRAME_MAX_PAYLOAD] = { 0 };
+    uint8_t ones[CMDFRAME_MAX_PAYLOAD];
+    size_t n;
+
+    CmdFrameRxReset(&rx);
+
+    // Up to the limit, then the lengths that still fit the encoded buffer,
+    // then one that overflows it
+    TestLength(&rx, 0, CMDFRAME_OK);
+    TestLength(&rx, CMDFRAME_MAX_PAYLOAD - 1, CMDFRAME_OK);
+    TestLength(&rx, CMDFRAME_MAX_PAYLOAD, CMDFRAME_OK);
+    TestLength(&rx, CMDFRAME_MAX_PAYLOAD + 1, CMDFRAME_TOO_LONG);
+    TestLength(&rx, CMDFRAME_MAX_ENCODED - 5, CMDFRAME_TOO_LONG);
+    TestLength(&rx, CMDFRAME_MAX_ENCODED - 4, CMDFRAME_TOO_LONG);
+    TestLength(&rx, CMDFRAME_MAX_ENCODED, CMDFRAME_TOO_LONG);
+
+    // The receiver is ready for the next frame after a rejected one
+    TestLength(&rx, 5, CMDFRAME_OK);
+
+    // CmdFrameEncode agrees with the receiver, and refuses too long payloads
+    n = CmdFrameEncode(3, CMDFRAME_TYPE_CMD, zeros, sizeof(zeros), encoded);
+    CHECK(n > 0 && n <= CMDFRAME_MAX_ENCODED, "encode %zu bytes", n);
+    CHECK(FrameFeed(&rx, encoded, n, &frame) == CMDFRAME_OK, "zero payload");
+    CHECK(frame.len == sizeof(zeros) && !memcmp(frame.payload, zeros, sizeof(zeros)), "zero payload contents");
+    CHECK(CmdFrameEncode(3, CMDFRAME_TYPE_CMD, zeros, CMDFRAME_MAX_PAYLOAD + 1, encoded) == 0, "encode over the limit");
+
+    // Frames stay within CMDFRAME_ENCODED_SIZE; payloads without zeros are the longest
+    memset(ones, 0xFF, sizeof(ones));
+    for (size_t len = 0; len <= CMDFRAME_MAX_PAYLOAD; len++)
+    {
+        n = CmdFrameEncode(3, CMDFRAME_TYPE_CMD, ones, len, encoded);
+        CHECK(n <= CMDFRAME_ENCODED_SIZE(len + 4) + 1, "encode %zu: %zu bytes", len, n);
+    }
+
+    // A corrupted byte is a CRC error, not a frame
+    n = FrameBuild(9, CMDFRAME_TYPE_CMD, (const uint8_t *)"stop", 4, encoded);
+    encoded[3] ^= 0x01;
+    CHECK(FrameFeed(&rx, encoded, n, &frame) == CMDFRAME_CRC_ERROR, "corrupted frame");
+    CHECK(frame.seq == 9, "corrupted frame seq %u", frame.seq);
+
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("cmdframe: all passed\n");
+    return 0;
+}
+
+// end of cmdframe_test.c
@@ -0,0 +1,432 @@
+//*****************************************************************************
+//
+// multipart_test.c - Host fuzz test of the multipart parser (multipart.c).
+//
+// Each test body is built together with the parts it must produce, then fed
+// to the parser whole, split in two at every byte offset, one byte at a time
+// and in random pieces. Every split must give exactly the expected parts.
+// Part content is drawn mostly from CR, LF, '-' and boundary characters, so
+// partial delimiters are common and often split across pieces.
+//
+//   cc -Wall -I../main -o multipart_test multipart_test.c ../main/multipart.c
+//   ./multipart_test [seed]
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "multipart.h"
+
+#define TEST_PARTS_MAX      4
+#define TEST_PART_SIZE      400
+#define TEST_BODY_SIZE      4096
+#define TEST_BODIES         200
+#define TEST_RANDOM_SPLITS  50
+
+typedef struct
+{
+    char name[MULTIPART_NAME_MAX + 1];
+    char filename[MULTIPART_NAME_MAX + 1];
+    uint8_t data[TEST_PART_SIZE];
+    size_t len;
+    bool ended;
+} test_part_t;
+
+// Parts seen by the callbacks
+typedef struct
+{
+    test_part_t parts[TEST_PARTS_MAX];
+    int count;
+    bool overflow;
+} test_result_t;
+
+// A body and the parts it must produce
+typedef struct
+{
+    char content_type[128];
+    uint8_t body[TEST_BODY_SIZE];
+    size_t len;
+    test_result_t expected;
+} test_body_t;
+
+static int failures;
+
+//*****************************************************************************
+// Parser callbacks, recording into a test_result_t
+//
+//*****************************************************************************
+static int TestOnPart(void *ctx, const multipart_part_t *part)
+{
+    test_result_t *result = ctx;
+    test_part_t *p;
+
+    if (result->count == TEST_PARTS_MAX)
+    {
+        result->overflow = true;
+        return -100;
+    }
+    p = &result->parts[result->count++];
+    memset(p, 0, sizeof(*p));
+    strcpy(p->name, part->name);
+    strcpy(p->filename, part->filename);
+    return 0;
+}
+
+static int TestOnData(void *ctx, const uint8_t *data, size_t len)
+{
+    test_result_t *result = ctx;
+    test_part_t *p;
+
+    if (result->count == 0 || result->parts[result->count - 1].ended)
+    {
+        result->overflow = true;
+        return -101;
+    }
+    p = &result->parts[result->count - 1];
+    if (p->len + len > sizeof(p->data))
+    {
+        result->overflow = true;
+        return -102;
+    }
+    memcpy(&p->data[p->len], data, len);
+    p->len += len;
+    return 0;
+}
+
+static int TestOnPartEnd(void *ctx)
+{
+    test_result_t *result = ctx;
+
+    if (result->count == 0)
+    {
+        result->overflow = true;
+        return -103;
+    }
+    result->parts[result->count - 1].ended = true;
+    return 0;
+}
+
+static const multipart_callbacks_t test_callbacks =
+{
+    .on_part = TestOnPart,
+    .on_data = TestOnData,
+    .on_part_end = TestOnPartEnd,
+};
+
+//*****************************************************************************
+// BodyAppend
+// Appends len bytes to the body being built.
+//
+//*****************************************************************************
+static void BodyAppend(test_body_t *t, const void *data, size_t len)
+{
+    if (t->len + len > sizeof(t->body))
+    {
+        printf("test body too large\n");
+        exit(2);
+    }
+    memcpy(&t->body[t->len], data, len);
+    t->len += len;
+}
+
+static void BodyAppendStr(test_body_t *t, const char *s)
+{
+    BodyAppend(t, s, strlen(s));
+}
+
+//*****************************************************************************
+// RandomContent
+// Fills data with bytes that look like parts of the delimiter: CR, LF, '-',
+// prefixes of "\r\n--" boundary, and some arbitrary bytes. The full
+// delimiter is never produced, as a real body would not contain it.
+//
+//*****************************************************************************
+static size_t RandomContent(uint8_t *data, size_t size, const char *boundary)
+{
+    char delim[MULTIPART_BOUNDARY_MAX + 5];
+    size_t delim_len, len = 0, n;
+
+    delim_len = (size_t)sprintf(delim, "\r\n--%s", boundary);
+    size = rand() % (size + 1);
+    while (len < size)
+    {
+        switch (rand() % 6)
+        {
+        case 0:
+            // A delimiter prefix, one byte short at most
+            n = 1 + rand() % (delim_len - 1);
+            n = (len + n > size) ? size - len : n;
+            memcpy(&data[len], delim, n);
+            len += n;
+            break;
+        case 1:
+            data[len++] = "\r\n-"[rand() % 3];
+            break;
+        case 2:
+            data[len++] = boundary[rand() % strlen(boundary)];
+            break;
+        default:
+            data[len++] = rand() & 0xFF;
+            break;
+        }
+    }
+
+    // Content next to a delimiter prefix could complete the delimiter.
+    // Break any full delimiter by changing its last byte.
+    for (size_t i = 0; i + delim_len <= len; i++)
+    {
+        if (!memcmp(&data[i], delim, delim_len))
+        {
+            data[i + delim_len - 1] ^= 0x20;
+        }
+    }
+    return len;
+}
+
+//*****************************************************************************
+// BodyBuild
+// Builds a random body: a boundary (quoted or not), an optional preamble,
+// one to TEST_PARTS_MAX parts with random content, optional transport
+// padding after delimiters and an optional epilogue.
+//
+//*****************************************************************************
+static void BodyBuild(test_body_t *t)
+{
+    static const char boundary_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789-_'()+,./:=?";
+    char boundary[MULTIPART_BOUNDARY_MAX + 1];
+    char line[256];
+    size_t boundary_len;
+    test_part_t *p;
+    int parts;
+
+    memset(t, 0, sizeof(*t));
+
+    boundary_len = 1 + rand() % MULTIPART_BOUNDARY_MAX;
+    for (size_t i = 0; i < boundary_len; i++)
+    {
+        boundary[i] = boundary_chars[rand() % (sizeof(boundary_chars) - 1)];
+    }
+    boundary[boundary_len] = 0;
+    sprintf(t->content_type, (rand() & 1) ? "multipart/form-data; boundary=\"%s\"" :
+            "multipart/form-data; boundary=%s", boundary);
+
+    if (rand() & 1)
+    {
+        BodyAppendStr(t, "This is the preamble.\r\n--NOT THE BOUNDARY\r\n");
+    }
+
+    parts = 1 + rand() % TEST_PARTS_MAX;
+    for (int i = 0; i < parts; i++)
+    {
+        p = &t->expected.parts[i];
+        sprintf(p->name, "field%d", i);
+        if (rand() & 1)
+        {
+            sprintf(p->filename, "file-%d.bin", rand() % 1000);
+        }
+        p->ended = true;
+
+        // The first delimiter need not follow a CRLF
+        BodyAppendStr(t, (i == 0) ? "--" : "\r\n--");
+        BodyAppendStr(t, boundary);
+        if (rand() % 4 == 0)
+        {
+            BodyAppendStr(t, " \t ");
+        }
+        BodyAppendStr(t, "\r\n");
+
+        if (p->filename[0])
+        {
+            sprintf(line, "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n",
+                    p->name, p->filename);
+        }
+        else
+        {
+            sprintf(line, "Content-Disposition: form-data; name=\"%s\"\r\n", p->name);
+        }
+        BodyAppendStr(t, line);
+        if (rand() & 1)
+        {
+            BodyAppendStr(t, "Content-Type: application/octet-stream\r\n");
+        }
+        BodyAppendStr(t, "\r\n");
+
+        p->len = RandomContent(p->data, sizeof(p->data), boundary);
+        BodyAppend(t, p->data, p->len);
+    }
+    t->expected.count = parts;
+
+    BodyAppendStr(t, "\r\n--");
+    BodyAppendStr(t, boundary);
+    BodyAppendStr(t, "--");
+    if (rand() & 1)
+    {
+        BodyAppendStr(t, "\r\nThis is the epilogue.\r\n");
+    }
+}
+
+//*****************************************************************************
+// BodyParse
+// Feeds the body in pieces ending at the given offsets (the last piece ends
+// at the end of the body) and checks the parts against the expected ones.
+//
+//*****************************************************************************
+static bool BodyParse(const test_body_t *t, const size_t *splits, int count, const char *what)
+{
+    static test_result_t result;
+    multipart_t mp;
+    size_t start = 0, stop;
+    int err;
+
+    memset(&result, 0, sizeof(result));
+    err = MultipartInit(&mp, t->content_type, &test_callbacks, &result);
+    for (int i = 0; (i <= count) && (err == MULTIPART_OK); i++)
+    {
+        stop = (i < count) ? splits[i] : t->len;
+        err = MultipartFeed(&mp, &t->body[start], stop - start);
+        start = stop;
+    }
+
+    if (err != MULTIPART_OK || !MultipartDone(&mp) || result.overflow ||
+        result.count != t->expected.count)
+    {
+        printf("FAIL %s: result %d, done %d, %d parts of %d\n", what, err, MultipartDone(&mp),
+               result.count, t->expected.count);
+        return false;
+    }
+    for (int i = 0; i < result.count; i++)
+    {
+        const test_part_t *got = &result.parts[i];
+        const test_part_t *want = &t->expected.parts[i];
+
+        if (strcmp(got->name, want->name) || strcmp(got->filename, want->filename) ||
+            !got->ended || got->len != want->len || memcmp(got->data, want->data, want->len))
+        {
+            printf("FAIL %s: part %d \"%s\" \"%s\" %zu bytes, expected \"%s\" \"%s\" %zu bytes\n",
+                   what, i, got->name, got->filename, got->len, want->name, want->filename, want->len);
+            return false;
+        }
+    }
+    return true;
+}
+
+//*****************************************************************************
+// BodyTest
+// Parses one body with every split and reports the first failure.
+//
+//*****************************************************************************
+static void BodyTest(const test_body_t *t)
+{
+    static size_t splits[TEST_BODY_SIZE];
+    char what[64];
+    int count;
+
+    if (!BodyParse(t, NULL, 0, "whole"))
+    {
+        failures++;
+        return;
+    }
+
+    for (size_t offset = 1; offset < t->len; offset++)
+    {
+        sprintf(what, "split at %zu", offset);
+        if (!BodyParse(t, &offset, 1, what))
+        {
+            failures++;
+            return;
+        }
+    }
+
+    for (size_t offset = 1; offset < t->len; offset++)
+    {
+        splits[offset - 1] = offset;
+    }
+    if (!BodyParse(t, splits, t->len - 1, "byte at a time"))
+    {
+        failures++;
+        return;
+    }
+
+    for (int i = 0; i < TEST_RANDOM_SPLITS; i++)
+    {
+        count = 0;
+        for (size_t offset = 1 + rand() % 64; offset < t->len; offset += 1 + rand() % 64)
+        {
+            splits[count++] = offset;
+        }
+        sprintf(what, "random split %d", i);
+        if (!BodyParse(t, splits, count, what))
+        {
+            failures++;
+            return;
+        }
+    }
+}
+
+//*****************************************************************************
+// ErrorTest
+// Malformed input must fail the same way however it is split.
+//
+//*****************************************************************************
+static void ErrorTest(const char *content_type, const char *body, int expected)
+{
+    test_result_t result;
+    multipart_t mp;
+    size_t len = strlen(body);
+    int err;
+
+    for (size_t offset = 0; offset <= len; offset++)
+    {
+        memset(&result, 0, sizeof(result));
+        err = MultipartInit(&mp, content_type, &test_callbacks, &result);
+        if (err == MULTIPART_OK)
+        {
+            err = MultipartFeed(&mp, (const uint8_t *)body, offset);
+        }
+        if (err == MULTIPART_OK)
+        {
+            err = MultipartFeed(&mp, (const uint8_t *)body + offset, len - offset);
+        }
+        if (err != expected)
+        {
+            printf("FAIL error body split at %zu: result %d, expected %d\n", offset, err, expected);
+            failures++;
+            return;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static test_body_t body;
+    unsigned seed = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1;
+
+    srand(seed);
+    for (int i = 0; i < TEST_BODIES; i++)
+    {
+        BodyBuild(&body);
+        BodyTest(&body);
+    }
+
+    ErrorTest("multipart/form-data", "--x\r\n\r\n", MULTIPART_BAD_BOUNDARY);
+    ErrorTest("multipart/form-data; boundary=x", "--x\r\nA: b\r\n\r\ndata\r\n--xZ", MULTIPART_BAD_FORMAT);
+    ErrorTest("multipart/form-data; boundary=x", "--x\r\n\r\ndata\r\n--x-Z", MULTIPART_BAD_FORMAT);
+    ErrorTest("multipart/form-data; boundary=x", "--x\rZ", MULTIPART_BAD_FORMAT);
+
+    if (failures)
+    {
+        printf("%d failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("multipart: all passed (seed %u)\n", seed);
+    return 0;
+}
+
+// end of multipart_test.c
@@ -0,0 +1,421 @@
+//*****************************************************************************
+//
+// ota_delta_test.c - Host test of the firmware patch decoder (ota_delta.c).
+//
+// Random patches are built here op by op, then fed to the decoder whole, one
+// byte at a time and in random pieces; every split must rebuild the same
+// target. Malformed patches must fail with the same error however they are
+// split. Given a base image and a new image, the patch tools/ota_pack.py
+// wrote for them (<image>.delta) is inflated and applied the same way:
+//
+//   cc -Wall -I../main -o ota_delta_test ota_delta_test.c ../main/ota_delta.c -lz
+//   ./ota_delta_test [seed]
+//   ../tools/ota_pack.py new.bin --base old.bin
+//   ./ota_delta_test [seed] old.bin new.bin
+//
+// License: GPL-3.0-or-later
+// Copyright 2017 Revely Microsystems LLC.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "ota_delta.h"
+
+#define TEST_BASE_SIZE      4096
+#define TEST_TARGET_SIZE    8192
+#define TEST_PATCH_SIZE     16384
+#define TEST_OPS_MAX        24
+#define TEST_PATCHES        200
+#define TEST_RANDOM_SPLITS  20
+
+// Error returned by the emit callback in the pass-through test
+#define TEST_EMIT_ERROR     0x105
+
+// Split modes
+#define SPLIT_WHOLE         0
+#define SPLIT_BYTES         1
+#define SPLIT_RANDOM        2
+
+typedef struct
+{
+    const uint8_t *base;
+    size_t base_len;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_max;
+    int emit_error;
+    bool header_seen;
+} test_ctx_t;
+
+static int failures;
+
+#define CHECK(cond, ...)                                        \
+    do                                                          \
+    {                                                           \
+        if (!(cond))                                            \
+        {                                                       \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+static void PutU32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+//*****************************************************************************
+// Decoder callbacks
+// Output goes to ctx->out; the decoder has already range checked it.
+//
+//*****************************************************************************
+static int TestHeader(void *ctx, const ota_delta_header_t *header)
+{
+    test_ctx_t *test = ctx;
+
+    test->header_seen = true;
+    return (header->base_size == test->base_len) ? 0 : OTA_DELTA_RANGE;
+}
+
+static int TestEmit(void *ctx, const uint8_t *data, size_t len)
+{
+    test_ctx_t *test = ctx;
+
+    if (test->emit_error)
+    {
+        return test->emit_error;
+    }
+    if (len > test->out_max - test->out_len)
+    {
+        return OTA_DELTA_RANGE;
+    }
+    memcpy(test->out + test->out_len, data, len);
+    test->out_len += len;
+    return 0;
+}
+
+static int TestCopy(void *ctx, uint32_t offset, uint32_t len)
+{
+    test_ctx_t *test = ctx;
+
+    if (!test->header_seen || (len > test->out_max - test->out_len))
+    {
+        return OTA_DELTA_RANGE;
+    }
+    memcpy(test->out + test->out_len, test->base + offset, len);
+    test->out_len += len;
+    return 0;
+}
+
+//*****************************************************************************
+// PatchApply
+// Feeds a patch to a fresh decoder, split as mode says. Returns the first
+// error, or OTA_DELTA_OK; *done is set if the END op was reached.
+//
+//*****************************************************************************
+static int PatchApply(test_ctx_t *test, const uint8_t *patch, size_t len, int mode, bool *done)
+{
+    ota_delta_t delta;
+    size_t pos = 0, n;
+    int result = OTA_DELTA_OK;
+
+    test->out_len = 0;
+    test->header_seen = false;
+    OtaDeltaInit(&delta, TestHeader, TestEmit, TestCopy, test);
+
+    while ((pos < len) && (result == OTA_DELTA_OK))
+    {
+        switch (mode)
+        {
+        case SPLIT_WHOLE:
+            n = len;
+            break;
+        case SPLIT_BYTES:
+            n = 1;
+            break;
+        default:
+            // Mostly short pieces, so op arguments are often split
+            n = (rand() % 4) ? 1 + rand() % 16 : 1 + rand() % 2048;
+            break;
+        }
+        n = (n < len - pos) ? n : len - pos;
+        result = OtaDeltaFeed(&delta, patch + pos, n);
+        pos += n;
+    }
+    *done = OtaDeltaDone(&delta);
+    return result;
+}
+
+//*****************************************************************************
+// PatchCheck
+// Applies a patch with every split mode. Each must give the expected result,
+// and a good patch must rebuild target exactly.
+//
+//*****************************************************************************
+static void PatchCheck(const char *what, test_ctx_t *test, const uint8_t *patch, size_t len,
+                       const uint8_t *target, size_t target_len, int expected)
+{
+    bool done;
+    int mode, result, i;
+
+    for (i = 0; i < 2 + TEST_RANDOM_SPLITS; i++)
+    {
+        mode = (i < SPLIT_RANDOM) ? i : SPLIT_RANDOM;
+        result = PatchApply(test, patch, len, mode, &done);
+        CHECK(result == expected, "%s split %d: result %d, expected %d", what, i, result, expected);
+        if (expected == OTA_DELTA_OK)
+        {
+            CHECK(done, "%s split %d: END not reached", what, i);
+            CHECK((test->out_len == target_len) && !memcmp(test->out, target, target_len),
+                  "%s split %d: %zu bytes out, target %zu", what, i, test->out_len, target_len);
+        }
+    }
+}
+
+//*****************************************************************************
+// PatchBuild
+// Writes a header and random COPY and INSERT ops (including empty ones)
+// into patch, and the target they produce into target. Returns the patch
+// length; the END op is not added.
+//
+//*****************************************************************************
+static size_t PatchBuild(const uint8_t *base, size_t base_len, uint8_t *patch,
+                         uint8_t *target, size_t *target_len)
+{
+    size_t pos = OTA_DELTA_HEADER_SIZE, out = 0;
+    uint32_t offset, len;
+    int ops = rand() % TEST_OPS_MAX;
+
+    for (int i = 0; i < ops; i++)
+    {
+        if (rand() % 2)
+        {
+            len = rand() % (((rand() % 4) && (base_len > 300)) ? 300 : base_len + 1);
+            offset = rand() % (base_len - len + 1);
+            if (out + len > TEST_TARGET_SIZE)
+            {
+                break;
+            }
+            patch[pos++] = OTA_DELTA_OP_COPY;
+            PutU32(&patch[pos], offset);
+            PutU32(&patch[pos + 4], len);
+            pos += 8;
+            memcpy(target + out, base + offset, len);
+        }
+        else
+        {
+            len = (rand() % 8) ? rand() % 300 : 0;
+            if ((out + len > TEST_TARGET_SIZE) || (pos + 5 + len > TEST_PATCH_SIZE - 1))
+            {
+                break;
+            }
+            patch[pos++] = OTA_DELTA_OP_INSERT;
+            PutU32(&patch[pos], len);
+            pos += 4;
+            for (uint32_t j = 0; j < len; j++)
+            {
+                target[out + j] = rand();
+            }
+            memcpy(&patch[pos], target + out, len);
+            pos += len;
+        }
+        out += len;
+    }
+
+    memset(patch, 0, OTA_DELTA_HEADER_SIZE);
+    memcpy(patch, OTA_DELTA_MAGIC, 4);
+    patch[4] = OTA_DELTA_VERSION;
+    PutU32(&patch[8], out);
+    PutU32(&patch[12], base_len);
+    *target_len = out;
+    return pos;
+}
+
+//*****************************************************************************
+// TestRandom
+// Good random patches, then each one broken in a way the decoder must catch.
+//
+//*****************************************************************************
+static void TestRandom(void)
+{
+    static uint8_t base[TEST_BASE_SIZE];
+    static uint8_t target[TEST_TARGET_SIZE];
+    static uint8_t patch[TEST_PATCH_SIZE + 16];
+    static uint8_t out[TEST_TARGET_SIZE + 16];
+    test_ctx_t test = { base, 0, out, 0, sizeof(out), 0, false };
+    size_t len, target_len;
+
+    for (int i = 0; i < TEST_PATCHES; i++)
+    {
+        test.base_len = 1 + rand() % TEST_BASE_SIZE;
+        for (size_t j = 0; j < test.base_len; j++)
+        {
+            base[j] = rand();
+        }
+        len = PatchBuild(base, test.base_len, patch, target, &target_len);
+        patch[len++] = OTA_DELTA_OP_END;
+        PatchCheck("good", &test, patch, len, target, target_len, OTA_DELTA_OK);
+
+        // Data after END
+        patch[len] = OTA_DELTA_OP_END;
+        PatchCheck("trailing", &test, patch, len + 1, NULL, 0, OTA_DELTA_TRAILING);
+
+        // Callback errors pass through unchanged
+        if (target_len)
+        {
+            test.emit_error = TEST_EMIT_ERROR;
+            patch[len - 1] = OTA_DELTA_OP_INSERT;
+            PutU32(&patch[len], 1);
+            PutU32(&patch[8], target_len + 1);
+            patch[len + 4] = 0x5A;
+            PatchCheck("emit error", &test, patch, len + 5, NULL, 0, TEST_EMIT_ERROR);
+            test.emit_error = 0;
+            PutU32(&patch[8], target_len);
+        }
+
+        // END before the target is complete
+        PutU32(&patch[8], target_len + 1);
+        patch[len - 1] = OTA_DELTA_OP_END;
+        PatchCheck("short", &test, patch, len, NULL, 0, OTA_DELTA_RANGE);
+
+        // INSERT past the target size
+        patch[len - 1] = OTA_DELTA_OP_INSERT;
+        PutU32(&patch[len], 2);
+        PatchCheck("long insert", &test, patch, len + 4, NULL, 0, OTA_DELTA_RANGE);
+
+        // COPY past the end of the base
+        PutU32(&patch[8], target_len + 2);
+        patch[len - 1] = OTA_DELTA_OP_COPY;
+        PutU32(&patch[len], test.base_len - 1);
+        PutU32(&patch[len + 4], 2);
+        PatchCheck("copy range", &test, patch, len + 8, NULL, 0, OTA_DELTA_RANGE);
+        PutU32(&patch[8], target_len);
+
+        // Unknown op
+        patch[len - 1] = 0x03 + rand() % 0xFD;
+        PatchCheck("bad op", &test, patch, len, NULL, 0, OTA_DELTA_BAD_OP);
+
+        // Bad magic or version
+        patch[len - 1] = OTA_DELTA_OP_END;
+        patch[rand() % 5] ^= 1 << (rand() % 8);
+        PatchCheck("bad header", &test, patch, len, NULL, 0, OTA_DELTA_BAD_HEADER);
+    }
+}
+
+//*****************************************************************************
+// FileRead
+// Reads a whole file into a malloc'd buffer. Returns NULL on failure.
+//
+//*****************************************************************************
+static uint8_t *FileRead(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data = NULL;
+    long size;
+
+    if (f == NULL)
+    {
+        printf("Can't open %s\n", path);
+        return NULL;
+    }
+    if ((fseek(f, 0, SEEK_END) == 0) && ((size = ftell(f)) >= 0) && (fseek(f, 0, SEEK_SET) == 0))
+    {
+        data = malloc(size ? size : 1);
+        if (data && (fread(data, 1, size, f) != (size_t)size))
+        {
+            free(data);
+            data = NULL;
+        }
+        *len = size;
+    }
+    fclose(f);
+    return data;
+}
+
+//*****************************************************************************
+// TestPacked
+// Applies the patch tools/ota_pack.py wrote for image against base.
+//
+//*****************************************************************************
+static int TestPacked(const char *base_path, const char *image_path)
+{
+    char delta_path[512];
+    uint8_t *base, *image, *packed, *patch = NULL, *out = NULL;
+    size_t base_len, image_len, packed_len, patch_len = 0, patch_max;
+    test_ctx_t test;
+    z_stream zs = { 0 };
+    int result = -1;
+
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", image_path);
+    base = FileRead(base_path, &base_len);
+    image = FileRead(image_path, &image_len);
+    packed = FileRead(delta_path, &packed_len);
+
+    // The patch is never larger than the image plus an INSERT per 5 bytes
+    patch_max = OTA_DELTA_HEADER_SIZE + image_len * 2 + 16;
+    patch = malloc(patch_max);
+    out = malloc(image_len + 16);
+    if (base && image && packed && patch && out && (inflateInit(&zs) == Z_OK))
+    {
+        zs.next_in = packed;
+        zs.avail_in = packed_len;
+        zs.next_out = patch;
+        zs.avail_out = patch_max;
+        if (inflate(&zs, Z_FINISH) == Z_STREAM_END)
+        {
+            patch_len = zs.total_out;
+            result = 0;
+        }
+        else
+        {
+            printf("%s: not a zlib stream\n", delta_path);
+        }
+        inflateEnd(&zs);
+    }
+
+    if (result == 0)
+    {
+        test = (test_ctx_t){ base, base_len, out, 0, image_len + 16, 0, false };
+        PatchCheck(delta_path, &test, patch, patch_len, image, image_len, OTA_DELTA_OK);
+        printf("%s: %zu byte patch, %zu byte image\n", delta_path, patch_len, image_len);
+    }
+    free(base);
+    free(image);
+    free(packed);
+    free(patch);
+    free(out);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned seed = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1;
+
+    srand(seed);
+    TestRandom();
+    if ((argc > 3) && TestPacked(argv[2], argv[3]))
+    {
+        failures++;
+    }
+
+    if (failures)
+    {
+        printf("%d failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("ota_delta: all passed (seed %u)\n", seed);
+    return 0;
+}
+
+// end of ota_delta_test.c
@@ -0,0 +1,253 @@
+#!/usr/bin/env python3
+#
+# cmdline_bench.py - Throughput and latency of the Growver command UART.
+#
+# Compares the text console with the framed binary protocol (main/cmdframe.c).
+# Runs against a real module on a serial port, or with --pty against a device
+# emulator on a pseudo terminal to measure host side protocol overhead.
+#
+#   cmdline_bench.py --port /dev/ttyUSB0 --bin-baud 921600
+#   cmdline_bench.py --pty
+#
+# License: GPL-3.0-or-later
+# Copyright 2017 Revely Microsystems LLC.
+
+import argparse
+import os
+import pty
+import select
+import statistics
+import termios
+import threading
+import time
+import tty
+
+TEXT_BAUD = 115200
+
+FRAME_CMD = 0x01
+FRAME_RESP = 0x81
+FRAME_RESP_PART = 0x82
+FRAME_EVENT = 0x83
+FRAME_NAK = 0x84
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT-FALSE, as CmdFrameCrc16."""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray([0])
+    code_pos, code = 0, 1
+    for byte in data:
+        if byte == 0:
+            out[code_pos] = code
+            code_pos, code = len(out), 1
+            out.append(0)
+        else:
+            out.append(byte)
+            code += 1
+            if code == 0xFF:
+                out[code_pos] = code
+                code_pos, code = len(out), 1
+                out.append(0)
+    out[code_pos] = code
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        i += 1
+        if code == 0 or i + code - 1 > len(data):
+            raise ValueError("bad COBS")
+        out += data[i:i + code - 1]
+        i += code - 1
+        if code != 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def frame_encode(seq, ftype, payload):
+    raw = bytes([seq, ftype]) + payload
+    crc = crc16(raw)
+    return cobs_encode(raw + bytes([crc & 0xFF, crc >> 8])) + b"\0"
+
+
+def frame_decode(encoded):
+    raw = cobs_decode(encoded)
+    if len(raw) < 4:
+        raise ValueError("short frame")
+    if crc16(raw[:-2]) != raw[-2] | (raw[-1] << 8):
+        raise ValueError("CRC")
+    return raw[0], raw[1], raw[2:-2]
+
+
+BAUD_CONSTANTS = {getattr(termios, n): int(n[1:]) for n in dir(termios)
+                  if n.startswith("B") and n[1:].isdigit()}
+
+
+def set_baud(fd, baud):
+    const = next((c for c, b in BAUD_CONSTANTS.items() if b == baud), None)
+    if const is None:
+        raise SystemExit("unsupported baud rate %d" % baud)
+    attrs = termios.tcgetattr(fd)
+    attrs[4] = attrs[5] = const
+    termios.tcsetattr(fd, termios.TCSADRAIN, attrs)
+
+
+class Port:
+    def __init__(self, fd):
+        self.fd = fd
+        self.pending = bytearray()
+
+    def write(self, data):
+        view = memoryview(data)
+        while view:
+            view = view[os.write(self.fd, view):]
+
+    def read_until(self, delim, timeout=2.0):
+        deadline = time.monotonic() + timeout
+        while delim not in self.pending:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0 or not select.select([self.fd], [], [], remaining)[0]:
+                raise TimeoutError("no response")
+            self.pending += os.read(self.fd, 4096)
+        idx = self.pending.index(delim)
+        data = bytes(self.pending[:idx])
+        del self.pending[:idx + len(delim)]
+        return data
+
+
+def bench_text(port, cmd, count):
+    latencies = []
+    start = time.perf_counter()
+    for _ in range(count):
+        t0 = time.perf_counter()
+        port.write(cmd.encode() + b"\r")
+        port.read_until(b"\n")
+        latencies.append(time.perf_counter() - t0)
+    return time.perf_counter() - start, latencies
+
+
+def bench_binary(port, cmd, count, window):
+    """Sends with up to window commands in flight, matched by sequence number."""
+    latencies = []
+    sent = {}
+    seq = 0
+    done = 0
+    start = time.perf_counter()
+    while done < count:
+        while len(sent) < window and done + len(sent) < count:
+            seq = (seq + 1) & 0xFF or 1
+            sent[seq] = time.perf_counter()
+            port.write(frame_encode(seq, FRAME_CMD, cmd.encode()))
+        rseq, ftype, _ = frame_decode(port.read_until(b"\0"))
+        if ftype in (FRAME_RESP, FRAME_NAK) and rseq in sent:
+            latencies.append(time.perf_counter() - sent.pop(rseq))
+            done += 1
+    return time.perf_counter() - start, latencies
+
+
+def report(name, elapsed, latencies):
+    lat = sorted(latencies)
+    p99 = lat[min(len(lat) - 1, int(len(lat) * 0.99))]
+    print("%-18s %8.0f cmd/s   latency p50 %7.1f us  p99 %7.1f us" %
+          (name, len(lat) / elapsed, statistics.median(lat) * 1e6, p99 * 1e6))
+
+
+def emulator(fd, stop):
+    """Minimal stand-in for the firmware console: text lines and binary frames."""
+    buf = bytearray()
+    binary = False
+    while not stop.is_set():
+        if not select.select([fd], [], [], 0.1)[0]:
+            continue
+        try:
+            buf += os.read(fd, 4096)
+        except OSError:
+            return
+        delim = b"\0" if binary else b"\r"
+        while delim in buf:
+            idx = buf.index(delim)
+            item = bytes(buf[:idx])
+            del buf[:idx + 1]
+            if not binary:
+                words = item.decode(errors="replace").split()
+                if words[:1] == ["bin"]:
+                    os.write(fd, b"OK\n")
+                    binary, delim = True, b"\0"
+                elif words:
+                    os.write(fd, b"12000\n")
+                continue
+            if not item:
+                continue
+            try:
+                seq, ftype, payload = frame_decode(item)
+            except ValueError:
+                os.write(fd, frame_encode(0, FRAME_NAK, bytes([0xFB])))
+                continue
+            if payload == b"text":
+                os.write(fd, frame_encode(seq, FRAME_RESP, b"\0"))
+                binary, delim = False, b"\r"
+            else:
+                os.write(fd, frame_encode(seq, FRAME_RESP, b"\0" + b"12000\n"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Growver command UART benchmark")
+    parser.add_argument("--port", help="serial device connected to the CMD UART")
+    parser.add_argument("--pty", action="store_true", help="benchmark against an emulator on a pty")
+    parser.add_argument("--bin-baud", type=int, default=921600)
+    parser.add_argument("--count", type=int, default=2000)
+    parser.add_argument("--window", type=int, default=4, help="binary commands in flight")
+    parser.add_argument("--cmd", default="batt")
+    args = parser.parse_args()
+
+    stop = threading.Event()
+    if args.pty:
+        master, slave = pty.openpty()
+        tty.setraw(master)
+        tty.setraw(slave)
+        threading.Thread(target=emulator, args=(master, stop), daemon=True).start()
+        fd = slave
+    elif args.port:
+        fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(fd)
+        set_baud(fd, TEXT_BAUD)
+    else:
+        parser.error("--port or --pty is required")
+
+    port = Port(fd)
+    elapsed, lat = bench_text(port, args.cmd, args.count)
+    report("text %d" % TEXT_BAUD, elapsed, lat)
+
+    port.write(("bin %d\r" % args.bin_baud).encode())
+    if port.read_until(b"\n").strip() != b"OK":
+        raise SystemExit("device did not accept binary mode")
+    if not args.pty:
+        termios.tcdrain(fd)
+        set_baud(fd, args.bin_baud)
+
+    elapsed, lat = bench_binary(port, args.cmd, args.count, 1)
+    report("binary %d" % args.bin_baud, elapsed, lat)
+    elapsed, lat = bench_binary(port, args.cmd, args.count, args.window)
+    report("binary window %d" % args.window, elapsed, lat)
+
+    port.write(frame_encode(1, FRAME_CMD, b"text"))
+    port.read_until(b"\0")
+    if not args.pty:
+        termios.tcdrain(fd)
+        set_baud(fd, TEXT_BAUD)
+    stop.set()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# hol_bench.py - Control latency of a Growver module during a large download.
+#
+# Sends motor stop commands (POST /api/v1/motor with zero speeds) to the
+# control server and reports their latency, first with the module idle and
+# then while another connection downloads 1 MB from the transfer server. A
+# test file is uploaded for the download and deleted afterwards. With one
+# server for everything, as in older firmware (run with --bulk-port 80), the
+# commands wait behind the download.
+#
+#   hol_bench.py growver.local
+#   hol_bench.py growver.local --bulk-port 80 --count 50
+#
+# License: GPL-3.0-or-later
+# Copyright 2017 Revely Microsystems LLC.
+
+import argparse
+import http.client
+import json
+import os
+import statistics
+import threading
+import time
+
+TEST_FILE = 'holbench.bin'
+STOP = json.dumps({'left_speed': 0, 'left_dir': 0, 'right_speed': 0, 'right_dir': 0}).encode()
+
+
+def motor_stop(host, port):
+    """Returns the latency of one stop command in ms."""
+    start = time.time()
+    conn = http.client.HTTPConnection(host, port, timeout=30)
+    conn.request('POST', '/api/v1/motor', body=STOP, headers={'Content-Type': 'application/json'})
+    resp = conn.getresponse()
+    resp.read()
+    conn.close()
+    if resp.status != 200:
+        raise SystemExit('motor command failed: %d' % resp.status)
+    return (time.time() - start) * 1000
+
+
+def download(host, port, total, result):
+    """Downloads the test file until total bytes have been received."""
+    received = 0
+    start = time.time()
+    while received < total:
+        conn = http.client.HTTPConnection(host, port, timeout=60)
+        conn.request('GET', '/fs/' + TEST_FILE)
+        resp = conn.getresponse()
+        while received < total:
+            data = resp.read(4096)
+            if not data:
+                break
+            received += len(data)
+        conn.close()
+    result['elapsed'] = time.time() - start
+    result['received'] = received
+
+
+def latencies(host, port, count, interval):
+    times = []
+    for _ in range(count):
+        times.append(motor_stop(host, port))
+        time.sleep(interval)
+    return times
+
+
+def report(name, times):
+    times = sorted(times)
+    print('%-10s %6d %9.1f %9.1f %9.1f' % (name, len(times), statistics.median(times),
+                                           times[int(len(times) * 0.95) - 1], times[-1]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Motor command latency during a concurrent download')
+    parser.add_argument('host', help='module address, e.g. growver.local')
+    parser.add_argument('--port', type=int, default=80, help='control server port')
+    parser.add_argument('--bulk-port', type=int, default=8080, help='transfer server port')
+    parser.add_argument('--size', type=int, default=128 * 1024, help='test file size, repeated to reach --total')
+    parser.add_argument('--total', type=int, default=1024 * 1024, help='bytes to download')
+    parser.add_argument('--count', type=int, default=20, help='commands per measurement')
+    parser.add_argument('--interval', type=float, default=0.05, help='seconds between commands')
+    args = parser.parse_args()
+
+    conn = http.client.HTTPConnection(args.host, args.bulk_port, timeout=120)
+    conn.request('POST', '/upload/' + TEST_FILE, body=os.urandom(args.size))
+    status = conn.getresponse().status
+    conn.close()
+    if status not in (200, 303):
+        raise SystemExit('upload of the test file failed: %d' % status)
+
+    try:
+        print('%-10s %6s %9s %9s %9s' % ('', 'n', 'p50 ms', 'p95 ms', 'max ms'))
+        report('idle', latencies(args.host, args.port, args.count, args.interval))
+
+        result = {}
+        thread = threading.Thread(target=download, args=(args.host, args.bulk_port, args.total, result))
+        thread.start()
+        times = []
+        while thread.is_alive():
+            times.append(motor_stop(args.host, args.port))
+            time.sleep(args.interval)
+        thread.join()
+        if times:
+            report('download', times)
+        print('downloaded %d bytes in %.1f s (%.1f KB/s)' % (result['received'], result['elapsed'],
+                                                            result['received'] / 1024 / max(result['elapsed'], 1e-3)))
+    finally:
+        conn = http.client.HTTPConnection(args.host, args.bulk_port, timeout=30)
+        conn.request('POST', '/delete/' + TEST_FILE)
+        conn.getresponse().read()
+        conn.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+#
+# ota_bench.py - Firmware upload throughput of a Growver module.
+#
+# Uploads an image through the /update form handler with inline flash writes
+# (?pipe=0) and with the double buffered writer (?pipe=1), and reports KB/s
+# for each as seen by the host and as measured on the module. Each upload
+# selects the image for the next boot, so use the firmware that is running.
+#
+# With --content-types it compares multipart/form-data uploads against bare
+# application/octet-stream uploads, which the module does not parse.
+#
+# With --encodings it instead compares /ota/stream uploads of the raw image
+# and of the .z and .delta files from ota_pack.py: bytes sent and update time.
+#
+#   ota_bench.py growver.local build/growver.bin --runs 3
+#   ota_bench.py growver.local build/growver.bin --content-types
+#   ota_bench.py growver.local build/growver.bin --encodings
+#
+# License: GPL-3.0-or-later
+# Copyright 2017 Revely Microsystems LLC.
+
+import argparse
+import hashlib
+import http.client
+import json
+import os
+import statistics
+import time
+import uuid
+
+
+def upload(host, image, pipe, raw=False):
+    """Posts image as multipart/form-data like the OTA page, or with raw as
+    application/octet-stream. Returns seconds."""
+    if raw:
+        body = image
+        content_type = 'application/octet-stream'
+    else:
+        boundary = uuid.uuid4().hex
+        head = ('--%s\r\nContent-Disposition: form-data; name="update"; filename="growver.bin"\r\n'
+                'Content-Type: application/octet-stream\r\n\r\n' % boundary).encode()
+        tail = ('\r\n--%s--\r\n' % boundary).encode()
+        body = head + image + tail
+        content_type = 'multipart/form-data; boundary=%s' % boundary
+
+    conn = http.client.HTTPConnection(host, timeout=120)
+    start = time.time()
+    conn.request('POST', '/update?pipe=%d' % pipe, body=body,
+                 headers={'Content-Type': content_type})
+    resp = conn.getresponse()
+    resp.read()
+    elapsed = time.time() - start
+    conn.close()
+    if resp.status != 200:
+        raise RuntimeError('upload failed: %d' % resp.status)
+    return elapsed
+
+
+def stream(host, body, encoding, digest):
+    """Posts to /ota/stream. Returns seconds until the image is verified."""
+    conn = http.client.HTTPConnection(host, timeout=300)
+    start = time.time()
+    conn.request('POST', '/ota/stream?encoding=%s&sha256=%s' % (encoding, digest), body=body,
+                 headers={'Content-Type': 'application/octet-stream'})
+    resp = conn.getresponse()
+    reply = resp.read()
+    elapsed = time.time() - start
+    conn.close()
+    if resp.status != 200:
+        raise RuntimeError('%s upload failed: %d %s' % (encoding, resp.status, reply))
+    return elapsed
+
+
+def compare_encodings(host, path, image, runs):
+    digest = hashlib.sha256(image).hexdigest()
+    print('%-8s %10s %8s %10s' % ('encoding', 'bytes', 'ratio', 'seconds'))
+    for encoding, suffix in (('raw', ''), ('zlib', '.z'), ('delta', '.delta')):
+        if not os.path.exists(path + suffix):
+            print('%-8s %10s (run ota_pack.py first)' % (encoding, '-'))
+            continue
+        with open(path + suffix, 'rb') as f:
+            body = f.read()
+        times = [stream(host, body, encoding, digest) for _ in range(runs)]
+        print('%-8s %10d %7.1f%% %10.2f' % (encoding, len(body), 100.0 * len(body) / len(image),
+                                             statistics.median(times)))
+
+
+def device_kbps(host):
+    conn = http.client.HTTPConnection(host, timeout=10)
+    conn.request('GET', '/ota/session')
+    reply = json.loads(conn.getresponse().read())
+    conn.close()
+    return reply.get('kbps', 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='OTA upload throughput: inline vs pipelined flash writes, multipart vs octet-stream')
+    parser.add_argument('host', help='module address, e.g. growver.local')
+    parser.add_argument('image', help='application binary (use the running firmware)')
+    parser.add_argument('--runs', type=int, default=3)
+    parser.add_argument('--content-types', action='store_true',
+                        help='compare multipart and octet-stream uploads')
+    parser.add_argument('--encodings', action='store_true', help='compare raw, zlib and delta uploads')
+    parser.add_argument('--port', type=int, default=8080, help='port of the transfer server on the module')
+    args = parser.parse_args()
+    args.host = '%s:%d' % (args.host, args.port)
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    if args.encodings:
+        compare_encodings(args.host, args.image, image, args.runs)
+        return
+
+    if args.content_types:
+        modes = ((1, False, 'multipart'), (1, True, 'octet'))
+    else:
+        modes = ((0, False, 'inline'), (1, False, 'pipelined'))
+
+    print('%-10s %12s %12s' % ('mode', 'host KB/s', 'device KB/s'))
+    for pipe, raw, name in modes:
+        host_rates, device_rates = [], []
+        for _ in range(args.runs):
+            elapsed = upload(args.host, image, pipe, raw)
+            host_rates.append(len(image) / 1024 / elapsed)
+            device_rates.append(device_kbps(args.host))
+        print('%-10s %12.1f %12.1f' % (name, statistics.median(host_rates), statistics.median(device_rates)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+#
+# ota_pack.py - Builds compressed and delta firmware images for OTA.
+#
+# Writes <image>.z, the image as a zlib stream, and with --base also
+# <image>.delta, a zlib compressed patch against the firmware running on the
+# module. Both are sent to POST /ota/stream (see main/ota-http.c), which
+# decodes them on the fly into the update partition.
+#
+# Delta format (little endian, before compression):
+#
+#   header  "GRVD" | version (1) | 3 reserved | target size (4)
+#           | base size (4) | base SHA-256 (32)
+#   ops     0x01 COPY   base offset (4) | length (4)
+#           0x02 INSERT length (4) | bytes
+#           0x00 END
+#
+#   ota_pack.py build/growver2020.bin --base old/growver2020.bin
+#
+# License: GPL-3.0-or-later
+# Copyright 2017 Revely Microsystems LLC.
+
+import argparse
+import hashlib
+import struct
+import zlib
+
+DELTA_MAGIC = b'GRVD'
+DELTA_VERSION = 1
+OP_END = 0x00
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+# Matches are searched for on this block size, indexed every BLOCK_STEP bytes
+# of the base. Shorter matches are sent as literals.
+BLOCK = 32
+BLOCK_STEP = 4
+
+
+def delta_encode(base, target):
+    """Greedy block matching of target against base. Returns the raw patch."""
+    index = {}
+    for offset in range(0, len(base) - BLOCK + 1, BLOCK_STEP):
+        index.setdefault(base[offset:offset + BLOCK], offset)
+
+    out = bytearray(DELTA_MAGIC)
+    out += struct.pack('<B3xII', DELTA_VERSION, len(target), len(base))
+    out += hashlib.sha256(base).digest()
+
+    literal = bytearray()
+
+    def flush_literal():
+        if literal:
+            out.extend(struct.pack('<BI', OP_INSERT, len(literal)))
+            out.extend(literal)
+            literal.clear()
+
+    pos = 0
+    while pos < len(target):
+        match = index.get(target[pos:pos + BLOCK])
+        if match is None:
+            literal.append(target[pos])
+            pos += 1
+            continue
+
+        # Extend the match backwards into pending literals, then forwards
+        while literal and match > 0 and base[match - 1] == literal[-1]:
+            literal.pop()
+            match -= 1
+            pos -= 1
+        length = BLOCK
+        while (pos + length < len(target) and match + length < len(base)
+               and target[pos + length] == base[match + length]):
+            length += 1
+
+        flush_literal()
+        out += struct.pack('<BII', OP_COPY, match, length)
+        pos += length
+
+    flush_literal()
+    out.append(OP_END)
+    return bytes(out)
+
+
+def delta_decode(base, patch):
+    """Reference decoder, used to check every patch that is written."""
+    magic, version, size, base_size = struct.unpack_from('<4sB3xII', patch)
+    assert magic == DELTA_MAGIC and version == DELTA_VERSION
+    assert base_size == len(base) and patch[16:48] == hashlib.sha256(base).digest()
+    out = bytearray()
+    pos = 48
+    while patch[pos] != OP_END:
+        if patch[pos] == OP_COPY:
+            offset, length = struct.unpack_from('<II', patch, pos + 1)
+            out += base[offset:offset + length]
+            pos += 9
+        else:
+            (length,) = struct.unpack_from('<I', patch, pos + 1)
+            out += patch[pos + 5:pos + 5 + length]
+            pos += 5 + length
+    assert len(out) == size
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build compressed and delta OTA images')
+    parser.add_argument('image', help='new application binary')
+    parser.add_argument('--base', help='application binary running on the module')
+    parser.add_argument('--level', type=int, default=9, help='zlib level')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    print('%-8s %8d bytes  sha256 %s' % ('raw', len(image), hashlib.sha256(image).hexdigest()))
+
+    packed = zlib.compress(image, args.level)
+    with open(args.image + '.z', 'wb') as f:
+        f.write(packed)
+    print('%-8s %8d bytes  %5.1f%%  %s.z' % ('zlib', len(packed), 100.0 * len(packed) / len(image), args.image))
+
+    if args.base:
+        with open(args.base, 'rb') as f:
+            base = f.read()
+        patch = delta_encode(base, image)
+        assert delta_decode(base, patch) == image
+        packed = zlib.compress(patch, args.level)
+        with open(args.image + '.delta', 'wb') as f:
+            f.write(packed)
+        print('%-8s %8d bytes  %5.1f%%  %s.delta' % ('delta', len(packed), 100.0 * len(packed) / len(image), args.image))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+#
+# ota_upload.py - Resumable firmware upload to a Growver module.
+#
+# Uses the OTA session API in main/ota-http.c. The image is sent in chunks,
+# each with its own SHA-256; if the connection drops the upload continues
+# from the last chunk the module committed, including after a restart of
+# this tool or of the module.
+#
+# With --storage the image is a SPIFFS image for the storage partition
+# (build/storage.bin), sent in one request to /ota/storage and applied by the
+# module on its next boot. This updates the web UI without new firmware.
+#
+#   ota_upload.py growver.local build/growver.bin --reboot
+#   ota_upload.py growver.local build/storage.bin --storage --reboot
+#
+# License: GPL-3.0-or-later
+# Copyright 2017 Revely Microsystems LLC.
+
+import argparse
+import hashlib
+import http.client
+import json
+import sys
+import time
+
+SECTOR_SIZE = 4096
+
+
+def request(host, method, path, body=None, timeout=30):
+    """Returns (status, parsed JSON or text)."""
+    conn = http.client.HTTPConnection(host, timeout=timeout)
+    try:
+        headers = {'Content-Type': 'application/octet-stream'} if body is not None else {}
+        conn.request(method, path, body=body, headers=headers)
+        resp = conn.getresponse()
+        data = resp.read().decode(errors='replace')
+        try:
+            data = json.loads(data)
+        except ValueError:
+            pass
+        return resp.status, data
+    finally:
+        conn.close()
+
+
+def upload(host, image, chunk_size, retries, reboot):
+    digest = hashlib.sha256(image).hexdigest()
+    begin = json.dumps({'size': len(image), 'sha256': digest})
+    status, reply = request(host, 'POST', '/ota/begin', begin.encode())
+    if status != 200:
+        sys.exit('begin failed: %s %s' % (status, reply))
+
+    offset = reply['offset']
+    chunk_size = min(chunk_size, reply['chunk_max'])
+    chunk_size -= chunk_size % SECTOR_SIZE
+    if offset:
+        print('resuming at %d of %d' % (offset, len(image)))
+
+    start = time.time()
+    sent = 0
+    failures = 0
+    while offset < len(image):
+        chunk = image[offset:offset + chunk_size]
+        path = '/ota/chunk?offset=%d&sha256=%s' % (offset, hashlib.sha256(chunk).hexdigest())
+        try:
+            status, reply = request(host, 'POST', path, chunk)
+        except (OSError, http.client.HTTPException) as err:
+            status, reply = None, str(err)
+
+        if status in (200, 409) and isinstance(reply, dict):
+            # 409: the module committed a different offset, continue from there
+            offset = reply['offset']
+            if status == 200:
+                sent += len(chunk)
+                failures = 0
+            print('\r%d of %d' % (offset, len(image)), end='', flush=True)
+            continue
+
+        failures += 1
+        if failures > retries:
+            sys.exit('\nchunk at %d failed: %s %s' % (offset, status, reply))
+        print('\nchunk at %d failed (%s %s), retrying' % (offset, status, reply))
+        time.sleep(min(2 ** failures, 30))
+        try:
+            status, reply = request(host, 'GET', '/ota/session')
+            if status == 200 and reply.get('active'):
+                offset = reply['offset']
+            else:
+                # Session gone (e.g. module restarted): begin resumes it from NVS
+                status, reply = request(host, 'POST', '/ota/begin', begin.encode())
+                offset = reply['offset']
+        except (OSError, http.client.HTTPException, ValueError, KeyError):
+            pass
+
+    elapsed = time.time() - start
+    print('\nsent %d bytes in %.1f s (%.1f KB/s)' % (sent, elapsed, sent / 1024 / max(elapsed, 1e-3)))
+
+    status, reply = request(host, 'POST', '/ota/finish' + ('?reboot=1' if reboot else ''), b'')
+    if status != 200:
+        sys.exit('finish failed: %s %s' % (status, reply))
+    print('image verified%s' % (', rebooting' if reboot else ''))
+
+
+def upload_storage(host, image, reboot):
+    path = '/ota/storage?sha256=%s%s' % (hashlib.sha256(image).hexdigest(), '&reboot=1' if reboot else '')
+    start = time.time()
+    status, reply = request(host, 'POST', path, image, timeout=120)
+    if status != 200:
+        sys.exit('storage upload failed: %s %s' % (status, reply))
+    elapsed = time.time() - start
+    print('sent %d bytes in %.1f s, applied on %s' % (len(image), elapsed, 'this reboot' if reboot else 'next boot'))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Resumable OTA upload to a Growver module')
+    parser.add_argument('host', help='module address, e.g. growver.local or 192.168.1.50')
+    parser.add_argument('image', help='application binary')
+    parser.add_argument('--chunk', type=int, default=64 * 1024, help='chunk size in bytes')
+    parser.add_argument('--retries', type=int, default=10, help='consecutive failures before giving up')
+    parser.add_argument('--reboot', action='store_true', help='restart into the new image')
+    parser.add_argument('--storage', action='store_true', help='image is a SPIFFS image for the storage partition')
+    parser.add_argument('--port', type=int, default=8080, help='port of the transfer server on the module')
+    args = parser.parse_args()
+    args.host = '%s:%d' % (args.host, args.port)
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    if args.storage:
+        upload_storage(args.host, image, args.reboot)
+    else:
+        upload(args.host, image, args.chunk, args.retries, args.reboot)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# page_report.py - Size and load time of a Growver web page.
+#
+# Loads a page from the module the way a browser on the robot's LAN would:
+# the page, then every script, stylesheet and icon it references, gzip
+# accepted. It then loads it again with the validators from the first load,
+# where revalidated resources should come back as 304 and resources marked
+# immutable are not requested at all. Any reference to another host is
+# listed; the page must not have any, as the robot's network usually has no
+# internet access.
+#
+#   page_report.py growver.local
+#   page_report.py growver.local:8080 /ota-page --runs 5
+#
+# License: GPL-3.0-or-later
+# Copyright 2017 Revely Microsystems LLC.
+
+import argparse
+import html.parser
+import http.client
+import statistics
+import sys
+import time
+import urllib.parse
+
+
+class References(html.parser.HTMLParser):
+    """Collects the URLs a browser fetches while loading the page."""
+
+    def __init__(self):
+        super().__init__()
+        self.urls = []
+
+    def handle_starttag(self, tag, attrs):
+        attrs = dict(attrs)
+        if tag == 'script' and attrs.get('src'):
+            self.urls.append(attrs['src'])
+        elif tag == 'link' and attrs.get('href') and attrs.get('rel') in ('stylesheet', 'icon'):
+            self.urls.append(attrs['href'])
+        elif tag == 'img' and attrs.get('src'):
+            self.urls.append(attrs['src'])
+
+
+def fetch(conn, path, cache):
+    """GET path on a kept-alive connection. Returns (status, wire bytes, body,
+    seconds). cache maps paths to (etag, cache-control) from earlier loads."""
+    headers = {'Accept-Encoding': 'gzip'}
+    if path in cache:
+        etag, cache_control = cache[path]
+        if 'immutable' in cache_control:
+            return None, 0, b'', 0.0
+        if etag:
+            headers['If-None-Match'] = etag
+    start = time.time()
+    conn.request('GET', path, headers=headers)
+    resp = conn.getresponse()
+    body = resp.read()
+    elapsed = time.time() - start
+    if resp.status == 200:
+        cache[path] = (resp.getheader('ETag'), resp.getheader('Cache-Control') or '')
+    return resp.status, len(body), body, elapsed
+
+
+def load(host, page, cache):
+    """One page load. Returns rows of (path, status, bytes, seconds)."""
+    conn = http.client.HTTPConnection(host, timeout=30)
+    rows = []
+    status, size, body, elapsed = fetch(conn, page, cache)
+    rows.append((page, status, size, elapsed))
+
+    # A revalidated page has no body; reuse the references of the first load
+    if status == 200:
+        parser = References()
+        parser.feed(body.decode('utf-8', errors='replace'))
+        cache[page + ' refs'] = parser.urls
+    for url in cache.get(page + ' refs', []):
+        parts = urllib.parse.urlsplit(url)
+        if parts.netloc and parts.netloc != host:
+            rows.append((url, 'external', 0, 0.0))
+            continue
+        path = parts.path + ('?' + parts.query if parts.query else '')
+        status, size, _, elapsed = fetch(conn, path, cache)
+        rows.append((path, status if status else 'cached', size, elapsed))
+    conn.close()
+    return rows
+
+
+def report(title, runs):
+    print(title)
+    for i, (path, status, size, _) in enumerate(runs[0]):
+        seconds = statistics.median(run[i][3] for run in runs)
+        print('  %-36s %8s %8d bytes %7.1f ms' % (path, status, size, seconds * 1000))
+    totals = [sum(row[3] for row in run) for run in runs]
+    requests = sum(1 for row in runs[0] if row[1] not in ('cached', 'external'))
+    print('  %-36s %8d %8d bytes %7.1f ms' % ('total (requests)', requests,
+                                              sum(row[2] for row in runs[0]), statistics.median(totals) * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Size and load time of a Growver web page')
+    parser.add_argument('host', help='module address, e.g. growver.local')
+    parser.add_argument('page', nargs='?', default='/')
+    parser.add_argument('--runs', type=int, default=3)
+    args = parser.parse_args()
+
+    first, repeat = [], []
+    for _ in range(args.runs):
+        cache = {}
+        first.append(load(args.host, args.page, cache))
+        repeat.append(load(args.host, args.page, cache))
+    report('first load of %s' % args.page, first)
+    report('repeat load', repeat)
+
+    external = [row[0] for row in first[0] if row[1] == 'external']
+    if external:
+        print('\nreferences outside the module, which stall the page offline:')
+        for url in external:
+            print('  ' + url)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
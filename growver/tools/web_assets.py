@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+#
+# web_assets.py - Minifies and gzips the web UI at build time.
+#
+# pack:  packs the pages, minified, and their gzip variants into one indexed
+#        blob, OUTDIR/web_assets.bin, with the content type, cache control
+#        and ETags of each, for embedding in the firmware (see
+#        main/static_assets.c).
+# fs:    mirrors a directory for the SPIFFS image, minifying text files and
+#        adding a .gz beside each one that compresses, which the file server
+#        sends to clients that accept gzip.
+#
+# Minifying is conservative: comments, indentation and blank lines go, line
+# breaks stay, so scripts relying on them are unaffected. gzip does the rest.
+#
+#   web_assets.py pack build/main/web main/WebFiles/index.html ...
+#   web_assets.py fs build/fs main/WebFiles/fs
+#
+# License: GPL-3.0-or-later
+# Copyright 2017 Revely Microsystems LLC.
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+import shutil
+import struct
+
+CONTENT_TYPES = {
+    '.html': 'text/html',
+    '.css': 'text/css',
+    '.js': 'application/javascript',
+    '.json': 'application/json',
+    '.svg': 'image/svg+xml',
+    '.txt': 'text/plain',
+    '.ico': 'image/x-icon',
+    '.png': 'image/png',
+    '.jpeg': 'image/jpeg',
+}
+
+# Types that are minified; anything else is copied as is
+TEXT_TYPES = ('.html', '.css', '.js', '.json', '.svg', '.txt')
+
+# Pages are revalidated on every load (answered with 304 while unchanged).
+# Scripts and styles are requested by pages as /assets/<name>?v=<hash>, so
+# they never change under a URL and are cached for good; other assets are
+# cached for a week.
+CACHE_PAGE = 'no-cache'
+CACHE_VERSIONED = 'public, max-age=31536000, immutable'
+CACHE_ASSET = 'public, max-age=604800'
+VERSIONED_TYPES = ('.js', '.css')
+ASSET_URL = '/assets/'
+
+
+def minify_js_css(text):
+    text = re.sub(r'/\*.*?\*/', '', text, flags=re.S)
+    lines = (line.strip() for line in text.splitlines())
+    return '\n'.join(line for line in lines if line and not line.startswith('//'))
+
+
+def minify_html(text):
+    # Comments go (including commented out scripts); scripts and styles are
+    # minified separately
+    parts = re.split(r'(<!--.*?-->|<script\b.*?</script>|<style\b.*?</style>)', text, flags=re.S | re.I)
+    out = []
+    for part in parts:
+        match = re.match(r'(<(script|style)\b[^>]*>)(.*)(</\2>)$', part, flags=re.S | re.I)
+        if part.startswith('<!--'):
+            continue
+        elif match:
+            out.append(match.group(1) + minify_js_css(match.group(3)) + match.group(4))
+        else:
+            lines = (line.strip() for line in part.splitlines())
+            out.append('\n'.join(line for line in lines if line))
+    return '\n'.join(part for part in out if part) + '\n'
+
+
+def minify(name, data):
+    ext = os.path.splitext(name)[1].lower()
+    if ext not in TEXT_TYPES:
+        return data
+    text = data.decode('utf-8')
+    if ext == '.html':
+        return minify_html(text).encode('utf-8')
+    if ext in ('.js', '.css'):
+        return (minify_js_css(text) + '\n').encode('utf-8')
+    return data
+
+
+def compress(data):
+    # mtime=0 keeps the output, and so the ETag, reproducible
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def fnv1a(text):
+    h = 0x811c9dc5
+    for byte in text.encode():
+        h = ((h ^ byte) * 0x01000193) & 0xffffffff
+    return h
+
+
+def align(data, size=4):
+    return data + b'\0' * (-len(data) % size)
+
+
+def pack(outdir, sources):
+    """Writes web_assets.bin, read by main/static_assets.c:
+         header   magic "GWAP", version, count, buckets, reserved, strings offset
+         buckets  u16 per bucket, entry index + 1 or 0 if empty, indexed by the
+                  FNV-1a hash of the path with linear probing
+         entries  hash, path, type, cache control, ETag, gzip ETag (offsets
+                  into the strings), data offset and length, gzip offset and
+                  length (0 when gzip is not smaller)
+         strings  NUL terminated
+         data     4 byte aligned
+       Little endian, offsets from the start of the pack."""
+    os.makedirs(outdir, exist_ok=True)
+    assets = []
+    versions = {}
+
+    # Pages last, so the hashes of what they reference are known
+    for path in sorted(sources, key=lambda path: path.endswith('.html')):
+        name = os.path.basename(path)
+        ext = os.path.splitext(name)[1].lower()
+        with open(path, 'rb') as f:
+            data = minify(name, f.read())
+        if ext == '.html':
+            for asset, version in versions.items():
+                url = (ASSET_URL + asset).encode()
+                data = data.replace(b'"' + url + b'"', b'"' + url + b'?v=' + version.encode() + b'"')
+        packed = compress(data)
+        if len(packed) >= len(data):
+            packed = b''
+
+        # Strong ETags differ per encoding
+        etag = hashlib.sha256(data).hexdigest()[:16]
+        if ext == '.html':
+            cache = CACHE_PAGE
+        elif ext in VERSIONED_TYPES:
+            cache = CACHE_VERSIONED
+            versions[name] = etag[:8]
+        else:
+            cache = CACHE_ASSET
+        assets.append(('/' + name, CONTENT_TYPES.get(ext, 'application/octet-stream'), cache,
+                       '"%s"' % etag, '"%s-gz"' % etag, data, packed))
+        print('%-20s %6d -> %6d minified, %6d gzip' % (name, os.path.getsize(path), len(data), len(packed)))
+
+    buckets = 1
+    while buckets < 2 * len(assets):
+        buckets *= 2
+    table = [0] * buckets
+    for index, asset in enumerate(assets):
+        bucket = fnv1a(asset[0]) & (buckets - 1)
+        while table[bucket]:
+            bucket = (bucket + 1) & (buckets - 1)
+        table[bucket] = index + 1
+
+    strings = b''
+    string_offsets = {}
+    for asset in assets:
+        for text in asset[:5]:
+            if text not in string_offsets:
+                string_offsets[text] = len(strings)
+                strings += text.encode() + b'\0'
+    strings = align(strings)
+
+    header_size = 16
+    bucket_bytes = align(struct.pack('<%dH' % buckets, *table))
+    entries_size = 32 * len(assets)
+    strings_offset = header_size + len(bucket_bytes) + entries_size
+    data = b''
+    entries = b''
+    data_offset = strings_offset + len(strings)
+    for asset in assets:
+        path, content_type, cache, etag, etag_gz, raw, packed = asset
+        raw_offset = data_offset + len(data)
+        data = align(data + raw)
+        gz_offset = data_offset + len(data) if packed else 0
+        data = align(data + packed)
+        entries += struct.pack('<I6H4I', fnv1a(path), string_offsets[path], string_offsets[content_type],
+                               string_offsets[cache], string_offsets[etag], string_offsets[etag_gz], 0,
+                               raw_offset, len(raw), gz_offset, len(packed))
+
+    blob = struct.pack('<4s4HI', b'GWAP', 1, len(assets), buckets, 0, strings_offset)
+    blob += bucket_bytes + entries + strings + data
+    with open(os.path.join(outdir, 'web_assets.bin'), 'wb') as f:
+        f.write(blob)
+    print('%-20s %6d bytes, %d assets in %d buckets' % ('web_assets.bin', len(blob), len(assets), buckets))
+
+
+def fs(outdir, srcdir):
+    shutil.rmtree(outdir, ignore_errors=True)
+    for root, _, files in os.walk(srcdir):
+        target = os.path.join(outdir, os.path.relpath(root, srcdir))
+        os.makedirs(target, exist_ok=True)
+        for name in files:
+            with open(os.path.join(root, name), 'rb') as f:
+                data = minify(name, f.read())
+            with open(os.path.join(target, name), 'wb') as f:
+                f.write(data)
+            if os.path.splitext(name)[1].lower() in TEXT_TYPES:
+                packed = compress(data)
+                if len(packed) < len(data):
+                    with open(os.path.join(target, name + '.gz'), 'wb') as f:
+                        f.write(packed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Minify and gzip web assets')
+    parser.add_argument('mode', choices=('pack', 'fs'))
+    parser.add_argument('outdir')
+    parser.add_argument('sources', nargs='+', help='files to embed, or the directory to mirror')
+    args = parser.parse_args()
+
+    if args.mode == 'pack':
+        pack(args.outdir, args.sources)
+    else:
+        fs(args.outdir, args.sources[0])
+
+
+if __name__ == '__main__':
+    main()